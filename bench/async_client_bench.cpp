@@ -0,0 +1,78 @@
+#include "async_client.hpp"
+#include "tcp_server.hpp"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+// Publish rate one AsyncClient sustains against an embedded server with one subscriber.
+// Publishes are fire and forget, when the queue is congested the publisher waits for
+// the backpressure handler to report that it drained.
+
+namespace {
+    constexpr int port = 12346;
+    constexpr int messages = 2000000;
+}
+
+int main(){
+    std::ostream out(std::cout.rdbuf());
+    std::ostringstream serverLog;
+    std::cout.rdbuf(serverLog.rdbuf());
+
+    boost::asio::io_context serverContext;
+    TcpServer server(port, serverContext);
+    server.start();
+    std::thread serverThread{[&serverContext]() { serverContext.run(); }};
+
+    boost::asio::io_context context;
+    auto work = boost::asio::make_work_guard(context);
+    std::thread clientThread{[&context]() { context.run(); }};
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), port};
+
+    std::atomic<int> received{0};
+    AsyncClient subscriber(context);
+    subscriber.setMessageHandler([&received](std::string_view, std::string_view) { ++received; });
+    subscriber.connect(endpoint, "subscriber").get();
+    subscriber.subscribe("bench").get();
+
+    AsyncClient publisher(context);
+    std::mutex mutex;
+    std::condition_variable drained;
+    bool congested = false;
+    publisher.setBackpressureHandler([&](bool isCongested) {
+        std::lock_guard<std::mutex> lock(mutex);
+        congested = isCongested;
+        drained.notify_all();
+    });
+    publisher.connect(endpoint, "publisher").get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const std::string payload(64, 'x');
+    auto start = std::chrono::steady_clock::now();
+    for(int i = 0; i < messages; ){
+        if(publisher.publish("bench", payload)){
+            ++i;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        drained.wait_for(lock, std::chrono::milliseconds(10), [&congested]() { return !congested; });
+    }
+    publisher.asyncPublish("bench", payload).get();
+    auto published = std::chrono::steady_clock::now();
+    while(received < messages + 1){
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto delivered = std::chrono::steady_clock::now();
+
+    auto seconds = [start](auto end) { return std::chrono::duration<double>(end - start).count(); };
+    out << "published " << static_cast<long>(messages / seconds(published)) << " msgs/s, delivered "
+        << static_cast<long>(messages / seconds(delivered)) << " msgs/s (" << payload.size() << " B payload)" << std::endl;
+
+    work.reset();
+    context.stop();
+    clientThread.join();
+    serverContext.stop();
+    serverThread.join();
+    std::cout.rdbuf(out.rdbuf());
+    return 0;
+}
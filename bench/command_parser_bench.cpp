@@ -0,0 +1,121 @@
+#include "command_parser.hpp"
+#include "protocol.hpp"
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Compares ns/command of the former istringstream + if/else parsing with the
+// string_view Tokenizer and the compile-time command table, on server wire frames,
+// and with decoding the same commands as protocol version 2 binary frames.
+
+namespace {
+    volatile size_t sink = 0;
+
+    void legacyParse(const std::string& input){
+        std::istringstream stream(input);
+        std::string command;
+        if (!std::getline(stream, command, ';')) {
+            return;
+        }
+        std::string topic, data;
+        if (command == "CONNECT") {
+            stream >> topic;
+        }
+        else if (command == "DISCONNECT") {
+        }
+        else if (command == "PUBLISH") {
+            std::getline(stream, topic, ';');
+            std::getline(stream, data);
+        }
+        else if (command == "SUBSCRIBE") {
+            stream >> topic;
+        }
+        else if (command == "UNSUBSCRIBE") {
+            stream >> topic;
+        }
+        sink = sink + topic.size() + data.size();
+    }
+
+    void tokenizerParse(std::string_view input){
+        Tokenizer args(input);
+        std::string_view topic, data;
+        switch (lookupCommand(args.next(';'))) {
+            case CommandType::Publish:
+                topic = args.next(';');
+                data = args.rest();
+                break;
+            case CommandType::Connect:
+            case CommandType::Subscribe:
+            case CommandType::Unsubscribe:
+                topic = args.nextWord();
+                break;
+            default:
+                break;
+        }
+        sink = sink + topic.size() + data.size();
+    }
+
+    void binaryParse(std::string_view frame){
+        Protocol::Frame decoded;
+        if (Protocol::decode(frame.substr(Protocol::length_size), decoded)) {
+            sink = sink + decoded.topic.size() + decoded.payload.size();
+        }
+    }
+
+    // Binary equivalent of a text wire frame
+    std::string toBinary(std::string_view input){
+        Tokenizer args(input);
+        CommandType command = lookupCommand(args.next(';'));
+        SharedBufferPtr frame;
+        switch (command) {
+            case CommandType::Publish: {
+                std::string_view topic = args.next(';');
+                frame = Protocol::encode(Protocol::Opcode::Publish, topic, args.rest());
+                break;
+            }
+            case CommandType::Subscribe: frame = Protocol::encode(Protocol::Opcode::Subscribe, args.rest()); break;
+            case CommandType::Unsubscribe: frame = Protocol::encode(Protocol::Opcode::Unsubscribe, args.rest()); break;
+            default: frame = Protocol::encode(Protocol::Opcode::Disconnect); break;
+        }
+        return std::string(frame->data(), frame->size());
+    }
+
+    template <typename Fn>
+    double nsPerCommand(const std::vector<std::string>& inputs, int iterations, Fn&& fn){
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; ++i){
+            for(const auto &input : inputs){
+                fn(input);
+            }
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / (iterations * inputs.size());
+    }
+}
+
+int main(){
+    const std::vector<std::pair<std::string, std::vector<std::string>>> workloads = {
+        {"PUBLISH", {"PUBLISH;md/eq/AAPL/trades;price=189.20 size=100"}},
+        {"SUBSCRIBE", {"SUBSCRIBE;md/eq/AAPL/trades"}},
+        {"mixed", {"CONNECT;client1", "SUBSCRIBE;test", "PUBLISH;test;some data", "UNSUBSCRIBE;test", "DISCONNECT;"}},
+    };
+    const int iterations = 500000;
+
+    std::cout << std::setw(12) << "workload" << std::setw(16) << "legacy ns/cmd"
+              << std::setw(16) << "table ns/cmd" << std::setw(16) << "binary ns/cmd" << std::endl;
+    for(const auto &[name, inputs] : workloads){
+        std::vector<std::string> binaryInputs;
+        for(const auto &input : inputs){
+            binaryInputs.push_back(toBinary(input));
+        }
+        double legacy = nsPerCommand(inputs, iterations, [](const std::string& input) { legacyParse(input); });
+        double table = nsPerCommand(inputs, iterations, [](const std::string& input) { tokenizerParse(input); });
+        double binary = nsPerCommand(binaryInputs, iterations, [](const std::string& input) { binaryParse(input); });
+        std::cout << std::setw(12) << name << std::fixed << std::setprecision(1)
+                  << std::setw(16) << legacy << std::setw(16) << table << std::setw(16) << binary << std::endl;
+    }
+    return 0;
+}
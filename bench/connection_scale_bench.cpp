@@ -0,0 +1,254 @@
+#include "tcp_server.hpp"
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Connect storm against a server running in a child process. Opens N connections at once,
+// each sends CONNECT and then stays idle. Reports how long it took until the server had
+// all of them as clients and the growth of the server's resident memory per connection.
+// With --heartbeat the server PINGs every connection at that interval and the CPU time it
+// spends on the idle connections is measured as well.
+//
+// A loopback client has about 28k ephemeral ports per destination address, so the
+// connections are spread over 127.0.0.1, 127.0.0.2, ... The client and the server
+// process each need one descriptor per connection, raise the hard limit (ulimit -Hn)
+// for runs beyond it.
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr size_t connections_per_address = 25000;
+    constexpr auto poll_interval = std::chrono::milliseconds(1);
+    constexpr auto storm_timeout = std::chrono::seconds(120);
+    constexpr auto idle_window = std::chrono::seconds(2);
+
+    struct Options {
+        int port = 12347;
+        size_t connections = 10000;
+        ConnectionLimits limits;
+        ConnectionTimeouts timeouts;
+        bool json = false;
+    };
+
+    bool parseOptions(int argc, char* argv[], Options& options){
+        for(int i = 1; i < argc; ++i){
+            std::string_view arg = argv[i];
+            if(arg == "--json"){
+                options.json = true;
+                continue;
+            }
+            if(i + 1 >= argc){
+                return false;
+            }
+            std::string_view value = argv[++i];
+            auto parse = [value](auto& out) {
+                auto result = std::from_chars(value.data(), value.data() + value.size(), out);
+                return result.ec == std::errc() && result.ptr == value.data() + value.size();
+            };
+            bool ok = false;
+            if(arg == "--port"){
+                ok = parse(options.port);
+            }else if(arg == "--connections"){
+                ok = parse(options.connections);
+            }else if(arg == "--backlog"){
+                ok = parse(options.limits.backlog);
+            }else if(arg == "--accept-batch"){
+                ok = parse(options.limits.acceptBatch);
+            }else if(arg == "--heartbeat"){
+                int milliseconds = 0;
+                ok = parse(milliseconds) && milliseconds >= 0;
+                options.timeouts.heartbeatInterval = std::chrono::milliseconds(milliseconds);
+            }
+            if(!ok){
+                return false;
+            }
+        }
+        return options.connections > 0 && options.limits.backlog > 0 && options.limits.acceptBatch > 0;
+    }
+
+    void raiseDescriptorLimit(){
+        struct rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) == 0){
+            limit.rlim_cur = limit.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    size_t residentBytes(pid_t pid){
+        std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+        size_t pages = 0;
+        size_t resident = 0;
+        statm >> pages >> resident;
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    }
+
+    // User and system CPU time of a process
+    double cpuSeconds(pid_t pid){
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string line;
+        std::getline(stat, line);
+        // The fields after the command name, which may contain spaces, utime and stime are the 12th and 13th
+        std::istringstream fields(line.substr(line.rfind(')') + 2));
+        std::string field;
+        for(int i = 0; i < 11; ++i){
+            fields >> field;
+        }
+        double utime = 0;
+        double stime = 0;
+        fields >> utime >> stime;
+        return (utime + stime) / static_cast<double>(sysconf(_SC_CLK_TCK));
+    }
+
+    // Runs until killed, writes one byte to ready once started and one once it has the clients
+    [[noreturn]] void runServer(const Options& options, int ready){
+        std::ofstream devNull("/dev/null");
+        std::cout.rdbuf(devNull.rdbuf());
+        std::cerr.rdbuf(devNull.rdbuf());
+
+        boost::asio::io_context context;
+        TcpServer server(options.port, context);
+        server.setConnectionLimits(options.limits);
+        server.setTimeouts(options.timeouts);
+        server.start();
+        boost::asio::steady_timer poll(context);
+        std::function<void()> check = [&]() {
+            if(static_cast<size_t>(server.getClientCount()) >= options.connections){
+                char done = 1;
+                (void)!write(ready, &done, 1);
+                return;
+            }
+            poll.expires_after(poll_interval);
+            poll.async_wait([&check](const boost::system::error_code &error) {
+                if(!error){
+                    check();
+                }
+            });
+        };
+        boost::asio::post(context, [&]() {
+            char started = 1;
+            (void)!write(ready, &started, 1);
+            check();
+        });
+        context.run();
+        _exit(0);
+    }
+}
+
+int main(int argc, char* argv[]){
+    Options options;
+    if(!parseOptions(argc, argv, options)){
+        std::cerr << "Usage: connection_scale_bench [--connections <n>] [--port <port>] [--backlog <n>]\n"
+                     "                              [--accept-batch <n>] [--heartbeat <ms>] [--json]\n";
+        return -1;
+    }
+    raiseDescriptorLimit();
+
+    int pipeEnds[2];
+    if(pipe(pipeEnds) != 0){
+        std::cerr << "pipe() failed" << std::endl;
+        return -1;
+    }
+    pid_t server = fork();
+    if(server == 0){
+        close(pipeEnds[0]);
+        runServer(options, pipeEnds[1]);
+    }
+    close(pipeEnds[1]);
+    char signal = 0;
+    if(read(pipeEnds[0], &signal, 1) != 1){
+        std::cerr << "Server did not start" << std::endl;
+        return -1;
+    }
+    size_t baseline = residentBytes(server);
+
+    boost::asio::io_context context;
+    std::vector<tcp::socket> sockets;
+    std::vector<std::string> commands;
+    sockets.reserve(options.connections);
+    commands.reserve(options.connections);
+    size_t failed = 0;
+    auto start = Clock::now();
+    for(size_t i = 0; i < options.connections; ++i){
+        auto address = boost::asio::ip::address_v4(0x7f000001 + static_cast<std::uint32_t>(i / connections_per_address));
+        tcp::endpoint endpoint{address, static_cast<unsigned short>(options.port)};
+        commands.push_back("CONNECT;client" + std::to_string(i) + "\n");
+        tcp::socket &socket = sockets.emplace_back(context);
+        const std::string &command = commands.back();
+        socket.async_connect(endpoint, [&socket, &command, &failed](const boost::system::error_code &error) {
+            if(error){
+                ++failed;
+                return;
+            }
+            boost::asio::async_write(socket, boost::asio::buffer(command),
+                                     [&failed](const boost::system::error_code &error, size_t) {
+                failed += error ? 1 : 0;
+            });
+        });
+    }
+    context.run();
+    auto connected = Clock::now();
+
+    // The server reports once every CONNECT arrived
+    bool complete = false;
+    if(failed == 0){
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(pipeEnds[0], &readable);
+        struct timeval timeout{std::chrono::duration_cast<std::chrono::seconds>(storm_timeout).count(), 0};
+        complete = select(pipeEnds[0] + 1, &readable, nullptr, nullptr, &timeout) == 1 &&
+                   read(pipeEnds[0], &signal, 1) == 1;
+    }
+    auto accepted = Clock::now();
+    size_t resident = residentBytes(server);
+
+    // CPU the server spends while every connection is idle, heartbeats aside
+    double idleCpuStart = cpuSeconds(server);
+    std::this_thread::sleep_for(idle_window);
+    double idleCpuPercent = 100 * (cpuSeconds(server) - idleCpuStart) / std::chrono::duration<double>(idle_window).count();
+
+    kill(server, SIGKILL);
+    waitpid(server, nullptr, 0);
+
+    double connectSeconds = std::chrono::duration<double>(connected - start).count();
+    double stormSeconds = std::chrono::duration<double>(accepted - start).count();
+    double bytesPerConnection = resident > baseline ? static_cast<double>(resident - baseline) / options.connections : 0;
+    if(options.json){
+        std::cout << "{\"connections\":" << options.connections
+                  << ",\"backlog\":" << options.limits.backlog
+                  << ",\"accept_batch\":" << options.limits.acceptBatch
+                  << ",\"io_engine\":\"" << Constants::io_engine << "\""
+                  << ",\"failed\":" << failed
+                  << ",\"complete\":" << (complete ? "true" : "false")
+                  << ",\"connect_s\":" << connectSeconds
+                  << ",\"storm_s\":" << stormSeconds
+                  << ",\"server_rss_bytes\":" << resident
+                  << ",\"rss_bytes_per_connection\":" << bytesPerConnection
+                  << ",\"heartbeat_ms\":" << options.timeouts.heartbeatInterval.count()
+                  << ",\"idle_cpu_percent\":" << idleCpuPercent << "}" << std::endl;
+    } else {
+        std::cout << options.connections << " connections (" << Constants::io_engine << "), backlog "
+                  << options.limits.backlog << ", accept batch " << options.limits.acceptBatch << std::endl;
+        if(!complete){
+            std::cout << "incomplete: " << failed << " connections failed" << std::endl;
+        }
+        std::cout << "connected in " << connectSeconds << " s, all CONNECTs handled after " << stormSeconds
+                  << " s (" << static_cast<long>(options.connections / stormSeconds) << " connections/s)" << std::endl;
+        std::cout << "server resident memory " << resident / 1024 << " KiB, "
+                  << static_cast<long>(bytesPerConnection) << " B per connection" << std::endl;
+        std::cout << "idle server cpu " << idleCpuPercent << " % (heartbeat ";
+        if(options.timeouts.heartbeatInterval.count() > 0){
+            std::cout << options.timeouts.heartbeatInterval.count() << " ms)" << std::endl;
+        } else {
+            std::cout << "off)" << std::endl;
+        }
+    }
+    return complete ? 0 : 1;
+}
@@ -0,0 +1,69 @@
+#include "subscription_index.hpp"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+
+// Measures the cost of resolving the subscribers of one topic while the number of
+// unrelated clients and topics grows. The legacy column reproduces the former
+// full scan over every client's topic list.
+
+namespace {
+    constexpr int topics_per_client = 4;
+    constexpr int hot_subscribers = 8;
+
+    template <typename Fn>
+    double nsPerPublish(int iterations, Fn&& fn){
+        auto start = std::chrono::steady_clock::now();
+        for(int i = 0; i < iterations; ++i){
+            fn();
+        }
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+    }
+}
+
+int main(){
+    std::cout << std::setw(10) << "clients" << std::setw(10) << "topics"
+              << std::setw(16) << "index ns/pub" << std::setw(16) << "legacy ns/pub" << std::endl;
+
+    volatile size_t sink = 0;
+    for(int clients : {100, 1000, 10000, 50000}){
+        SubscriptionIndex index;
+        std::unordered_map<int, std::vector<std::string>> legacy;
+        for(int client = 0; client < clients; ++client){
+            for(int k = 0; k < topics_per_client; ++k){
+                std::string topic = "topic" + std::to_string(client) + "_" + std::to_string(k);
+                index.subscribe(client, topic);
+                legacy[client].push_back(topic);
+            }
+            if(client < hot_subscribers){
+                index.subscribe(client, "hot");
+                legacy[client].push_back("hot");
+            }
+        }
+
+        const std::string topic = "hot";
+        double indexNs = nsPerPublish(200000, [&](){
+            for(int subscriber : index.subscribers(topic)){
+                sink = sink + subscriber;
+            }
+        });
+        double legacyNs = nsPerPublish(std::max(10, 2000000 / clients), [&](){
+            std::vector<int> topicSubscribers;
+            for(auto it : legacy){
+                if(std::find(it.second.begin(), it.second.end(), topic) != it.second.end()){
+                    topicSubscribers.push_back(it.first);
+                }
+            }
+            for(int subscriber : topicSubscribers){
+                sink = sink + subscriber;
+            }
+        });
+
+        std::cout << std::setw(10) << clients << std::setw(10) << index.topicCount()
+                  << std::setw(16) << std::fixed << std::setprecision(1) << indexNs
+                  << std::setw(16) << legacyNs << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,764 @@
+#include "tcp_server.hpp"
+#include "shard_group.hpp"
+#include "latency_histogram.hpp"
+#include "ack_window.hpp"
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <sys/resource.h>
+
+// End to end load generator. Starts N publishers and M subscribers on TcpConnections,
+// publishes at a target rate (or as fast as the server accepts) and measures the
+// delivered throughput and the publish to delivery latency of every message.
+//
+// Every payload starts with the send time in nanoseconds of the steady clock, so
+// publishers and subscribers have to run in this process. With a target rate the
+// send time is the time the message was scheduled for, not when it went out, so a
+// stalled server shows up in the latency instead of silently lowering the rate.
+//
+// The CPU time of the whole process (server, publishers and subscribers) during the
+// measured window is reported per delivered message, to compare builds.
+//
+// The shm transport connects over the Unix domain socket and has the server deliver into
+// a shared memory ring per subscriber, read by a thread of the subscriber's own.
+//
+// With --qos 1 publishers and subscribers connect with at-least-once delivery. Publishers
+// keep their unacknowledged publishes in an AckWindow and count as congested while it is
+// full, subscribers acknowledge with cumulative Acks paced like TcpClient's.
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    constexpr size_t timestamp_size = 20;
+    constexpr auto settle_time = std::chrono::milliseconds(200);
+    constexpr auto drain_time = std::chrono::milliseconds(500);
+    constexpr auto tick = std::chrono::milliseconds(1);
+    // Messages published per tick at most, so publishing cannot starve the reads
+    constexpr std::uint64_t max_batch = 1024;
+    constexpr unsigned ring_spin_count = 100;
+    constexpr auto ring_wait_timeout = std::chrono::milliseconds(100);
+
+    enum class Transport { Tcp, Uds, Shm };
+
+    struct Options {
+        int port = 12345;
+        // Loopback TCP, the server's Unix domain socket or shared memory, one after the other
+        std::vector<Transport> transports{Transport::Tcp};
+        std::string udsPath = "/tmp/tcp_bench.sock";
+        int publishers = 1;
+        int subscribers = 4;
+        int topics = 1;
+        size_t payload = 64;
+        std::uint64_t rate = 0;
+        double duration = 5.0;
+        double warmup = 1.0;
+        int serverThreads = 1;
+        // Publishes per PublishBatch frame, 1 sends every publish in its own frame
+        size_t batch = 1;
+        bool external = false;
+        bool binary = false;
+        // At-least-once delivery, binary protocol over a socket only
+        bool qos = false;
+        bool json = false;
+    };
+
+    std::int64_t nowNs(){
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+    }
+
+    std::string_view transportName(Transport transport){
+        switch(transport){
+            case Transport::Uds: return "uds";
+            case Transport::Shm: return "shm";
+            default: return "tcp";
+        }
+    }
+
+    std::int64_t processCpuNs(){
+        struct rusage usage;
+        ::getrusage(RUSAGE_SELF, &usage);
+        auto toNs = [](const timeval& time) {
+            return static_cast<std::int64_t>(time.tv_sec) * 1000000000 + static_cast<std::int64_t>(time.tv_usec) * 1000;
+        };
+        return toNs(usage.ru_utime) + toNs(usage.ru_stime);
+    }
+
+    std::string topicName(int topic){
+        return "bench/" + std::to_string(topic);
+    }
+
+    // One bench connection, publishers and subscribers only differ in what they send
+    class BenchClient : public TcpObject {
+        public:
+            struct Stats {
+                LatencyHistogram latency;
+                std::uint64_t messages = 0;
+                std::uint64_t bytes = 0;
+                std::int64_t windowBegin = 0;
+                std::int64_t windowEnd = 0;
+                // User and system time of the process during the window
+                std::int64_t cpuNs = 0;
+            };
+
+            // Connects and sends CONNECT with name
+            BenchClient(boost::asio::io_context& context, const Options& options, Transport transport, Stats& stats,
+                        const std::string& name, size_t batch = 1) :
+                m_stats(stats),
+                m_version(options.binary ? Protocol::Version::Binary : Protocol::Version::Text),
+                m_batchSize(batch),
+                m_batched(0),
+                m_ackTimer(context) {
+                StreamSocket socket(context);
+                if(transport == Transport::Shm && !(m_ring = ShmRing::create())){
+                    throw std::runtime_error("shared memory is not available");
+                }
+                std::string command = "CONNECT;" + name;
+                if(m_version == Protocol::Version::Binary){
+                    command += ";2";
+                }
+                if(options.qos){
+                    command += ";;;1;0";
+                }
+                if(transport != Transport::Tcp){
+                    boost::asio::local::stream_protocol::socket local(context);
+                    local.connect(boost::asio::local::stream_protocol::endpoint(options.udsPath));
+                    // The ring's memory goes along with the CONNECT, before the connection uses the socket
+                    if(m_ring && !m_ring->sendDescriptor(local.native_handle(), command + ";;" +
+                                                         std::string(Protocol::ring_field) + "\n")){
+                        throw std::runtime_error("cannot pass the shared memory ring");
+                    }
+                    socket = std::move(local);
+                }else{
+                    tcp::socket remote(context);
+                    remote.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"),
+                                                 static_cast<unsigned short>(options.port)});
+                    remote.set_option(tcp::no_delay(true));
+                    socket = std::move(remote);
+                }
+                m_connection = TcpConnection::create(std::move(socket), *this);
+                if(options.qos){
+                    // The window bounds the queue, see TcpClient::connect(). Sized in publishes
+                    // rather than frames, so batches do not outrun the subscribers' windows.
+                    m_window = std::make_unique<AckWindow>(std::max<size_t>(AckWindow::default_capacity / batch, 1));
+                    m_connection->setWaterMarks(Constants::write_low_water_mark, SIZE_MAX);
+                }
+                m_connection->read();
+                if(!m_ring){
+                    m_connection->send(command.data(), command.size());
+                }
+            }
+
+            ~BenchClient(){
+                stopRingReader();
+            }
+
+            void subscribe(const std::string& topic){
+                if(m_version == Protocol::Version::Binary){
+                    m_connection->send(Protocol::encode(Protocol::Opcode::Subscribe, topic));
+                    return;
+                }
+                std::string command = "SUBSCRIBE;" + topic;
+                m_connection->send(command.data(), command.size());
+            }
+
+            bool publish(const std::string& topic, std::string& payload, std::int64_t timestamp){
+                // Zero padded so the subscriber can parse a fixed width field
+                auto digits = std::to_string(timestamp);
+                payload.replace(timestamp_size - digits.size(), digits.size(), digits);
+                if(m_batchSize > 1){
+                    // Rejected while congested like a single frame, so flushes are never rejected
+                    if(isCongested()){
+                        return false;
+                    }
+                    Protocol::appendBatchEntry(m_batch, topic, payload);
+                    if(++m_batched == m_batchSize){
+                        flush();
+                    }
+                    return true;
+                }
+                if(m_version == Protocol::Version::Binary){
+                    return sendPublish(Protocol::encode(Protocol::Opcode::Publish, topic, payload));
+                }
+                m_command.assign("PUBLISH;").append(topic).append(";").append(payload);
+                return m_connection->send(m_command.data(), m_command.size());
+            }
+
+            // Sends the pending publishes as one PublishBatch, kept for later while congested
+            void flush(){
+                if(m_batched == 0 || isCongested()){
+                    return;
+                }
+                sendPublish(Protocol::encode(Protocol::Opcode::PublishBatch, {}, m_batch));
+                m_batch.clear();
+                m_batched = 0;
+            }
+
+            bool hasPending() const{
+                return m_batched != 0;
+            }
+
+            bool isCongested(){
+                return m_connection->isCongested() || (m_window && m_window->full());
+            }
+
+            void close(){
+                m_connection->close();
+            }
+
+            // Call once the measured window is set, the thread reads it
+            void startRingReader(){
+                if(!m_ring){
+                    return;
+                }
+                m_ringReader = std::thread([this]() {
+                    auto onFrame = [this](std::string_view frame) { receivedBinary(frame); };
+                    for(;;){
+                        bool closed = m_ring->isClosed();
+                        m_ring->read(onFrame);
+                        if(closed){
+                            return;
+                        }
+                        m_ring->wait(ring_wait_timeout, ring_spin_count);
+                    }
+                });
+            }
+
+            // Called from the ring reader as well, send() is thread safe
+            void receivedBinary(std::string_view frame){
+                Protocol::Frame decoded;
+                if(!Protocol::decode(frame, decoded)){
+                    return;
+                }
+                if(decoded.opcode == Protocol::Opcode::Message){
+                    m_received += m_window != nullptr;
+                    received(decoded.payload);
+                } else if(decoded.opcode == Protocol::Opcode::Ack && m_window){
+                    m_window->acknowledge(decoded.sequence);
+                } else if(decoded.opcode == Protocol::Opcode::Ping){
+                    m_connection->send(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Binary));
+                }
+            }
+
+            void stopRingReader(){
+                if(m_ring){
+                    m_ring->close();
+                }
+                if(m_ringReader.joinable()){
+                    m_ringReader.join();
+                }
+            }
+
+            void onFrame(int connId, std::string_view frame) override{
+                if(m_connection->protocol() == Protocol::Version::Binary){
+                    receivedBinary(frame);
+                    return;
+                }
+                if(frame == Protocol::ping){
+                    m_connection->send(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Text));
+                    return;
+                }
+                if(m_version == Protocol::Version::Binary && (frame == Protocol::connack || frame == Protocol::connack_ring ||
+                                                              frame.substr(0, Protocol::connack_qos.size()) == Protocol::connack_qos)){
+                    m_connection->setProtocol(Protocol::Version::Binary);
+                    return;
+                }
+                onRead(connId, frame);
+            }
+
+            void onRead(int connId, std::string_view data) override{
+                (void)connId;
+                auto separator = data.find(Constants::delimiter);
+                if(separator != std::string_view::npos){
+                    received(data.substr(separator + 1));
+                }
+            }
+
+            // Acknowledges like TcpClient, see AckWindow::ack_threshold
+            void onReadComplete(int connId) override{
+                (void)connId;
+                std::uint64_t unacknowledged = m_received - m_receivedAcknowledged;
+                if(unacknowledged >= AckWindow::ack_threshold){
+                    sendAck();
+                }else if(unacknowledged != 0 && !m_ackPending){
+                    m_ackPending = true;
+                    m_ackTimer.expires_after(AckWindow::ack_delay);
+                    m_ackTimer.async_wait([this](const boost::system::error_code& error) {
+                        m_ackPending = false;
+                        if(!error && m_received != m_receivedAcknowledged){
+                            sendAck();
+                        }
+                    });
+                }
+            }
+
+            void onClose(int connId) override { (void)connId; }
+            void onStart(int connId) override { (void)connId; }
+            void handleCommand(std::string_view input, int connId) override { (void)input; (void)connId; }
+
+        private:
+            void sendAck(){
+                if(m_connection->sendControl(Protocol::encodeAck(m_received))){
+                    m_receivedAcknowledged = m_received;
+                }
+            }
+
+            bool sendPublish(const SharedBufferPtr& frame){
+                if(m_window && !m_window->push(frame)){
+                    return false;
+                }
+                return m_connection->send(frame);
+            }
+
+            void handleConnect(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+            void handleDisconnect(int connId) override { (void)connId; }
+            void handlePublish(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+            void handleSubscribe(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+            void handleUnsubscribe(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+            void handleStats(int connId) override { (void)connId; }
+
+            void received(std::string_view payload){
+                std::int64_t now = nowNs();
+                std::int64_t sent = 0;
+                if(payload.size() < timestamp_size ||
+                   std::from_chars(payload.data(), payload.data() + timestamp_size, sent).ec != std::errc{}){
+                    return;
+                }
+                // Only messages published inside the measured window count
+                if(sent < m_stats.windowBegin || sent >= m_stats.windowEnd){
+                    return;
+                }
+                m_stats.latency.record(static_cast<std::uint64_t>(std::max<std::int64_t>(now - sent, 0)));
+                ++m_stats.messages;
+                m_stats.bytes += payload.size();
+            }
+
+            Stats& m_stats;
+            Protocol::Version m_version;
+            std::shared_ptr<TcpConnection> m_connection;
+            std::string m_command;
+            size_t m_batchSize;
+            size_t m_batched;
+            std::string m_batch;
+            std::unique_ptr<ShmRing> m_ring;
+            std::thread m_ringReader;
+            // Publishes not acknowledged yet, QoS 1 only
+            std::unique_ptr<AckWindow> m_window;
+            // Messages received and the last one acknowledged, QoS 1 only
+            std::uint64_t m_received = 0;
+            std::uint64_t m_receivedAcknowledged = 0;
+            bool m_ackPending = false;
+            boost::asio::steady_timer m_ackTimer;
+    };
+
+    // Publishes round robin over publishers and topics from timer ticks on the client io_context
+    class Publisher {
+        public:
+            Publisher(boost::asio::io_context& context, const Options& options,
+                      std::vector<std::unique_ptr<BenchClient>>& clients, BenchClient::Stats& stats) :
+                m_context(context),
+                m_timer(context),
+                m_options(options),
+                m_clients(clients),
+                m_stats(stats),
+                m_sentPerTopic(options.topics, 0),
+                m_payload(options.payload, 'x'),
+                m_sequence(0),
+                m_sent(0),
+                m_dropped(0) {
+                m_payload.replace(0, timestamp_size, timestamp_size, '0');
+                for(int topic = 0; topic < options.topics; ++topic){
+                    m_topics.push_back(topicName(topic));
+                }
+            }
+
+            void start(std::int64_t startNs, std::int64_t endNs){
+                m_startNs = startNs;
+                m_endNs = endNs;
+                run();
+            }
+
+            std::uint64_t sent() const { return m_sent; }
+            std::uint64_t sent(int topic) const { return m_sentPerTopic[topic]; }
+            std::uint64_t dropped() const { return m_dropped; }
+
+        private:
+            // Returns whether no publishes are left pending
+            bool flush(){
+                bool flushed = true;
+                for(auto &client : m_clients){
+                    client->flush();
+                    flushed = flushed && !client->hasPending();
+                }
+                return flushed;
+            }
+
+            void run(){
+                std::int64_t now = nowNs();
+                if(now >= m_endNs){
+                    // Every publish counted as sent has to go out, batches of congested clients are retried
+                    if(!flush()){
+                        m_timer.expires_after(tick);
+                        m_timer.async_wait([this](const boost::system::error_code& error) {
+                            if(!error){
+                                run();
+                            }
+                        });
+                    }
+                    return;
+                }
+                std::uint64_t due = m_sequence + max_batch;
+                if(m_options.rate != 0){
+                    auto elapsed = static_cast<double>(now - m_startNs) / 1e9;
+                    due = std::min(due, static_cast<std::uint64_t>(elapsed * m_options.rate) + 1);
+                }
+                bool congested = false;
+                for(; m_sequence < due; ++m_sequence){
+                    auto publisher = m_sequence % m_clients.size();
+                    // Without a target rate the publishers run closed loop, limited by backpressure
+                    if(m_options.rate == 0 && m_clients[publisher]->isCongested()){
+                        congested = true;
+                        break;
+                    }
+                    std::int64_t timestamp = m_options.rate == 0 ? nowNs() :
+                        m_startNs + static_cast<std::int64_t>(m_sequence * 1e9 / m_options.rate);
+                    auto topic = (m_sequence / m_clients.size()) % m_topics.size();
+                    bool inWindow = timestamp >= m_stats.windowBegin && timestamp < m_stats.windowEnd;
+                    if(m_clients[publisher]->publish(m_topics[topic], m_payload, timestamp)){
+                        m_sent += inWindow;
+                        m_sentPerTopic[topic] += inWindow;
+                    }else{
+                        m_dropped += inWindow;
+                    }
+                }
+                // Partial batches go out every run, so batching adds no latency beyond a run
+                flush();
+                if(m_options.rate == 0 && !congested){
+                    boost::asio::post(m_context, [this]() { run(); });
+                    return;
+                }
+                m_timer.expires_after(tick);
+                m_timer.async_wait([this](const boost::system::error_code& error) {
+                    if(!error){
+                        run();
+                    }
+                });
+            }
+
+            boost::asio::io_context& m_context;
+            boost::asio::steady_timer m_timer;
+            const Options& m_options;
+            std::vector<std::unique_ptr<BenchClient>>& m_clients;
+            BenchClient::Stats& m_stats;
+            std::vector<std::string> m_topics;
+            std::vector<std::uint64_t> m_sentPerTopic;
+            std::string m_payload;
+            std::uint64_t m_sequence;
+            std::int64_t m_startNs;
+            std::int64_t m_endNs;
+            std::uint64_t m_sent;
+            std::uint64_t m_dropped;
+    };
+
+    void usage(){
+        std::cerr << "Usage: tcp_bench [--port <port>] [--publishers <n>] [--subscribers <m>] [--topics <t>]\n"
+                     "                 [--payload <bytes>] [--rate <msgs/s, 0 = unlimited>] [--duration <s>]\n"
+                     "                 [--warmup <s>] [--server-threads <n>] [--batch <publishes per frame>] [--external]\n"
+                     "                 [--transport tcp|uds|shm|both|all] [--uds-path <path>] [--binary] [--qos 0|1] [--json]\n";
+    }
+
+    template <typename T>
+    bool parseValue(const char* text, T& value){
+        std::istringstream stream(text);
+        return static_cast<bool>(stream >> value) && stream.eof();
+    }
+
+    bool parseOptions(int argc, char* argv[], Options& options){
+        for(int i = 1; i < argc; ++i){
+            std::string_view arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            bool ok = true;
+            if(arg == "--external"){
+                options.external = true;
+            }else if(arg == "--binary"){
+                options.binary = true;
+            }else if(arg == "--json"){
+                options.json = true;
+            }else if(!hasValue){
+                ok = false;
+            }else if(arg == "--port"){
+                ok = parseValue(argv[++i], options.port);
+            }else if(arg == "--publishers"){
+                ok = parseValue(argv[++i], options.publishers);
+            }else if(arg == "--subscribers"){
+                ok = parseValue(argv[++i], options.subscribers);
+            }else if(arg == "--topics"){
+                ok = parseValue(argv[++i], options.topics);
+            }else if(arg == "--payload"){
+                ok = parseValue(argv[++i], options.payload);
+            }else if(arg == "--rate"){
+                ok = parseValue(argv[++i], options.rate);
+            }else if(arg == "--duration"){
+                ok = parseValue(argv[++i], options.duration);
+            }else if(arg == "--warmup"){
+                ok = parseValue(argv[++i], options.warmup);
+            }else if(arg == "--server-threads"){
+                ok = parseValue(argv[++i], options.serverThreads);
+            }else if(arg == "--batch"){
+                ok = parseValue(argv[++i], options.batch);
+            }else if(arg == "--qos"){
+                int qos = 0;
+                ok = parseValue(argv[++i], qos) && (qos == 0 || qos == 1);
+                options.qos = qos == 1;
+            }else if(arg == "--transport"){
+                std::string_view transport = argv[++i];
+                if(transport == "tcp"){
+                    options.transports = {Transport::Tcp};
+                }else if(transport == "uds"){
+                    options.transports = {Transport::Uds};
+                }else if(transport == "shm"){
+                    options.transports = {Transport::Shm};
+                }else if(transport == "both"){
+                    options.transports = {Transport::Tcp, Transport::Uds};
+                }else if(transport == "all"){
+                    options.transports = {Transport::Tcp, Transport::Uds, Transport::Shm};
+                }else{
+                    ok = false;
+                }
+            }else if(arg == "--uds-path"){
+                options.udsPath = argv[++i];
+            }else{
+                ok = false;
+            }
+            if(!ok){
+                std::cerr << "Invalid argument " << arg << std::endl;
+                return false;
+            }
+        }
+        if(options.publishers < 1 || options.subscribers < 0 || options.topics < 1 || options.duration <= 0 ||
+           options.warmup < 0 || options.serverThreads < 1 ||
+           options.serverThreads > static_cast<int>(ShardGroup::max_shards)){
+            std::cerr << "Counts must be positive and the duration above zero" << std::endl;
+            return false;
+        }
+        if(options.batch < 1 || (options.batch > 1 && !options.binary)){
+            std::cerr << "Batches need --binary and at least one publish" << std::endl;
+            return false;
+        }
+        bool shm = std::find(options.transports.begin(), options.transports.end(), Transport::Shm) !=
+                   options.transports.end();
+        if(shm && !options.binary){
+            std::cerr << "The shm transport needs --binary" << std::endl;
+            return false;
+        }
+        if(options.qos && (!options.binary || shm)){
+            std::cerr << "QoS 1 needs --binary and a socket transport" << std::endl;
+            return false;
+        }
+        if(options.payload < timestamp_size){
+            std::cerr << "Payload must be at least " << timestamp_size << " bytes (send timestamp)" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void report(std::ostream& out, const Options& options, Transport transport, const BenchClient::Stats& stats,
+                std::uint64_t sent, std::uint64_t dropped, std::uint64_t expected){
+        double messagesPerSecond = stats.messages / options.duration;
+        double bytesPerSecond = stats.bytes / options.duration;
+        double cpuPerMessage = stats.messages == 0 ? 0 : static_cast<double>(stats.cpuNs) / stats.messages;
+        const auto &latency = stats.latency;
+        if(options.json){
+            out << "{\"publishers\":" << options.publishers
+                << ",\"subscribers\":" << options.subscribers
+                << ",\"topics\":" << options.topics
+                << ",\"payload_bytes\":" << options.payload
+                << ",\"target_rate\":" << options.rate
+                << ",\"duration_s\":" << options.duration
+                << ",\"protocol\":\"" << (options.binary ? "binary" : "text") << "\""
+                << ",\"transport\":\"" << transportName(transport) << "\""
+                << ",\"server_threads\":" << options.serverThreads
+                << ",\"batch\":" << options.batch
+                << ",\"qos\":" << options.qos
+                << ",\"io_engine\":\"" << Constants::io_engine << "\""
+                << ",\"connection_engine\":\"" << Constants::connection_engine << "\""
+                << ",\"published\":" << sent
+                << ",\"publish_rejected\":" << dropped
+                << ",\"expected_deliveries\":" << expected
+                << ",\"delivered\":" << stats.messages
+                << ",\"published_msgs_per_s\":" << sent / options.duration
+                << ",\"delivered_msgs_per_s\":" << messagesPerSecond
+                << ",\"delivered_bytes_per_s\":" << bytesPerSecond
+                << ",\"cpu_ns_per_msg\":" << cpuPerMessage
+                << ",\"latency_ns\":{\"mean\":" << latency.mean()
+                << ",\"p50\":" << latency.percentile(50)
+                << ",\"p99\":" << latency.percentile(99)
+                << ",\"p99_9\":" << latency.percentile(99.9)
+                << ",\"max\":" << latency.max() << "}}" << std::endl;
+            return;
+        }
+        out << "publishers " << options.publishers << ", subscribers " << options.subscribers
+            << ", topics " << options.topics << ", payload " << options.payload << " B, rate "
+            << (options.rate == 0 ? std::string("unlimited") : std::to_string(options.rate) + " msgs/s")
+            << ", " << (options.binary ? "binary" : "text") << " protocol over " << transportName(transport) << ", "
+            << Constants::io_engine << ", " << Constants::connection_engine;
+        if(options.batch > 1){
+            out << ", " << options.batch << " publishes per batch";
+        }
+        if(options.qos){
+            out << ", QoS 1";
+        }
+        out << std::endl;
+        out << std::fixed << std::setprecision(0);
+        out << "published  " << std::setw(12) << sent / options.duration << " msgs/s ("
+            << dropped << " rejected by backpressure)" << std::endl;
+        out << "delivered  " << std::setw(12) << messagesPerSecond << " msgs/s "
+            << std::setw(12) << bytesPerSecond << " bytes/s (" << stats.messages << " of "
+            << expected << ")" << std::endl;
+        out << "cpu        " << std::setw(12) << cpuPerMessage << " ns per delivered msg" << std::endl;
+        out << std::setprecision(1);
+        out << "latency us  mean " << latency.mean() / 1e3 << "  p50 " << latency.percentile(50) / 1e3
+            << "  p99 " << latency.percentile(99) / 1e3 << "  p99.9 " << latency.percentile(99.9) / 1e3
+            << "  max " << latency.max() / 1e3 << std::endl;
+    }
+
+    // One measurement over the given transport with its own clients, the server is shared
+    bool runBench(const Options& options, Transport transport, std::ostream& out){
+        boost::asio::io_context context;
+        BenchClient::Stats stats;
+        // Ring readers run on threads of their own and count into their own stats
+        std::vector<std::unique_ptr<BenchClient::Stats>> ringStats;
+        std::vector<std::unique_ptr<BenchClient>> subscribers;
+        std::vector<std::unique_ptr<BenchClient>> publishers;
+        std::vector<std::uint64_t> subscribersPerTopic(options.topics, 0);
+        try {
+            for(int i = 0; i < options.subscribers; ++i){
+                BenchClient::Stats *subscriberStats = &stats;
+                if(transport == Transport::Shm){
+                    ringStats.push_back(std::make_unique<BenchClient::Stats>());
+                    subscriberStats = ringStats.back().get();
+                }
+                subscribers.push_back(std::make_unique<BenchClient>(context, options, transport, *subscriberStats,
+                                                                    "sub" + std::to_string(i)));
+                subscribers.back()->subscribe(topicName(i % options.topics));
+                ++subscribersPerTopic[i % options.topics];
+            }
+            for(int i = 0; i < options.publishers; ++i){
+                publishers.push_back(std::make_unique<BenchClient>(context, options, transport, stats,
+                                                                   "pub" + std::to_string(i), options.batch));
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "tcp_bench: cannot connect to " << (transport != Transport::Tcp ? options.udsPath :
+                         "port " + std::to_string(options.port)) << ": " << e.what() << std::endl;
+            return false;
+        }
+        std::thread clientThread{[&context]() { context.run(); }};
+
+        // Give the server time to register every subscription before the first publish
+        std::this_thread::sleep_for(settle_time);
+        std::int64_t start = nowNs();
+        stats.windowBegin = start + static_cast<std::int64_t>(options.warmup * 1e9);
+        stats.windowEnd = stats.windowBegin + static_cast<std::int64_t>(options.duration * 1e9);
+        for(auto &subscriberStats : ringStats){
+            subscriberStats->windowBegin = stats.windowBegin;
+            subscriberStats->windowEnd = stats.windowEnd;
+        }
+        for(auto &client : subscribers){
+            client->startRingReader();
+        }
+        Publisher publisher(context, options, publishers, stats);
+        boost::asio::post(context, [&]() { publisher.start(start, stats.windowEnd); });
+
+        std::this_thread::sleep_until(Clock::time_point(std::chrono::nanoseconds(stats.windowBegin)));
+        std::int64_t cpuBegin = processCpuNs();
+        std::this_thread::sleep_until(Clock::time_point(std::chrono::nanoseconds(stats.windowEnd)));
+        stats.cpuNs = processCpuNs() - cpuBegin;
+        std::this_thread::sleep_until(Clock::time_point(std::chrono::nanoseconds(stats.windowEnd)) + drain_time);
+        std::promise<void> stopped;
+        boost::asio::post(context, [&]() {
+            for(auto &client : subscribers){
+                client->close();
+            }
+            for(auto &client : publishers){
+                client->close();
+            }
+            stopped.set_value();
+        });
+        stopped.get_future().wait();
+        context.stop();
+        clientThread.join();
+        for(auto &client : subscribers){
+            client->stopRingReader();
+        }
+        for(auto &subscriberStats : ringStats){
+            stats.latency.merge(subscriberStats->latency);
+            stats.messages += subscriberStats->messages;
+            stats.bytes += subscriberStats->bytes;
+        }
+
+        // Every publish in the window goes to every subscriber of its topic
+        std::uint64_t expected = 0;
+        for(int topic = 0; topic < options.topics; ++topic){
+            expected += subscribersPerTopic[topic] * publisher.sent(topic);
+        }
+        report(out, options, transport, stats, publisher.sent(), publisher.dropped(), expected);
+        return true;
+    }
+}
+
+int main(int argc, char* argv[]){
+    Options options;
+    if(!parseOptions(argc, argv, options)){
+        usage();
+        return 1;
+    }
+
+    // Results go to stdout, the server's connection log is silenced so it cannot mix in
+    std::ostream out(std::cout.rdbuf());
+    std::ostringstream serverLog;
+    std::unique_ptr<ShardGroup> shards;
+    std::unique_ptr<boost::asio::io_context> serverContext;
+    std::unique_ptr<TcpServer> server;
+    std::thread serverThread;
+    bool uds = std::find_if(options.transports.begin(), options.transports.end(),
+                            [](Transport transport) { return transport != Transport::Tcp; }) != options.transports.end();
+    if(!options.external){
+        std::cout.rdbuf(serverLog.rdbuf());
+        if(options.serverThreads > 1){
+            shards = std::make_unique<ShardGroup>(options.port, static_cast<size_t>(options.serverThreads));
+            if(uds){
+                shards->listenLocal(options.udsPath);
+            }
+            shards->start();
+        }else{
+            serverContext = std::make_unique<boost::asio::io_context>();
+            server = std::make_unique<TcpServer>(options.port, *serverContext);
+            if(uds){
+                server->listenLocal(options.udsPath);
+            }
+            server->start();
+            serverThread = std::thread{[&serverContext]() { serverContext->run(); }};
+        }
+    }
+
+    bool ok = true;
+    for(Transport transport : options.transports){
+        ok = ok && runBench(options, transport, out);
+    }
+
+    if(serverContext){
+        serverContext->stop();
+        serverThread.join();
+    }
+    if(shards){
+        shards->stop();
+        shards->wait();
+    }
+    std::cout.rdbuf(out.rdbuf());
+    return ok ? 0 : 1;
+}
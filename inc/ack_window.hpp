@@ -0,0 +1,55 @@
+#ifndef ACK_WINDOW_HPP
+#define ACK_WINDOW_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include "shared_buffer.hpp"
+
+// Frames a QoS 1 sender sent and the receiver did not acknowledge yet. Sequence numbers are
+// not carried by the frames, the n-th counted frame on a connection has sequence n on both
+// sides, so a frame shared by many receivers stays shared. Acknowledgements are cumulative,
+// one Ack covers every frame up to its sequence.
+//
+// Receivers acknowledge once ack_threshold frames are unacknowledged, and otherwise after
+// ack_delay. Acknowledging every read costs the receiver a write per read and the sender a
+// read per Ack, which under load means smaller reads and even more Acks.
+//
+// The frames of a lost connection are sent again on the next one, after resume() dropped
+// the ones the receiver reported to have.
+class AckWindow {
+    public:
+        // Frames in flight at most, further frames are refused until acknowledgements arrive
+        static constexpr size_t default_capacity = 4096;
+        // A quarter of the window, so the sender is never stopped by Acks held back
+        static constexpr std::uint64_t ack_threshold = default_capacity / 4;
+        static constexpr std::chrono::milliseconds ack_delay{5};
+
+        explicit AckWindow(size_t capacity = default_capacity);
+
+        bool full() const;
+        size_t size() const;
+        // Sequence of the last acknowledged frame, 0 before the first
+        std::uint64_t acknowledged() const;
+        // Frames in sequence order, the first one has sequence acknowledged() + 1
+        const std::deque<SharedBufferPtr>& frames() const;
+
+        // Returns false and keeps nothing if the window is full
+        bool push(const SharedBufferPtr& frame);
+        // Keeps the frame even past the capacity, for the few replies that must not be lost
+        void forcePush(const SharedBufferPtr& frame);
+        // Releases the frames up to sequence, returns false if sequence was never sent
+        bool acknowledge(std::uint64_t sequence);
+        // The receiver has everything up to sequence, the frames left are renumbered from
+        // sequence + 1 to be sent again. A receiver that lost its state reports less than
+        // was acknowledged, its numbering is taken over.
+        void resume(std::uint64_t sequence);
+
+    private:
+        std::deque<SharedBufferPtr> m_frames;
+        size_t m_capacity;
+        std::uint64_t m_acknowledged;
+};
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef ADMIN_ENDPOINT_HPP
+#define ADMIN_ENDPOINT_HPP
+
+#include <functional>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+
+using boost::asio::ip::tcp;
+
+// Minimal HTTP/1.0 endpoint for operators, bound to the loopback interface only.
+// GET /metrics is answered with the text of the provider (Prometheus exposition
+// format), everything else with 404. One request per connection.
+class AdminEndpoint {
+    public:
+        using Provider = std::function<std::string()>;
+
+        // The provider is called on the io_context thread of the endpoint
+        AdminEndpoint(int port, boost::asio::io_context& io_context, Provider provider);
+        void start();
+
+    private:
+        void accept();
+        // Logs a failed accept and accepts again, after a short delay if the process is out
+        // of descriptors or memory
+        void handleAcceptError(const boost::system::error_code& error);
+
+        tcp::acceptor m_acceptor;
+        boost::asio::steady_timer m_retryTimer;
+        Provider m_provider;
+};
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef ASYNC_CLIENT_HPP
+#define ASYNC_CLIENT_HPP
+
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include "tcp_connection.hpp"
+
+// Client for applications that embed the publish/subscribe client instead of driving it
+// through console commands. Nothing is printed, results are reported to completion
+// handlers or futures and messages to a handler that gets views of the received frame.
+//
+// Publishes are pipelined: each call only appends a frame to the connection's outbound
+// queue and everything queued while a write is in flight goes out in the next gathered
+// write, so many publishes are in flight at once. A completion handler runs once its
+// frame was written to the socket.
+//
+// Handlers run on the io_context thread. The calls may be made from any thread, but the
+// future returning overloads must not be waited on from the io_context thread.
+// Destroy the client on the io_context thread or after the io_context stopped.
+class AsyncClient : TcpObject {
+    public:
+        using CompletionHandler = std::function<void(const boost::system::error_code& error)>;
+        // topic and payload view the read buffer and are only valid during the call
+        using MessageHandler = std::function<void(std::string_view topic, std::string_view payload)>;
+        // Called when the outbound queue crosses the high water mark (true) and once it drained (false)
+        using BackpressureHandler = std::function<void(bool congested)>;
+        using RegisterHandler = std::function<void(const boost::system::error_code& error, std::uint32_t topicId)>;
+
+        explicit AsyncClient(boost::asio::io_context& ioContext);
+        ~AsyncClient();
+
+        void setMessageHandler(MessageHandler handler);
+        void setBackpressureHandler(BackpressureHandler handler);
+
+        // Connects and sends CONNECT, the binary protocol is used unless Text is asked for.
+        // The handler runs once the CONNECT frame is queued, later calls may follow right away.
+        void asyncConnect(const tcp::endpoint& endpoint, std::string_view name, CompletionHandler handler,
+                          Protocol::Version version = Protocol::Version::Binary);
+        std::future<void> connect(const tcp::endpoint& endpoint, std::string_view name,
+                                  Protocol::Version version = Protocol::Version::Binary);
+        void disconnect();
+        bool isConnected() const;
+
+        // Fire and forget. Returns false without queueing the publish if the client is not
+        // connected or its queue is congested, see setBackpressureHandler.
+        bool publish(std::string_view topic, std::string_view payload);
+        // Handler or future complete once the frame was written, with no_buffer_space if
+        // the queue is congested and not_connected or operation_aborted if the connection is gone
+        void asyncPublish(std::string_view topic, std::string_view payload, CompletionHandler handler);
+        std::future<void> asyncPublish(std::string_view topic, std::string_view payload);
+
+        // Asks the server for the id of a topic (binary protocol only). Publishes may use the id
+        // instead of the topic string and the server delivers messages of the topic with the id.
+        // Completes once the answer arrived, with invalid_argument for a wildcard topic and
+        // operation_not_supported on a text connection.
+        void asyncRegister(std::string_view topic, RegisterHandler handler);
+        std::future<std::uint32_t> registerTopic(std::string_view topic);
+        // Same as the topic string overloads for a topic id returned by registerTopic
+        bool publish(std::uint32_t topicId, std::string_view payload);
+        void asyncPublish(std::uint32_t topicId, std::string_view payload, CompletionHandler handler);
+        std::future<void> asyncPublish(std::uint32_t topicId, std::string_view payload);
+
+        void asyncSubscribe(std::string_view topic, CompletionHandler handler);
+        std::future<void> subscribe(std::string_view topic);
+        void asyncUnsubscribe(std::string_view topic, CompletionHandler handler);
+        std::future<void> unsubscribe(std::string_view topic);
+
+    private:
+        struct PendingWrite {
+            std::uint64_t frame;
+            CompletionHandler handler;
+        };
+
+        struct PendingRegister {
+            std::string topic;
+            RegisterHandler handler;
+        };
+
+        void onRead(int connId, std::string_view data) override;
+        void onFrame(int connId, std::string_view frame) override;
+        void onClose(int connId) override;
+        void onStart(int connId) override;
+        void onBackpressure(int connId, bool congested) override;
+        void onWritten(int connId, size_t frames) override;
+
+        // Commands are only sent, never received, by a client
+        void handleCommand(std::string_view input, int connId) override;
+        void handleConnect(Tokenizer& args, int connId) override;
+        void handleDisconnect(int connId) override;
+        void handlePublish(Tokenizer& args, int connId) override;
+        void handleSubscribe(Tokenizer& args, int connId) override;
+        void handleUnsubscribe(Tokenizer& args, int connId) override;
+        void handleStats(int connId) override;
+
+        static SharedBufferPtr encodePublish(Protocol::Version version, std::string_view topic, std::string_view payload);
+        static SharedBufferPtr encodeTopicCommand(Protocol::Version version, Protocol::Opcode opcode,
+                                                  std::string_view command, std::string_view topic);
+        // Queues a frame and remembers the handler until the frame is written, called with m_pendingMutex held
+        void send(const SharedBufferPtr& frame, CompletionHandler handler);
+        void failPending(const boost::system::error_code& error);
+        void onRegistered(std::string_view topic, std::uint32_t topicId);
+        static std::future<void> futureOf(const std::function<void(CompletionHandler)>& call);
+
+        boost::asio::io_context& m_ioContext;
+        // Replaced on the io_context thread with m_pendingMutex held, other threads read it under the lock
+        std::shared_ptr<TcpConnection> m_connection;
+        std::atomic<bool> m_isConnected;
+        // Protocol of the frames this client sends, received frames follow m_connection->protocol().
+        // Guarded like m_connection.
+        Protocol::Version m_protocol;
+        MessageHandler m_messageHandler;
+        BackpressureHandler m_backpressureHandler;
+
+        // Frames are numbered in queue order, so the handlers complete in that order as
+        // onWritten reports written frames. The mutex keeps numbering and queueing together.
+        std::mutex m_pendingMutex;
+        std::uint64_t m_queuedFrames;
+        std::uint64_t m_writtenFrames;
+        std::deque<PendingWrite> m_pending;
+        // Answers carry the topic and are matched by it, so a missing answer only holds up
+        // the registration of its own topic
+        std::deque<PendingRegister> m_registrations;
+        // Registered topics indexed by id, only touched on the io_context thread
+        std::vector<std::string> m_topicNames;
+};
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <cstddef>
+
+// Per thread free lists of fixed size blocks (powers of two from min_block_size to
+// max_block_size) for message buffers. A freed block goes to the free list of the thread
+// that frees it, so a buffer encoded on one thread and released on another is recycled
+// there without locking. Each list keeps at most max_cached_bytes, larger requests and
+// blocks beyond that go to the global heap. In steady state encoding a message does not
+// allocate.
+namespace BufferPool {
+    constexpr size_t min_block_size = 64;
+    constexpr size_t max_block_size = 64 * 1024;
+    constexpr size_t max_cached_bytes = 1024 * 1024;
+
+    void* allocate(size_t size);
+    // size must be the size passed to allocate
+    void deallocate(void* block, size_t size);
+}
+
+#endif
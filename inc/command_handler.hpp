@@ -2,19 +2,43 @@
 #define COMMAND_HANDLER_HPP
 
 #include <iostream>
-#include <sstream>
 #include <string>
+#include <string_view>
 #include <map>
+#include "command_parser.hpp"
 
 class CommandHandler {
     public:
-        virtual void handleCommand(const std::string& input, int connId) = 0;
+        virtual void handleCommand(std::string_view input, int connId) = 0;
+    protected:
+        // Calls the handler of a command looked up with lookupCommand, returns false for unknown commands
+        bool dispatch(CommandType command, Tokenizer& args, int connId){
+            switch(command){
+                case CommandType::Connect: handleConnect(args, connId); return true;
+                case CommandType::Disconnect: handleDisconnect(connId); return true;
+                case CommandType::Publish: handlePublish(args, connId); return true;
+                case CommandType::Subscribe: handleSubscribe(args, connId); return true;
+                case CommandType::Unsubscribe: handleUnsubscribe(args, connId); return true;
+                case CommandType::Stats: handleStats(connId); return true;
+                case CommandType::Peer: handlePeer(args, connId); return true;
+                case CommandType::Ping: handlePing(connId); return true;
+                case CommandType::Pong: handlePong(connId); return true;
+                case CommandType::Unknown: break;
+            }
+            return false;
+        }
     private:
-        virtual void handleConnect(std::istringstream& stream, int connId) = 0;
+        virtual void handleConnect(Tokenizer& args, int connId) = 0;
         virtual void handleDisconnect(int connId) = 0;
-        virtual void handlePublish(std::istringstream& stream, int connId) = 0;
-        virtual void handleSubscribe(std::istringstream& stream, int connId) = 0;
-        virtual void handleUnsubscribe(std::istringstream& stream, int connId) = 0;
+        virtual void handlePublish(Tokenizer& args, int connId) = 0;
+        virtual void handleSubscribe(Tokenizer& args, int connId) = 0;
+        virtual void handleUnsubscribe(Tokenizer& args, int connId) = 0;
+        virtual void handleStats(int connId) = 0;
+        // Only servers accept links from other servers
+        virtual void handlePeer(Tokenizer& args, int connId) { (void)args; (void)connId; }
+        // Heartbeats, the side that receives a PING answers it with a PONG
+        virtual void handlePing(int connId) { (void)connId; }
+        virtual void handlePong(int connId) { (void)connId; }
 };
 
-#endif
\ No newline at end of file
+#endif
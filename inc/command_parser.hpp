@@ -0,0 +1,121 @@
+#ifndef COMMAND_PARSER_HPP
+#define COMMAND_PARSER_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+enum class CommandType : std::uint8_t {
+    Connect,
+    Disconnect,
+    Publish,
+    Subscribe,
+    Unsubscribe,
+    Stats,
+    Peer,
+    Ping,
+    Pong,
+    Unknown
+};
+
+// Splits a command into fields without copying, every field views the input
+class Tokenizer {
+    public:
+        constexpr explicit Tokenizer(std::string_view input) : m_rest(input) {}
+
+        // Field up to the next delimiter (or the end), the delimiter is consumed
+        constexpr std::string_view next(char delimiter){
+            size_t end = m_rest.find(delimiter);
+            std::string_view field = m_rest.substr(0, end);
+            m_rest.remove_prefix(end == std::string_view::npos ? m_rest.size() : end + 1);
+            return field;
+        }
+
+        // Skips leading whitespace and returns the following word, one trailing
+        // whitespace character is consumed (same as operator>> followed by getline)
+        constexpr std::string_view nextWord(){
+            size_t begin = 0;
+            while(begin < m_rest.size() && isSpace(m_rest[begin])){
+                ++begin;
+            }
+            size_t end = begin;
+            while(end < m_rest.size() && !isSpace(m_rest[end])){
+                ++end;
+            }
+            std::string_view word = m_rest.substr(begin, end - begin);
+            m_rest.remove_prefix(end < m_rest.size() ? end + 1 : end);
+            return word;
+        }
+
+        constexpr std::string_view rest() const { return m_rest; }
+        constexpr bool empty() const { return m_rest.empty(); }
+
+    private:
+        static constexpr bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+        std::string_view m_rest;
+};
+
+namespace CommandTable {
+    struct Entry {
+        std::string_view name;
+        CommandType type;
+    };
+
+    inline constexpr Entry commands[] = {
+        {"CONNECT", CommandType::Connect},
+        {"DISCONNECT", CommandType::Disconnect},
+        {"PUBLISH", CommandType::Publish},
+        {"SUBSCRIBE", CommandType::Subscribe},
+        {"UNSUBSCRIBE", CommandType::Unsubscribe},
+        {"STATS", CommandType::Stats},
+        {"PEER", CommandType::Peer},
+        {"PING", CommandType::Ping},
+        {"PONG", CommandType::Pong},
+    };
+
+    inline constexpr size_t table_size = 32;
+
+    // Perfect for the command names above, checked at compile time below. The second
+    // character tells PING from PONG, single character names use the first one twice.
+    constexpr size_t hash(std::string_view name){
+        return (name.size() + static_cast<unsigned char>(name.front()) + static_cast<unsigned char>(name.back()) +
+                2 * static_cast<unsigned char>(name[name.size() > 1 ? 1 : 0])) % table_size;
+    }
+
+    constexpr std::array<Entry, table_size> build(){
+        std::array<Entry, table_size> table{};
+        for(auto &entry : table){
+            entry = Entry{{}, CommandType::Unknown};
+        }
+        for(const auto &command : commands){
+            table[hash(command.name)] = command;
+        }
+        return table;
+    }
+
+    constexpr bool isPerfect(){
+        auto table = build();
+        for(const auto &command : commands){
+            if(table[hash(command.name)].name != command.name){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline constexpr std::array<Entry, table_size> table = build();
+    static_assert(isPerfect(), "CommandTable::hash collides, adjust it when adding commands");
+}
+
+// One hash, one table load and one comparison, no allocation
+constexpr CommandType lookupCommand(std::string_view name){
+    if(name.empty()){
+        return CommandType::Unknown;
+    }
+    const auto &entry = CommandTable::table[CommandTable::hash(name)];
+    return entry.name == name ? entry.type : CommandType::Unknown;
+}
+
+#endif
@@ -0,0 +1,122 @@
+#ifndef COROUTINE_HPP
+#define COROUTINE_HPP
+
+#include <coroutine>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <boost/asio/async_result.hpp>
+#include <boost/system/error_code.hpp>
+#include "handler_allocator.hpp"
+
+// Coroutine that runs from the call until its co_return and then frees itself, for the
+// loops of a connection. Frames are allocated from the per thread BufferPool like the
+// operations they await, so a connection costs no heap allocation once the pool is warm.
+//
+// Asio operations are awaited with the use_coroutine token, the result of co_await is the
+// tuple of the completion arguments:
+//
+//     auto [error, bytes] = co_await socket.async_read_some(buffers, use_coroutine);
+//
+// The completion resumes the coroutine directly, there is no scheduler of its own and no
+// frame per operation. An operation that is destroyed without completing (its io_context
+// is destroyed) destroys the waiting coroutine, as it would destroy a completion handler.
+class Coroutine {
+    public:
+        struct promise_type {
+            static void* operator new(size_t size){
+                return BufferPool::allocate(size);
+            }
+
+            static void operator delete(void* memory, size_t size){
+                BufferPool::deallocate(memory, size);
+            }
+
+            Coroutine get_return_object() noexcept { return {}; }
+            std::suspend_never initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() noexcept {}
+            // Leaves io_context::run() like an exception thrown by a completion handler
+            void unhandled_exception(){ throw; }
+        };
+};
+
+struct UseCoroutine {};
+constexpr UseCoroutine use_coroutine{};
+
+// Completion handler that stores the completion arguments and resumes the coroutine
+template <typename... Results>
+class CoroutineHandler {
+    public:
+        CoroutineHandler(std::coroutine_handle<> coroutine, std::optional<std::tuple<Results...>>& result) :
+            m_coroutine(coroutine),
+            m_result(&result) {}
+
+        CoroutineHandler(CoroutineHandler&& other) noexcept :
+            m_coroutine(std::exchange(other.m_coroutine, nullptr)),
+            m_result(other.m_result) {}
+
+        CoroutineHandler(const CoroutineHandler&) = delete;
+        CoroutineHandler& operator=(const CoroutineHandler&) = delete;
+        CoroutineHandler& operator=(CoroutineHandler&&) = delete;
+
+        ~CoroutineHandler(){
+            if(m_coroutine){
+                m_coroutine.destroy();
+            }
+        }
+
+        template <typename... Args>
+        void operator()(Args&&... args){
+            m_result->emplace(std::forward<Args>(args)...);
+            std::exchange(m_coroutine, nullptr).resume();
+        }
+
+    private:
+        std::coroutine_handle<> m_coroutine;
+        std::optional<std::tuple<Results...>>* m_result;
+};
+
+// What co_await sees of an operation started with use_coroutine. The operation is only
+// initiated once the coroutine is suspended.
+template <typename Initiation, typename InitArgs, typename... Results>
+class OperationAwaiter {
+    public:
+        OperationAwaiter(Initiation initiation, InitArgs args) :
+            m_initiation(std::move(initiation)),
+            m_args(std::move(args)) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> coroutine){
+            // The completion may resume the coroutine on the io_context thread before this
+            // returns, so nothing is touched after the initiation
+            std::apply([this, coroutine](auto&&... args) {
+                std::move(m_initiation)(pooled(CoroutineHandler<Results...>(coroutine, m_result)), std::move(args)...);
+            }, std::move(m_args));
+        }
+
+        std::tuple<Results...> await_resume(){
+            return std::move(*m_result);
+        }
+
+    private:
+        Initiation m_initiation;
+        InitArgs m_args;
+        std::optional<std::tuple<Results...>> m_result;
+};
+
+namespace boost::asio {
+    template <typename... Args>
+    class async_result<UseCoroutine, void(boost::system::error_code, Args...)> {
+        public:
+            template <typename Initiation, typename... InitArgs>
+            static auto initiate(Initiation initiation, UseCoroutine, InitArgs... args){
+                return OperationAwaiter<Initiation, std::tuple<InitArgs...>, boost::system::error_code, std::decay_t<Args>...>(
+                    std::move(initiation), std::tuple<InitArgs...>(std::move(args)...));
+            }
+    };
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef FEDERATION_HPP
+#define FEDERATION_HPP
+
+#include "tcp_server.hpp"
+#include <set>
+
+// Bridges the topics of one TcpServer (a node) with the servers listed as its peers.
+//
+// The node dials every peer and identifies itself with "PEER;<node>;2", so the link is a
+// binary session that the peer knows is a server. Over that link the node subscribes to
+// the filters its local clients subscribed to, the peer then sends it exactly the
+// publishes of its own clients that match them. The node delivers those to its local
+// subscribers only, never to its own peers, so every publish makes at most one hop and
+// loops or duplicate deliveries cannot happen. That requires a full mesh: every node
+// lists every other node as peer.
+//
+// Lost links are redialed and resubscribed. Runs on the server's io_context thread, destroy
+// it only after the io_context stopped.
+class Federation : public PublishRouter {
+    public:
+        static constexpr auto reconnect_delay = std::chrono::seconds(1);
+
+        // Installs itself as the server's router
+        Federation(TcpServer& server, boost::asio::io_context& io_context, std::string nodeName);
+        ~Federation();
+
+        // Call before start()
+        void addPeer(const tcp::endpoint& endpoint);
+        void start();
+
+        void onTopicInterest(std::string_view topic, bool interested) override;
+        // Peers subscribe on the server like clients, which delivers them the publishes they
+        // are interested in
+        bool routesPublishes() const override { return false; }
+
+        // Publishes received from peers, thread safe
+        std::uint64_t receivedMessages() const;
+        // Peers with an established link, thread safe
+        size_t connectedPeers() const;
+
+    private:
+        class Link;
+
+        void deliver(std::string_view topic, std::string_view payload);
+
+        TcpServer& m_server;
+        boost::asio::io_context& m_ioContext;
+        std::string m_nodeName;
+        std::vector<std::unique_ptr<Link>> m_links;
+        // Filters with local subscribers, subscribed on every link
+        std::set<std::string, std::less<>> m_interest;
+        MetricCounter m_receivedMessages;
+        std::atomic<size_t> m_connectedPeers;
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef FRAME_SCANNER_HPP
+#define FRAME_SCANNER_HPP
+
+#include <cstddef>
+
+// Returns a pointer to the first occurrence of delimiter in [begin, end) or end if
+// there is none. Uses AVX2 when the CPU supports it, SSE2 on other x86-64 CPUs and
+// a scalar loop everywhere else.
+const char* findDelimiter(const char* begin, const char* end, char delimiter);
+
+// Same as findDelimiter but always takes the scalar path, used as reference in tests
+const char* findDelimiterScalar(const char* begin, const char* end, char delimiter);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef HANDLER_ALLOCATOR_HPP
+#define HANDLER_ALLOCATOR_HPP
+
+#include <type_traits>
+#include <utility>
+#include "buffer_pool.hpp"
+
+// Allocator for the operation state of asynchronous calls, taken from the per thread
+// BufferPool. Asio only caches one such block per thread, so a connection with a read and
+// a write in flight would otherwise allocate an operation on most calls.
+template <typename T>
+class PooledAllocator {
+    public:
+        using value_type = T;
+
+        PooledAllocator() noexcept = default;
+        template <typename U>
+        PooledAllocator(const PooledAllocator<U>&) noexcept {}
+
+        T* allocate(size_t count){
+            return static_cast<T*>(BufferPool::allocate(count * sizeof(T)));
+        }
+
+        void deallocate(T* memory, size_t count){
+            BufferPool::deallocate(memory, count * sizeof(T));
+        }
+
+        template <typename U>
+        bool operator==(const PooledAllocator<U>&) const noexcept { return true; }
+        template <typename U>
+        bool operator!=(const PooledAllocator<U>&) const noexcept { return false; }
+};
+
+// Completion handler wrapper that makes asio allocate the operation with PooledAllocator
+template <typename Handler>
+class PooledHandler {
+    public:
+        using allocator_type = PooledAllocator<void>;
+
+        explicit PooledHandler(Handler handler) : m_handler(std::move(handler)) {}
+
+        allocator_type get_allocator() const noexcept { return {}; }
+
+        template <typename... Args>
+        void operator()(Args&&... args){
+            m_handler(std::forward<Args>(args)...);
+        }
+
+    private:
+        Handler m_handler;
+};
+
+template <typename Handler>
+PooledHandler<std::decay_t<Handler>> pooled(Handler&& handler){
+    return PooledHandler<std::decay_t<Handler>>(std::forward<Handler>(handler));
+}
+
+#endif
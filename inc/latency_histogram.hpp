@@ -0,0 +1,44 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Log-linear histogram in the style of HdrHistogram. Values below 256 get their own
+// bucket, above that every power of two range is split into 128 buckets, so a recorded
+// value is off by less than 1% over the whole 64 bit range. One thread at a time records,
+// with relaxed loads and stores and no read-modify-write instructions, any other thread may
+// read concurrently (reads are not a snapshot).
+class LatencyHistogram {
+    public:
+        static constexpr unsigned sub_bucket_bits = 7;
+        static constexpr std::uint64_t sub_bucket_count = std::uint64_t{1} << sub_bucket_bits;
+        // The linear range [0, 256) plus one range per most significant bit from 8 to 63
+        static constexpr size_t bucket_count = 2 * sub_bucket_count + (63 - sub_bucket_bits) * sub_bucket_count;
+
+        LatencyHistogram();
+
+        void record(std::uint64_t value);
+        void merge(const LatencyHistogram& other);
+        void reset();
+
+        std::uint64_t count() const;
+        std::uint64_t max() const;
+        double mean() const;
+        // Highest value equivalent to the recorded one at the given percentile (0-100)
+        std::uint64_t percentile(double percentile) const;
+
+        static size_t bucketIndex(std::uint64_t value);
+        // Highest value that falls into a bucket
+        static std::uint64_t bucketValue(size_t index);
+
+    private:
+        std::array<std::atomic<std::uint64_t>, bucket_count> m_buckets;
+        std::atomic<std::uint64_t> m_count;
+        std::atomic<std::uint64_t> m_sum;
+        std::atomic<std::uint64_t> m_max;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "latency_histogram.hpp"
+
+// Counter with a single writer at a time (the owning io_context thread, or whoever holds
+// the lock guarding the counted event) that any thread may read. The increment is a relaxed
+// load and store, so the hot path never takes a locked read-modify-write instruction.
+class MetricCounter {
+    public:
+        void add(std::uint64_t value = 1){
+            m_value.store(m_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+        }
+
+        std::uint64_t value() const{
+            return m_value.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<std::uint64_t> m_value{0};
+};
+
+struct ConnectionMetrics {
+    MetricCounter messagesIn;
+    MetricCounter bytesIn;
+    MetricCounter messagesOut;
+    MetricCounter bytesOut;
+    // Frames rejected, discarded or conflated by the slow consumer policy while congested
+    MetricCounter dropped;
+};
+
+struct TopicMetrics {
+    MetricCounter published;
+    MetricCounter publishedBytes;
+    MetricCounter delivered;
+    MetricCounter dropped;
+};
+
+// Point in time copy of the metrics of one TcpServer, taken on its io_context thread
+struct MetricsSnapshot {
+    struct Connection {
+        int id;
+        std::string name;
+        std::uint64_t messagesIn;
+        std::uint64_t bytesIn;
+        std::uint64_t messagesOut;
+        std::uint64_t bytesOut;
+        std::uint64_t dropped;
+        std::uint64_t queuedBytes;
+    };
+
+    struct Topic {
+        std::string name;
+        std::uint64_t subscribers;
+        std::uint64_t published;
+        std::uint64_t publishedBytes;
+        std::uint64_t delivered;
+        std::uint64_t dropped;
+    };
+
+    std::vector<Connection> connections;
+    std::vector<Topic> topics;
+    // Time from receiving a publish to the write of its frame completing, in nanoseconds
+    std::unique_ptr<LatencyHistogram> writeLatency = std::make_unique<LatencyHistogram>();
+    // Connections closed by the disconnect slow consumer policy
+    std::uint64_t slowConsumerDisconnects = 0;
+    // Connections closed right after accepting them, by admission control or for lack of descriptors
+    std::uint64_t rejectedConnections = 0;
+    // Connections closed by the read or idle timeout
+    std::uint64_t timedOutConnections = 0;
+    // QoS 1 states of lost connections discarded to make room for newer ones
+    std::uint64_t discardedQosSessions = 0;
+    // Publishes this shard dropped instead of routing them to a shard that fell behind
+    std::uint64_t droppedRoutedPublishes = 0;
+};
+
+namespace Metrics {
+    // Topic name the topics without counters of their own are reported under. '#' stands
+    // alone in a valid filter, so no topic or filter has this name.
+    constexpr const char* other_topics = "#other";
+
+    // Prometheus text exposition format (version 0.0.4), one snapshot per shard
+    std::string formatPrometheus(const std::vector<MetricsSnapshot>& shards);
+    // Single line summary answered to the STATS command, fields separated by ';'
+    std::string formatSummary(const MetricsSnapshot& snapshot);
+}
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef PROTOCOL_HPP
+#define PROTOCOL_HPP
+
+#include <cstdint>
+#include <string_view>
+#include "shared_buffer.hpp"
+
+// Wire protocol version 2. A client opts in with a third CONNECT field ("CONNECT;name;2"),
+// sent as a version 1 text frame. The server answers with the text frame "CONNACK;2"
+// and both directions switch to length prefixed binary frames after that:
+//
+//   u32 little endian length of the rest of the frame
+//   u8  opcode
+//   varint topic id                          (Registered, PublishById, MessageById)
+//   varint topic length, topic bytes         (Publish, Message, Subscribe, Unsubscribe, Register, Registered)
+//   varint payload length, payload bytes     (Publish, Message, PublishById, MessageById, PublishBatch)
+//
+// Payloads may contain any byte. The client may pipeline binary frames right after its
+// CONNECT, the server switches its reader at that frame boundary.
+//
+// Topic ids: a client registers a topic once and gets the server's id for it back, later
+// publishes may carry the id instead of the topic string and messages of registered topics
+// are delivered with the id as well. An id is only valid on the connection that registered
+// it, until that connection closes. The server reuses released ids for other topics.
+//
+// The payload of PublishBatch is a sequence of entries, each one publish:
+//
+//   varint topic length, topic bytes
+//   varint payload length, payload bytes
+//
+// A client on the server's Unix domain socket may ask for a shared memory ring (see ShmRing)
+// with a fifth CONNECT field, "CONNECT;name;2;<policy or empty>;shm", and pass the ring's
+// descriptor along with the CONNECT (SCM_RIGHTS). If the server could map it, it answers
+// "CONNACK;2;shm" and writes every later frame into the ring instead of the socket,
+// otherwise it answers "CONNACK;2" and the socket is used.
+//
+// At-least-once delivery (QoS 1) is asked for with two more CONNECT fields,
+// "CONNECT;name;2;<policy>;<ring or empty>;1;<received>", and acknowledged with
+// "CONNACK;2;qos;<received>". Both directions then number their counted frames from 1 in the
+// order they are sent, the client's Publish, PublishById and PublishBatch frames and the
+// server's Message and MessageById frames, without carrying the number. The receiver
+// acknowledges with a cumulative Ack:
+//
+//   varint sequence of the last frame received
+//
+// Unacknowledged frames are sent again when the client reconnects with the same name. Its
+// <received> and the server's tell the other side where to resume, see AckWindow. A QoS 1
+// connection never uses a shared memory ring, a ring drops frames when it is full.
+namespace Protocol {
+    enum class Version : std::uint8_t { Text = 1, Binary = 2 };
+
+    enum class Opcode : std::uint8_t {
+        Disconnect = 1,
+        Publish = 2,
+        Subscribe = 3,
+        Unsubscribe = 4,
+        // Server to client delivery of a publish
+        Message = 5,
+        // Answered with a Message frame on the topic "STATS"
+        Stats = 6,
+        // Answered with Registered, which carries the topic and its id, or rejected_topic_id
+        // if the topic cannot be registered
+        Register = 7,
+        Registered = 8,
+        PublishById = 9,
+        // Delivery of a publish to a topic the client registered
+        MessageById = 10,
+        // Many publishes in one frame
+        PublishBatch = 11,
+        // Heartbeats, sent by either side and answered with Pong, no fields
+        Ping = 12,
+        Pong = 13,
+        // QoS 1 cumulative acknowledgement, carries a sequence
+        Ack = 14,
+    };
+
+    constexpr size_t length_size = 4;
+    constexpr size_t header_size = length_size + 1;
+    constexpr std::uint32_t max_frame_length = 16 * 1024 * 1024;
+    constexpr std::uint32_t rejected_topic_id = UINT32_MAX;
+    std::string_view const connack = "CONNACK;2";
+    // Fifth CONNECT field of a client that passed a shared memory ring along
+    std::string_view const ring_field = "shm";
+    // Acknowledges a CONNECT that passed a shared memory ring, the client reads from it from now on
+    std::string_view const connack_ring = "CONNACK;2;shm";
+    // Acknowledges a QoS 1 CONNECT, followed by ";<received>"
+    std::string_view const connack_qos = "CONNACK;2;qos";
+    // Heartbeats of text connections
+    std::string_view const ping = "PING";
+    std::string_view const pong = "PONG";
+
+    struct Frame {
+        Opcode opcode;
+        std::uint32_t topicId;
+        std::string_view topic;
+        std::string_view payload;
+        // Ack only
+        std::uint64_t sequence;
+    };
+
+    size_t varintSize(std::uint64_t value);
+    // Exact size of an encoded frame including its length prefix. Fields the opcode does not
+    // carry are ignored.
+    size_t frameSize(Opcode opcode, std::string_view topic, std::string_view payload = {}, std::uint32_t topicId = 0);
+    boost::intrusive_ptr<SharedBuffer> encode(Opcode opcode, std::string_view topic = {}, std::string_view payload = {},
+                                              std::uint32_t topicId = 0);
+    // Appends one frame to an existing buffer that has the capacity for frameSize() more bytes
+    void encodeInto(SharedBuffer& buffer, Opcode opcode, std::string_view topic, std::string_view payload = {},
+                    std::uint32_t topicId = 0);
+    // frame is everything after the length prefix, returns false if it is malformed.
+    // For PublishBatch the payload holds the entries, which are checked as well.
+    bool decode(std::string_view frame, Frame& out);
+    std::uint32_t readLength(const char* data);
+
+    size_t batchEntrySize(std::string_view topic, std::string_view payload);
+    void appendBatchEntry(std::string& entries, std::string_view topic, std::string_view payload);
+    // Takes the next entry off the front of a PublishBatch payload, false once it is empty
+    bool nextBatchEntry(std::string_view& entries, std::string_view& topic, std::string_view& payload);
+
+    // Ping or Pong frame of the given protocol version
+    boost::intrusive_ptr<SharedBuffer> encodeHeartbeat(Opcode opcode, Version version);
+    // Whether a received frame (the text line or everything after the length prefix) is the
+    // Ping or Pong heartbeat given by opcode
+    bool isHeartbeat(std::string_view frame, Version version, Opcode opcode);
+
+    // Ack frame acknowledging everything up to sequence
+    boost::intrusive_ptr<SharedBuffer> encodeAck(std::uint64_t sequence);
+
+    // Text delivery frame "topic;payload\n"
+    boost::intrusive_ptr<SharedBuffer> encodeText(std::string_view topic, std::string_view payload);
+}
+
+// The encodings of one publish. Each encoding is built at most once, when the first
+// subscriber that speaks it is served, and then shared by all of them.
+class PublishFrames {
+    public:
+        PublishFrames(std::string_view topic, std::string_view payload);
+        // Reuses an already encoded text frame, topic and payload then view into it
+        PublishFrames(const SharedBufferPtr& textFrame, size_t topicLength);
+
+        // Receive time stamped on every encoding, see SharedBuffer::timestamp()
+        void setTimestamp(std::int64_t timestamp);
+
+        std::string_view topic() const;
+        std::string_view payload() const;
+        const SharedBufferPtr& text();
+        const SharedBufferPtr& binary();
+        // MessageById frame, for subscribers that registered the topic
+        const SharedBufferPtr& binaryById(std::uint32_t topicId);
+        const SharedBufferPtr& frame(Protocol::Version version);
+        // Payloads containing the frame delimiter cannot be delivered to text clients
+        bool isTextSafe();
+
+    private:
+        std::string_view m_topic;
+        std::string_view m_payload;
+        SharedBufferPtr m_text;
+        SharedBufferPtr m_binary;
+        SharedBufferPtr m_binaryById;
+        std::int64_t m_timestamp;
+        int m_textSafe;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef SHARD_GROUP_HPP
+#define SHARD_GROUP_HPP
+
+#include "tcp_server.hpp"
+#include <deque>
+#include <thread>
+#include <boost/lockfree/spsc_queue.hpp>
+
+// Message passed between shards through the lock free queues. For Publish the buffer
+// is the encoded delivery frame and the topic is its first topicLength bytes, for
+// Interest/Uninterest the buffer only holds the topic.
+struct ShardMessage {
+    enum class Kind : std::uint8_t { Publish, Interest, Uninterest };
+
+    Kind kind = Kind::Publish;
+    std::uint32_t topicLength = 0;
+    SharedBufferPtr buffer;
+
+    std::string_view topic() const { return std::string_view(buffer->data(), topicLength); }
+};
+
+// Runs one TcpServer per shard, each on its own io_context and thread and with its own
+// acceptor on the same port (SO_REUSEPORT lets the kernel spread connections over them)
+// and its own subscription index. Each shard tells the others which topics it has local
+// subscribers for, so a publish is only routed to shards that hold subscribers of the
+// topic. Shards talk through one single producer single consumer queue per shard pair.
+class ShardGroup {
+    public:
+        static constexpr size_t max_shards = 64;
+        static constexpr size_t queue_capacity = 4096;
+        // Publishes a shard holds back for another shard whose queue is full, at most. Further
+        // ones are dropped and counted, the shard keeps serving its own clients meanwhile.
+        // Interest changes are always kept, routing depends on them.
+        static constexpr size_t max_overflow = 16 * queue_capacity;
+
+        ShardGroup(int port, size_t shardCount);
+        ~ShardGroup();
+
+        // Call before start()
+        void setSlowConsumerPolicy(SlowConsumerPolicy policy);
+        // maxConnections is for the whole group and split evenly over the shards
+        void setConnectionLimits(const ConnectionLimits& limits);
+        void setTimeouts(const ConnectionTimeouts& timeouts);
+        // A Unix domain socket cannot be shared like the port, the first shard accepts all
+        // local clients and the routing reaches subscribers on the other shards
+        void listenLocal(const std::string& path);
+        void start();
+        // Blocks until stop() is called from another thread
+        void wait();
+        void stop();
+
+        size_t shardCount() const;
+        // Sums the connected clients of all shards, must not be called from a shard thread
+        int getClientCount();
+        // One snapshot per shard, same threading rule as getClientCount()
+        std::vector<MetricsSnapshot> collectMetrics();
+
+    private:
+        class Shard;
+
+        std::vector<std::unique_ptr<Shard>> m_shards;
+};
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SHARED_BUFFER_HPP
+#define SHARED_BUFFER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <boost/intrusive_ptr.hpp>
+
+// Immutable, reference counted message buffer. A message that is delivered to many
+// connections is encoded once into a SharedBuffer and every outbound queue only holds
+// a reference to it. Header and payload share a single block from the BufferPool.
+class SharedBuffer {
+    public:
+        static boost::intrusive_ptr<SharedBuffer> create(size_t capacity);
+
+        void append(std::string_view data);
+        void append(char data);
+
+        // Steady clock time in nanoseconds the message was received, 0 if it is not tracked.
+        // Used to measure the publish to write latency of delivered messages.
+        void setTimestamp(std::int64_t timestamp);
+        std::int64_t timestamp() const;
+
+        const char* data() const;
+        size_t size() const;
+        size_t capacity() const;
+
+        friend void intrusive_ptr_add_ref(const SharedBuffer* buffer);
+        friend void intrusive_ptr_release(const SharedBuffer* buffer);
+
+    private:
+        explicit SharedBuffer(size_t capacity);
+        char* storage();
+
+        mutable std::atomic<unsigned> m_refCount;
+        size_t m_size;
+        size_t m_capacity;
+        std::int64_t m_timestamp;
+};
+
+using SharedBufferPtr = boost::intrusive_ptr<const SharedBuffer>;
+
+#endif
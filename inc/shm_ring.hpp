@@ -0,0 +1,80 @@
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string_view>
+
+// Single producer single consumer ring of binary protocol frames in shared memory. A client
+// on the same host as the server creates one and passes its descriptor along with CONNECT
+// over a Unix domain socket, the server then writes the client's frames into it instead of
+// the socket. The client reads them straight from the mapping: no system call and no copy
+// per message while it keeps up.
+//
+// The memory is a memfd sealed against shrinking and growing before it is passed on. The
+// client cannot truncate it under the server's mapping later, which would make the server's
+// next write fault (SIGBUS). The producer refuses memory that is not sealed.
+//
+// The ring carries the byte stream the socket would, frames with their length prefix. A
+// frame never wraps around the end of the ring, the producer skips the rest of the ring
+// instead, marked by a zero length (or implied when fewer than length_size bytes are left).
+// Head and tail are byte positions that only grow, the offset into the ring is the
+// position modulo the capacity. The consumer sleeps on a futex when the ring is empty and
+// the producer only makes the wake up system call when the consumer announced that.
+class ShmRing {
+    public:
+        static constexpr size_t default_capacity = 1024 * 1024;
+
+        // Consumer side, creates, seals and maps a new ring of capacity bytes (a power of two).
+        // Returns nullptr if shared memory is not available.
+        static std::unique_ptr<ShmRing> create(size_t capacity = default_capacity);
+        // Producer side, maps the ring in descriptor, which it takes over and closes. Returns
+        // nullptr if it is not a valid ring or its size is not sealed.
+        static std::unique_ptr<ShmRing> attach(int descriptor);
+        ~ShmRing();
+
+        // Descriptor the consumer passes to the producer, -1 on the producer side
+        int descriptor() const;
+        // Consumer. Writes data to a blocking Unix domain socket with the descriptor attached
+        // (SCM_RIGHTS), the other side receives it with the first bytes of data. Returns false
+        // if not all of data was written.
+        bool sendDescriptor(int socket, std::string_view data) const;
+        size_t capacity() const;
+
+        // Producer. Appends one frame (length prefix included), returns false and leaves the
+        // ring unchanged if it does not fit.
+        bool write(const char* data, size_t size);
+        // Producer. Wakes the consumer if it is waiting, call after a series of write()s.
+        void notify();
+        // Either side. Tells the other side that no more frames follow.
+        void close();
+        bool isClosed() const;
+
+        // Consumer. Calls onFrame for every frame in the ring (everything after the length
+        // prefix, valid until onFrame returns) and returns the number of frames.
+        size_t read(const std::function<void(std::string_view)>& onFrame);
+        // Consumer. Checks spinCount times, yielding the CPU in between, and then sleeps until
+        // frames arrive, the ring is closed or the timeout passed. Returns whether frames are
+        // available.
+        bool wait(std::chrono::milliseconds timeout, unsigned spinCount = 0);
+
+    private:
+        struct Header;
+
+        // capacity is the one checked against the mapping, never read back from the shared header
+        ShmRing(int descriptor, Header* header, size_t mappedSize, size_t capacity);
+
+        int m_descriptor;
+        Header* m_header;
+        char* m_data;
+        size_t m_mappedSize;
+        size_t m_mask;
+        // Head for the producer, tail for the consumer
+        std::uint64_t m_position;
+};
+
+#endif
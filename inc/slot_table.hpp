@@ -0,0 +1,108 @@
+#ifndef SLOT_TABLE_HPP
+#define SLOT_TABLE_HPP
+
+#include <cstdint>
+#include <vector>
+
+// Dense array of values addressed by int handles, freed slots are kept in a free list and
+// reused first. A handle packs the slot index (low index_bits) and the slot's generation,
+// which is bumped whenever the slot is freed, so the stale handle of an erased value never
+// finds the value that reuses its slot. The first value of a slot has generation 0 and so
+// a handle equal to the slot index. A lookup is one bounds check and one indexed access.
+template <typename T>
+class SlotTable {
+    public:
+        static constexpr unsigned index_bits = 20;
+        static constexpr std::uint32_t max_slots = 1u << index_bits;
+        // Generations wrap after this many reuses of the same slot, handles stay positive ints
+        static constexpr std::uint32_t generation_mask = (1u << (31 - index_bits)) - 1;
+        static constexpr int invalid_handle = -1;
+
+        // Returns invalid_handle once max_slots values are stored
+        int insert(T value){
+            std::uint32_t index;
+            if(!m_free.empty()){
+                index = m_free.back();
+                m_free.pop_back();
+            } else if(m_slots.size() < max_slots){
+                index = static_cast<std::uint32_t>(m_slots.size());
+                m_slots.emplace_back();
+            } else {
+                return invalid_handle;
+            }
+            Slot &slot = m_slots[index];
+            slot.used = true;
+            slot.value = std::move(value);
+            ++m_size;
+            return handle(index, slot.generation);
+        }
+
+        T* find(int handle){
+            Slot *slot = slotOf(handle);
+            return slot ? &slot->value : nullptr;
+        }
+
+        const T* find(int handle) const{
+            return const_cast<SlotTable*>(this)->find(handle);
+        }
+
+        bool erase(int handle){
+            Slot *slot = slotOf(handle);
+            if(slot == nullptr){
+                return false;
+            }
+            // Releases whatever the value holds right away
+            slot->value = T{};
+            slot->used = false;
+            slot->generation = (slot->generation + 1) & generation_mask;
+            m_free.push_back(static_cast<std::uint32_t>(handle) & (max_slots - 1));
+            --m_size;
+            return true;
+        }
+
+        size_t size() const{
+            return m_size;
+        }
+
+        // Calls function(handle, value) for every stored value in slot order
+        template <typename Function>
+        void forEach(Function function){
+            for(std::uint32_t index = 0; index < m_slots.size(); ++index){
+                if(m_slots[index].used){
+                    function(handle(index, m_slots[index].generation), m_slots[index].value);
+                }
+            }
+        }
+
+    private:
+        struct Slot {
+            std::uint32_t generation = 0;
+            bool used = false;
+            T value{};
+        };
+
+        static int handle(std::uint32_t index, std::uint32_t generation){
+            return static_cast<int>((generation << index_bits) | index);
+        }
+
+        Slot* slotOf(int handle){
+            if(handle < 0){
+                return nullptr;
+            }
+            std::uint32_t index = static_cast<std::uint32_t>(handle) & (max_slots - 1);
+            if(index >= m_slots.size()){
+                return nullptr;
+            }
+            Slot &slot = m_slots[index];
+            if(!slot.used || slot.generation != static_cast<std::uint32_t>(handle) >> index_bits){
+                return nullptr;
+            }
+            return &slot;
+        }
+
+        std::vector<Slot> m_slots;
+        std::vector<std::uint32_t> m_free;
+        size_t m_size = 0;
+};
+
+#endif
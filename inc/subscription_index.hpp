@@ -0,0 +1,113 @@
+#ifndef SUBSCRIPTION_INDEX_HPP
+#define SUBSCRIPTION_INDEX_HPP
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+using TopicId = std::uint32_t;
+
+// Interns topic strings into dense TopicIds, so they can index plain vectors. Released ids
+// are reused by later topics, state kept by id must be reset before an id is released.
+// Lookups by string_view do not allocate.
+class TopicRegistry {
+    public:
+        static constexpr TopicId invalid_topic = UINT32_MAX;
+
+        TopicId intern(std::string_view topic);
+        TopicId find(std::string_view topic) const;
+        void release(TopicId topicId);
+        const std::string& name(TopicId topicId) const;
+        // Ids handed out so far, released ones included
+        size_t size() const;
+        // Topics interned and not released
+        size_t count() const;
+
+    private:
+        // Deque keeps the interned strings at stable addresses so the map can key on views of them
+        std::deque<std::string> m_names;
+        std::unordered_map<std::string_view, TopicId> m_ids;
+        std::vector<TopicId> m_released;
+};
+
+class TopicTrie;
+
+// Inverted topic -> subscriber index. Each topic keeps a compact vector of
+// subscriber connection ids and each client keeps the ids of the topics it is
+// subscribed to. Publishing only touches the subscribers of the published topic.
+// Wildcard filters ("md/eq/+/trades", "md/#") are kept in a TopicTrie. Once any exist,
+// match() resolves the subscribers of a concrete topic through the trie and caches the
+// result until a subscription change invalidates it. Published topics are never interned:
+// the lists of topics only wildcards match are cached by topic string instead of by id.
+// Each cache is dropped as a whole when it holds max_resolved_topics lists, so publishers
+// of ever new topics grow neither the index nor the per topic state kept by TopicId.
+// The id of a topic is released once it has neither subscribers nor holds, so subscribers
+// of ever new topics do not grow them either.
+class SubscriptionIndex {
+    public:
+        static constexpr TopicId invalid_topic = TopicRegistry::invalid_topic;
+        static constexpr size_t max_resolved_topics = 65536;
+
+        SubscriptionIndex();
+        ~SubscriptionIndex();
+
+        bool subscribe(int connId, std::string_view topic);
+        bool unsubscribe(int connId, std::string_view topic);
+        // Returns the topics which lost their last subscriber, their ids may be released already
+        std::vector<std::string> removeClient(int connId);
+
+        TopicId find(std::string_view topic) const;
+        // Ids of registered topics, so per topic state can be kept in vectors indexed by it.
+        // Each call holds the id until a matching release(), subscribed to or not.
+        TopicId intern(std::string_view topic);
+        void hold(TopicId topicId);
+        // Drops a hold, returns true if the id was given up because nobody subscribes to it
+        bool release(TopicId topicId);
+        const std::string& topicName(TopicId topicId) const;
+        const std::vector<int>& subscribers(TopicId topicId) const;
+        const std::vector<int>& subscribers(std::string_view topic) const;
+        // Subscribers of a published topic, exact and wildcard, each connection once.
+        // The reference stays valid until the next call of match() or one that changes the index.
+        const std::vector<int>& match(std::string_view topic);
+        const std::vector<int>& match(TopicId topicId);
+        std::vector<std::string> clientTopics(int connId) const;
+        // Topics with subscribers or holds
+        size_t topicCount() const;
+        // Upper bound of the ids in use, for walking state indexed by TopicId
+        size_t topicIdCount() const;
+
+    private:
+        struct Resolved {
+            std::uint64_t generation = 0;
+            std::vector<int> subscribers;
+        };
+
+        void eraseSubscriber(TopicId topicId, int connId);
+        // Gives up the id once the topic has neither subscribers nor holds
+        bool releaseUnused(TopicId topicId);
+        void subscriptionsChanged(TopicId topicId);
+        // Appends the subscribers of the wildcard filters matching topic, sorted and unique
+        void matchWildcards(std::string_view topic, std::vector<int>& subscribers);
+
+        TopicRegistry m_topics;
+        std::vector<std::vector<int>> m_subscribers;
+        std::vector<std::uint32_t> m_holds;
+        std::unordered_map<int, std::vector<TopicId>> m_clientTopics;
+        std::unique_ptr<TopicTrie> m_wildcards;
+        size_t m_wildcardCount;
+        // Cache entries are valid while their generation matches, a wildcard change bumps
+        // m_generation and so drops every entry at once
+        std::vector<Resolved> m_resolved;
+        size_t m_resolvedCount;
+        // Lists of topics without an id, keyed by views of m_resolvedNames
+        std::deque<std::string> m_resolvedNames;
+        std::unordered_map<std::string_view, Resolved> m_resolvedByName;
+        std::uint64_t m_generation;
+        std::vector<TopicId> m_matchedFilters;
+};
+
+#endif
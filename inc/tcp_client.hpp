@@ -1,39 +1,108 @@
 #ifndef TCP_CLIENT_HPP
 #define TCP_CLIENT_HPP
 
+#include <chrono>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include "tcp_connection.hpp"
+#include "ack_window.hpp"
 #include <vector>
 
 class TcpClient : TcpObject {
     public:
-        void onRead(int connId, std::string payload) override;
+        // The ring reader spins this many times before it sleeps on an empty ring
+        static constexpr unsigned ring_spin_count = 100;
+        static constexpr auto ring_wait_timeout = std::chrono::milliseconds(100);
+
+        void onRead(int connId, std::string_view payload) override;
+        void onFrame(int connId, std::string_view frame) override;
         void onClose(int connId) override;
         void onStart(int connId) override;
+        void onReadComplete(int connId) override;
         bool isConnected() const;
-        void handleCommand(const std::string& input, int connId = 0);
+        void handleCommand(std::string_view input, int connId = 0);
+        // Collects publishes and sends them together, as one PublishBatch frame on binary
+        // connections and as one write of PUBLISH lines on text ones. A batch goes out once
+        // maxBytes are pending or maxDelay after its first publish, whichever comes first.
+        // Other commands send the pending batch first, so the order is kept. maxBytes 0
+        // turns batching off.
+        void setBatching(size_t maxBytes, std::chrono::microseconds maxDelay);
+        // Sends the pending batch now
+        void flush();
 
         TcpClient(boost::asio::io_context &ioContext);
+        ~TcpClient();
     private:
-        void handleConnect(std::istringstream& stream, int connId = 0);
-        void handleDisconnect(int connId = 0);
-        void handlePublish(std::istringstream& stream, int connId = 0);
-        void handleSubscribe(std::istringstream& stream, int connId = 0);
-        void handleUnsubscribe(std::istringstream& stream, int connId = 0);
+        void handleConnect(Tokenizer& args, int connId = 0) override;
+        void handleDisconnect(int connId = 0) override;
+        void handlePublish(Tokenizer& args, int connId = 0) override;
+        void handleSubscribe(Tokenizer& args, int connId = 0) override;
+        void handleUnsubscribe(Tokenizer& args, int connId = 0) override;
+        void handleStats(int connId = 0) override;
 
-        void connect(const int& port, const std::string& name);
+        // server is a port on 127.0.0.1 or the path of a Unix domain socket. With ring the
+        // server is asked to deliver through a shared memory ring (binary protocol over the
+        // Unix domain socket only). With
+        // qos publishes and messages are delivered at least once (binary protocol only), a
+        // reconnect with the same name resumes where the lost connection left off.
+        void connect(std::string_view server, std::string_view name, Protocol::Version version, bool ring = false,
+                     bool qos = false);
         void disconnect();
-        void publish(const std::string& topic, const std::string& data);
-        void subscribe(const std::string& topic);
-        void unsubscribe(const std::string& topic);
+        void publish(std::string_view topic, std::string_view data);
+        void subscribe(std::string_view topic);
+        void unsubscribe(std::string_view topic);
+        void requestStats();
+        bool sendTopicCommand(Protocol::Opcode opcode, std::string_view command, std::string_view topic);
+        bool batchPublish(std::string_view topic, std::string_view data);
+        // Sends a publish frame, under QoS 1 through m_publishes. Returns false if it was not sent.
+        bool sendPublish(const SharedBufferPtr& frame);
+        // Takes the server's "CONNACK;2;qos;<received>" and sends what it did not receive again
+        void resumeQos(std::string_view connack);
+        void resetQos();
+        // Acknowledges the messages received so far, called with m_qosMutex held
+        void sendAck();
+        // message is the buffer the "topic;data" form is built in, one per reading thread
+        void onBinaryFrame(int connId, std::string_view frame, std::string& message);
+        // Reads m_ring on a thread of its own until the ring is closed
+        void startRingReader();
+        void stopRingReader();
 
         boost::asio::io_context &m_ioContext;
         std::shared_ptr<TcpConnection> m_connection;
         bool m_isConnected;
+        // Protocol of the frames this client sends, received frames follow m_connection->protocol()
+        Protocol::Version m_protocol;
+        std::string m_message;
 
-        int m_serverPort;
+        std::string m_server;
         std::string m_clientName;
         std::vector<std::string> m_topics;        
+
+        // Commands may come from another thread than the io_context's, which runs the timer
+        std::mutex m_batchMutex;
+        std::string m_batch;
+        size_t m_batchMaxBytes;
+        std::chrono::microseconds m_batchMaxDelay;
+        boost::asio::steady_timer m_batchTimer;
+
+        // Shared memory ring the server delivers into, set from CONNECT until the connection closes
+        std::unique_ptr<ShmRing> m_ring;
+        std::thread m_ringReader;
+        std::string m_ringMessage;
+
+        // QoS 1 state, kept when the connection is lost and dropped by DISCONNECT
+        std::mutex m_qosMutex;
+        bool m_qos;
+        // Publishes are held back until the CONNACK told where to resume
+        bool m_qosReady;
+        AckWindow m_publishes;
+        // Messages received and the last one acknowledged
+        std::uint64_t m_received;
+        std::uint64_t m_receivedAcknowledged;
+        // Sends an Ack delayed by onReadComplete()
+        bool m_ackPending;
+        boost::asio::steady_timer m_ackTimer;
 };
 
 #endif
\ No newline at end of file
@@ -1,47 +1,233 @@
 #ifndef TCP_CONNECTION_HPP
 #define TCP_CONNECTION_HPP
 
+#include <atomic>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 #include <boost/asio.hpp>
 #include "command_handler.hpp"
+#include "metrics.hpp"
+#include "protocol.hpp"
+#include "shared_buffer.hpp"
+#include "shm_ring.hpp"
+#if defined(TCP_SERVER_COROUTINES)
+#include "coroutine.hpp"
+#endif
 
 using boost::asio::ip::tcp;
+// Socket of a TcpConnection. Holds a TCP or a Unix domain (AF_UNIX) stream socket, both
+// convert to it when moved in, so one connection type serves every transport.
+using StreamSocket = boost::asio::generic::stream_protocol::socket;
 
 namespace Constants{
     std::string const delimiter = ";";
+    char const frame_delimiter = '\n';
+    // Bytes a read asks for, and so the size of an idle connection's read buffer
     int const max_length = 1024;
-    int const max_clients = 32;
+    // Longest text frame, delimiter excluded. Longer frames arrive over several reads, a
+    // connection that sends more without a frame_delimiter is closed.
+    size_t const max_text_frame_length = 64 * 1024;
+    size_t const write_low_water_mark = 64 * 1024;
+    size_t const write_high_water_mark = 1024 * 1024;
+    // Reactor the io_contexts run on, chosen at build time with TCP_SERVER_IO_URING
+#if defined(BOOST_ASIO_HAS_IO_URING_AS_DEFAULT)
+    std::string_view const io_engine = "io_uring";
+#else
+    std::string_view const io_engine = "epoll";
+#endif
+    // How connections run their reads and writes, chosen at build time with TCP_SERVER_COROUTINES
+#if defined(TCP_SERVER_COROUTINES)
+    std::string_view const connection_engine = "coroutines";
+#else
+    std::string_view const connection_engine = "callbacks";
+#endif
 }
 
-class TcpObject : CommandHandler
+// What a connection does with frames sent while its outbound queue is over the high water mark
+enum class SlowConsumerPolicy : std::uint8_t {
+    // Rejects the new frame until the queue drained below the low water mark
+    DropNewest,
+    // Closes the connection, the new frame is rejected
+    Disconnect,
+    // Discards the oldest queued frames that are not being written yet to make room
+    DropOldest,
+    // Replaces the queued frame with the same conflation key (the topic), so a slow
+    // consumer only gets the newest value of each topic
+    Conflate
+};
+
+// Names are drop-newest, disconnect, drop-oldest and conflate
+std::optional<SlowConsumerPolicy> parseSlowConsumerPolicy(std::string_view name);
+std::string_view slowConsumerPolicyName(SlowConsumerPolicy policy);
+
+class TcpObject : public CommandHandler
 {
 public:
-    virtual void onRead(int connId, std::string data) = 0;
+    // data views the connection's read buffer and is only valid for the duration of the call
+    virtual void onRead(int connId, std::string_view data) = 0;
+    // Called by the connection for every received frame (the text line or, for binary
+    // connections, everything after the length prefix). Forwards to onRead by default.
+    virtual void onFrame(int connId, std::string_view frame) { onRead(connId, frame); }
+    // Called once the frames of a read were handled, before the next read is started. Lets
+    // the object answer a whole read at once, for example with one cumulative Ack.
+    virtual void onReadComplete(int connId) { (void)connId; }
     virtual void onClose(int connId) = 0;
     virtual void onStart(int connId) = 0;
+    // Called when the outbound queue of a connection crosses its high water mark (congested)
+    // and again once it drained below the low water mark. Called from the thread that crossed the mark.
+    virtual void onBackpressure(int connId, bool congested) { (void)connId; (void)congested; }
+    // Called on the io_context thread after a write completed with the number of frames of
+    // send() it wrote, frames are written in the order send() queued them. Frames of
+    // sendControl() are not counted.
+    virtual void onWritten(int connId, size_t frames) { (void)connId; (void)frames; }
 };
 
 class TcpConnection : public std::enable_shared_from_this<TcpConnection>
 {
 public:
-    static std::shared_ptr<TcpConnection> create(tcp::socket &&socket, TcpObject &object, int connId = 0);
+    static constexpr std::uint32_t no_conflation_key = UINT32_MAX;
+
+    struct OutboundFrame {
+        SharedBufferPtr buffer;
+        std::uint32_t conflationKey = no_conflation_key;
+        // Set by send(), whether the frame was queued
+        bool sent = false;
+    };
+
+    static std::shared_ptr<TcpConnection> create(StreamSocket &&socket, TcpObject &object, int connId = 0);
 
     void read();
     void close();
+    // Thread safe. Queues one frame and returns false if the connection is closed or congested,
+    // in which case the frame is not sent.
     bool send(const char *data, size_t size);
+    // Same as above for an already framed buffer (including the frame delimiter) that can be
+    // shared by many connections, no bytes are copied. While congested the slow consumer
+    // policy decides what happens to the frame, under Conflate a queued frame with the same
+    // conflationKey is replaced by it.
+    bool send(const SharedBufferPtr &buffer, std::uint32_t conflationKey = no_conflation_key);
+    // Queues many frames under one lock and writes them with a single gathered write. Each
+    // frame is handled like a send() of its own, returns how many were queued.
+    size_t send(OutboundFrame *frames, size_t count);
+    // Thread safe. Queues a reply the peer waits for, such as CONNACK or Registered. It is
+    // queued even while congested, is never dropped by the slow consumer policy and always
+    // goes over the socket, also once a ring is attached. It is written ahead of the frames
+    // queued by send(). Returns false only if the connection is closed.
+    bool sendControl(const char *data, size_t size);
+    bool sendControl(const SharedBufferPtr &buffer);
+    void setWaterMarks(size_t lowWaterMark, size_t highWaterMark);
+    void setSlowConsumerPolicy(SlowConsumerPolicy policy);
+    SlowConsumerPolicy slowConsumerPolicy();
+    // Framing of received data. Only call it from the io_context thread, typically from
+    // onFrame, the following frames of the current read are already parsed with it.
+    void setProtocol(Protocol::Version version);
+    Protocol::Version protocol() const;
+    size_t queuedBytes();
+    bool isCongested();
+    const ConnectionMetrics& metrics() const;
+    // Records the publish to write latency of every written frame that carries a timestamp.
+    // The histogram is recorded on the io_context thread and must outlive the connection.
+    void setLatencyHistogram(LatencyHistogram* histogram);
+    // Frames sent from now on are written into the client's shared memory ring instead of
+    // the socket, the socket only carries what the client sends. A full ring drops the
+    // frame, or closes the connection under the Disconnect policy. For binary connections,
+    // call on the io_context thread.
+    void attachRing(std::unique_ptr<ShmRing> ring);
+    bool hasRing();
+    // For a Unix domain socket, the first read also takes a descriptor the peer sent along
+    // with its first bytes (SCM_RIGHTS). Asio's reads pass no buffer for it, the kernel would
+    // discard it. Call before read().
+    void receiveDescriptor();
+    // The descriptor received, which the caller then owns, or -1. Call on the io_context thread.
+    int takeDescriptor();
 
 private:
-    TcpConnection(tcp::socket &&socket, TcpObject &object, int connId);
-    bool doWrite();
+    TcpConnection(StreamSocket &&socket, TcpObject &object, int connId);
+#if defined(TCP_SERVER_COROUTINES)
+    // Runs until the socket is closed, owns the connection meanwhile
+    Coroutine readLoop(std::shared_ptr<TcpConnection> self);
+    // Runs until the connection is closed or destroyed. Sleeps on m_writeSignal while there is
+    // nothing to write and only owns the connection while a write is in flight, like doWrite().
+    Coroutine writeLoop(std::weak_ptr<TcpConnection> weak);
+#else
+    void doWrite();
+#endif
+    // Returns whether to read on
+    bool completeRead(const boost::system::error_code &error, size_t bytesTransferred);
+    // Reads like async_read_some() once the socket is readable, and keeps a descriptor that
+    // came with the data in m_descriptor
+    size_t readWithDescriptor(boost::system::error_code &error);
+    // Moves the queued frames into m_flushQueue and m_flushBuffers, returns false and marks the
+    // writer idle if there are none
+    bool takeWriteQueue();
+    // Returns whether to write on
+    bool completeWrite(const boost::system::error_code &error, size_t bytesTransferred);
+    void doClose();
+    bool processFrames();
+    void recordLatency();
+
+    // What queueing frames requires once m_writeBufferMutex is released
+    struct QueueResult {
+        bool startWrite = false;
+        bool congested = false;
+        bool disconnect = false;
+    };
+    // Called with m_writeBufferMutex held, returns whether the frame was queued
+    bool enqueue(const SharedBufferPtr &buffer, std::uint32_t conflationKey, QueueResult &result);
+    // Returns false if the connection is being closed
+    bool afterQueue(const QueueResult &result);
+    // Called with m_writeBufferMutex held, returns whether the frame fit into m_ring
+    bool writeRing(const SharedBufferPtr &buffer);
+    // The ring is full and the policy is Disconnect
+    void closeSlowRing();
+    // Called with m_writeBufferMutex held while congested, returns whether the frame was queued
+    bool queueCongested(const SharedBufferPtr &buffer, std::uint32_t conflationKey);
+    void pushFrame(const SharedBufferPtr &buffer, std::uint32_t conflationKey);
 
-    tcp::socket m_socket;
+    StreamSocket m_socket;
     TcpObject &m_object;
     boost::asio::streambuf m_readBuffer;
-    boost::asio::streambuf m_writeBuffer;
+    size_t m_scannedBytes;
+    // Bytes still missing from a partially received binary frame, so the next read is sized for it
+    size_t m_readHint;
+    Protocol::Version m_protocol;
+    // Frames are queued in m_writeQueue by send() and swapped into m_flushQueue, which only the
+    // io_context thread touches while a gathered async_write of m_flushBuffers is in flight
+    std::vector<SharedBufferPtr> m_writeQueue;
+    // Frames before it were discarded by DropOldest, they are erased when the queue is flushed
+    size_t m_writeQueueHead;
+    // Conflation key to position in m_writeQueue, only kept under Conflate
+    std::unordered_map<std::uint32_t, size_t> m_conflationSlots;
+    // Frames of sendControl(), taken before m_writeQueue
+    std::vector<SharedBufferPtr> m_controlQueue;
+    std::vector<SharedBufferPtr> m_flushQueue;
+    // Frames of m_controlQueue at the front of m_flushQueue, onWritten() leaves them out
+    size_t m_flushControlFrames;
+    std::vector<boost::asio::const_buffer> m_flushBuffers;
+#if defined(TCP_SERVER_COROUTINES)
+    // Never expires, cancelled to wake the idle writer coroutine
+    boost::asio::steady_timer m_writeSignal;
+#endif
     std::mutex m_writeBufferMutex;
+    std::unique_ptr<ShmRing> m_ring;
+    // Set by receiveDescriptor() until the first data arrived
+    bool m_receiveDescriptor;
+    int m_descriptor;
+    ConnectionMetrics m_metrics;
+    LatencyHistogram* m_latency;
+    size_t m_queuedBytes;
+    size_t m_lowWaterMark;
+    size_t m_highWaterMark;
+    SlowConsumerPolicy m_policy;
     int m_connectionId;
     bool m_isWritting;
+    bool m_isCongested;
+    std::atomic<bool> m_isOpen;
 };
 #endif
\ No newline at end of file
@@ -3,40 +3,299 @@
 
 #include <iostream>
 #include "tcp_connection.hpp"
+#include "subscription_index.hpp"
+#include "slot_table.hpp"
+#include "timing_wheel.hpp"
+#include "ack_window.hpp"
+#include <chrono>
+#include <deque>
+#include <list>
 #include <map>
+#include <memory>
+#include <unordered_map>
 
 using boost::asio::ip::tcp;
 
+// Receives the publishes and topic interest changes of a TcpServer so they can be
+// forwarded to other servers. Called on the server's io_context thread.
+class PublishRouter {
+    public:
+        virtual ~PublishRouter() = default;
+        // First local subscriber of a topic appeared (interested) or the last one left
+        virtual void onTopicInterest(std::string_view topic, bool interested) = 0;
+        // Whether onPublish is called. A router that returns false only forwards interest, and
+        // the server skips encoding publishes for it. Read once by TcpServer::setRouter.
+        virtual bool routesPublishes() const { return true; }
+        // frame is the encoded text delivery frame, already delivered to the local subscribers.
+        // PublishFrames can rebuild every other encoding from it.
+        virtual void onPublish(std::string_view topic, const SharedBufferPtr& frame) { (void)topic; (void)frame; }
+};
+
+// At-least-once (QoS 1) state of a client. Kept by name when the connection is lost, so
+// the client's next QoS 1 CONNECT resumes where it left off.
+struct QosSession {
+    // Message and MessageById frames the client did not acknowledge yet
+    AckWindow deliveries;
+    // Deliveries behind a full window, sent as Acks make room. Numbered only once they
+    // enter the window, so they are sent again in order after a lost connection as well.
+    std::deque<SharedBufferPtr> waiting;
+    // Publish frames received from the client and the last one acknowledged to it
+    std::uint64_t published = 0;
+    std::uint64_t publishedAcknowledged = 0;
+    // In the server's list of delayed Acks
+    bool ackPending = false;
+};
+
+// State of one client connection, connection ids are its handle in the server's SlotTable
+struct Session {
+    std::shared_ptr<TcpConnection> connection;
+    // Empty until the client sent CONNECT
+    std::string name;
+    // Topics the client registered, indexed by TopicId. Deliveries of those topics carry
+    // the id instead of the topic string.
+    std::vector<bool> registeredTopics;
+    size_t registeredTopicCount = 0;
+    // Link of another server of the federation, sent PEER instead of CONNECT
+    bool peer = false;
+    // Deliveries of the PublishBatch being processed, sent together once it is done
+    std::vector<TcpConnection::OutboundFrame> pendingFrames;
+    // Next heartbeat or timeout check in the server's TimingWheel, invalid_timer if none
+    TimingWheel::TimerId timer = TimingWheel::invalid_timer;
+    // Wheel ticks of the last frame received, of the last frame other than PING and PONG
+    // and of the last PING sent
+    std::uint64_t lastReceived = 0;
+    std::uint64_t lastActive = 0;
+    std::uint64_t lastPing = 0;
+    // Set for QoS 1 clients
+    std::unique_ptr<QosSession> qos;
+};
+
+// Connection scaling knobs of a TcpServer, see "Scaling to many connections" in the README
+struct ConnectionLimits {
+    // Connections accepted while this many are open are closed right away (admission control),
+    // 0 leaves only the session table's limit of SlotTable<Session>::max_slots
+    size_t maxConnections = 0;
+    // Completed connections the kernel queues until they are accepted, capped by net.core.somaxconn
+    int backlog = boost::asio::socket_base::max_listen_connections;
+    // Connections taken off the backlog per accept completion
+    size_t acceptBatch = 64;
+};
+
+// Heartbeats and timeouts of the connections of a TcpServer, 0 turns each one off. They are
+// tracked in ticks of ConnectionTimeouts::tick and rounded up to whole ticks.
+struct ConnectionTimeouts {
+    static constexpr std::chrono::milliseconds tick{100};
+
+    // A PING is sent to a connection that sent nothing for this long, the client answers with PONG
+    std::chrono::milliseconds heartbeatInterval{0};
+    // Connections that sent nothing for this long, not even a PONG, are closed
+    std::chrono::milliseconds readTimeout{0};
+    // Connections that sent nothing but heartbeats for this long are closed, peers are exempt
+    std::chrono::milliseconds idleTimeout{0};
+};
+
 class TcpServer : TcpObject{
     public:
-        TcpServer(int port, boost::asio::io_context& io_context);
-        void onRead(int connId, std::string data) override;
+        // QoS 1 states of lost connections kept at most, the least recently lost one is
+        // discarded to make room
+        static constexpr size_t max_retained_sessions = 1024;
+        // Deliveries waiting behind a full QoS 1 window at most. A client this far behind is
+        // disconnected and keeps its state, so its next CONNECT gets them all.
+        static constexpr size_t max_waiting_deliveries = 4 * AckWindow::default_capacity;
+        // Topics with counters of their own at most, in order of first use. The others are
+        // counted under Metrics::other_topics, so clients cannot grow the metric label set.
+        static constexpr size_t max_topic_metrics = 1024;
+        // Topics a client may register, and topics registered by all clients together. A
+        // REGISTER beyond either is answered with Protocol::rejected_topic_id.
+        static constexpr size_t max_registered_topics_per_session = 4096;
+        static constexpr size_t max_registered_topics = 65536;
+
+        // reusePort lets several servers (one per io_context) accept on the same port
+        TcpServer(int port, boost::asio::io_context& io_context, bool reusePort = false);
+        ~TcpServer();
+        void onRead(int connId, std::string_view data) override;
         void onClose(int connId) override;
         void onStart(int connId) override;
+        void onReadComplete(int connId) override;
+        void onBackpressure(int connId, bool congested) override;
 
         int getClientCount() const;
         std::string getClientName(int connId) const;
         std::vector<std::string> getClientTopics(int connId) const;
 
+        void setWriteWaterMarks(size_t lowWaterMark, size_t highWaterMark);
+        // Policy of connections accepted from now on, a client may pick its own in CONNECT
+        void setSlowConsumerPolicy(SlowConsumerPolicy policy);
+        // Call before start()
+        void setConnectionLimits(const ConnectionLimits& limits);
+        // Call before start()
+        void setTimeouts(const ConnectionTimeouts& timeouts);
+        // Also accepts clients on a Unix domain socket at path, call before start(). Those
+        // clients share the sessions and subscriptions of the TCP ones. A stale socket file
+        // left at path is replaced, any other file there makes it throw and is kept. The
+        // socket file is removed when the server is destroyed.
+        void listenLocal(const std::string& path);
+        void setRouter(PublishRouter* router);
         void start();
-        void handleCommand(const std::string& input, int connId);
+        void handleCommand(std::string_view input, int connId);
+        // Sends a publish to the local subscribers of its topic, each in its own protocol.
+        // Peers are left out, so a publish that came from a peer is never forwarded again.
+        void deliver(PublishFrames& frames);
+        // Call on the io_context thread
+        MetricsSnapshot collectMetrics();
     private:
-        void accept();
+        // What an accept loop does after an accept completed
+        enum class AcceptStep { Continue, Retry, Stop };
+
+        // Instantiated for the TCP and the Unix domain acceptor
+        template <typename Acceptor>
+        void accept(Acceptor& acceptor);
+#if defined(TCP_SERVER_COROUTINES)
+        template <typename Acceptor>
+        Coroutine acceptLoop(Acceptor& acceptor);
+#else
+        template <typename Acceptor>
+        void retryAccept(Acceptor& acceptor);
+#endif
+        // Takes up to acceptBatch - 1 more connections off the backlog without waiting
+        template <typename Acceptor>
+        boost::system::error_code acceptBacklog(Acceptor& acceptor);
+        template <typename Acceptor>
+        AcceptStep handleAcceptError(Acceptor& acceptor, const boost::system::error_code& error);
+        template <typename Acceptor>
+        boost::asio::steady_timer& retryTimer(Acceptor& acceptor);
+        void admit(StreamSocket socket);
+        void reject(StreamSocket& socket);
+
+        void handleConnect(Tokenizer& args, int connId) override;
+        void handleDisconnect(int connId) override;
+        void handlePublish(Tokenizer& args, int connId) override;
+        void handleSubscribe(Tokenizer& args, int connId) override;
+        void handleUnsubscribe(Tokenizer& args, int connId) override;
+        void handleStats(int connId) override;
+        void handlePeer(Tokenizer& args, int connId) override;
+        void handlePing(int connId) override;
+        void handleBinaryFrame(std::string_view data, int connId);
+
+        void publish(std::string_view topic, std::string_view data, int connId);
+        void publish(TopicId topicId, std::string_view data, int connId);
+        // topicId is invalid_topic if the topic has no id, wildcard subscribers match it by name
+        void publish(TopicId topicId, std::string_view topic, std::string_view data, int connId);
+        // Publishes every entry of a PublishBatch and then sends each subscriber its share
+        // of the batch with one write
+        void publishBatch(std::string_view entries, int connId);
+        void registerTopic(std::string_view topic, int connId);
+        // Drops the session's registrations, ids no client registers or subscribes to any more
+        // are released unless the topic has counters of its own
+        void releaseRegisteredTopics(Session& session);
+        void subscribe(std::string_view topic, int connId);
+        void unsubscribe(std::string_view topic, int connId);
+        void deliver(TopicId topicId, PublishFrames& frames);
+        void deliver(TopicId topicId, PublishFrames& frames, const std::vector<int>& subscribers);
+        // Subscribers of a published topic, by topic string if it has no id
+        const std::vector<int>& matchSubscribers(TopicId topicId, std::string_view topic);
+        // Queues the deliveries in the subscribers' pendingFrames, sent by flushBatch()
+        void queueDeliveries(TopicId topicId, PublishFrames& frames, const std::vector<int>& subscribers);
+        void flushBatch();
+        // Encoding of a publish the session receives, null if it cannot receive the payload
+        const SharedBufferPtr* deliveryFrame(const Session& session, TopicId topicId, PublishFrames& frames);
+        // Sends a Message or MessageById frame, through the delivery window of QoS 1 sessions.
+        // Returns false if it was dropped.
+        bool sendDelivery(Session& session, const SharedBufferPtr& frame, std::uint32_t conflationKey);
+        enum class QosAdmission { Send, Wait, Refuse };
+        // Puts a delivery into the window of a QoS 1 session, or behind it if it is full.
+        // Refused only once the session is disconnected for falling max_waiting_deliveries behind.
+        QosAdmission admitQos(Session& session, const SharedBufferPtr& frame);
+        // Moves waiting deliveries into the room Acks made in the window and sends them
+        void sendWaiting(Session& session);
+        // Gives a QoS 1 CONNECT the state its name left behind, or a new one, and sends the
+        // CONNACK followed by the deliveries the client did not receive
+        void resumeQos(Session& session, int connId, std::uint64_t received);
+        // Keeps the QoS 1 state of a lost connection for its next CONNECT
+        void retainQos(Session& session);
+        // Removes the state retained for name and returns it, null if there is none
+        std::unique_ptr<QosSession> takeRetainedQos(const std::string& name);
+        // Removes the session from m_qosConnections, call before its QoS 1 state is dropped
+        void forgetQosConnection(const Session& session, int connId);
+        static constexpr std::uint32_t no_metric_slot = UINT32_MAX;
 
-        void handleConnect(std::istringstream& stream, int connId);
-        void handleDisconnect(int connId);
-        void handlePublish(std::istringstream& stream, int connId);
-        void handleSubscribe(std::istringstream& stream, int connId);
-        void handleUnsubscribe(std::istringstream& stream, int connId);
+        // Counters of the topic, m_otherTopicMetrics if it has none of its own
+        TopicMetrics& topicMetrics(TopicId topicId);
+        bool hasTimeouts() const;
+        // Advances m_timers once per tick
+        void startTimeoutTimer();
+        // The session's timer expired, closes it or sends a PING and schedules the next check
+        void checkTimeouts(int connId);
+        // Earliest tick one of the session's heartbeat or timeouts is due, UINT64_MAX if none
+        std::uint64_t nextDeadline(const Session& session) const;
+        // Acknowledges the publishes received from a QoS 1 session so far
+        void sendAck(Session& session);
+        // Sends the Acks delayed by onReadComplete()
+        void flushAcks();
 
         boost::asio::io_context& m_ioContext;
         tcp::acceptor m_acceptor;
+        boost::asio::local::stream_protocol::acceptor m_localAcceptor;
+        std::string m_localPath;
+        boost::asio::steady_timer m_acceptRetryTimer;
+        boost::asio::steady_timer m_localRetryTimer;
+        ConnectionLimits m_limits;
+        // Descriptor held back for accepting and closing a connection while the process is out
+        // of descriptors, -1 if it could not be reopened
+        int m_spareDescriptor;
 
         int m_serverPort;
+        // Sessions that sent CONNECT, peers are not counted
         int m_clientCount;
-        std::unordered_map<int, std::vector<std::string>> m_clientTopics;
-        std::unordered_map<int, std::shared_ptr<TcpConnection>> m_clientConnections;
-        std::unordered_map<int, std::string> m_clientNames;
+        int m_peerCount;
+        size_t m_writeLowWaterMark;
+        size_t m_writeHighWaterMark;
+        SlowConsumerPolicy m_slowConsumerPolicy;
+        MetricCounter m_slowConsumerDisconnects;
+        MetricCounter m_rejectedConnections;
+        MetricCounter m_timedOutConnections;
+        MetricCounter m_discardedQosSessions;
+        ConnectionTimeouts m_timeouts;
+        // One timer per session, keyed by connection id, instead of one steady_timer each
+        TimingWheel m_timers;
+        boost::asio::steady_timer m_timeoutTimer;
+        std::chrono::steady_clock::time_point m_timeoutStart;
+        // Shared by all sessions of a protocol version
+        SharedBufferPtr m_textPing;
+        SharedBufferPtr m_binaryPing;
+        PublishRouter* m_router;
+        // m_router if it routes publishes, else null
+        PublishRouter* m_publishRouter;
+        SubscriptionIndex m_subscriptions;
+        // Subscriptions of peers. Kept apart so they are not reported to the router as
+        // interest of this server and only publishes of local clients reach the peers.
+        SubscriptionIndex m_peerSubscriptions;
+        SlotTable<Session> m_sessions;
+        // Sessions with pendingFrames while a PublishBatch is processed
+        std::vector<int> m_batchSubscribers;
+        // A deque because the counters cannot be moved, indexed by m_topicMetricSlots
+        std::deque<TopicMetrics> m_topicMetrics;
+        // Indexed by TopicId, no_metric_slot if the topic is counted in m_otherTopicMetrics
+        std::vector<std::uint32_t> m_topicMetricSlots;
+        // Sessions that registered the topic, indexed by TopicId, and topics registered by any
+        std::vector<std::uint32_t> m_topicRegistrations;
+        size_t m_registeredTopicCount;
+        TopicMetrics m_otherTopicMetrics;
+        LatencyHistogram m_writeLatency;
+        struct RetainedSession {
+            std::unique_ptr<QosSession> qos;
+            // Position in m_retainedOrder
+            std::list<std::string>::iterator order;
+        };
+        // QoS 1 states of lost connections by client name
+        std::unordered_map<std::string, RetainedSession> m_retainedSessions;
+        // Names of m_retainedSessions, least recently lost first
+        std::list<std::string> m_retainedOrder;
+        // Connection ids of the sessions with QoS 1 state by client name
+        std::unordered_map<std::string, int> m_qosConnections;
+        // Sessions with an Ack delayed until m_ackTimer expires, one timer for all of them
+        std::vector<int> m_pendingAcks;
+        boost::asio::steady_timer m_ackTimer;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hierarchical timing wheel (Varghese and Lauck) for the timeouts of many connections. Time
+// is counted in ticks, the owner advances the wheel from one periodic timer. Level 0 has a
+// slot per tick for the next 256 ticks, each higher level has a slot per 256 slots of the
+// level below, so 4 levels cover 2^32 ticks. Scheduling and cancelling are O(1), a timer is
+// moved down a level at most 3 times before it expires.
+//
+// Timers live in one vector and are linked by index, a timer costs no allocation once the
+// vector has grown to the number of scheduled timers. The key passed to schedule() is what
+// advance() reports when the timer expires.
+class TimingWheel {
+    public:
+        using TimerId = std::uint32_t;
+        static constexpr TimerId invalid_timer = UINT32_MAX;
+        static constexpr unsigned slot_bits = 8;
+        static constexpr size_t slot_count = size_t{1} << slot_bits;
+        static constexpr unsigned level_count = 4;
+
+        TimingWheel();
+
+        // Tick the wheel was last advanced to, starts at 0
+        std::uint64_t now() const;
+        // Number of scheduled timers
+        size_t size() const;
+
+        // Expires at tick deadline, deadlines that are not after now() expire on the next tick
+        TimerId schedule(std::uint64_t deadline, std::uint32_t key);
+        // id must be scheduled, the id of a timer that expired or was cancelled may already
+        // belong to another one
+        void cancel(TimerId id);
+        // Moves the wheel to tick and calls onExpire(key) for every timer due by then, earlier
+        // ticks first. onExpire may schedule and cancel timers.
+        void advance(std::uint64_t tick, const std::function<void(std::uint32_t)>& onExpire);
+
+    private:
+        static constexpr std::uint32_t no_slot = UINT32_MAX;
+
+        struct Timer {
+            std::uint64_t deadline = 0;
+            std::uint32_t key = 0;
+            // Slot the timer is linked into, no_slot while it is free
+            std::uint32_t slot = no_slot;
+            std::uint32_t previous = invalid_timer;
+            // Next timer of the slot or of the free list
+            std::uint32_t next = invalid_timer;
+        };
+
+        // Links the timer into the slot its deadline belongs to as seen from m_now
+        void place(TimerId id);
+        void link(TimerId id, std::uint32_t slot);
+        void unlink(TimerId id);
+        void release(TimerId id);
+        // Places the timers of a higher level slot again, m_now reached its range
+        void cascade(unsigned level);
+
+        std::vector<Timer> m_timers;
+        // First timer of every slot, level after level
+        std::array<TimerId, level_count * slot_count> m_slots;
+        TimerId m_free;
+        std::uint64_t m_now;
+        size_t m_size;
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef TOPIC_TRIE_HPP
+#define TOPIC_TRIE_HPP
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "subscription_index.hpp"
+
+// Trie of wildcard topic filters. Topics are split into levels on '/'. In a filter '+'
+// matches exactly one level and '#' (only allowed as the last level) matches any number
+// of remaining levels, including none ("md/#" matches "md" and "md/eq/AAPL").
+// Each node stores the ids of the filters ending at it, matching a topic walks the trie
+// once, following the literal and the '+' child of every level.
+class TopicTrie {
+    public:
+        static constexpr char level_separator = '/';
+        static constexpr char single_level_wildcard = '+';
+        static constexpr char multi_level_wildcard = '#';
+
+        static bool isWildcard(std::string_view filter);
+        // A filter is a topic whose levels may be a lone '+' or a lone trailing '#'
+        static bool isValidFilter(std::string_view filter);
+        // Topics that are published to may not contain wildcards
+        static bool isValidTopic(std::string_view topic);
+
+        void insert(std::string_view filter, TopicId filterId);
+        void erase(std::string_view filter, TopicId filterId);
+        // Appends the ids of all filters matching topic
+        void match(std::string_view topic, std::vector<TopicId>& filterIds) const;
+        bool empty() const;
+
+    private:
+        struct Node {
+            // std::less<> allows looking levels up by string_view without allocating
+            std::map<std::string, std::unique_ptr<Node>, std::less<>> children;
+            std::unique_ptr<Node> singleLevel;
+            std::vector<TopicId> filters;
+            std::vector<TopicId> multiLevelFilters;
+
+            bool empty() const;
+        };
+
+        static bool erase(Node& node, std::string_view filter, TopicId filterId);
+        static void match(const Node& node, std::string_view rest, bool atEnd, std::vector<TopicId>& filterIds);
+
+        Node m_root;
+};
+
+#endif
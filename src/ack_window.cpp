@@ -0,0 +1,53 @@
+#include "ack_window.hpp"
+
+AckWindow::AckWindow(size_t capacity) :
+    m_frames(),
+    m_capacity(capacity),
+    m_acknowledged(0) {}
+
+bool AckWindow::full() const{
+    return m_frames.size() >= m_capacity;
+}
+
+size_t AckWindow::size() const{
+    return m_frames.size();
+}
+
+std::uint64_t AckWindow::acknowledged() const{
+    return m_acknowledged;
+}
+
+const std::deque<SharedBufferPtr>& AckWindow::frames() const{
+    return m_frames;
+}
+
+bool AckWindow::push(const SharedBufferPtr& frame){
+    if(full()){
+        return false;
+    }
+    m_frames.push_back(frame);
+    return true;
+}
+
+void AckWindow::forcePush(const SharedBufferPtr& frame){
+    m_frames.push_back(frame);
+}
+
+bool AckWindow::acknowledge(std::uint64_t sequence){
+    if(sequence > m_acknowledged + m_frames.size()){
+        return false;
+    }
+    while(m_acknowledged < sequence){
+        m_frames.pop_front();
+        ++m_acknowledged;
+    }
+    return true;
+}
+
+void AckWindow::resume(std::uint64_t sequence){
+    while(m_acknowledged < sequence && !m_frames.empty()){
+        m_frames.pop_front();
+        ++m_acknowledged;
+    }
+    m_acknowledged = sequence;
+}
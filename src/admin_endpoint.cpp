@@ -0,0 +1,81 @@
+#include "admin_endpoint.hpp"
+#include <cerrno>
+#include <chrono>
+#include <iostream>
+#include <memory>
+
+namespace {
+    constexpr size_t max_request_size = 8192;
+    constexpr auto accept_retry_delay = std::chrono::milliseconds(100);
+
+    struct AdminSession {
+        explicit AdminSession(tcp::socket&& socket) : socket(std::move(socket)), request(max_request_size) {}
+
+        tcp::socket socket;
+        boost::asio::streambuf request;
+        std::string response;
+    };
+
+    std::string httpResponse(const char* status, const std::string& body){
+        return std::string("HTTP/1.0 ") + status + "\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+               "Connection: close\r\n\r\n" + body;
+    }
+}
+
+AdminEndpoint::AdminEndpoint(int port, boost::asio::io_context& io_context, Provider provider) :
+    m_acceptor(io_context, tcp::endpoint{boost::asio::ip::address_v4::loopback(), static_cast<unsigned short>(port)}),
+    m_retryTimer(io_context),
+    m_provider(std::move(provider)) {}
+
+void AdminEndpoint::start(){
+    std::cout << "Admin endpoint on http://127.0.0.1:" << m_acceptor.local_endpoint().port() << "/metrics" << std::endl;
+    accept();
+}
+
+void AdminEndpoint::accept(){
+    m_acceptor.async_accept([this](const auto &error, auto socket) {
+        if (error) {
+            handleAcceptError(error);
+            return;
+        }
+        auto session = std::make_shared<AdminSession>(std::move(socket));
+        boost::asio::async_read_until(session->socket, session->request, "\r\n\r\n",
+                                      [this, session](const auto &error, auto) {
+            if (error) {
+                return;
+            }
+            std::string_view request(static_cast<const char*>(session->request.data().data()),
+                                     session->request.size());
+            bool metrics = request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET /metrics?", 0) == 0;
+            session->response = metrics ? httpResponse("200 OK", m_provider()) : httpResponse("404 Not Found", "");
+            boost::asio::async_write(session->socket, boost::asio::buffer(session->response),
+                                     [session](const auto &, auto) {
+                boost::system::error_code ignored;
+                session->socket.shutdown(tcp::socket::shutdown_both, ignored);
+            });
+        });
+        accept();
+    });
+}
+
+void AdminEndpoint::handleAcceptError(const boost::system::error_code& error){
+    if (error == boost::asio::error::operation_aborted || !m_acceptor.is_open()) {
+        return;
+    }
+    std::cerr << "AdminEndpoint::accept() error: " + error.message() + ".\n";
+    // Accepting again right away would fail the same way until descriptors or memory are freed
+    if (error == boost::asio::error::no_descriptors ||
+        error == boost::system::error_code(ENFILE, boost::system::system_category()) ||
+        error == boost::asio::error::no_buffer_space || error == boost::asio::error::no_memory) {
+        m_retryTimer.expires_after(accept_retry_delay);
+        m_retryTimer.async_wait([this](const boost::system::error_code& timerError) {
+            if (!timerError) {
+                accept();
+            }
+        });
+        return;
+    }
+    accept();
+}
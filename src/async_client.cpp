@@ -0,0 +1,397 @@
+#include "async_client.hpp"
+#include <algorithm>
+#include <utility>
+
+AsyncClient::AsyncClient(boost::asio::io_context& ioContext) :
+    m_ioContext(ioContext),
+    m_connection{},
+    m_isConnected{false},
+    m_protocol{Protocol::Version::Binary},
+    m_queuedFrames{0},
+    m_writtenFrames{0} {}
+
+AsyncClient::~AsyncClient(){
+    if(m_connection){
+        m_connection->close();
+    }
+}
+
+void AsyncClient::setMessageHandler(MessageHandler handler){
+    m_messageHandler = std::move(handler);
+}
+
+void AsyncClient::setBackpressureHandler(BackpressureHandler handler){
+    m_backpressureHandler = std::move(handler);
+}
+
+void AsyncClient::asyncConnect(const tcp::endpoint& endpoint, std::string_view name, CompletionHandler handler,
+                               Protocol::Version version){
+    if(m_isConnected){
+        boost::asio::post(m_ioContext, [handler]() { handler(boost::asio::error::already_connected); });
+        return;
+    }
+    auto socket = std::make_shared<tcp::socket>(m_ioContext);
+    socket->async_connect(endpoint, [this, socket, name = std::string(name), handler, version](const auto &error) {
+        if(error){
+            handler(error);
+            return;
+        }
+        socket->set_option(tcp::no_delay(true));
+        std::string connectString = "CONNECT" + Constants::delimiter + name;
+        if(version == Protocol::Version::Binary){
+            // Binary frames may follow right away, received frames stay text until CONNACK
+            connectString += Constants::delimiter + "2";
+        }
+        auto frame = SharedBuffer::create(connectString.size() + 1);
+        frame->append(connectString);
+        frame->append(Constants::frame_delimiter);
+        m_topicNames.clear();
+        // The previous connection is released outside the lock
+        std::shared_ptr<TcpConnection> previous;
+        {
+            // Publishing threads read the connection and protocol under the lock
+            std::lock_guard<std::mutex> lock(m_pendingMutex);
+            m_queuedFrames = m_writtenFrames = 0;
+            m_protocol = version;
+            previous = std::exchange(m_connection, TcpConnection::create(std::move(*socket), *this));
+            send(frame, {});
+        }
+        m_isConnected = true;
+        m_connection->read();
+        handler(boost::system::error_code{});
+    });
+}
+
+std::future<void> AsyncClient::connect(const tcp::endpoint& endpoint, std::string_view name, Protocol::Version version){
+    return futureOf([&](CompletionHandler handler) { asyncConnect(endpoint, name, std::move(handler), version); });
+}
+
+void AsyncClient::disconnect(){
+    if(!m_isConnected){
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    if(m_protocol == Protocol::Version::Binary){
+        send(Protocol::encode(Protocol::Opcode::Disconnect), {});
+        return;
+    }
+    std::string disconnectString = "DISCONNECT" + Constants::delimiter;
+    auto frame = SharedBuffer::create(disconnectString.size() + 1);
+    frame->append(disconnectString);
+    frame->append(Constants::frame_delimiter);
+    send(frame, {});
+}
+
+bool AsyncClient::isConnected() const{
+    return m_isConnected;
+}
+
+bool AsyncClient::publish(std::string_view topic, std::string_view payload){
+    if(!m_isConnected){
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    if(!m_connection->send(encodePublish(m_protocol, topic, payload))){
+        return false;
+    }
+    ++m_queuedFrames;
+    return true;
+}
+
+void AsyncClient::asyncPublish(std::string_view topic, std::string_view payload, CompletionHandler handler){
+    if(!m_isConnected){
+        boost::asio::post(m_ioContext, [handler]() { handler(boost::asio::error::not_connected); });
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    send(encodePublish(m_protocol, topic, payload), std::move(handler));
+}
+
+std::future<void> AsyncClient::asyncPublish(std::string_view topic, std::string_view payload){
+    return futureOf([&](CompletionHandler handler) { asyncPublish(topic, payload, std::move(handler)); });
+}
+
+void AsyncClient::asyncRegister(std::string_view topic, RegisterHandler handler){
+    boost::system::error_code error;
+    std::unique_lock<std::mutex> lock(m_pendingMutex);
+    if(!m_isConnected){
+        error = boost::asio::error::not_connected;
+    } else if(m_protocol != Protocol::Version::Binary){
+        error = boost::asio::error::operation_not_supported;
+    } else if(topic.empty() || topic.find_first_of("+#; \t\r\n") != std::string_view::npos){
+        error = boost::asio::error::invalid_argument;
+    } else {
+        if(m_connection->send(Protocol::encode(Protocol::Opcode::Register, topic))){
+            ++m_queuedFrames;
+            m_registrations.push_back({std::string(topic), std::move(handler)});
+            return;
+        }
+        error = m_isConnected ? boost::asio::error::no_buffer_space : boost::asio::error::not_connected;
+    }
+    lock.unlock();
+    boost::asio::post(m_ioContext, [handler = std::move(handler), error]() { handler(error, 0); });
+}
+
+std::future<std::uint32_t> AsyncClient::registerTopic(std::string_view topic){
+    auto promise = std::make_shared<std::promise<std::uint32_t>>();
+    asyncRegister(topic, [promise](const boost::system::error_code& error, std::uint32_t topicId) {
+        if(error){
+            promise->set_exception(std::make_exception_ptr(boost::system::system_error(error)));
+        } else {
+            promise->set_value(topicId);
+        }
+    });
+    return promise->get_future();
+}
+
+bool AsyncClient::publish(std::uint32_t topicId, std::string_view payload){
+    if(!m_isConnected){
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    if(!m_connection->send(Protocol::encode(Protocol::Opcode::PublishById, {}, payload, topicId))){
+        return false;
+    }
+    ++m_queuedFrames;
+    return true;
+}
+
+void AsyncClient::asyncPublish(std::uint32_t topicId, std::string_view payload, CompletionHandler handler){
+    if(!m_isConnected){
+        boost::asio::post(m_ioContext, [handler]() { handler(boost::asio::error::not_connected); });
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    send(Protocol::encode(Protocol::Opcode::PublishById, {}, payload, topicId), std::move(handler));
+}
+
+std::future<void> AsyncClient::asyncPublish(std::uint32_t topicId, std::string_view payload){
+    return futureOf([&](CompletionHandler handler) { asyncPublish(topicId, payload, std::move(handler)); });
+}
+
+void AsyncClient::asyncSubscribe(std::string_view topic, CompletionHandler handler){
+    if(!m_isConnected){
+        boost::asio::post(m_ioContext, [handler]() { handler(boost::asio::error::not_connected); });
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    send(encodeTopicCommand(m_protocol, Protocol::Opcode::Subscribe, "SUBSCRIBE", topic), std::move(handler));
+}
+
+std::future<void> AsyncClient::subscribe(std::string_view topic){
+    return futureOf([&](CompletionHandler handler) { asyncSubscribe(topic, std::move(handler)); });
+}
+
+void AsyncClient::asyncUnsubscribe(std::string_view topic, CompletionHandler handler){
+    if(!m_isConnected){
+        boost::asio::post(m_ioContext, [handler]() { handler(boost::asio::error::not_connected); });
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_pendingMutex);
+    send(encodeTopicCommand(m_protocol, Protocol::Opcode::Unsubscribe, "UNSUBSCRIBE", topic), std::move(handler));
+}
+
+std::future<void> AsyncClient::unsubscribe(std::string_view topic){
+    return futureOf([&](CompletionHandler handler) { asyncUnsubscribe(topic, std::move(handler)); });
+}
+
+SharedBufferPtr AsyncClient::encodePublish(Protocol::Version version, std::string_view topic, std::string_view payload){
+    if(version == Protocol::Version::Binary){
+        return Protocol::encode(Protocol::Opcode::Publish, topic, payload);
+    }
+    // "PUBLISH;topic;payload\n" built in place, one allocation per publish
+    auto frame = SharedBuffer::create(7 + topic.size() + payload.size() + 2 * Constants::delimiter.size() + 1);
+    frame->append("PUBLISH");
+    frame->append(Constants::delimiter);
+    frame->append(topic);
+    frame->append(Constants::delimiter);
+    frame->append(payload);
+    frame->append(Constants::frame_delimiter);
+    return frame;
+}
+
+SharedBufferPtr AsyncClient::encodeTopicCommand(Protocol::Version version, Protocol::Opcode opcode,
+                                                std::string_view command, std::string_view topic){
+    if(version == Protocol::Version::Binary){
+        return Protocol::encode(opcode, topic);
+    }
+    auto frame = SharedBuffer::create(command.size() + Constants::delimiter.size() + topic.size() + 1);
+    frame->append(command);
+    frame->append(Constants::delimiter);
+    frame->append(topic);
+    frame->append(Constants::frame_delimiter);
+    return frame;
+}
+
+void AsyncClient::send(const SharedBufferPtr& frame, CompletionHandler handler){
+    if(m_connection->send(frame)){
+        ++m_queuedFrames;
+        if(handler){
+            m_pending.push_back({m_queuedFrames, std::move(handler)});
+        }
+        return;
+    }
+    boost::system::error_code error = m_isConnected ? boost::asio::error::no_buffer_space
+                                                    : boost::asio::error::not_connected;
+    if(handler){
+        boost::asio::post(m_ioContext, [handler = std::move(handler), error]() { handler(error); });
+    }
+}
+
+void AsyncClient::onWritten(int connId, size_t frames){
+    (void)connId;
+    std::deque<PendingWrite> completed;
+    {
+        std::lock_guard<std::mutex> lock(m_pendingMutex);
+        m_writtenFrames += frames;
+        while(!m_pending.empty() && m_pending.front().frame <= m_writtenFrames){
+            completed.push_back(std::move(m_pending.front()));
+            m_pending.pop_front();
+        }
+    }
+    // Outside the lock, a handler may publish again
+    for(auto &pending : completed){
+        pending.handler(boost::system::error_code{});
+    }
+}
+
+void AsyncClient::failPending(const boost::system::error_code& error){
+    std::deque<PendingWrite> failed;
+    std::deque<PendingRegister> registrations;
+    {
+        std::lock_guard<std::mutex> lock(m_pendingMutex);
+        failed.swap(m_pending);
+        registrations.swap(m_registrations);
+    }
+    for(auto &pending : failed){
+        pending.handler(error);
+    }
+    for(auto &registration : registrations){
+        registration.handler(error, 0);
+    }
+}
+
+void AsyncClient::onRegistered(std::string_view topic, std::uint32_t topicId){
+    PendingRegister registration;
+    {
+        std::lock_guard<std::mutex> lock(m_pendingMutex);
+        auto it = std::find_if(m_registrations.begin(), m_registrations.end(),
+                               [topic](const PendingRegister& pending) { return pending.topic == topic; });
+        if(it == m_registrations.end()){
+            return;
+        }
+        registration = std::move(*it);
+        m_registrations.erase(it);
+    }
+    if(topicId == Protocol::rejected_topic_id){
+        registration.handler(boost::asio::error::invalid_argument, 0);
+        return;
+    }
+    if(m_topicNames.size() <= topicId){
+        m_topicNames.resize(topicId + 1);
+    }
+    m_topicNames[topicId] = std::move(registration.topic);
+    registration.handler(boost::system::error_code{}, topicId);
+}
+
+std::future<void> AsyncClient::futureOf(const std::function<void(CompletionHandler)>& call){
+    auto promise = std::make_shared<std::promise<void>>();
+    call([promise](const boost::system::error_code& error) {
+        if(error){
+            promise->set_exception(std::make_exception_ptr(boost::system::system_error(error)));
+        } else {
+            promise->set_value();
+        }
+    });
+    return promise->get_future();
+}
+
+void AsyncClient::onFrame(int connId, std::string_view frame){
+    if(m_connection->protocol() == Protocol::Version::Binary){
+        Protocol::Frame decoded;
+        if(!Protocol::decode(frame, decoded)){
+            return;
+        }
+        if(decoded.opcode == Protocol::Opcode::Registered){
+            onRegistered(decoded.topic, decoded.topicId);
+        } else if(decoded.opcode == Protocol::Opcode::MessageById && m_messageHandler &&
+                  decoded.topicId < m_topicNames.size()){
+            m_messageHandler(m_topicNames[decoded.topicId], decoded.payload);
+        } else if(decoded.opcode == Protocol::Opcode::Message && m_messageHandler){
+            m_messageHandler(decoded.topic, decoded.payload);
+        } else if(decoded.opcode == Protocol::Opcode::Ping){
+            m_connection->sendControl(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Binary));
+        }
+        return;
+    }
+    if(frame == Protocol::ping){
+        m_connection->sendControl(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Text));
+        return;
+    }
+    if(m_protocol == Protocol::Version::Binary && frame == Protocol::connack){
+        m_connection->setProtocol(Protocol::Version::Binary);
+        return;
+    }
+    onRead(connId, frame);
+}
+
+void AsyncClient::onRead(int connId, std::string_view data){
+    (void)connId;
+    auto separator = data.find(Constants::delimiter);
+    if(separator != std::string_view::npos && m_messageHandler){
+        m_messageHandler(data.substr(0, separator), data.substr(separator + 1));
+    }
+}
+
+void AsyncClient::onClose(int connId){
+    (void)connId;
+    m_isConnected = false;
+    failPending(boost::asio::error::operation_aborted);
+}
+
+void AsyncClient::onStart(int connId){
+    (void)connId;
+}
+
+void AsyncClient::onBackpressure(int connId, bool congested){
+    (void)connId;
+    if(!m_backpressureHandler){
+        return;
+    }
+    // Congestion is reported by the send() of a publishing thread with m_pendingMutex held,
+    // posted so the handler runs on the io_context thread and may publish
+    boost::asio::post(m_ioContext, [handler = m_backpressureHandler, congested]() { handler(congested); });
+}
+
+void AsyncClient::handleCommand(std::string_view input, int connId){
+    (void)input;
+    (void)connId;
+}
+
+void AsyncClient::handleConnect(Tokenizer& args, int connId){
+    (void)args;
+    (void)connId;
+}
+
+void AsyncClient::handleDisconnect(int connId){
+    (void)connId;
+}
+
+void AsyncClient::handlePublish(Tokenizer& args, int connId){
+    (void)args;
+    (void)connId;
+}
+
+void AsyncClient::handleSubscribe(Tokenizer& args, int connId){
+    (void)args;
+    (void)connId;
+}
+
+void AsyncClient::handleUnsubscribe(Tokenizer& args, int connId){
+    (void)args;
+    (void)connId;
+}
+
+void AsyncClient::handleStats(int connId){
+    (void)connId;
+}
@@ -0,0 +1,88 @@
+#include "buffer_pool.hpp"
+#include <new>
+
+namespace {
+    constexpr size_t class_count = 11;
+    static_assert(BufferPool::min_block_size << (class_count - 1) == BufferPool::max_block_size);
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    size_t sizeClass(size_t size){
+        size_t index = 0;
+        while((BufferPool::min_block_size << index) < size){
+            ++index;
+        }
+        return index;
+    }
+
+    class ThreadCache {
+        public:
+            ~ThreadCache(){
+                for(auto &list : m_lists){
+                    while(list.head){
+                        FreeBlock *block = list.head;
+                        list.head = block->next;
+                        ::operator delete(block);
+                    }
+                }
+                s_destroyed = true;
+            }
+
+            void* allocate(size_t index){
+                List &list = m_lists[index];
+                if(list.head == nullptr){
+                    return ::operator new(BufferPool::min_block_size << index);
+                }
+                FreeBlock *block = list.head;
+                list.head = block->next;
+                --list.count;
+                return block;
+            }
+
+            void deallocate(void* memory, size_t index){
+                List &list = m_lists[index];
+                if(list.count * (BufferPool::min_block_size << index) >= BufferPool::max_cached_bytes){
+                    ::operator delete(memory);
+                    return;
+                }
+                list.head = new (memory) FreeBlock{list.head};
+                ++list.count;
+            }
+
+            // Set once the thread's cache is gone, blocks freed during thread exit after
+            // that go straight to the heap
+            static thread_local bool s_destroyed;
+
+        private:
+            struct List {
+                FreeBlock *head = nullptr;
+                size_t count = 0;
+            };
+
+            List m_lists[class_count];
+    };
+
+    thread_local bool ThreadCache::s_destroyed = false;
+    thread_local ThreadCache cache;
+}
+
+namespace BufferPool {
+
+void* allocate(size_t size){
+    if(size > max_block_size || ThreadCache::s_destroyed){
+        return ::operator new(size);
+    }
+    return cache.allocate(sizeClass(size));
+}
+
+void deallocate(void* block, size_t size){
+    if(size > max_block_size || ThreadCache::s_destroyed){
+        ::operator delete(block);
+        return;
+    }
+    cache.deallocate(block, sizeClass(size));
+}
+
+}
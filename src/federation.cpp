@@ -0,0 +1,151 @@
+#include "federation.hpp"
+#include "topic_trie.hpp"
+
+// Outbound link to one peer. Carries the node's subscriptions to the peer and the
+// matching publishes of the peer's clients back.
+class Federation::Link : public TcpObject {
+    public:
+        Link(Federation& federation, const tcp::endpoint& endpoint) :
+            m_federation(federation),
+            m_endpoint(endpoint),
+            m_reconnectTimer(federation.m_ioContext),
+            m_isConnected(false) {}
+
+        void connect(){
+            auto socket = std::make_shared<tcp::socket>(m_federation.m_ioContext);
+            socket->async_connect(m_endpoint, [this, socket](const boost::system::error_code &error) {
+                if(error){
+                    return reconnect();
+                }
+                socket->set_option(tcp::no_delay(true));
+                m_connection = TcpConnection::create(std::move(*socket), *this);
+                m_connection->read();
+                std::string peer = "PEER" + Constants::delimiter + m_federation.m_nodeName + Constants::delimiter + "2";
+                // Control frames, a congested queue must not drop them. Nothing sends them again,
+                // the peer would never forward the topics of a lost Subscribe.
+                m_connection->sendControl(peer.data(), peer.size());
+                // Binary frames may follow right away, the peer switches its reader after PEER
+                for(const auto &filter : m_federation.m_interest){
+                    subscribe(filter, true);
+                }
+            });
+        }
+
+        void subscribe(std::string_view filter, bool subscribe){
+            if(m_connection){
+                m_connection->sendControl(Protocol::encode(subscribe ? Protocol::Opcode::Subscribe
+                                                                     : Protocol::Opcode::Unsubscribe, filter));
+            }
+        }
+
+        void onFrame(int connId, std::string_view frame) override{
+            (void)connId;
+            if(m_connection->protocol() == Protocol::Version::Text){
+                if(frame == Protocol::connack){
+                    m_connection->setProtocol(Protocol::Version::Binary);
+                    m_isConnected = true;
+                    ++m_federation.m_connectedPeers;
+                    std::cout << "Connected to peer " << m_endpoint << std::endl;
+                }
+                return;
+            }
+            Protocol::Frame decoded;
+            if(!Protocol::decode(frame, decoded)){
+                return;
+            }
+            if(decoded.opcode == Protocol::Opcode::Message){
+                m_federation.deliver(decoded.topic, decoded.payload);
+            } else if(decoded.opcode == Protocol::Opcode::Ping){
+                m_connection->sendControl(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Binary));
+            }
+        }
+
+        void onClose(int connId) override{
+            (void)connId;
+            if(m_isConnected){
+                m_isConnected = false;
+                --m_federation.m_connectedPeers;
+                std::cout << "Lost peer " << m_endpoint << std::endl;
+            }
+            reconnect();
+        }
+
+        void onRead(int connId, std::string_view data) override { (void)connId; (void)data; }
+        void onStart(int connId) override { (void)connId; }
+        void handleCommand(std::string_view input, int connId) override { (void)input; (void)connId; }
+
+    private:
+        void reconnect(){
+            m_reconnectTimer.expires_after(reconnect_delay);
+            m_reconnectTimer.async_wait([this](const boost::system::error_code &error) {
+                if(!error){
+                    connect();
+                }
+            });
+        }
+
+        void handleConnect(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+        void handleDisconnect(int connId) override { (void)connId; }
+        void handlePublish(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+        void handleSubscribe(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+        void handleUnsubscribe(Tokenizer& args, int connId) override { (void)args; (void)connId; }
+        void handleStats(int connId) override { (void)connId; }
+
+        Federation& m_federation;
+        tcp::endpoint m_endpoint;
+        boost::asio::steady_timer m_reconnectTimer;
+        std::shared_ptr<TcpConnection> m_connection;
+        bool m_isConnected;
+};
+
+Federation::Federation(TcpServer& server, boost::asio::io_context& io_context, std::string nodeName) :
+    m_server(server),
+    m_ioContext(io_context),
+    m_nodeName(std::move(nodeName)),
+    m_connectedPeers(0) {
+    m_server.setRouter(this);
+}
+
+Federation::~Federation(){
+    m_server.setRouter(nullptr);
+}
+
+void Federation::addPeer(const tcp::endpoint& endpoint){
+    m_links.push_back(std::make_unique<Link>(*this, endpoint));
+}
+
+void Federation::start(){
+    for(auto &link : m_links){
+        link->connect();
+    }
+}
+
+void Federation::onTopicInterest(std::string_view topic, bool interested){
+    if(interested){
+        m_interest.emplace(topic);
+    } else if(auto filter = m_interest.find(topic); filter != m_interest.end()){
+        m_interest.erase(filter);
+    }
+    for(auto &link : m_links){
+        link->subscribe(topic, interested);
+    }
+}
+
+std::uint64_t Federation::receivedMessages() const{
+    return m_receivedMessages.value();
+}
+
+size_t Federation::connectedPeers() const{
+    return m_connectedPeers;
+}
+
+void Federation::deliver(std::string_view topic, std::string_view payload){
+    if(!TopicTrie::isValidTopic(topic)){
+        return;
+    }
+    m_receivedMessages.add();
+    PublishFrames frames(topic, payload);
+    frames.setTimestamp(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+    m_server.deliver(frames);
+}
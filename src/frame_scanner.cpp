@@ -0,0 +1,77 @@
+#include "frame_scanner.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_SCANNER_X86 1
+#endif
+
+const char* findDelimiterScalar(const char* begin, const char* end, char delimiter){
+    while(begin != end && *begin != delimiter){
+        ++begin;
+    }
+    return begin;
+}
+
+#ifdef FRAME_SCANNER_X86
+
+namespace {
+
+#if defined(__SSE2__)
+const char* findDelimiterSse2(const char* begin, const char* end, char delimiter){
+    const __m128i needle = _mm_set1_epi8(delimiter);
+    while(end - begin >= 16){
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if(mask != 0){
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 16;
+    }
+    return findDelimiterScalar(begin, end, delimiter);
+}
+#else
+const char* findDelimiterSse2(const char* begin, const char* end, char delimiter){
+    return findDelimiterScalar(begin, end, delimiter);
+}
+#endif
+
+__attribute__((target("avx2")))
+const char* findDelimiterAvx2(const char* begin, const char* end, char delimiter){
+    const __m256i needle = _mm256_set1_epi8(delimiter);
+    while(end - begin >= 32){
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+        unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle)));
+        if(mask != 0){
+            return begin + __builtin_ctz(mask);
+        }
+        begin += 32;
+    }
+    return findDelimiterSse2(begin, end, delimiter);
+}
+
+using ScanFunction = const char* (*)(const char*, const char*, char);
+
+ScanFunction selectScanFunction(){
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        return findDelimiterAvx2;
+    }
+    return findDelimiterSse2;
+}
+
+// Resolved once at load time so the per-frame call is a single indirect call
+const ScanFunction scanFunction = selectScanFunction();
+
+}
+
+const char* findDelimiter(const char* begin, const char* end, char delimiter){
+    return scanFunction(begin, end, delimiter);
+}
+
+#else
+
+const char* findDelimiter(const char* begin, const char* end, char delimiter){
+    return findDelimiterScalar(begin, end, delimiter);
+}
+
+#endif
@@ -0,0 +1,95 @@
+#include "latency_histogram.hpp"
+#include <algorithm>
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram(){
+    reset();
+}
+
+size_t LatencyHistogram::bucketIndex(std::uint64_t value){
+    if(value < 2 * sub_bucket_count){
+        return static_cast<size_t>(value);
+    }
+    unsigned shift = 63 - static_cast<unsigned>(__builtin_clzll(value)) - sub_bucket_bits;
+    std::uint64_t subBucket = (value >> shift) - sub_bucket_count;
+    return static_cast<size_t>(2 * sub_bucket_count + (shift - 1) * sub_bucket_count + subBucket);
+}
+
+std::uint64_t LatencyHistogram::bucketValue(size_t index){
+    if(index < 2 * sub_bucket_count){
+        return index;
+    }
+    size_t offset = index - 2 * sub_bucket_count;
+    unsigned shift = static_cast<unsigned>(offset / sub_bucket_count) + 1;
+    std::uint64_t subBucket = offset % sub_bucket_count + sub_bucket_count;
+    return ((subBucket + 1) << shift) - 1;
+}
+
+namespace {
+    void add(std::atomic<std::uint64_t>& cell, std::uint64_t value){
+        cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::record(std::uint64_t value){
+    add(m_buckets[bucketIndex(value)], 1);
+    add(m_count, 1);
+    add(m_sum, value);
+    if(value > m_max.load(std::memory_order_relaxed)){
+        m_max.store(value, std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other){
+    for(size_t i = 0; i < bucket_count; ++i){
+        std::uint64_t count = other.m_buckets[i].load(std::memory_order_relaxed);
+        if(count != 0){
+            add(m_buckets[i], count);
+        }
+    }
+    add(m_count, other.count());
+    add(m_sum, other.m_sum.load(std::memory_order_relaxed));
+    if(other.max() > max()){
+        m_max.store(other.max(), std::memory_order_relaxed);
+    }
+}
+
+void LatencyHistogram::reset(){
+    for(auto &bucket : m_buckets){
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    m_count.store(0, std::memory_order_relaxed);
+    m_sum.store(0, std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+}
+
+std::uint64_t LatencyHistogram::count() const{
+    return m_count.load(std::memory_order_relaxed);
+}
+
+std::uint64_t LatencyHistogram::max() const{
+    return m_max.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const{
+    std::uint64_t count = this->count();
+    return count == 0 ? 0.0 : static_cast<double>(m_sum.load(std::memory_order_relaxed)) / count;
+}
+
+std::uint64_t LatencyHistogram::percentile(double percentile) const{
+    std::uint64_t count = this->count();
+    if(count == 0){
+        return 0;
+    }
+    auto rank = static_cast<std::uint64_t>(std::ceil(std::clamp(percentile, 0.0, 100.0) / 100.0 * count));
+    rank = std::max<std::uint64_t>(rank, 1);
+    std::uint64_t seen = 0;
+    for(size_t i = 0; i < bucket_count; ++i){
+        seen += m_buckets[i].load(std::memory_order_relaxed);
+        if(seen >= rank){
+            // Never report more than the exact maximum
+            return std::min(bucketValue(i), max());
+        }
+    }
+    return max();
+}
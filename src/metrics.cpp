@@ -0,0 +1,166 @@
+#include "metrics.hpp"
+#include <sstream>
+
+namespace {
+    // Label values are quoted, so backslash, quote and newline have to be escaped
+    std::string escapeLabel(const std::string& value){
+        std::string escaped;
+        escaped.reserve(value.size());
+        for(char c : value){
+            if(c == '\\' || c == '"'){
+                escaped += '\\';
+                escaped += c;
+            }else if(c == '\n'){
+                escaped += "\\n";
+            }else{
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    void family(std::ostream& out, const char* name, const char* type, const char* help){
+        out << "# HELP " << name << ' ' << help << '\n';
+        out << "# TYPE " << name << ' ' << type << '\n';
+    }
+
+    template <typename Field>
+    void connectionFamily(std::ostream& out, const std::vector<MetricsSnapshot>& shards, const char* name,
+                          const char* type, const char* help, Field field){
+        family(out, name, type, help);
+        for(size_t shard = 0; shard < shards.size(); ++shard){
+            for(const auto &connection : shards[shard].connections){
+                out << name << "{shard=\"" << shard << "\",conn=\"" << connection.id << "\",name=\""
+                    << escapeLabel(connection.name) << "\"} " << field(connection) << '\n';
+            }
+        }
+    }
+
+    template <typename Field>
+    void topicFamily(std::ostream& out, const std::vector<MetricsSnapshot>& shards, const char* name,
+                     const char* type, const char* help, Field field){
+        family(out, name, type, help);
+        for(size_t shard = 0; shard < shards.size(); ++shard){
+            for(const auto &topic : shards[shard].topics){
+                out << name << "{shard=\"" << shard << "\",topic=\"" << escapeLabel(topic.name) << "\"} "
+                    << field(topic) << '\n';
+            }
+        }
+    }
+}
+
+namespace Metrics {
+
+std::string formatPrometheus(const std::vector<MetricsSnapshot>& shards){
+    std::ostringstream out;
+    using Connection = MetricsSnapshot::Connection;
+    using Topic = MetricsSnapshot::Topic;
+
+    family(out, "tcp_server_connections", "gauge", "Open client connections.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        out << "tcp_server_connections{shard=\"" << shard << "\"} " << shards[shard].connections.size() << '\n';
+    }
+
+    connectionFamily(out, shards, "tcp_server_connection_messages_in_total", "counter",
+                     "Frames received from the connection.", [](const Connection& c) { return c.messagesIn; });
+    connectionFamily(out, shards, "tcp_server_connection_bytes_in_total", "counter",
+                     "Frame bytes received from the connection.", [](const Connection& c) { return c.bytesIn; });
+    connectionFamily(out, shards, "tcp_server_connection_messages_out_total", "counter",
+                     "Frames written to the connection.", [](const Connection& c) { return c.messagesOut; });
+    connectionFamily(out, shards, "tcp_server_connection_bytes_out_total", "counter",
+                     "Bytes written to the connection.", [](const Connection& c) { return c.bytesOut; });
+    connectionFamily(out, shards, "tcp_server_connection_dropped_total", "counter",
+                     "Frames dropped, evicted or conflated by the slow consumer policy.", [](const Connection& c) { return c.dropped; });
+    connectionFamily(out, shards, "tcp_server_connection_queued_bytes", "gauge",
+                     "Bytes waiting in the outbound queue.", [](const Connection& c) { return c.queuedBytes; });
+
+    family(out, "tcp_server_slow_consumer_disconnects_total", "counter",
+           "Connections closed because their outbound queue reached the high water mark.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        out << "tcp_server_slow_consumer_disconnects_total{shard=\"" << shard << "\"} "
+            << shards[shard].slowConsumerDisconnects << '\n';
+    }
+
+    family(out, "tcp_server_connections_rejected_total", "counter",
+           "Connections closed right after accepting them because of the connection limit or running out of descriptors.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        out << "tcp_server_connections_rejected_total{shard=\"" << shard << "\"} "
+            << shards[shard].rejectedConnections << '\n';
+    }
+
+    family(out, "tcp_server_connections_timed_out_total", "counter",
+           "Connections closed because they sent nothing for the read timeout or only heartbeats for the idle timeout.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        out << "tcp_server_connections_timed_out_total{shard=\"" << shard << "\"} "
+            << shards[shard].timedOutConnections << '\n';
+    }
+
+    family(out, "tcp_server_qos_sessions_discarded_total", "counter",
+           "QoS 1 states of lost connections discarded because the server kept the most it retains.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        out << "tcp_server_qos_sessions_discarded_total{shard=\"" << shard << "\"} "
+            << shards[shard].discardedQosSessions << '\n';
+    }
+
+    family(out, "tcp_server_routed_publishes_dropped_total", "counter",
+           "Publishes not routed to another shard because too many were waiting for it.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        out << "tcp_server_routed_publishes_dropped_total{shard=\"" << shard << "\"} "
+            << shards[shard].droppedRoutedPublishes << '\n';
+    }
+
+    topicFamily(out, shards, "tcp_server_topic_subscribers", "gauge",
+                "Local subscribers of the topic or filter.", [](const Topic& t) { return t.subscribers; });
+    topicFamily(out, shards, "tcp_server_topic_published_total", "counter",
+                "Publishes received for the topic.", [](const Topic& t) { return t.published; });
+    topicFamily(out, shards, "tcp_server_topic_published_bytes_total", "counter",
+                "Payload bytes published to the topic.", [](const Topic& t) { return t.publishedBytes; });
+    topicFamily(out, shards, "tcp_server_topic_delivered_total", "counter",
+                "Messages of the topic queued to subscribers.", [](const Topic& t) { return t.delivered; });
+    topicFamily(out, shards, "tcp_server_topic_dropped_total", "counter",
+                "Messages of the topic dropped for congested subscribers.", [](const Topic& t) { return t.dropped; });
+
+    family(out, "tcp_server_publish_write_latency_seconds", "summary",
+           "Time from receiving a publish to its frame being written to a subscriber.");
+    for(size_t shard = 0; shard < shards.size(); ++shard){
+        const auto &latency = *shards[shard].writeLatency;
+        for(double quantile : {0.5, 0.9, 0.99, 0.999}){
+            out << "tcp_server_publish_write_latency_seconds{shard=\"" << shard << "\",quantile=\"" << quantile
+                << "\"} " << latency.percentile(quantile * 100) / 1e9 << '\n';
+        }
+        out << "tcp_server_publish_write_latency_seconds_sum{shard=\"" << shard << "\"} "
+            << latency.mean() * latency.count() / 1e9 << '\n';
+        out << "tcp_server_publish_write_latency_seconds_count{shard=\"" << shard << "\"} "
+            << latency.count() << '\n';
+    }
+    return out.str();
+}
+
+std::string formatSummary(const MetricsSnapshot& snapshot){
+    std::uint64_t published = 0;
+    std::uint64_t delivered = 0;
+    std::uint64_t dropped = 0;
+    std::uint64_t queuedBytes = 0;
+    for(const auto &topic : snapshot.topics){
+        published += topic.published;
+        delivered += topic.delivered;
+        dropped += topic.dropped;
+    }
+    for(const auto &connection : snapshot.connections){
+        queuedBytes += connection.queuedBytes;
+    }
+    const auto &latency = *snapshot.writeLatency;
+    std::ostringstream out;
+    out << "connections=" << snapshot.connections.size()
+        << ";topics=" << snapshot.topics.size()
+        << ";published=" << published
+        << ";delivered=" << delivered
+        << ";dropped=" << dropped
+        << ";queued_bytes=" << queuedBytes
+        << ";latency_p50_us=" << latency.percentile(50) / 1000
+        << ";latency_p99_us=" << latency.percentile(99) / 1000
+        << ";latency_max_us=" << latency.max() / 1000;
+    return out.str();
+}
+
+}
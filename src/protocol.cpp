@@ -0,0 +1,308 @@
+#include "protocol.hpp"
+#include "frame_scanner.hpp"
+#include "tcp_connection.hpp"
+
+namespace Protocol {
+
+namespace {
+    bool hasTopicId(Opcode opcode){
+        return opcode == Opcode::Registered || opcode == Opcode::PublishById || opcode == Opcode::MessageById;
+    }
+
+    bool hasTopic(Opcode opcode){
+        return opcode != Opcode::Disconnect && opcode != Opcode::Stats && opcode != Opcode::PublishById &&
+               opcode != Opcode::MessageById && opcode != Opcode::PublishBatch && opcode != Opcode::Ping &&
+               opcode != Opcode::Pong && opcode != Opcode::Ack;
+    }
+
+    bool hasPayload(Opcode opcode){
+        return opcode == Opcode::Publish || opcode == Opcode::Message || opcode == Opcode::PublishById ||
+               opcode == Opcode::MessageById || opcode == Opcode::PublishBatch;
+    }
+
+    // Works on SharedBuffer and std::string
+    template <typename Buffer>
+    void appendVarint(Buffer& buffer, std::uint64_t value){
+        char bytes[10];
+        size_t size = 0;
+        while(value >= 0x80){
+            bytes[size++] = static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        bytes[size++] = static_cast<char>(value);
+        buffer.append(std::string_view(bytes, size));
+    }
+
+    bool readVarint(std::string_view& input, std::uint64_t& value){
+        value = 0;
+        for(unsigned shift = 0; shift < 64 && !input.empty(); shift += 7){
+            auto byte = static_cast<unsigned char>(input.front());
+            input.remove_prefix(1);
+            value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+            if((byte & 0x80) == 0){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool readField(std::string_view& input, std::string_view& field){
+        std::uint64_t length = 0;
+        if(!readVarint(input, length) || length > input.size()){
+            return false;
+        }
+        field = input.substr(0, length);
+        input.remove_prefix(length);
+        return true;
+    }
+}
+
+size_t varintSize(std::uint64_t value){
+    size_t size = 1;
+    while(value >= 0x80){
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+size_t frameSize(Opcode opcode, std::string_view topic, std::string_view payload, std::uint32_t topicId){
+    size_t size = header_size;
+    if(hasTopicId(opcode)){
+        size += varintSize(topicId);
+    }
+    if(hasTopic(opcode)){
+        size += varintSize(topic.size()) + topic.size();
+    }
+    if(hasPayload(opcode)){
+        size += varintSize(payload.size()) + payload.size();
+    }
+    return size;
+}
+
+void encodeInto(SharedBuffer& buffer, Opcode opcode, std::string_view topic, std::string_view payload,
+                std::uint32_t topicId){
+    std::uint32_t length = static_cast<std::uint32_t>(frameSize(opcode, topic, payload, topicId) - length_size);
+    for(size_t i = 0; i < length_size; ++i){
+        buffer.append(static_cast<char>((length >> (8 * i)) & 0xff));
+    }
+    buffer.append(static_cast<char>(opcode));
+    if(hasTopicId(opcode)){
+        appendVarint(buffer, topicId);
+    }
+    if(hasTopic(opcode)){
+        appendVarint(buffer, topic.size());
+        buffer.append(topic);
+    }
+    if(hasPayload(opcode)){
+        appendVarint(buffer, payload.size());
+        buffer.append(payload);
+    }
+}
+
+boost::intrusive_ptr<SharedBuffer> encode(Opcode opcode, std::string_view topic, std::string_view payload,
+                                          std::uint32_t topicId){
+    auto buffer = SharedBuffer::create(frameSize(opcode, topic, payload, topicId));
+    encodeInto(*buffer, opcode, topic, payload, topicId);
+    return buffer;
+}
+
+bool decode(std::string_view frame, Frame& out){
+    if(frame.empty()){
+        return false;
+    }
+    out.opcode = static_cast<Opcode>(frame.front());
+    out.topicId = 0;
+    out.topic = {};
+    out.payload = {};
+    out.sequence = 0;
+    frame.remove_prefix(1);
+    std::uint64_t topicId = 0;
+    switch(out.opcode){
+        case Opcode::Disconnect:
+        case Opcode::Stats:
+        case Opcode::Ping:
+        case Opcode::Pong:
+            break;
+        case Opcode::Ack:
+            if(!readVarint(frame, out.sequence)){
+                return false;
+            }
+            break;
+        case Opcode::Subscribe:
+        case Opcode::Unsubscribe:
+        case Opcode::Register:
+            if(!readField(frame, out.topic)){
+                return false;
+            }
+            break;
+        case Opcode::Registered:
+            if(!readVarint(frame, topicId) || topicId > UINT32_MAX || !readField(frame, out.topic)){
+                return false;
+            }
+            break;
+        case Opcode::PublishById:
+        case Opcode::MessageById:
+            if(!readVarint(frame, topicId) || topicId > UINT32_MAX || !readField(frame, out.payload)){
+                return false;
+            }
+            break;
+        case Opcode::Publish:
+        case Opcode::Message:
+            if(!readField(frame, out.topic) || !readField(frame, out.payload)){
+                return false;
+            }
+            break;
+        case Opcode::PublishBatch: {
+            if(!readField(frame, out.payload)){
+                return false;
+            }
+            std::string_view entries = out.payload;
+            std::string_view topic;
+            std::string_view payload;
+            while(nextBatchEntry(entries, topic, payload)){}
+            if(!entries.empty()){
+                return false;
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+    out.topicId = static_cast<std::uint32_t>(topicId);
+    return frame.empty();
+}
+
+std::uint32_t readLength(const char* data){
+    std::uint32_t length = 0;
+    for(size_t i = 0; i < length_size; ++i){
+        length |= static_cast<std::uint32_t>(static_cast<unsigned char>(data[i])) << (8 * i);
+    }
+    return length;
+}
+
+size_t batchEntrySize(std::string_view topic, std::string_view payload){
+    return varintSize(topic.size()) + topic.size() + varintSize(payload.size()) + payload.size();
+}
+
+void appendBatchEntry(std::string& entries, std::string_view topic, std::string_view payload){
+    appendVarint(entries, topic.size());
+    entries.append(topic);
+    appendVarint(entries, payload.size());
+    entries.append(payload);
+}
+
+bool nextBatchEntry(std::string_view& entries, std::string_view& topic, std::string_view& payload){
+    // Malformed entries are left in place, decode() rejects a batch that does not end empty
+    std::string_view rest = entries;
+    if(rest.empty() || !readField(rest, topic) || !readField(rest, payload)){
+        return false;
+    }
+    entries = rest;
+    return true;
+}
+
+boost::intrusive_ptr<SharedBuffer> encodeHeartbeat(Opcode opcode, Version version){
+    if(version == Version::Binary){
+        return encode(opcode);
+    }
+    std::string_view text = opcode == Opcode::Ping ? ping : pong;
+    auto buffer = SharedBuffer::create(text.size() + 1);
+    buffer->append(text);
+    buffer->append(Constants::frame_delimiter);
+    return buffer;
+}
+
+bool isHeartbeat(std::string_view frame, Version version, Opcode opcode){
+    if(version == Version::Binary){
+        return frame.size() == 1 && static_cast<Opcode>(frame.front()) == opcode;
+    }
+    return frame == (opcode == Opcode::Ping ? ping : pong);
+}
+
+boost::intrusive_ptr<SharedBuffer> encodeAck(std::uint64_t sequence){
+    std::uint32_t length = static_cast<std::uint32_t>(1 + varintSize(sequence));
+    auto buffer = SharedBuffer::create(length_size + length);
+    for(size_t i = 0; i < length_size; ++i){
+        buffer->append(static_cast<char>((length >> (8 * i)) & 0xff));
+    }
+    buffer->append(static_cast<char>(Opcode::Ack));
+    appendVarint(*buffer, sequence);
+    return buffer;
+}
+
+boost::intrusive_ptr<SharedBuffer> encodeText(std::string_view topic, std::string_view payload){
+    auto buffer = SharedBuffer::create(topic.size() + Constants::delimiter.size() + payload.size() + 1);
+    buffer->append(topic);
+    buffer->append(Constants::delimiter);
+    buffer->append(payload);
+    buffer->append(Constants::frame_delimiter);
+    return buffer;
+}
+
+}
+
+PublishFrames::PublishFrames(std::string_view topic, std::string_view payload) :
+    m_topic(topic),
+    m_payload(payload),
+    m_timestamp(0),
+    m_textSafe(-1) {}
+
+PublishFrames::PublishFrames(const SharedBufferPtr& textFrame, size_t topicLength) :
+    m_topic(textFrame->data(), topicLength),
+    m_payload(textFrame->data() + topicLength + Constants::delimiter.size(),
+              textFrame->size() - topicLength - Constants::delimiter.size() - 1),
+    m_text(textFrame),
+    m_timestamp(textFrame->timestamp()),
+    m_textSafe(-1) {}
+
+void PublishFrames::setTimestamp(std::int64_t timestamp){
+    m_timestamp = timestamp;
+}
+
+std::string_view PublishFrames::topic() const{
+    return m_topic;
+}
+
+std::string_view PublishFrames::payload() const{
+    return m_payload;
+}
+
+const SharedBufferPtr& PublishFrames::text(){
+    if(!m_text){
+        auto text = Protocol::encodeText(m_topic, m_payload);
+        text->setTimestamp(m_timestamp);
+        m_text = std::move(text);
+    }
+    return m_text;
+}
+
+const SharedBufferPtr& PublishFrames::binary(){
+    if(!m_binary){
+        auto binary = Protocol::encode(Protocol::Opcode::Message, m_topic, m_payload);
+        binary->setTimestamp(m_timestamp);
+        m_binary = std::move(binary);
+    }
+    return m_binary;
+}
+
+const SharedBufferPtr& PublishFrames::binaryById(std::uint32_t topicId){
+    if(!m_binaryById){
+        auto binary = Protocol::encode(Protocol::Opcode::MessageById, {}, m_payload, topicId);
+        binary->setTimestamp(m_timestamp);
+        m_binaryById = std::move(binary);
+    }
+    return m_binaryById;
+}
+
+const SharedBufferPtr& PublishFrames::frame(Protocol::Version version){
+    return version == Protocol::Version::Binary ? binary() : text();
+}
+
+bool PublishFrames::isTextSafe(){
+    if(m_textSafe < 0){
+        const char *end = m_payload.data() + m_payload.size();
+        m_textSafe = findDelimiter(m_payload.data(), end, Constants::frame_delimiter) == end;
+    }
+    return m_textSafe == 1;
+}
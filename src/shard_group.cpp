@@ -0,0 +1,299 @@
+#include "shard_group.hpp"
+#include <future>
+
+class ShardGroup::Shard : public PublishRouter {
+    public:
+        Shard(ShardGroup& group, size_t index, int port, size_t shardCount) :
+            m_group(group),
+            m_index(index),
+            m_context(),
+            m_overflowTimer(m_context),
+            m_overflowScheduled(false),
+            m_server(port, m_context, true),
+            m_running(false),
+            m_drainScheduled(false),
+            m_overflow(shardCount) {
+            for(size_t source = 0; source < shardCount; ++source){
+                m_inbound.push_back(std::make_unique<boost::lockfree::spsc_queue<ShardMessage>>(queue_capacity));
+            }
+            m_server.setRouter(this);
+        }
+
+        void setSlowConsumerPolicy(SlowConsumerPolicy policy){
+            m_server.setSlowConsumerPolicy(policy);
+        }
+
+        void setConnectionLimits(const ConnectionLimits& limits){
+            m_server.setConnectionLimits(limits);
+        }
+
+        void setTimeouts(const ConnectionTimeouts& timeouts){
+            m_server.setTimeouts(timeouts);
+        }
+
+        void listenLocal(const std::string& path){
+            m_server.listenLocal(path);
+        }
+
+        void start(){
+            m_server.start();
+            m_running.store(true);
+            m_thread = std::thread([this]() {
+                m_context.run();
+                m_running.store(false);
+            });
+        }
+
+        void stop(){
+            m_context.stop();
+        }
+
+        void join(){
+            if(m_thread.joinable()){
+                m_thread.join();
+            }
+        }
+
+        int getClientCount(){
+            return query([this]() { return m_server.getClientCount(); });
+        }
+
+        MetricsSnapshot collectMetrics(){
+            return query([this]() {
+                MetricsSnapshot snapshot = m_server.collectMetrics();
+                snapshot.droppedRoutedPublishes = m_droppedPublishes.value();
+                return snapshot;
+            });
+        }
+
+        void onTopicInterest(std::string_view topic, bool interested) override{
+            auto buffer = SharedBuffer::create(topic.size());
+            buffer->append(topic);
+            ShardMessage message{interested ? ShardMessage::Kind::Interest : ShardMessage::Kind::Uninterest,
+                                 static_cast<std::uint32_t>(topic.size()), std::move(buffer)};
+            for(size_t destination = 0; destination < m_group.m_shards.size(); ++destination){
+                if(destination != m_index){
+                    push(destination, message);
+                }
+            }
+        }
+
+        void onPublish(std::string_view topic, const SharedBufferPtr& frame) override{
+            const auto &shards = m_remoteInterest.match(topic);
+            if(shards.empty()){
+                return;
+            }
+            ShardMessage message{ShardMessage::Kind::Publish, static_cast<std::uint32_t>(topic.size()), frame};
+            for(int destination : shards){
+                push(static_cast<size_t>(destination), message);
+            }
+        }
+
+    private:
+        // Runs read on the shard thread and waits for the result. A stopped context never runs
+        // the handler, once the thread has left run() the server is read from here instead.
+        template<class Read>
+        auto query(Read read) -> decltype(read()){
+            if(!m_running.load()){
+                return read();
+            }
+            auto result = std::make_shared<std::promise<decltype(read())>>();
+            auto future = result->get_future();
+            boost::asio::post(m_context, [result, read]() { result->set_value(read()); });
+            while(future.wait_for(std::chrono::milliseconds(10)) != std::future_status::ready){
+                if(!m_running.load()){
+                    return read();
+                }
+            }
+            return future.get();
+        }
+
+        // Called on this shard's thread only, so the queue from this shard to destination has one producer
+        void push(size_t destination, const ShardMessage& message){
+            auto &overflow = m_overflow[destination];
+            Shard &target = *m_group.m_shards[destination];
+            if(overflow.empty() && target.m_inbound[m_index]->push(message)){
+                target.notify();
+                return;
+            }
+            // The destination is behind, keep the message here in order and retry shortly
+            if(message.kind == ShardMessage::Kind::Publish && overflow.size() >= max_overflow){
+                if(m_droppedPublishes.value() == 0){
+                    std::cout << "Shard " << destination << " is not keeping up, dropping publishes routed to it" << std::endl;
+                }
+                m_droppedPublishes.add();
+                return;
+            }
+            overflow.push_back(message);
+            scheduleOverflowFlush();
+        }
+
+        void notify(){
+            if(!m_drainScheduled.exchange(true)){
+                boost::asio::post(m_context, [this]() { drain(); });
+            }
+        }
+
+        void drain(){
+            // Cleared before draining, so a producer pushing after this point schedules another drain
+            m_drainScheduled.store(false);
+            for(size_t source = 0; source < m_inbound.size(); ++source){
+                m_inbound[source]->consume_all([this, source](const ShardMessage& message) {
+                    handle(source, message);
+                });
+            }
+        }
+
+        void handle(size_t source, const ShardMessage& message){
+            switch(message.kind){
+                case ShardMessage::Kind::Publish: {
+                    PublishFrames frames(message.buffer, message.topicLength);
+                    m_server.deliver(frames);
+                    break;
+                }
+                case ShardMessage::Kind::Interest:
+                case ShardMessage::Kind::Uninterest: {
+                    if(message.kind == ShardMessage::Kind::Interest){
+                        m_remoteInterest.subscribe(static_cast<int>(source), message.topic());
+                    } else {
+                        m_remoteInterest.unsubscribe(static_cast<int>(source), message.topic());
+                    }
+                    break;
+                }
+            }
+        }
+
+        void scheduleOverflowFlush(){
+            if(m_overflowScheduled){
+                return;
+            }
+            m_overflowScheduled = true;
+            m_overflowTimer.expires_after(std::chrono::microseconds(100));
+            m_overflowTimer.async_wait([this](const auto &error) {
+                m_overflowScheduled = false;
+                if(!error){
+                    flushOverflow();
+                }
+            });
+        }
+
+        void flushOverflow(){
+            bool pending = false;
+            for(size_t destination = 0; destination < m_overflow.size(); ++destination){
+                auto &overflow = m_overflow[destination];
+                Shard &target = *m_group.m_shards[destination];
+                bool pushed = false;
+                while(!overflow.empty() && target.m_inbound[m_index]->push(overflow.front())){
+                    overflow.pop_front();
+                    pushed = true;
+                }
+                if(pushed){
+                    target.notify();
+                }
+                pending = pending || !overflow.empty();
+            }
+            if(pending){
+                scheduleOverflowFlush();
+            }
+        }
+
+        ShardGroup& m_group;
+        size_t m_index;
+        boost::asio::io_context m_context;
+        boost::asio::steady_timer m_overflowTimer;
+        bool m_overflowScheduled;
+        TcpServer m_server;
+        std::thread m_thread;
+        std::atomic<bool> m_running;
+
+        // Indexed by source shard, only that shard pushes into its queue
+        std::vector<std::unique_ptr<boost::lockfree::spsc_queue<ShardMessage>>> m_inbound;
+        std::atomic<bool> m_drainScheduled;
+        // Topic filters the other shards have subscribers for, keyed by shard index as the
+        // subscriber, so wildcard filters are matched the same way as for local clients
+        SubscriptionIndex m_remoteInterest;
+        // Indexed by destination shard, messages that did not fit into its queue yet
+        std::vector<std::deque<ShardMessage>> m_overflow;
+        // Publishes to other shards dropped at max_overflow
+        MetricCounter m_droppedPublishes;
+};
+
+ShardGroup::ShardGroup(int port, size_t shardCount){
+    if(shardCount == 0 || shardCount > max_shards){
+        throw std::invalid_argument("ShardGroup: shard count must be between 1 and " + std::to_string(max_shards));
+    }
+    for(size_t index = 0; index < shardCount; ++index){
+        m_shards.push_back(std::make_unique<Shard>(*this, index, port, shardCount));
+    }
+}
+
+ShardGroup::~ShardGroup(){
+    stop();
+    for(auto &shard : m_shards){
+        shard->join();
+    }
+}
+
+void ShardGroup::setSlowConsumerPolicy(SlowConsumerPolicy policy){
+    for(auto &shard : m_shards){
+        shard->setSlowConsumerPolicy(policy);
+    }
+}
+
+void ShardGroup::setConnectionLimits(const ConnectionLimits& limits){
+    ConnectionLimits shardLimits = limits;
+    if(limits.maxConnections != 0){
+        shardLimits.maxConnections = (limits.maxConnections + m_shards.size() - 1) / m_shards.size();
+    }
+    for(auto &shard : m_shards){
+        shard->setConnectionLimits(shardLimits);
+    }
+}
+
+void ShardGroup::setTimeouts(const ConnectionTimeouts& timeouts){
+    for(auto &shard : m_shards){
+        shard->setTimeouts(timeouts);
+    }
+}
+
+void ShardGroup::listenLocal(const std::string& path){
+    m_shards.front()->listenLocal(path);
+}
+
+void ShardGroup::start(){
+    for(auto &shard : m_shards){
+        shard->start();
+    }
+}
+
+void ShardGroup::wait(){
+    for(auto &shard : m_shards){
+        shard->join();
+    }
+}
+
+void ShardGroup::stop(){
+    for(auto &shard : m_shards){
+        shard->stop();
+    }
+}
+
+size_t ShardGroup::shardCount() const{
+    return m_shards.size();
+}
+
+int ShardGroup::getClientCount(){
+    int count = 0;
+    for(auto &shard : m_shards){
+        count += shard->getClientCount();
+    }
+    return count;
+}
+
+std::vector<MetricsSnapshot> ShardGroup::collectMetrics(){
+    std::vector<MetricsSnapshot> snapshots;
+    for(auto &shard : m_shards){
+        snapshots.push_back(shard->collectMetrics());
+    }
+    return snapshots;
+}
@@ -0,0 +1,59 @@
+#include "shared_buffer.hpp"
+#include "buffer_pool.hpp"
+#include <cassert>
+#include <cstring>
+#include <new>
+
+SharedBuffer::SharedBuffer(size_t capacity) : m_refCount{0}, m_size{0}, m_capacity{capacity}, m_timestamp{0} {}
+
+boost::intrusive_ptr<SharedBuffer> SharedBuffer::create(size_t capacity){
+    void *memory = BufferPool::allocate(sizeof(SharedBuffer) + capacity);
+    return boost::intrusive_ptr<SharedBuffer>(new (memory) SharedBuffer{capacity});
+}
+
+char* SharedBuffer::storage(){
+    return reinterpret_cast<char*>(this + 1);
+}
+
+void SharedBuffer::append(std::string_view data){
+    assert(m_size + data.size() <= m_capacity);
+    std::memcpy(storage() + m_size, data.data(), data.size());
+    m_size += data.size();
+}
+
+void SharedBuffer::append(char data){
+    assert(m_size < m_capacity);
+    storage()[m_size++] = data;
+}
+
+void SharedBuffer::setTimestamp(std::int64_t timestamp){
+    m_timestamp = timestamp;
+}
+
+std::int64_t SharedBuffer::timestamp() const{
+    return m_timestamp;
+}
+
+const char* SharedBuffer::data() const{
+    return reinterpret_cast<const char*>(this + 1);
+}
+
+size_t SharedBuffer::size() const{
+    return m_size;
+}
+
+size_t SharedBuffer::capacity() const{
+    return m_capacity;
+}
+
+void intrusive_ptr_add_ref(const SharedBuffer* buffer){
+    buffer->m_refCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(const SharedBuffer* buffer){
+    if(buffer->m_refCount.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        size_t size = sizeof(SharedBuffer) + buffer->m_capacity;
+        buffer->~SharedBuffer();
+        BufferPool::deallocate(const_cast<SharedBuffer*>(buffer), size);
+    }
+}
@@ -0,0 +1,229 @@
+#include "shm_ring.hpp"
+#include "protocol.hpp"
+#include <cstring>
+#include <thread>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    constexpr std::uint32_t ring_magic = 0x52534354;
+    constexpr size_t cache_line = 64;
+    // The size of the memory can never change again once the ring is passed on
+    constexpr int ring_seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+
+    long futex(std::atomic<std::uint32_t>* word, int operation, std::uint32_t value, const struct timespec* timeout){
+        // Shared futex, the word lives in memory mapped by two processes
+        return syscall(SYS_futex, reinterpret_cast<std::uint32_t*>(word), operation, value, timeout, nullptr, 0);
+    }
+}
+
+// Start of the mapping, the frames follow it. Producer and consumer fields are on
+// separate cache lines.
+struct ShmRing::Header {
+    std::uint32_t magic;
+    std::uint32_t capacity;
+    alignas(cache_line) std::atomic<std::uint64_t> head;
+    alignas(cache_line) std::atomic<std::uint64_t> tail;
+    // Futex word, bumped by the producer for every wake up
+    alignas(cache_line) std::atomic<std::uint32_t> wakeSequence;
+    std::atomic<std::uint32_t> consumerWaiting;
+    std::atomic<std::uint32_t> closed;
+};
+
+static_assert(std::atomic<std::uint64_t>::is_always_lock_free && std::atomic<std::uint32_t>::is_always_lock_free,
+              "Ring positions are shared between processes");
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "Futex words are 32 bit");
+
+std::unique_ptr<ShmRing> ShmRing::create(size_t capacity){
+    if(capacity < cache_line || (capacity & (capacity - 1)) != 0 || capacity > UINT32_MAX){
+        return nullptr;
+    }
+    int fd = ::memfd_create("tcp-client-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0){
+        return nullptr;
+    }
+    size_t mappedSize = sizeof(Header) + capacity;
+    void *memory = MAP_FAILED;
+    if(::ftruncate(fd, static_cast<off_t>(mappedSize)) == 0 && ::fcntl(fd, F_ADD_SEALS, ring_seals) == 0){
+        memory = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(memory == MAP_FAILED){
+        ::close(fd);
+        return nullptr;
+    }
+    // ftruncate zeroed the memory, which is a valid state for every atomic
+    auto header = static_cast<Header*>(memory);
+    header->capacity = static_cast<std::uint32_t>(capacity);
+    header->magic = ring_magic;
+    return std::unique_ptr<ShmRing>(new ShmRing(fd, header, mappedSize, capacity));
+}
+
+std::unique_ptr<ShmRing> ShmRing::attach(int descriptor){
+    // Checked before the size is read, once sealed the size stays what fstat reports
+    int seals = ::fcntl(descriptor, F_GET_SEALS);
+    struct stat status;
+    void *memory = MAP_FAILED;
+    size_t mappedSize = 0;
+    if(seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_GROW)) == (F_SEAL_SHRINK | F_SEAL_GROW) &&
+       ::fstat(descriptor, &status) == 0 && static_cast<size_t>(status.st_size) > sizeof(Header)){
+        mappedSize = static_cast<size_t>(status.st_size);
+        memory = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+    }
+    ::close(descriptor);
+    if(memory == MAP_FAILED){
+        return nullptr;
+    }
+    auto header = static_cast<Header*>(memory);
+    // Read once, the consumer can still change it. Only the checked copy is used from here on,
+    // otherwise a capacity changed after the check would let write() go past the mapping.
+    size_t capacity = *static_cast<volatile std::uint32_t*>(&header->capacity);
+    if(header->magic != ring_magic || capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+       sizeof(Header) + capacity != mappedSize){
+        ::munmap(memory, mappedSize);
+        return nullptr;
+    }
+    return std::unique_ptr<ShmRing>(new ShmRing(-1, header, mappedSize, capacity));
+}
+
+ShmRing::ShmRing(int descriptor, Header* header, size_t mappedSize, size_t capacity) :
+    m_descriptor(descriptor),
+    m_header(header),
+    m_data(reinterpret_cast<char*>(header) + sizeof(Header)),
+    m_mappedSize(mappedSize),
+    m_mask(capacity - 1),
+    m_position(0) {}
+
+ShmRing::~ShmRing(){
+    close();
+    if(m_descriptor >= 0){
+        ::close(m_descriptor);
+    }
+    ::munmap(m_header, m_mappedSize);
+}
+
+int ShmRing::descriptor() const{
+    return m_descriptor;
+}
+
+bool ShmRing::sendDescriptor(int socket, std::string_view data) const{
+    struct iovec buffer{const_cast<char*>(data.data()), data.size()};
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    struct msghdr message{};
+    message.msg_iov = &buffer;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(header), &m_descriptor, sizeof(int));
+    return ::sendmsg(socket, &message, MSG_NOSIGNAL) == static_cast<ssize_t>(data.size());
+}
+
+size_t ShmRing::capacity() const{
+    return m_mask + 1;
+}
+
+bool ShmRing::write(const char* data, size_t size){
+    // The other process can write the shared header, so only the own position is trusted
+    // and a bogus tail can at worst make the ring look full
+    std::uint64_t head = m_position;
+    std::uint64_t tail = m_header->tail.load(std::memory_order_acquire);
+    size_t offset = head & m_mask;
+    size_t contiguous = capacity() - offset;
+    size_t skip = contiguous < size ? contiguous : 0;
+    if(size > capacity() || tail > head || head + skip + size - tail > capacity()){
+        return false;
+    }
+    if(skip >= Protocol::length_size){
+        std::memset(m_data + offset, 0, Protocol::length_size);
+    }
+    head += skip;
+    std::memcpy(m_data + (head & m_mask), data, size);
+    m_position = head + size;
+    m_header->head.store(m_position, std::memory_order_release);
+    return true;
+}
+
+void ShmRing::notify(){
+    // Pairs with the fence in wait(), either the consumer sees the new head before it
+    // sleeps or the producer sees it waiting
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(m_header->consumerWaiting.load(std::memory_order_relaxed) != 0){
+        m_header->wakeSequence.fetch_add(1, std::memory_order_release);
+        futex(&m_header->wakeSequence, FUTEX_WAKE, 1, nullptr);
+    }
+}
+
+void ShmRing::close(){
+    if(m_header->closed.exchange(1) == 0){
+        m_header->wakeSequence.fetch_add(1, std::memory_order_release);
+        futex(&m_header->wakeSequence, FUTEX_WAKE, 1, nullptr);
+    }
+}
+
+bool ShmRing::isClosed() const{
+    return m_header->closed.load(std::memory_order_acquire) != 0;
+}
+
+size_t ShmRing::read(const std::function<void(std::string_view)>& onFrame){
+    std::uint64_t tail = m_position;
+    std::uint64_t head = m_header->head.load(std::memory_order_acquire);
+    if(head - tail > capacity()){
+        close();
+        return 0;
+    }
+    size_t frames = 0;
+    while(tail < head){
+        size_t offset = tail & m_mask;
+        size_t contiguous = capacity() - offset;
+        std::uint32_t length = contiguous < Protocol::length_size ? 0 : Protocol::readLength(m_data + offset);
+        if(length == 0){
+            tail += contiguous;
+            continue;
+        }
+        if(Protocol::length_size + length > contiguous){
+            // Frames never wrap, the ring is corrupt
+            close();
+            break;
+        }
+        onFrame(std::string_view(m_data + offset + Protocol::length_size, length));
+        tail += Protocol::length_size + length;
+        ++frames;
+    }
+    // Frees the space only after the frames were handled, they are read in place
+    m_position = tail;
+    m_header->tail.store(tail, std::memory_order_release);
+    return frames;
+}
+
+bool ShmRing::wait(std::chrono::milliseconds timeout, unsigned spinCount){
+    auto available = [this]() {
+        return m_header->head.load(std::memory_order_acquire) != m_position;
+    };
+    for(unsigned i = 0; i < spinCount; ++i){
+        if(available()){
+            return true;
+        }
+        // Lets the producer run if it shares the CPU
+        std::this_thread::yield();
+    }
+    std::uint32_t sequence = m_header->wakeSequence.load(std::memory_order_acquire);
+    m_header->consumerWaiting.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(!available() && !isClosed()){
+        auto seconds = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+        struct timespec relative{static_cast<time_t>(seconds.count()),
+                                 static_cast<long>(std::chrono::nanoseconds(timeout - seconds).count())};
+        // Returns right away if a wake up happened since the sequence was read
+        futex(&m_header->wakeSequence, FUTEX_WAIT, sequence, &relative);
+    }
+    m_header->consumerWaiting.store(0, std::memory_order_relaxed);
+    return available();
+}
@@ -0,0 +1,271 @@
+#include "subscription_index.hpp"
+#include "topic_trie.hpp"
+#include <algorithm>
+
+namespace {
+    const std::vector<int> noSubscribers{};
+}
+
+TopicId TopicRegistry::intern(std::string_view topic){
+    auto it = m_ids.find(topic);
+    if(it != m_ids.end()){
+        return it->second;
+    }
+    if(!m_released.empty()){
+        TopicId topicId = m_released.back();
+        m_released.pop_back();
+        m_names[topicId] = topic;
+        m_ids.emplace(m_names[topicId], topicId);
+        return topicId;
+    }
+    TopicId topicId = static_cast<TopicId>(m_names.size());
+    m_names.emplace_back(topic);
+    m_ids.emplace(m_names.back(), topicId);
+    return topicId;
+}
+
+void TopicRegistry::release(TopicId topicId){
+    m_ids.erase(m_names[topicId]);
+    m_names[topicId].clear();
+    m_released.push_back(topicId);
+}
+
+TopicId TopicRegistry::find(std::string_view topic) const{
+    auto it = m_ids.find(topic);
+    if(it == m_ids.end()){
+        return invalid_topic;
+    }
+    return it->second;
+}
+
+const std::string& TopicRegistry::name(TopicId topicId) const{
+    return m_names[topicId];
+}
+
+size_t TopicRegistry::size() const{
+    return m_names.size();
+}
+
+size_t TopicRegistry::count() const{
+    return m_ids.size();
+}
+
+SubscriptionIndex::SubscriptionIndex() :
+    m_wildcards(std::make_unique<TopicTrie>()),
+    m_wildcardCount(0),
+    m_resolvedCount(0),
+    m_generation(1) {}
+
+SubscriptionIndex::~SubscriptionIndex() = default;
+
+TopicId SubscriptionIndex::find(std::string_view topic) const{
+    return m_topics.find(topic);
+}
+
+TopicId SubscriptionIndex::intern(std::string_view topic){
+    TopicId topicId = m_topics.intern(topic);
+    hold(topicId);
+    return topicId;
+}
+
+void SubscriptionIndex::hold(TopicId topicId){
+    if(topicId >= m_holds.size()){
+        m_holds.resize(topicId + 1);
+    }
+    ++m_holds[topicId];
+}
+
+bool SubscriptionIndex::release(TopicId topicId){
+    --m_holds[topicId];
+    return releaseUnused(topicId);
+}
+
+bool SubscriptionIndex::releaseUnused(TopicId topicId){
+    if(!subscribers(topicId).empty() || (topicId < m_holds.size() && m_holds[topicId] != 0)){
+        return false;
+    }
+    if(topicId < m_resolved.size()){
+        m_resolved[topicId] = Resolved{};
+    }
+    m_topics.release(topicId);
+    return true;
+}
+
+const std::string& SubscriptionIndex::topicName(TopicId topicId) const{
+    return m_topics.name(topicId);
+}
+
+bool SubscriptionIndex::subscribe(int connId, std::string_view topic){
+    TopicId topicId = m_topics.intern(topic);
+    if(topicId >= m_subscribers.size()){
+        m_subscribers.resize(topicId + 1);
+    }
+    auto &topics = m_clientTopics[connId];
+    if(std::find(topics.begin(), topics.end(), topicId) != topics.end()){
+        return false;
+    }
+    topics.push_back(topicId);
+    m_subscribers[topicId].push_back(connId);
+    if(m_subscribers[topicId].size() == 1 && TopicTrie::isWildcard(topic)){
+        m_wildcards->insert(topic, topicId);
+        ++m_wildcardCount;
+    }
+    subscriptionsChanged(topicId);
+    return true;
+}
+
+bool SubscriptionIndex::unsubscribe(int connId, std::string_view topic){
+    TopicId topicId = find(topic);
+    auto clientIt = m_clientTopics.find(connId);
+    if(topicId == invalid_topic || clientIt == m_clientTopics.end()){
+        return false;
+    }
+    auto &topics = clientIt->second;
+    auto it = std::find(topics.begin(), topics.end(), topicId);
+    if(it == topics.end()){
+        return false;
+    }
+    topics.erase(it);
+    if(topics.empty()){
+        m_clientTopics.erase(clientIt);
+    }
+    eraseSubscriber(topicId, connId);
+    subscriptionsChanged(topicId);
+    releaseUnused(topicId);
+    return true;
+}
+
+std::vector<std::string> SubscriptionIndex::removeClient(int connId){
+    std::vector<std::string> emptiedTopics;
+    auto clientIt = m_clientTopics.find(connId);
+    if(clientIt == m_clientTopics.end()){
+        return emptiedTopics;
+    }
+    for(TopicId topicId : clientIt->second){
+        eraseSubscriber(topicId, connId);
+        subscriptionsChanged(topicId);
+        if(m_subscribers[topicId].empty()){
+            emptiedTopics.push_back(m_topics.name(topicId));
+            releaseUnused(topicId);
+        }
+    }
+    m_clientTopics.erase(clientIt);
+    return emptiedTopics;
+}
+
+void SubscriptionIndex::eraseSubscriber(TopicId topicId, int connId){
+    // Subscriber order carries no meaning, so swap with the last entry instead of shifting
+    auto &subscribers = m_subscribers[topicId];
+    auto it = std::find(subscribers.begin(), subscribers.end(), connId);
+    if(it != subscribers.end()){
+        *it = subscribers.back();
+        subscribers.pop_back();
+    }
+    if(subscribers.empty()){
+        const std::string &name = m_topics.name(topicId);
+        if(TopicTrie::isWildcard(name)){
+            m_wildcards->erase(name, topicId);
+            --m_wildcardCount;
+        }
+    }
+}
+
+void SubscriptionIndex::subscriptionsChanged(TopicId topicId){
+    if(TopicTrie::isWildcard(m_topics.name(topicId))){
+        // Any cached topic may match the filter
+        ++m_generation;
+    }else if(topicId < m_resolved.size()){
+        m_resolved[topicId].generation = 0;
+    }
+}
+
+const std::vector<int>& SubscriptionIndex::subscribers(TopicId topicId) const{
+    if(topicId >= m_subscribers.size()){
+        return noSubscribers;
+    }
+    return m_subscribers[topicId];
+}
+
+const std::vector<int>& SubscriptionIndex::subscribers(std::string_view topic) const{
+    return subscribers(find(topic));
+}
+
+const std::vector<int>& SubscriptionIndex::match(std::string_view topic){
+    TopicId topicId = find(topic);
+    if(topicId != invalid_topic || m_wildcardCount == 0){
+        return match(topicId);
+    }
+    auto it = m_resolvedByName.find(topic);
+    if(it == m_resolvedByName.end()){
+        if(m_resolvedByName.size() >= max_resolved_topics){
+            m_resolvedByName.clear();
+            m_resolvedNames.clear();
+        }
+        m_resolvedNames.emplace_back(topic);
+        it = m_resolvedByName.emplace(m_resolvedNames.back(), Resolved{}).first;
+    }
+    auto &resolved = it->second;
+    if(resolved.generation != m_generation){
+        resolved.subscribers.clear();
+        matchWildcards(topic, resolved.subscribers);
+        resolved.generation = m_generation;
+    }
+    return resolved.subscribers;
+}
+
+const std::vector<int>& SubscriptionIndex::match(TopicId topicId){
+    if(m_wildcardCount == 0 || topicId == invalid_topic){
+        return subscribers(topicId);
+    }
+    if(topicId < m_resolved.size() && m_resolved[topicId].generation == m_generation){
+        return m_resolved[topicId].subscribers;
+    }
+    if(m_resolvedCount >= max_resolved_topics){
+        // Dropped as a whole, most entries are stale by then or of topics published once
+        std::vector<Resolved>().swap(m_resolved);
+        m_resolvedCount = 0;
+    }
+    if(topicId >= m_resolved.size()){
+        m_resolved.resize(topicId + 1);
+    }
+    auto &resolved = m_resolved[topicId];
+    ++m_resolvedCount;
+    resolved.subscribers = subscribers(topicId);
+    matchWildcards(m_topics.name(topicId), resolved.subscribers);
+    resolved.generation = m_generation;
+    return resolved.subscribers;
+}
+
+void SubscriptionIndex::matchWildcards(std::string_view topic, std::vector<int>& subscribers){
+    m_matchedFilters.clear();
+    m_wildcards->match(topic, m_matchedFilters);
+    for(TopicId filterId : m_matchedFilters){
+        const auto &filterSubscribers = m_subscribers[filterId];
+        subscribers.insert(subscribers.end(), filterSubscribers.begin(), filterSubscribers.end());
+    }
+    if(!m_matchedFilters.empty()){
+        // A client subscribed to overlapping filters still gets a message once
+        std::sort(subscribers.begin(), subscribers.end());
+        subscribers.erase(std::unique(subscribers.begin(), subscribers.end()), subscribers.end());
+    }
+}
+
+std::vector<std::string> SubscriptionIndex::clientTopics(int connId) const{
+    std::vector<std::string> topics;
+    auto clientIt = m_clientTopics.find(connId);
+    if(clientIt != m_clientTopics.end()){
+        topics.reserve(clientIt->second.size());
+        for(TopicId topicId : clientIt->second){
+            topics.push_back(m_topics.name(topicId));
+        }
+    }
+    return topics;
+}
+
+size_t SubscriptionIndex::topicCount() const{
+    return m_topics.count();
+}
+
+size_t SubscriptionIndex::topicIdCount() const{
+    return m_topics.size();
+}
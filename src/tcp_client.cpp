@@ -1,16 +1,14 @@
 #include "tcp_client.hpp"
+#include <charconv>
+#include <cstring>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <atomic>
 #include <mutex>
-#include <queue>
-#include <bits/this_thread_sleep.h>
 
 std::mutex outputMutex;
-std::mutex inputMutex;
-std::atomic<bool> exit_flag(false);
-std::queue<std::string> inputQueue;
 
 inline void printMessage(const std::string& message) {
     std::lock_guard<std::mutex> lock(outputMutex);
@@ -20,33 +18,212 @@ inline void printMessage(const std::string& message) {
 TcpClient::TcpClient(boost::asio::io_context &ioContext) : 
         m_ioContext(ioContext), 
         m_connection{},
-        m_isConnected{false} {}
+        m_isConnected{false},
+        m_protocol{Protocol::Version::Text},
+        m_batchMaxBytes{0},
+        m_batchMaxDelay{0},
+        m_batchTimer{ioContext},
+        m_qos{false},
+        m_qosReady{false},
+        m_received{0},
+        m_receivedAcknowledged{0},
+        m_ackPending{false},
+        m_ackTimer{ioContext} {}
+
+TcpClient::~TcpClient() {
+    stopRingReader();
+}
+
+void TcpClient::setBatching(size_t maxBytes, std::chrono::microseconds maxDelay) {
+    flush();
+    std::lock_guard<std::mutex> lock(m_batchMutex);
+    // A batch has to fit into one binary frame
+    m_batchMaxBytes = std::min<size_t>(maxBytes, Protocol::max_frame_length / 2);
+    m_batchMaxDelay = maxDelay;
+}
+
+void TcpClient::flush() {
+    std::lock_guard<std::mutex> lock(m_batchMutex);
+    if (m_batch.empty()) {
+        return;
+    }
+    if (m_isConnected) {
+        if (m_protocol == Protocol::Version::Binary) {
+            sendPublish(Protocol::encode(Protocol::Opcode::PublishBatch, {}, m_batch));
+        } else {
+            auto lines = SharedBuffer::create(m_batch.size());
+            lines->append(m_batch);
+            m_connection->send(lines);
+        }
+    }
+    m_batch.clear();
+}
+
+bool TcpClient::batchPublish(std::string_view topic, std::string_view data) {
+    bool first = false;
+    bool full = false;
+    {
+        std::lock_guard<std::mutex> lock(m_batchMutex);
+        if (m_batchMaxBytes == 0) {
+            return false;
+        }
+        first = m_batch.empty();
+        if (m_protocol == Protocol::Version::Binary) {
+            Protocol::appendBatchEntry(m_batch, topic, data);
+        } else {
+            m_batch.append("PUBLISH").append(Constants::delimiter).append(topic).append(Constants::delimiter)
+                   .append(data).push_back(Constants::frame_delimiter);
+        }
+        full = m_batch.size() >= m_batchMaxBytes;
+    }
+    if (full) {
+        flush();
+    } else if (first) {
+        // A timer that is still armed for an earlier batch is moved to this one
+        boost::asio::post(m_ioContext, [this]() {
+            m_batchTimer.expires_after(m_batchMaxDelay);
+            m_batchTimer.async_wait([this](const boost::system::error_code &error) {
+                if (!error) {
+                    flush();
+                }
+            });
+        });
+    }
+    return true;
+}
 
-void TcpClient::connect(const int& port, const std::string& name) {
+bool TcpClient::sendPublish(const SharedBufferPtr& frame) {
+    std::lock_guard<std::mutex> lock(m_qosMutex);
+    if (!m_qos) {
+        return m_connection->send(frame);
+    }
+    if (!m_publishes.push(frame)) {
+        printMessage("Too many publishes are not acknowledged by the server yet.");
+        return false;
+    }
+    if (m_qosReady) {
+        m_connection->send(frame);
+    }
+    return true;
+}
+
+void TcpClient::resumeQos(std::string_view connack) {
+    std::uint64_t received = 0;
+    std::string_view field = connack.substr(std::min(connack.size(), Protocol::connack_qos.size() + 1));
+    std::from_chars(field.data(), field.data() + field.size(), received);
+    std::lock_guard<std::mutex> lock(m_qosMutex);
+    m_publishes.resume(received);
+    std::vector<TcpConnection::OutboundFrame> frames;
+    frames.reserve(m_publishes.size());
+    for (const auto &frame : m_publishes.frames()) {
+        frames.push_back({frame});
+    }
+    if (!frames.empty()) {
+        m_connection->send(frames.data(), frames.size());
+    }
+    m_qosReady = true;
+}
+
+void TcpClient::resetQos() {
+    std::lock_guard<std::mutex> lock(m_qosMutex);
+    m_qos = false;
+    m_qosReady = false;
+    m_publishes = AckWindow();
+    m_received = 0;
+    m_receivedAcknowledged = 0;
+}
+
+void TcpClient::connect(std::string_view server, std::string_view name, Protocol::Version version, bool ring,
+                        bool qos) {
+    qos = qos && version == Protocol::Version::Binary;
     if (!m_isConnected) {
-        auto socket = std::make_shared<boost::asio::ip::tcp::socket>(m_ioContext);
+        StreamSocket socket(m_ioContext);
         boost::system::error_code ec;
-        socket->connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), static_cast<short unsigned int>(port)}, ec); 
+        bool local = server.find('/') != std::string_view::npos;
+        if (local) {
+            // Same host over a Unix domain socket, skips the TCP/IP stack
+            boost::asio::local::stream_protocol::socket local(m_ioContext);
+            try {
+                local.connect(boost::asio::local::stream_protocol::endpoint(std::string(server)), ec);
+            } catch (const boost::system::system_error &e) {
+                // Paths longer than sun_path
+                ec = e.code();
+            }
+            socket = std::move(local);
+        } else {
+            int port = 0;
+            std::from_chars(server.data(), server.data() + server.size(), port);
+            tcp::socket remote(m_ioContext);
+            remote.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), static_cast<short unsigned int>(port)}, ec); 
+            socket = std::move(remote);
+        }
         if (ec) {
             std::cerr << "TcpClient::connect() error: " + ec.message() + ".\n";
             onClose(0);
             return;
         }
-        m_connection = TcpConnection::create(std::move(*socket), *this);
+        m_server = server;
+        if (!qos || name != m_clientName) {
+            // What a QoS 1 connection of another name left behind is not resumed
+            resetQos();
+        }
+        m_clientName = name;
+        std::string connectString = "CONNECT" + Constants::delimiter + m_clientName;
+        bool ringPassed = false;
+        if (qos) {
+            std::lock_guard<std::mutex> lock(m_qosMutex);
+            m_qos = true;
+            m_receivedAcknowledged = m_received;
+            connectString += Constants::delimiter + "2" + Constants::delimiter + Constants::delimiter +
+                             Constants::delimiter + "1" + Constants::delimiter + std::to_string(m_received);
+        } else if (version == Protocol::Version::Binary) {
+            // Binary frames may follow right away, the server switches at this frame.
+            // Received frames stay text until the server acknowledged with CONNACK.
+            connectString += Constants::delimiter + "2";
+            if (ring && !local) {
+                printMessage("A shared memory ring needs the server's Unix domain socket, messages arrive over the socket.");
+            } else if (ring && (m_ring = ShmRing::create())) {
+                // The ring's memory goes along with the CONNECT, written before the connection
+                // starts reading and writing the socket
+                std::string ringConnect = connectString + Constants::delimiter + Constants::delimiter +
+                                          std::string(Protocol::ring_field) + Constants::frame_delimiter;
+                ringPassed = m_ring->sendDescriptor(socket.native_handle(), ringConnect);
+                if (!ringPassed) {
+                    m_ring.reset();
+                }
+            }
+            if (ring && local && !ringPassed) {
+                printMessage("Shared memory is not available, messages arrive over the socket.");
+            }
+        }
+        // Set before reading, the CONNACK can arrive on the io_context thread right away
+        m_protocol = version;
+        m_connection = TcpConnection::create(std::move(socket), *this);
+        if (qos) {
+            // The window bounds what is queued, a publish refused by the queue would leave a
+            // hole in the numbering
+            m_connection->setWaterMarks(Constants::write_low_water_mark, SIZE_MAX);
+        }
         m_isConnected = true;
         m_connection->read();
         onStart(0);
-        m_serverPort = port;
-        m_clientName = name;
-        std::string connectString = "CONNECT" + Constants::delimiter + name;
-        m_connection->send(connectString.c_str(), connectString.size());
+        if (!ringPassed) {
+            m_connection->send(connectString.c_str(), connectString.size());
+        }
     } else {
-        printMessage("Already connected to " + std::to_string(m_serverPort));
+        printMessage("Already connected to " + m_server);
     }
 }
 
 void TcpClient::disconnect() {
+    flush();
     if (m_isConnected) {
+        if (m_protocol == Protocol::Version::Binary) {
+            m_connection->send(Protocol::encode(Protocol::Opcode::Disconnect));
+            // The server discards its QoS 1 state as well
+            resetQos();
+            return;
+        }
         std::string connectString = "DISCONNECT" + Constants::delimiter;
         m_connection->send(connectString.c_str(), connectString.size());
     } else {
@@ -54,10 +231,19 @@ void TcpClient::disconnect() {
     }
 }
 
-void TcpClient::publish(const std::string& topic, const std::string& data) {
+void TcpClient::publish(std::string_view topic, std::string_view data) {
     if (m_isConnected) {
-        std::string connectString = "PUBLISH" + Constants::delimiter + topic + Constants::delimiter + data;
-        if(m_connection->send(connectString.c_str(), connectString.size())){
+        bool sent = false;
+        if (batchPublish(topic, data)) {
+            sent = true;
+        } else if (m_protocol == Protocol::Version::Binary) {
+            sent = sendPublish(Protocol::encode(Protocol::Opcode::Publish, topic, data));
+        } else {
+            std::string connectString = "PUBLISH" + Constants::delimiter;
+            connectString.append(topic).append(Constants::delimiter).append(data);
+            sent = m_connection->send(connectString.c_str(), connectString.size());
+        }
+        if(sent){
             std::cout << "Published to topic: " << topic << " Data: " << data << std::endl;
         }
     } else {
@@ -65,49 +251,162 @@ void TcpClient::publish(const std::string& topic, const std::string& data) {
     }
 }
 
-void TcpClient::subscribe(const std::string& topic) {
+void TcpClient::subscribe(std::string_view topic) {
     if (m_isConnected) {
         auto it = std::find(m_topics.begin(), m_topics.end(), topic);
         if(it == m_topics.end()){
-            std::string connectString = "SUBSCRIBE" + Constants::delimiter + topic;
-            if(m_connection->send(connectString.c_str(), connectString.size())){
-                printMessage("Subscribed to topic: " + topic);
-                m_topics.push_back(topic);
+            if(sendTopicCommand(Protocol::Opcode::Subscribe, "SUBSCRIBE", topic)){
+                m_topics.emplace_back(topic);
+                printMessage("Subscribed to topic: " + m_topics.back());
             }
         }
         else{
-            printMessage("Already subscribed to topic: " + topic);
+            printMessage("Already subscribed to topic: " + std::string(topic));
         }
     } else {
         printMessage("You must be connected to subscribe.");
     }
 }
 
-void TcpClient::unsubscribe(const std::string& topic) {
+void TcpClient::unsubscribe(std::string_view topic) {
     if (m_isConnected) {
         auto it = std::find(m_topics.begin(), m_topics.end(), topic);
         if (it != m_topics.end()) {
-            std::string connectString = "UNSUBSCRIBE" + Constants::delimiter + topic;
-            if(m_connection->send(connectString.c_str(), connectString.size())){
+            if(sendTopicCommand(Protocol::Opcode::Unsubscribe, "UNSUBSCRIBE", topic)){
+                printMessage("Unsubscribed from topic: " + *it);
                 m_topics.erase(it);
-                printMessage("Unsubscribed from topic: " + topic);
             }
         } else {
-            printMessage("Not subscribed to topic: " + topic);
+            printMessage("Not subscribed to topic: " + std::string(topic));
         }
     } else {
         printMessage("You must be connected to unsubscribe.");
     }
 }
 
-void TcpClient::onRead(int connId, std::string payload) {
+void TcpClient::requestStats() {
+    flush();
+    if (m_isConnected) {
+        // The answer arrives as a message on the topic STATS
+        if (m_protocol == Protocol::Version::Binary) {
+            m_connection->send(Protocol::encode(Protocol::Opcode::Stats));
+            return;
+        }
+        std::string statsString = "STATS";
+        m_connection->send(statsString.c_str(), statsString.size());
+    } else {
+        printMessage("You must be connected to request stats.");
+    }
+}
+
+bool TcpClient::sendTopicCommand(Protocol::Opcode opcode, std::string_view command, std::string_view topic) {
+    flush();
+    if (m_protocol == Protocol::Version::Binary) {
+        return m_connection->send(Protocol::encode(opcode, topic));
+    }
+    std::string commandString(command);
+    commandString.append(Constants::delimiter).append(topic);
+    return m_connection->send(commandString.c_str(), commandString.size());
+}
+
+void TcpClient::onFrame(int connId, std::string_view frame) {
+    if (m_connection && m_connection->protocol() == Protocol::Version::Binary) {
+        onBinaryFrame(connId, frame, m_message);
+        return;
+    }
+    if (frame == Protocol::ping) {
+        m_connection->sendControl(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Text));
+        return;
+    }
+    if (m_protocol == Protocol::Version::Binary && frame == Protocol::connack_ring && m_ring) {
+        m_connection->setProtocol(Protocol::Version::Binary);
+        startRingReader();
+        return;
+    }
+    if (m_protocol == Protocol::Version::Binary && frame.substr(0, Protocol::connack_qos.size()) == Protocol::connack_qos) {
+        m_connection->setProtocol(Protocol::Version::Binary);
+        resumeQos(frame);
+        return;
+    }
+    if (m_protocol == Protocol::Version::Binary && frame == Protocol::connack) {
+        m_connection->setProtocol(Protocol::Version::Binary);
+        if (m_ring) {
+            printMessage("The server cannot use shared memory, messages arrive over the socket.");
+            m_ring.reset();
+        }
+        return;
+    }
+    onRead(connId, frame);
+}
+
+void TcpClient::onBinaryFrame(int connId, std::string_view frame, std::string& message) {
+    Protocol::Frame decoded;
+    if (Protocol::isHeartbeat(frame, Protocol::Version::Binary, Protocol::Opcode::Ping)) {
+        // Also called by the ring reader, send() is thread safe
+        m_connection->sendControl(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Binary));
+        return;
+    }
+    if (!Protocol::decode(frame, decoded)) {
+        printMessage("Invalid binary frame received.");
+        return;
+    }
+    if (decoded.opcode == Protocol::Opcode::Ack) {
+        // An Ack delayed past a DISCONNECT finds the state reset
+        std::lock_guard<std::mutex> lock(m_qosMutex);
+        if (m_qos && !m_publishes.acknowledge(decoded.sequence)) {
+            printMessage("Ack of a publish that was not sent received.");
+        }
+        return;
+    }
+    if (decoded.opcode != Protocol::Opcode::Message) {
+        printMessage("Invalid binary frame received.");
+        return;
+    }
+    {
+        // Acknowledged once the read is handled, see onReadComplete()
+        std::lock_guard<std::mutex> lock(m_qosMutex);
+        if (m_qos) {
+            ++m_received;
+        }
+    }
+    // Binary messages are handed to onRead in the same "topic;data" form as text ones
+    message.assign(decoded.topic).append(Constants::delimiter).append(decoded.payload);
+    onRead(connId, message);
+}
+
+void TcpClient::startRingReader() {
+    m_ringReader = std::thread([this]() {
+        auto onFrame = [this](std::string_view frame) { onBinaryFrame(0, frame, m_ringMessage); };
+        for (;;) {
+            // The server closes the ring after its last frame
+            bool closed = m_ring->isClosed();
+            m_ring->read(onFrame);
+            if (closed) {
+                return;
+            }
+            m_ring->wait(ring_wait_timeout, ring_spin_count);
+        }
+    });
+}
+
+void TcpClient::stopRingReader() {
+    if (m_ring) {
+        m_ring->close();
+    }
+    if (m_ringReader.joinable()) {
+        m_ringReader.join();
+    }
+    m_ring.reset();
+}
+
+void TcpClient::onRead(int connId, std::string_view payload) {
     (void)connId;
-    std::istringstream stream(payload);
-    std::string topic, data;
-    if (!std::getline(stream, topic, ';')) {
+    auto separator = payload.find(Constants::delimiter);
+    if (separator == std::string_view::npos) {
         return;
     }
-    std::getline(stream, data);
+    std::string_view topic = payload.substr(0, separator);
+    std::string_view data = payload.substr(separator + 1);
 
     std::lock_guard<std::mutex> lock(outputMutex);
     std::cout << "[Message] Topic: " << topic << " Data: " << data << std::endl;
@@ -117,55 +416,48 @@ bool TcpClient::isConnected() const {
     return m_isConnected;
 }
 
-void TcpClient::handleCommand(const std::string& input, int connId) {
+void TcpClient::handleCommand(std::string_view input, int connId) {
     (void)connId;
     
-    if(input.length() >= Constants::max_length){
-        printMessage("Command length exceeds maximum message length of " + std::to_string(Constants::max_length));
+    if(input.length() > Constants::max_text_frame_length){
+        printMessage("Command length exceeds maximum message length of " + std::to_string(Constants::max_text_frame_length));
         return;
     }
-    std::istringstream stream(input);
-    std::string command;
-    stream >> command;
-
-    if (command == "CONNECT") {
-        handleConnect(stream);
-    }
-    else if (command == "DISCONNECT") {
-        handleDisconnect();
-    }
-    else if (command == "PUBLISH") {
-        handlePublish(stream);
-    }
-    else if (command == "SUBSCRIBE") {
-        handleSubscribe(stream);
-    }
-    else if (command == "UNSUBSCRIBE") {
-        handleUnsubscribe(stream);
-    }
-    else {
-        printMessage("Invalid command: " + input);
+    Tokenizer args(input);
+    if (!dispatch(lookupCommand(args.nextWord()), args, connId)) {
+        printMessage("Invalid command: " + std::string(input));
     }
 }
 
-void TcpClient::handleConnect(std::istringstream& stream, int connId) {
+void TcpClient::handleConnect(Tokenizer& args, int connId) {
     (void)connId;
-    std::string portStr, name;
-    stream >> portStr >> name;
+    std::string_view portStr = args.nextWord();
+    std::string_view name = args.nextWord();
+    std::string_view version = args.nextWord();
 
     if (portStr.empty() || name.empty()) {
-        printMessage("Error: CONNECT command requires <port> (int) and <name> parameters.");
+        printMessage("Error: CONNECT command requires <port> (int) or <socket path> and <name> parameters.");
         return;
     }
 
-    int port = strtol(portStr.c_str(), nullptr, 10);
+    // A path (containing '/') is the server's Unix domain socket
+    int port = 0;
+    std::from_chars(portStr.data(), portStr.data() + portStr.size(), port);
 
-    if (port < 1 || port > 65535) {
+    if (portStr.find('/') == std::string_view::npos && (port < 1 || port > 65535)) {
         printMessage("Error: Port must be an integer between 1 and 65535.");
         return;
     }
 
-    connect(port, name);
+    // A QoS 1 connection never uses shared memory, the ring drops messages when it is full
+    std::string_view delivery = args.nextWord();
+    if ((!version.empty() && version != "v2") || (!delivery.empty() && delivery != "shm" && delivery != "qos1")) {
+        printMessage("Error: The optional CONNECT parameters are v2 (binary protocol) and then shm (shared memory delivery) or qos1 (at-least-once delivery).");
+        return;
+    }
+
+    connect(portStr, name, version.empty() ? Protocol::Version::Text : Protocol::Version::Binary, delivery == "shm",
+            delivery == "qos1");
 }
 
 void TcpClient::handleDisconnect(int connId) {
@@ -173,16 +465,14 @@ void TcpClient::handleDisconnect(int connId) {
     disconnect();
 }
 
-void TcpClient::handlePublish(std::istringstream& stream, int connId) {
+void TcpClient::handlePublish(Tokenizer& args, int connId) {
     (void)connId;
-    std::string topic, data;
-    stream >> topic;
-    if(topic.find(Constants::delimiter) != std::string::npos){
+    std::string_view topic = args.nextWord();
+    if(topic.find(Constants::delimiter) != std::string_view::npos){
         printMessage("Topic contains delimiter character " + Constants::delimiter + " which could lead to unwanted behaviour.");
         return;
     }
-    std::getline(stream, data);
-    data.erase(0, 1);
+    std::string_view data = args.rest();
     
     if (topic.empty() || data.empty()) {
         printMessage("Error: PUBLISH command requires <topic> and <data> parameters.");
@@ -191,14 +481,13 @@ void TcpClient::handlePublish(std::istringstream& stream, int connId) {
     }
 }
 
-void TcpClient::handleSubscribe(std::istringstream& stream, int connId) {
+void TcpClient::handleSubscribe(Tokenizer& args, int connId) {
     (void)connId;
-    std::string topic;
-    stream >> topic;
+    std::string_view topic = args.nextWord();
     if (topic.empty()) {
         printMessage("Error: SUBSCRIBE command requires <topic> parameter.");
     } else {
-        if(topic.find(Constants::delimiter) != std::string::npos){
+        if(topic.find(Constants::delimiter) != std::string_view::npos){
             printMessage("Topic contains delimiter character " + Constants::delimiter + " which could lead to unwanted behaviour.");
             return;
         }
@@ -206,10 +495,9 @@ void TcpClient::handleSubscribe(std::istringstream& stream, int connId) {
     }
 }
 
-void TcpClient::handleUnsubscribe(std::istringstream& stream, int connId) {
+void TcpClient::handleUnsubscribe(Tokenizer& args, int connId) {
     (void)connId;
-    std::string topic;
-    stream >> topic;
+    std::string_view topic = args.nextWord();
     if (topic.empty()) {
         printMessage("Error: UNSUBSCRIBE command requires <topic> parameter.");
     } else {
@@ -217,10 +505,58 @@ void TcpClient::handleUnsubscribe(std::istringstream& stream, int connId) {
     }
 }
 
+void TcpClient::handleStats(int connId) {
+    (void)connId;
+    requestStats();
+}
+
+void TcpClient::onReadComplete(int connId) {
+    (void)connId;
+    std::lock_guard<std::mutex> lock(m_qosMutex);
+    if (!m_qos) {
+        return;
+    }
+    std::uint64_t unacknowledged = m_received - m_receivedAcknowledged;
+    if (unacknowledged >= AckWindow::ack_threshold) {
+        sendAck();
+    } else if (unacknowledged != 0 && !m_ackPending) {
+        m_ackPending = true;
+        m_ackTimer.expires_after(AckWindow::ack_delay);
+        m_ackTimer.async_wait([this](const boost::system::error_code &error) {
+            if (error) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(m_qosMutex);
+            m_ackPending = false;
+            if (m_qos && m_isConnected && m_received != m_receivedAcknowledged) {
+                sendAck();
+            }
+        });
+    }
+}
+
+void TcpClient::sendAck() {
+    // A control frame, a congested queue must not drop the ack the server's window waits for
+    if (m_connection->sendControl(Protocol::encodeAck(m_received))) {
+        m_receivedAcknowledged = m_received;
+    }
+}
+
 void TcpClient::onClose(int connId){
     (void)connId;
+    stopRingReader();
+    {
+        // The window is kept for the next connection, which resumes it once acknowledged
+        std::lock_guard<std::mutex> lock(m_qosMutex);
+        m_qosReady = false;
+    }
     m_isConnected = false;
+    m_protocol = Protocol::Version::Text;
     m_topics.clear();
+    {
+        std::lock_guard<std::mutex> lock(m_batchMutex);
+        m_batch.clear();
+    }
     printMessage("Connection to server closed");
 }
 
@@ -229,66 +565,104 @@ void TcpClient::onStart(int connId){
     printMessage("Connection to server started");
 }
 
-void signal_handler(int s){
-    (void)s;
-    printMessage("Caught SIGINT signal");
-    exit_flag = true;
-    exit(1); 
-}
+// Feeds stdin lines to the client on its io_context thread, so commands run on the same
+// thread as the connection callbacks and are handled as soon as the line arrives.
+// stdin is read asynchronously through a stream_descriptor. Regular files cannot be
+// polled, so redirected input falls back to a reader thread that posts every line. Reads
+// of a regular file never block, the thread sees m_stopped after its current line.
+class ConsoleInput {
+    public:
+        ConsoleInput(boost::asio::io_context& context, TcpClient& client) :
+            m_context(context),
+            m_client(client),
+            m_input(context),
+            m_stopped(false) {}
+
+        ~ConsoleInput(){
+            m_stopped.store(true);
+            if(m_thread.joinable()){
+                m_thread.join();
+            }
+        }
 
-std::string get_input(){
-    std::string cmd;
-    std::cin >> cmd;
-    return cmd;
-}
+        void start(){
+            boost::system::error_code error;
+            m_input.assign(::dup(STDIN_FILENO), error);
+            if(!error){
+                read();
+                return;
+            }
+            m_thread = std::thread{[this]() {
+                std::string line;
+                while(!m_stopped.load() && std::getline(std::cin, line)){
+                    boost::asio::post(m_context, [this, line]() { handleLine(line); });
+                }
+            }};
+        }
+
+    private:
+        void read(){
+            boost::asio::async_read_until(m_input, m_buffer, '\n', [this](const auto &error, auto length) {
+                if(error){
+                    // End of input, keep receiving messages until exit or SIGINT
+                    return;
+                }
+                std::string line(static_cast<const char*>(m_buffer.data().data()), length - 1);
+                m_buffer.consume(length);
+                handleLine(line);
+                read();
+            });
+        }
 
-void read_input() {
-    std::string input;
-    while (!exit_flag) {
-        std::getline(std::cin, input);
-        if (!input.empty()) {
-            std::lock_guard<std::mutex> lock(inputMutex);
-            inputQueue.push(input);
-            if (input == "exit") {
-                exit_flag = true;
+        void handleLine(const std::string& line){
+            if(line == "exit"){
+                m_context.stop();
+            } else if(!line.empty()){
+                m_client.handleCommand(line);
             }
         }
+
+        boost::asio::io_context& m_context;
+        TcpClient& m_client;
+        boost::asio::posix::stream_descriptor m_input;
+        boost::asio::streambuf m_buffer;
+        std::thread m_thread;
+        std::atomic<bool> m_stopped;
+};
+
+int main(int argc, char* argv[]) {
+    size_t batchBytes = 0;
+    long batchDelay = 1000;
+    bool validArgs = argc % 2 == 1;
+    for (int i = 1; validArgs && i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--batch-bytes") == 0) {
+            batchBytes = strtoull(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--batch-delay-us") == 0) {
+            batchDelay = atol(argv[i + 1]);
+        } else {
+            validArgs = false;
+        }
+    }
+    if (!validArgs || batchDelay < 0) {
+        std::cout << "Usage: tcp_client [--batch-bytes <bytes> [--batch-delay-us <microseconds>]]" << std::endl;
+        return -1;
     }
-}
 
-int main() {
     boost::asio::io_context context;
 
     TcpClient client{context};
-
-    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work = boost::asio::make_work_guard(context);
-    std::thread thread{[&context]() { context.run(); }};
-
-    struct sigaction sigIntHandler;
-
-    sigIntHandler.sa_handler = signal_handler;
-    sigemptyset(&sigIntHandler.sa_mask);
-    sigIntHandler.sa_flags = 0;
-
-    sigaction(SIGINT, &sigIntHandler, NULL);
-
-    std::thread input_thread(read_input);
-
-    while (!exit_flag) {
-        {
-            std::lock_guard<std::mutex> lock(inputMutex);
-            if (!inputQueue.empty()) {
-                std::string user_input = inputQueue.front();
-                inputQueue.pop();
-                client.handleCommand(user_input);
-            }
+    client.setBatching(batchBytes, std::chrono::microseconds(batchDelay));
+    ConsoleInput input{context, client};
+    input.start();
+
+    boost::asio::signal_set signals{context, SIGINT};
+    signals.async_wait([&context](const auto &error, int) {
+        if (!error) {
+            printMessage("Caught SIGINT signal");
+            context.stop();
         }
+    });
 
-        // Prevent 100% CPU usage and allow other threads to run without buffer interrupts
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    }
-    work.reset();
-    input_thread.join();
-    thread.join();
+    context.run();
     return 0;
-}
\ No newline at end of file
+}
@@ -1,70 +1,622 @@
 #include "tcp_connection.hpp"
+#include "frame_scanner.hpp"
+#include "handler_allocator.hpp"
+#include <algorithm>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
 
-TcpConnection::TcpConnection(tcp::socket &&socket, TcpObject &object, int connId) : m_socket(std::move(socket)), m_object(object), m_readBuffer{}, m_writeBuffer{},
-m_writeBufferMutex{}, m_connectionId(connId), m_isWritting{false} {}
+namespace {
+    constexpr std::string_view policy_names[] = {"drop-newest", "disconnect", "drop-oldest", "conflate"};
 
+    // Buffer sequence referring to a vector of buffers. async_write copies the sequence it
+    // is given into the operation, a vector would be copied with a heap allocation per write.
+    class BufferSequenceView {
+        public:
+            using value_type = boost::asio::const_buffer;
+            using const_iterator = std::vector<boost::asio::const_buffer>::const_iterator;
+
+            explicit BufferSequenceView(const std::vector<boost::asio::const_buffer> &buffers) : m_buffers(&buffers) {}
+
+            const_iterator begin() const { return m_buffers->begin(); }
+            const_iterator end() const { return m_buffers->end(); }
+
+        private:
+            const std::vector<boost::asio::const_buffer> *m_buffers;
+    };
+}
+
+std::optional<SlowConsumerPolicy> parseSlowConsumerPolicy(std::string_view name) {
+    for (size_t i = 0; i < std::size(policy_names); ++i) {
+        if (policy_names[i] == name) {
+            return static_cast<SlowConsumerPolicy>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view slowConsumerPolicyName(SlowConsumerPolicy policy) {
+    return policy_names[static_cast<size_t>(policy)];
+}
+
+TcpConnection::TcpConnection(StreamSocket &&socket, TcpObject &object, int connId) : m_socket(std::move(socket)), m_object(object), m_readBuffer{}, m_scannedBytes{0}, m_readHint{0},
+m_protocol{Protocol::Version::Text}, m_writeQueue{}, m_writeQueueHead{0}, m_conflationSlots{},
+m_controlQueue{}, m_flushQueue{}, m_flushControlFrames{0}, m_flushBuffers{},
+#if defined(TCP_SERVER_COROUTINES)
+m_writeSignal{m_socket.get_executor(), boost::asio::steady_timer::time_point::max()},
+#endif
+m_writeBufferMutex{}, m_receiveDescriptor{false}, m_descriptor{-1}, m_metrics{}, m_latency{nullptr}, m_queuedBytes{0}, m_lowWaterMark{Constants::write_low_water_mark},
+m_highWaterMark{Constants::write_high_water_mark}, m_policy{SlowConsumerPolicy::DropNewest}, m_connectionId(connId), m_isWritting{false}, m_isCongested{false}, m_isOpen{true} {}
+
+#if defined(TCP_SERVER_COROUTINES)
+void TcpConnection::read(){
+    readLoop(shared_from_this());
+}
+
+Coroutine TcpConnection::readLoop(std::shared_ptr<TcpConnection> self){
+    // self is taken once for the lifetime of the loop instead of once per read
+    (void)self;
+    while (m_receiveDescriptor) {
+        auto [error] = co_await m_socket.async_wait(StreamSocket::wait_read, use_coroutine);
+        boost::system::error_code readError = error;
+        size_t bytesTransferred = readError ? 0 : readWithDescriptor(readError);
+        if (!completeRead(readError, bytesTransferred)) {
+            co_return;
+        }
+    }
+    for (;;) {
+        auto buffers = m_readBuffer.prepare(std::max(static_cast<size_t>(Constants::max_length), m_readHint));
+        auto [error, bytesTransferred] = co_await m_socket.async_read_some(buffers, use_coroutine);
+        if (!completeRead(error, bytesTransferred)) {
+            co_return;
+        }
+    }
+}
+#else
 void TcpConnection::read(){
-    auto buffers = m_readBuffer.prepare(Constants::max_length);
     auto self = shared_from_this();
-    m_socket.async_read_some(buffers, [this, self](const auto &error,
-                                                    auto bytesTransferred) {
-        if (error) {
-            return close();
-        }
-        m_readBuffer.commit(bytesTransferred);
-        m_object.onRead(m_connectionId,
-            std::string(static_cast<const char *>(m_readBuffer.data().data()), bytesTransferred));
-        m_readBuffer.consume(bytesTransferred);
-        read();
-    });
+    if (m_receiveDescriptor) {
+        m_socket.async_wait(StreamSocket::wait_read, [this, self](const boost::system::error_code &error) {
+            boost::system::error_code readError = error;
+            size_t bytesTransferred = readError ? 0 : readWithDescriptor(readError);
+            if (completeRead(readError, bytesTransferred)) {
+                read();
+            }
+        });
+        return;
+    }
+    auto buffers = m_readBuffer.prepare(std::max(static_cast<size_t>(Constants::max_length), m_readHint));
+    m_socket.async_read_some(buffers, pooled([this, self](const boost::system::error_code &error,
+                                                           size_t bytesTransferred) {
+        if (completeRead(error, bytesTransferred)) {
+            read();
+        }
+    }));
+}
+#endif
+
+size_t TcpConnection::readWithDescriptor(boost::system::error_code &error){
+    auto buffer = m_readBuffer.prepare(std::max(static_cast<size_t>(Constants::max_length), m_readHint));
+    struct iovec data{buffer.data(), buffer.size()};
+    // Room for one descriptor, the kernel closes any further ones
+    alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message{};
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = ::recvmsg(m_socket.native_handle(), &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        // Woken up without data, completeRead() is called with nothing read and waits again
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            error.assign(errno, boost::system::system_category());
+        }
+        return 0;
+    }
+    if (received == 0) {
+        error = boost::asio::error::eof;
+        return 0;
+    }
+    m_receiveDescriptor = false;
+    for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            std::memcpy(&m_descriptor, CMSG_DATA(header), sizeof(int));
+        }
+    }
+    return static_cast<size_t>(received);
+}
+
+bool TcpConnection::completeRead(const boost::system::error_code &error, size_t bytesTransferred){
+    if (error) {
+        close();
+        return false;
+    }
+    m_readBuffer.commit(bytesTransferred);
+    if (!processFrames()) {
+        std::cerr << "TcpConnection::read() error: invalid frame or frame exceeds maximum length.\n";
+        close();
+        return false;
+    }
+    if (!m_socket.is_open()) {
+        return false;
+    }
+    m_object.onReadComplete(m_connectionId);
+    return m_socket.is_open();
+}
+
+bool TcpConnection::processFrames() {
+    // TCP may coalesce several frames into one read or split a frame across reads, so the
+    // read buffer is split into frames and the incomplete tail is kept for the next read
+    const char *begin = static_cast<const char *>(m_readBuffer.data().data());
+    const char *end = begin + m_readBuffer.size();
+    const char *frameStart = begin;
+    const char *scanFrom = begin + m_scannedBytes;
+    m_readHint = 0;
+    while (m_socket.is_open()) {
+        if (m_protocol == Protocol::Version::Text) {
+            const char *frameEnd = findDelimiter(scanFrom, end, Constants::frame_delimiter);
+            if (frameEnd == end) {
+                break;
+            }
+            m_metrics.messagesIn.add();
+            m_metrics.bytesIn.add(frameEnd + 1 - frameStart);
+            m_object.onFrame(m_connectionId, std::string_view(frameStart, frameEnd - frameStart));
+            frameStart = frameEnd + 1;
+        } else {
+            size_t available = end - frameStart;
+            if (available < Protocol::length_size) {
+                m_readHint = Protocol::length_size - available;
+                break;
+            }
+            std::uint32_t length = Protocol::readLength(frameStart);
+            if (length == 0 || length > Protocol::max_frame_length) {
+                return false;
+            }
+            if (available < Protocol::length_size + length) {
+                m_readHint = Protocol::length_size + length - available;
+                break;
+            }
+            m_metrics.messagesIn.add();
+            m_metrics.bytesIn.add(Protocol::length_size + length);
+            m_object.onFrame(m_connectionId, std::string_view(frameStart + Protocol::length_size, length));
+            frameStart += Protocol::length_size + length;
+        }
+        scanFrom = frameStart;
+    }
+    m_readBuffer.consume(frameStart - begin);
+    if (m_protocol != Protocol::Version::Text) {
+        m_scannedBytes = 0;
+        return true;
+    }
+    m_scannedBytes = m_readBuffer.size();
+    return m_scannedBytes <= Constants::max_text_frame_length;
+}
+
+void TcpConnection::setProtocol(Protocol::Version version) {
+    m_protocol = version;
+}
+
+Protocol::Version TcpConnection::protocol() const {
+    return m_protocol;
 }
 
 bool TcpConnection::send(const char *data, size_t size) {
-    if (m_socket.is_open()) {
-        std::ostream bufferStream{&m_writeBuffer};
-        bufferStream.write(data, size);
+    if (!m_isOpen) {
+        std::cerr << "Socket is closed.\n";
+        return false;
+    }
+    auto buffer = SharedBuffer::create(size + 1);
+    buffer->append(std::string_view(data, size));
+    buffer->append(Constants::frame_delimiter);
+    return send(buffer);
+}
+
+bool TcpConnection::send(const SharedBufferPtr &buffer, std::uint32_t conflationKey) {
+    if (!m_isOpen) {
+        return false;
+    }
+    QueueResult result;
+    bool queued;
+    {
+        std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+        if (m_ring) {
+            queued = writeRing(buffer);
+            m_ring->notify();
+            if (!queued && m_policy == SlowConsumerPolicy::Disconnect) {
+                closeSlowRing();
+            }
+            return queued;
+        }
+        queued = enqueue(buffer, conflationKey, result);
+    }
+    return afterQueue(result) && queued;
+}
+
+size_t TcpConnection::send(OutboundFrame *frames, size_t count) {
+    if (!m_isOpen) {
+        return 0;
+    }
+    QueueResult result;
+    size_t queued = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+        if (m_ring) {
+            // One wake up for all of them
+            for (size_t i = 0; i < count; ++i) {
+                frames[i].sent = writeRing(frames[i].buffer);
+                queued += frames[i].sent ? 1 : 0;
+            }
+            m_ring->notify();
+            if (queued < count && m_policy == SlowConsumerPolicy::Disconnect) {
+                closeSlowRing();
+            }
+            return queued;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            frames[i].sent = enqueue(frames[i].buffer, frames[i].conflationKey, result);
+            queued += frames[i].sent ? 1 : 0;
+        }
+    }
+    if (!afterQueue(result)) {
+        for (size_t i = 0; i < count; ++i) {
+            frames[i].sent = false;
+        }
+        return 0;
+    }
+    return queued;
+}
+
+bool TcpConnection::enqueue(const SharedBufferPtr &buffer, std::uint32_t conflationKey, QueueResult &result) {
+    if (m_isCongested) {
+        return queueCongested(buffer, conflationKey);
+    }
+    if (m_policy == SlowConsumerPolicy::Disconnect && m_queuedBytes + buffer->size() >= m_highWaterMark) {
+        m_metrics.dropped.add();
+        m_isCongested = result.congested = result.disconnect = true;
+        return false;
+    }
+    pushFrame(buffer, conflationKey);
+    if (m_queuedBytes >= m_highWaterMark) {
+        m_isCongested = result.congested = true;
+    }
+    if (!m_isWritting) {
+        m_isWritting = result.startWrite = true;
+    }
+    return true;
+}
+
+bool TcpConnection::afterQueue(const QueueResult &result) {
+    if (result.congested) {
+        m_object.onBackpressure(m_connectionId, true);
+        if (result.disconnect) {
+            // Posted rather than dispatched, the caller may be iterating the subscribers that
+            // onClose changes
+            boost::asio::post(m_socket.get_executor(), [self = shared_from_this()]() { self->doClose(); });
+            return false;
+        }
+    }
+    if (result.startWrite) {
+        // Runs inline when called from the io_context thread, otherwise the write is started there
+#if defined(TCP_SERVER_COROUTINES)
+        boost::asio::dispatch(m_socket.get_executor(), pooled([self = shared_from_this()]() { self->m_writeSignal.cancel(); }));
+#else
+        boost::asio::dispatch(m_socket.get_executor(), pooled([self = shared_from_this()]() { self->doWrite(); }));
+#endif
+    }
+    return true;
+}
+
+bool TcpConnection::writeRing(const SharedBufferPtr &buffer) {
+    // Frames already in the ring are visible to the client and cannot be taken back, so
+    // DropOldest and Conflate drop the new frame like DropNewest
+    if (!m_ring->write(buffer->data(), buffer->size())) {
+        m_metrics.dropped.add();
+        return false;
+    }
+    m_metrics.messagesOut.add();
+    m_metrics.bytesOut.add(buffer->size());
+    if (m_latency != nullptr && buffer->timestamp() != 0) {
+        std::int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        m_latency->record(static_cast<std::uint64_t>(std::max<std::int64_t>(now - buffer->timestamp(), 0)));
+    }
+    return true;
+}
+
+void TcpConnection::closeSlowRing() {
+    if (m_isCongested) {
+        return;
+    }
+    m_isCongested = true;
+    // Same as a socket queue over its high water mark, posted because the caller holds the lock
+    boost::asio::post(m_socket.get_executor(), [self = shared_from_this()]() {
+        self->m_object.onBackpressure(self->m_connectionId, true);
+        self->doClose();
+    });
+}
+
+void TcpConnection::attachRing(std::unique_ptr<ShmRing> ring) {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    m_ring = std::move(ring);
+}
+
+bool TcpConnection::sendControl(const char *data, size_t size) {
+    auto buffer = SharedBuffer::create(size + 1);
+    buffer->append(std::string_view(data, size));
+    buffer->append(Constants::frame_delimiter);
+    return sendControl(buffer);
+}
+
+bool TcpConnection::sendControl(const SharedBufferPtr &buffer) {
+    if (!m_isOpen) {
+        return false;
+    }
+    QueueResult result;
+    {
+        std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+        m_controlQueue.push_back(buffer);
+        m_queuedBytes += buffer->size();
         if (!m_isWritting) {
-            return doWrite();
+            m_isWritting = result.startWrite = true;
         }
     }
-    else{
-        std::cerr << "Socket is closed.\n";
+    return afterQueue(result);
+}
+
+bool TcpConnection::hasRing() {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    return m_ring != nullptr;
+}
+
+void TcpConnection::receiveDescriptor() {
+    m_receiveDescriptor = true;
+}
+
+int TcpConnection::takeDescriptor() {
+    return std::exchange(m_descriptor, -1);
+}
+
+void TcpConnection::pushFrame(const SharedBufferPtr &buffer, std::uint32_t conflationKey) {
+    if (m_policy == SlowConsumerPolicy::Conflate && conflationKey != no_conflation_key) {
+        m_conflationSlots[conflationKey] = m_writeQueue.size();
+    }
+    m_writeQueue.push_back(buffer);
+    m_queuedBytes += buffer->size();
+}
+
+bool TcpConnection::queueCongested(const SharedBufferPtr &buffer, std::uint32_t conflationKey) {
+    switch (m_policy) {
+    case SlowConsumerPolicy::DropNewest:
+    case SlowConsumerPolicy::Disconnect:
+        m_metrics.dropped.add();
         return false;
+    case SlowConsumerPolicy::DropOldest:
+        // Frames in m_flushQueue are being written and cannot be taken back, so if all queued
+        // bytes are in flight the queue may exceed the high water mark by this one frame
+        while (m_writeQueueHead < m_writeQueue.size() && m_queuedBytes + buffer->size() > m_highWaterMark) {
+            auto &oldest = m_writeQueue[m_writeQueueHead++];
+            m_queuedBytes -= oldest->size();
+            oldest.reset();
+            m_metrics.dropped.add();
+        }
+        break;
+    case SlowConsumerPolicy::Conflate:
+        if (conflationKey != no_conflation_key) {
+            auto slot = m_conflationSlots.find(conflationKey);
+            if (slot != m_conflationSlots.end()) {
+                auto &queued = m_writeQueue[slot->second];
+                m_queuedBytes = m_queuedBytes - queued->size() + buffer->size();
+                queued = buffer;
+                m_metrics.dropped.add();
+                return true;
+            }
+        }
+        // The queue grows by at most one frame per topic beyond the high water mark
+        break;
     }
-    return false;
+    pushFrame(buffer, conflationKey);
+    return true;
 }
 
-bool TcpConnection::doWrite() {
-    m_isWritting = true;
+#if defined(TCP_SERVER_COROUTINES)
+Coroutine TcpConnection::writeLoop(std::weak_ptr<TcpConnection> weak) {
+    for (;;) {
+        auto self = weak.lock();
+        if (!self) {
+            co_return;
+        }
+        if (!takeWriteQueue()) {
+            if (!m_isOpen) {
+                co_return;
+            }
+            // send() or doClose() cancel the wait. Destroying the connection does as well,
+            // so nothing may be touched after it before the connection is locked again.
+            self.reset();
+            co_await m_writeSignal.async_wait(use_coroutine);
+            continue;
+        }
+        auto [error, bytesTransferred] = co_await boost::asio::async_write(m_socket, BufferSequenceView(m_flushBuffers),
+                                                                           use_coroutine);
+        if (!completeWrite(error, bytesTransferred)) {
+            co_return;
+        }
+    }
+}
+#else
+void TcpConnection::doWrite() {
+    if (!takeWriteQueue()) {
+        return;
+    }
     auto self = shared_from_this();
-    boost::system::error_code error;
-    auto bytesTransferred = m_socket.write_some(m_writeBuffer.data(), error);
-      if (error) {
+    boost::asio::async_write(m_socket, BufferSequenceView(m_flushBuffers), pooled([this, self](const boost::system::error_code &error,
+                                                                                               size_t bytesTransferred) {
+        if (completeWrite(error, bytesTransferred)) {
+            doWrite();
+        }
+    }));
+}
+#endif
+
+bool TcpConnection::takeWriteQueue() {
+    {
+        std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+        if ((m_writeQueueHead == m_writeQueue.size() && m_controlQueue.empty()) || !m_isOpen) {
+            m_writeQueue.clear();
+            m_writeQueueHead = 0;
+            m_controlQueue.clear();
+            m_isWritting = false;
+            return false;
+        }
+        m_writeQueue.erase(m_writeQueue.begin(), m_writeQueue.begin() + m_writeQueueHead);
+        m_writeQueueHead = 0;
+        m_conflationSlots.clear();
+        m_flushControlFrames = m_controlQueue.size();
+        if (m_controlQueue.empty()) {
+            m_flushQueue.swap(m_writeQueue);
+        } else {
+            m_controlQueue.insert(m_controlQueue.end(), m_writeQueue.begin(), m_writeQueue.end());
+            m_writeQueue.clear();
+            m_flushQueue.swap(m_controlQueue);
+        }
+    }
+    m_flushBuffers.clear();
+    for (const auto &buffer : m_flushQueue) {
+        m_flushBuffers.emplace_back(buffer->data(), buffer->size());
+    }
+    return true;
+}
+
+bool TcpConnection::completeWrite(const boost::system::error_code &error, size_t bytesTransferred) {
+    if (!error) {
+        m_metrics.messagesOut.add(m_flushQueue.size());
+        m_metrics.bytesOut.add(bytesTransferred);
+        recordLatency();
+    }
+    size_t written = m_flushQueue.size() - m_flushControlFrames;
+    m_flushQueue.clear();
+    bool drained = false;
+    {
+        std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+        m_queuedBytes -= bytesTransferred;
+        if (m_isCongested && m_queuedBytes <= m_lowWaterMark) {
+            m_isCongested = false;
+            drained = true;
+        }
+    }
+    if (error) {
         std::cerr << "TcpConnection::doWrite() error: " + error.message() + ".\n";
+        close();
         return false;
-      }
-      m_writeBuffer.consume(bytesTransferred);
-      if (m_writeBuffer.size() == 0) {
-        m_isWritting = false;
-        return true;
-      }
-      return doWrite();
-  }
+    }
+    m_object.onWritten(m_connectionId, written);
+    if (drained) {
+        m_object.onBackpressure(m_connectionId, false);
+    }
+    return true;
+}
+
+void TcpConnection::recordLatency() {
+    if (m_latency == nullptr) {
+        return;
+    }
+    // One clock read per completed write, shared by all frames of the batch
+    std::int64_t now = 0;
+    for (const auto &buffer : m_flushQueue) {
+        if (buffer->timestamp() == 0) {
+            continue;
+        }
+        if (now == 0) {
+            now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        m_latency->record(static_cast<std::uint64_t>(std::max<std::int64_t>(now - buffer->timestamp(), 0)));
+    }
+}
+
+const ConnectionMetrics& TcpConnection::metrics() const {
+    return m_metrics;
+}
+
+void TcpConnection::setLatencyHistogram(LatencyHistogram* histogram) {
+    m_latency = histogram;
+}
+
+void TcpConnection::setWaterMarks(size_t lowWaterMark, size_t highWaterMark) {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    m_lowWaterMark = lowWaterMark;
+    m_highWaterMark = highWaterMark;
+}
+
+void TcpConnection::setSlowConsumerPolicy(SlowConsumerPolicy policy) {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    m_policy = policy;
+    m_conflationSlots.clear();
+}
+
+SlowConsumerPolicy TcpConnection::slowConsumerPolicy() {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    return m_policy;
+}
+
+size_t TcpConnection::queuedBytes() {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    return m_queuedBytes;
+}
+
+bool TcpConnection::isCongested() {
+    std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+    return m_isCongested;
+}
 
 void TcpConnection::close(){
+    boost::asio::dispatch(m_socket.get_executor(), [self = shared_from_this()]() { self->doClose(); });
+}
+
+void TcpConnection::doClose(){
+    if (!m_isOpen.exchange(false)) {
+        return;
+    }
+    {
+        // Pending operations may keep the connection alive a little longer, what was queued
+        // for it is released right away
+        std::lock_guard<std::mutex> lock(m_writeBufferMutex);
+        for (size_t i = m_writeQueueHead; i < m_writeQueue.size(); ++i) {
+            m_queuedBytes -= m_writeQueue[i]->size();
+        }
+        m_writeQueue.clear();
+        m_writeQueueHead = 0;
+        m_conflationSlots.clear();
+        for (const auto &buffer : m_controlQueue) {
+            m_queuedBytes -= buffer->size();
+        }
+        m_controlQueue.clear();
+        if (m_ring) {
+            m_ring->close();
+            m_ring.reset();
+        }
+    }
+    if (m_descriptor >= 0) {
+        ::close(std::exchange(m_descriptor, -1));
+    }
     if(m_socket.is_open()){
         try {
             m_socket.close();
         } catch (const std::exception &e) {
             std::cerr << "TcpConnection::close() exception: " +
                             static_cast<std::string>(e.what()) + ".\n";
-            return;
         }
     }
+#if defined(TCP_SERVER_COROUTINES)
+    m_writeSignal.cancel();
+#endif
     m_object.onClose(m_connectionId);
 }
 
-std::shared_ptr<TcpConnection> TcpConnection::create(tcp::socket &&socket, TcpObject &object, int connId){
-    return std::shared_ptr<TcpConnection>(
+std::shared_ptr<TcpConnection> TcpConnection::create(StreamSocket &&socket, TcpObject &object, int connId){
+    auto connection = std::shared_ptr<TcpConnection>(
         new TcpConnection{std::move(socket), object, connId});
+#if defined(TCP_SERVER_COROUTINES)
+    connection->writeLoop(connection);
+#endif
+    return connection;
 }
@@ -1,168 +1,1161 @@
 #include "tcp_server.hpp"
+#include "admin_endpoint.hpp"
+#include "federation.hpp"
+#include "handler_allocator.hpp"
+#include "shard_group.hpp"
+#include "topic_trie.hpp"
 #include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-TcpServer::TcpServer(int port, boost::asio::io_context& io_context) : 
+namespace {
+    // Wait before accepting again after the kernel ran out of memory or descriptors
+    constexpr auto accept_retry_delay = std::chrono::milliseconds(100);
+
+    // Whole ticks of ConnectionTimeouts::tick, rounded up
+    std::uint64_t ticks(std::chrono::milliseconds duration){
+        return static_cast<std::uint64_t>((duration + ConnectionTimeouts::tick - std::chrono::milliseconds(1)) /
+                                          ConnectionTimeouts::tick);
+    }
+
+    int openSpareDescriptor(){
+        return ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    // Every connection needs a descriptor, so the soft limit (often 1024) is raised to the hard
+    // limit. Returns the limit in effect.
+    rlim_t raiseDescriptorLimit(){
+        struct rlimit limit;
+        if(getrlimit(RLIMIT_NOFILE, &limit) != 0){
+            return 0;
+        }
+        if(limit.rlim_cur < limit.rlim_max){
+            rlim_t current = limit.rlim_cur;
+            limit.rlim_cur = limit.rlim_max;
+            if(setrlimit(RLIMIT_NOFILE, &limit) != 0){
+                return current;
+            }
+        }
+        return limit.rlim_cur;
+    }
+}
+
+TcpServer::TcpServer(int port, boost::asio::io_context& io_context, bool reusePort) : 
     m_ioContext(io_context),
-    m_acceptor(io_context, tcp::endpoint(tcp::v4(), port)),
+    m_acceptor(io_context),
+    m_localAcceptor(io_context),
+    m_acceptRetryTimer(io_context),
+    m_localRetryTimer(io_context),
+    m_limits(),
+    m_spareDescriptor(openSpareDescriptor()),
     m_serverPort(port),
-    m_clientCount(0) {}
+    m_clientCount(0),
+    m_peerCount(0),
+    m_writeLowWaterMark(Constants::write_low_water_mark),
+    m_writeHighWaterMark(Constants::write_high_water_mark),
+    m_slowConsumerPolicy(SlowConsumerPolicy::DropNewest),
+    m_timeouts(),
+    m_timeoutTimer(io_context),
+    m_textPing(Protocol::encodeHeartbeat(Protocol::Opcode::Ping, Protocol::Version::Text)),
+    m_binaryPing(Protocol::encodeHeartbeat(Protocol::Opcode::Ping, Protocol::Version::Binary)),
+    m_router(nullptr),
+    m_publishRouter(nullptr),
+    m_registeredTopicCount(0),
+    m_ackTimer(io_context) {
+    using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+    tcp::endpoint endpoint(tcp::v4(), port);
+    m_acceptor.open(endpoint.protocol());
+    m_acceptor.set_option(tcp::acceptor::reuse_address(true));
+    if(reusePort){
+        m_acceptor.set_option(reuse_port(true));
+    }
+    m_acceptor.bind(endpoint);
+}
+
+TcpServer::~TcpServer(){
+    if(m_spareDescriptor >= 0){
+        ::close(m_spareDescriptor);
+    }
+    if(m_localAcceptor.is_open()){
+        ::unlink(m_localPath.c_str());
+    }
+}
+
+void TcpServer::listenLocal(const std::string& path){
+    boost::asio::local::stream_protocol::endpoint endpoint(path);
+    struct stat status;
+    if(::lstat(path.c_str(), &status) == 0){
+        if(!S_ISSOCK(status.st_mode)){
+            throw boost::system::system_error(boost::system::errc::make_error_code(boost::system::errc::file_exists),
+                                              "listenLocal: " + path + " is not a socket");
+        }
+        ::unlink(path.c_str());
+    }
+    m_localAcceptor.open(endpoint.protocol());
+    m_localAcceptor.bind(endpoint);
+    m_localPath = path;
+}
+
+void TcpServer::setRouter(PublishRouter* router){
+    m_router = router;
+    m_publishRouter = router != nullptr && router->routesPublishes() ? router : nullptr;
+}
+
+void TcpServer::setWriteWaterMarks(size_t lowWaterMark, size_t highWaterMark){
+    m_writeLowWaterMark = lowWaterMark;
+    m_writeHighWaterMark = highWaterMark;
+}
+
+void TcpServer::setSlowConsumerPolicy(SlowConsumerPolicy policy){
+    m_slowConsumerPolicy = policy;
+}
+
+void TcpServer::setConnectionLimits(const ConnectionLimits& limits){
+    m_limits = limits;
+    m_limits.acceptBatch = std::max<size_t>(m_limits.acceptBatch, 1);
+}
+
+void TcpServer::setTimeouts(const ConnectionTimeouts& timeouts){
+    m_timeouts = timeouts;
+}
 
 void TcpServer::start(){
     try {
-        std::cout << "Starting server on port " << m_serverPort << std::endl;
-        m_acceptor.listen(Constants::max_clients);
+        std::cout << "Starting server on port " << m_serverPort << " (" << Constants::io_engine << ", "
+                  << Constants::connection_engine << ")" << std::endl;
+        m_acceptor.listen(m_limits.backlog);
+        // Lets accept() drain the backlog after a completion without blocking
+        m_acceptor.non_blocking(true);
+        if (m_localAcceptor.is_open()) {
+            std::cout << "Accepting local clients on " << m_localPath << std::endl;
+            m_localAcceptor.listen(m_limits.backlog);
+            m_localAcceptor.non_blocking(true);
+        }
     } catch (const std::exception &e) {
         std::cerr << "TcpServer::start() exception: " +
                          static_cast<std::string>(e.what()) + ".\n";
         return;
     }
-      accept();
+      accept(m_acceptor);
+      if (m_localAcceptor.is_open()) {
+          accept(m_localAcceptor);
+      }
+      if (hasTimeouts()) {
+          m_timeoutStart = std::chrono::steady_clock::now();
+          startTimeoutTimer();
+      }
 }
 
-void TcpServer::accept(){
-    m_acceptor.async_accept([this](const auto &error, auto socket) {
+bool TcpServer::hasTimeouts() const{
+    return m_timeouts.heartbeatInterval.count() > 0 || m_timeouts.readTimeout.count() > 0 ||
+           m_timeouts.idleTimeout.count() > 0;
+}
+
+void TcpServer::startTimeoutTimer(){
+    // Deadlines are counted from the start, so a late tick does not delay the following ones
+    m_timeoutTimer.expires_at(m_timeoutStart + (m_timers.now() + 1) * ConnectionTimeouts::tick);
+    m_timeoutTimer.async_wait([this](const boost::system::error_code& error) {
         if (error) {
-          std::cerr << "TcpServer::doAccept() error: " + error.message() + ".\n";
-          return;
-        } else {
-          auto connection{
-              TcpConnection::create(std::move(socket), *this, m_clientCount)};
-          connection->read();
-          m_clientConnections.insert({m_clientCount, std::move(connection)});
-          onStart(m_clientCount);
-          m_clientCount++;
-        }
-        accept();
+            return;
+        }
+        auto elapsed = std::chrono::steady_clock::now() - m_timeoutStart;
+        m_timers.advance(static_cast<std::uint64_t>(elapsed / ConnectionTimeouts::tick),
+                         [this](std::uint32_t connId) { checkTimeouts(static_cast<int>(connId)); });
+        startTimeoutTimer();
     });
 }
 
-int TcpServer::getClientCount() const{
-    return m_clientNames.size();
+std::uint64_t TcpServer::nextDeadline(const Session& session) const{
+    std::uint64_t deadline = UINT64_MAX;
+    if (m_timeouts.heartbeatInterval.count() > 0) {
+        deadline = std::max(session.lastReceived, session.lastPing) + ticks(m_timeouts.heartbeatInterval);
+    }
+    if (m_timeouts.readTimeout.count() > 0) {
+        deadline = std::min(deadline, session.lastReceived + ticks(m_timeouts.readTimeout));
+    }
+    if (m_timeouts.idleTimeout.count() > 0 && !session.peer) {
+        deadline = std::min(deadline, session.lastActive + ticks(m_timeouts.idleTimeout));
+    }
+    return deadline;
 }
 
-std::string TcpServer::getClientName(int connId) const{
-    if(m_clientNames.find(connId) != m_clientNames.end()){
-        return m_clientNames.at(connId);
+void TcpServer::checkTimeouts(int connId){
+    Session *session = m_sessions.find(connId);
+    if (session == nullptr) {
+        return;
+    }
+    session->timer = TimingWheel::invalid_timer;
+    std::uint64_t now = m_timers.now();
+    bool readTimedOut = m_timeouts.readTimeout.count() > 0 &&
+                        now >= session->lastReceived + ticks(m_timeouts.readTimeout);
+    bool idleTimedOut = m_timeouts.idleTimeout.count() > 0 && !session->peer &&
+                        now >= session->lastActive + ticks(m_timeouts.idleTimeout);
+    if (readTimedOut || idleTimedOut) {
+        std::cout << "Client(id="<<connId<<") timed out (" << (readTimedOut ? "read" : "idle") << ")" << std::endl;
+        m_timedOutConnections.add();
+        // onClose() runs right away and frees the session, its subscriptions and queued frames
+        session->connection->close();
+        return;
+    }
+    if (m_timeouts.heartbeatInterval.count() > 0 &&
+        now >= std::max(session->lastReceived, session->lastPing) + ticks(m_timeouts.heartbeatInterval)) {
+        // A control frame, a congested connection still gets the chance to prove it is alive
+        auto &connection = session->connection;
+        connection->sendControl(connection->protocol() == Protocol::Version::Binary ? m_binaryPing : m_textPing);
+        session->lastPing = now;
+    }
+    std::uint64_t deadline = nextDeadline(*session);
+    if (deadline != UINT64_MAX) {
+        session->timer = m_timers.schedule(deadline, static_cast<std::uint32_t>(connId));
     }
-    return "";
 }
 
-std::vector<std::string> TcpServer::getClientTopics(int connId) const{
-    if(m_clientTopics.find(connId) != m_clientTopics.end()){
-        return m_clientTopics.at(connId);
+#if defined(TCP_SERVER_COROUTINES)
+template <typename Acceptor>
+void TcpServer::accept(Acceptor& acceptor){
+    acceptLoop(acceptor);
+}
+
+template <typename Acceptor>
+Coroutine TcpServer::acceptLoop(Acceptor& acceptor){
+    for (;;) {
+        auto [error, socket] = co_await acceptor.async_accept(use_coroutine);
+        if (!error) {
+            admit(std::move(socket));
+            error = acceptBacklog(acceptor);
+        }
+        switch (handleAcceptError(acceptor, error)) {
+        case AcceptStep::Continue:
+            break;
+        case AcceptStep::Retry: {
+            auto &timer = retryTimer(acceptor);
+            timer.expires_after(accept_retry_delay);
+            auto [timerError] = co_await timer.async_wait(use_coroutine);
+            if (timerError) {
+                co_return;
+            }
+            break;
+        }
+        case AcceptStep::Stop:
+            co_return;
+        }
     }
-    return std::vector<std::string>();
+}
+#else
+template <typename Acceptor>
+void TcpServer::accept(Acceptor& acceptor){
+    using Socket = typename Acceptor::protocol_type::socket;
+    acceptor.async_accept(pooled([this, &acceptor](boost::system::error_code error, Socket socket) {
+        if (!error) {
+          admit(std::move(socket));
+          error = acceptBacklog(acceptor);
+        }
+        switch (handleAcceptError(acceptor, error)) {
+        case AcceptStep::Continue:
+          return accept(acceptor);
+        case AcceptStep::Retry:
+          return retryAccept(acceptor);
+        case AcceptStep::Stop:
+          return;
+        }
+    }));
 }
 
-void TcpServer::handleCommand(const std::string& input, int connId){
-    std::istringstream stream(input);
-    std::string command;
-    if (!std::getline(stream, command, Constants::delimiter.c_str()[0])) {
-        return;
+template <typename Acceptor>
+void TcpServer::retryAccept(Acceptor& acceptor){
+    auto &timer = retryTimer(acceptor);
+    timer.expires_after(accept_retry_delay);
+    timer.async_wait([this, &acceptor](const boost::system::error_code &error) {
+        if (!error) {
+            accept(acceptor);
+        }
+    });
+}
+#endif
+
+template <typename Acceptor>
+boost::system::error_code TcpServer::acceptBacklog(Acceptor& acceptor){
+    // A connect storm is taken off the backlog in batches instead of one completion each
+    for (size_t i = 1; i < m_limits.acceptBatch; ++i) {
+      boost::system::error_code error;
+      auto next = acceptor.accept(error);
+      if (error == boost::asio::error::would_block || error == boost::asio::error::try_again) {
+        break;
+      }
+      if (error) {
+        return error;
+      }
+      admit(std::move(next));
     }
+    return {};
+}
 
-    if (command == "CONNECT") {
-        handleConnect(stream, connId);
+template <typename Acceptor>
+boost::asio::steady_timer& TcpServer::retryTimer(Acceptor& acceptor){
+    (void)acceptor;
+    // Each acceptor has its own timer, both fail at once when the process is out of descriptors
+    if constexpr (std::is_same_v<Acceptor, tcp::acceptor>) {
+        return m_acceptRetryTimer;
+    } else {
+        return m_localRetryTimer;
     }
-    else if (command == "DISCONNECT") {
-        handleDisconnect(connId);
+}
+
+void TcpServer::admit(StreamSocket socket){
+    if (m_limits.maxConnections != 0 && m_sessions.size() >= m_limits.maxConnections) {
+        return reject(socket);
+    }
+    int connId = m_sessions.insert({});
+    if (connId == SlotTable<Session>::invalid_handle) {
+        std::cerr << "TcpServer::admit() error: session table is full.\n";
+        return reject(socket);
+    }
+    boost::system::error_code error;
+    bool local = socket.local_endpoint(error).protocol().family() == AF_UNIX;
+    auto connection{TcpConnection::create(std::move(socket), *this, connId)};
+    if (local) {
+        // Clients asking for a shared memory ring pass it along with their CONNECT
+        connection->receiveDescriptor();
+    }
+    connection->setWaterMarks(m_writeLowWaterMark, m_writeHighWaterMark);
+    connection->setSlowConsumerPolicy(m_slowConsumerPolicy);
+    connection->setLatencyHistogram(&m_writeLatency);
+    Session &session = *m_sessions.find(connId);
+    session.connection = connection;
+    if (hasTimeouts()) {
+        session.lastReceived = session.lastActive = session.lastPing = m_timers.now();
+        session.timer = m_timers.schedule(nextDeadline(session), static_cast<std::uint32_t>(connId));
+    }
+    connection->read();
+    onStart(connId);
+}
+
+void TcpServer::reject(StreamSocket& socket){
+    // Reset instead of a graceful close, the client learns right away and no TIME_WAIT is left behind
+    boost::system::error_code ignored;
+    socket.set_option(boost::asio::socket_base::linger(true, 0), ignored);
+    socket.close(ignored);
+    m_rejectedConnections.add();
+}
+
+template <typename Acceptor>
+TcpServer::AcceptStep TcpServer::handleAcceptError(Acceptor& acceptor, const boost::system::error_code& error){
+    if (!error) {
+        return AcceptStep::Continue;
     }
-    else if (command == "PUBLISH") {
-        handlePublish(stream, connId);
+    if (error == boost::asio::error::operation_aborted || !acceptor.is_open()) {
+        return AcceptStep::Stop;
+    }
+    bool outOfDescriptors = error == boost::asio::error::no_descriptors ||
+                            error == boost::system::error_code(ENFILE, boost::system::system_category());
+    if (outOfDescriptors && m_spareDescriptor >= 0) {
+        // The pending connection stays in the backlog and would fail every accept again, so
+        // the spare descriptor makes room to accept and reject it and is then taken back
+        ::close(m_spareDescriptor);
+        boost::system::error_code ignored;
+        StreamSocket socket = acceptor.accept(ignored);
+        if (!ignored) {
+            reject(socket);
+        }
+        m_spareDescriptor = openSpareDescriptor();
+        return AcceptStep::Continue;
     }
-    else if (command == "SUBSCRIBE") {
-        handleSubscribe(stream, connId);
+    std::cerr << "TcpServer::accept() error: " + error.message() + ".\n";
+    if (outOfDescriptors || error == boost::asio::error::no_buffer_space ||
+        error == boost::asio::error::no_memory) {
+        return AcceptStep::Retry;
     }
-    else if (command == "UNSUBSCRIBE") {
-        handleUnsubscribe(stream, connId);
+    // Errors of a single connection, like one that was aborted while in the backlog
+    return AcceptStep::Continue;
+}
+
+int TcpServer::getClientCount() const{
+    return m_clientCount;
+}
+
+std::string TcpServer::getClientName(int connId) const{
+    const Session *session = m_sessions.find(connId);
+    return session ? session->name : "";
+}
+
+std::vector<std::string> TcpServer::getClientTopics(int connId) const{
+    return m_subscriptions.clientTopics(connId);
+}
+
+void TcpServer::handleCommand(std::string_view input, int connId){
+    if (input.empty()) {
+        return;
     }
-    else {
+    Tokenizer args(input);
+    std::string_view command = args.next(Constants::delimiter[0]);
+    if (!dispatch(lookupCommand(command), args, connId)) {
         std::cout << "Invalid command: " << command << std::endl;
     }
 }
 
-void TcpServer::handleConnect(std::istringstream& stream, int connId){
-    std::string name;
-    stream >> name;
+void TcpServer::handleConnect(Tokenizer& args, int connId){
+    std::string_view name = Tokenizer(args.next(Constants::delimiter[0])).nextWord();
+    std::string_view version = Tokenizer(args.next(Constants::delimiter[0])).nextWord();
+    std::string_view policyName = Tokenizer(args.next(Constants::delimiter[0])).nextWord();
+    std::string_view ringName = Tokenizer(args.next(Constants::delimiter[0])).nextWord();
+    std::string_view qos = Tokenizer(args.next(Constants::delimiter[0])).nextWord();
+    std::string_view receivedField = args.nextWord();
 
-    if (name.empty()) {
+    Session *session = m_sessions.find(connId);
+    if (name.empty() || session == nullptr) {
         std::cout << "Error: Invalid format CONNECT received.\n";
         return;
     }
-    m_clientNames[connId] = name;
-    m_clientTopics[connId] = std::vector<std::string>();
+    if (session->name.empty() && !session->peer) {
+        ++m_clientCount;
+    }
+    forgetQosConnection(*session, connId);
+    session->name = name;
     std::cout << "Client (id="<<connId<<") name: " << name << std::endl;
+
+    if (!policyName.empty()) {
+        if (auto policy = parseSlowConsumerPolicy(policyName)) {
+            session->connection->setSlowConsumerPolicy(*policy);
+        } else {
+            std::cout << "Error: Unknown slow consumer policy " << policyName << " received.\n";
+        }
+    }
+    if (version == "2" && qos == "1" && !session->peer) {
+        std::uint64_t received = 0;
+        std::from_chars(receivedField.data(), receivedField.data() + receivedField.size(), received);
+        // A shared memory ring is not used, it drops frames when it is full
+        session->connection->setProtocol(Protocol::Version::Binary);
+        resumeQos(*session, connId, received);
+        return;
+    }
+    // Connecting without QoS 1 discards what a QoS 1 connection of the name left behind
+    session->qos.reset();
+    takeRetainedQos(session->name);
+    if (version == "2") {
+        // The acknowledgement is the last text frame, everything after it is binary in both directions
+        session->connection->setProtocol(Protocol::Version::Binary);
+        // Only a client on the Unix domain socket can pass the ring's memory along
+        std::unique_ptr<ShmRing> ring;
+        int descriptor = session->connection->takeDescriptor();
+        if (ringName == Protocol::ring_field && descriptor >= 0 && !session->peer) {
+            ring = ShmRing::attach(std::exchange(descriptor, -1));
+        }
+        if (descriptor >= 0) {
+            ::close(descriptor);
+        }
+        if (!ringName.empty() && !ring) {
+            std::cout << "Error: Cannot attach the shared memory ring of client(id=" << connId << "), using the socket.\n";
+        }
+        std::string_view connack = ring ? Protocol::connack_ring : Protocol::connack;
+        session->connection->sendControl(connack.data(), connack.size());
+        if (ring) {
+            session->connection->attachRing(std::move(ring));
+        }
+    }
 }
 
-void TcpServer::handleDisconnect(int connId){
-    m_clientConnections[connId]->close();
+void TcpServer::resumeQos(Session& session, int connId, std::uint64_t received){
+    // A client that reconnects before its lost connection was noticed takes its state over
+    auto live = m_qosConnections.find(session.name);
+    if (live != m_qosConnections.end() && live->second != connId) {
+        Session *other = m_sessions.find(live->second);
+        if (other != nullptr && other->qos) {
+            session.qos = std::move(other->qos);
+            // Closing erases the other session, it has no state left to retain
+            other->connection->close();
+        }
+    }
+    m_qosConnections[session.name] = connId;
+    auto retained = takeRetainedQos(session.name);
+    if (!session.qos) {
+        session.qos = std::move(retained);
+    }
+    if (!session.qos) {
+        session.qos = std::make_unique<QosSession>();
+    }
+    // The delivery window and max_waiting_deliveries bound the queue instead of the slow
+    // consumer policy
+    session.connection->setWaterMarks(m_writeLowWaterMark, SIZE_MAX);
+
+    QosSession &qos = *session.qos;
+    qos.publishedAcknowledged = qos.published;
+    qos.ackPending = false;
+    std::string connack(Protocol::connack_qos);
+    connack += Constants::delimiter;
+    connack += std::to_string(qos.published);
+    session.connection->sendControl(connack.data(), connack.size());
+
+    qos.deliveries.resume(received);
+    std::vector<TcpConnection::OutboundFrame> frames;
+    frames.reserve(qos.deliveries.size());
+    for (const auto &frame : qos.deliveries.frames()) {
+        frames.push_back({frame});
+    }
+    if (!frames.empty()) {
+        std::cout << "Client(id="<<connId<<") " << session.name << " resumed, sending "
+                  << frames.size() << " unacknowledged messages again" << std::endl;
+        session.connection->send(frames.data(), frames.size());
+    }
+    sendWaiting(session);
 }
 
-void TcpServer::handlePublish(std::istringstream& stream, int connId){
-    (void)connId;
-    std::string topic, data;
-    if (!std::getline(stream, topic, Constants::delimiter.c_str()[0])) {
+void TcpServer::retainQos(Session& session){
+    takeRetainedQos(session.name);
+    if (m_retainedSessions.size() >= max_retained_sessions) {
+        const std::string &oldest = m_retainedOrder.front();
+        std::cout << "Discarded the QoS 1 state of " << oldest << ", the states of "
+                  << max_retained_sessions << " lost connections are kept at most" << std::endl;
+        m_discardedQosSessions.add();
+        m_retainedSessions.erase(oldest);
+        m_retainedOrder.pop_front();
+    }
+    auto order = m_retainedOrder.insert(m_retainedOrder.end(), session.name);
+    m_retainedSessions[session.name] = {std::move(session.qos), order};
+}
+
+std::unique_ptr<QosSession> TcpServer::takeRetainedQos(const std::string& name){
+    auto retained = m_retainedSessions.find(name);
+    if (retained == m_retainedSessions.end()) {
+        return nullptr;
+    }
+    auto qos = std::move(retained->second.qos);
+    m_retainedOrder.erase(retained->second.order);
+    m_retainedSessions.erase(retained);
+    return qos;
+}
+
+void TcpServer::forgetQosConnection(const Session& session, int connId){
+    auto entry = m_qosConnections.find(session.name);
+    if (entry != m_qosConnections.end() && entry->second == connId) {
+        m_qosConnections.erase(entry);
+    }
+}
+
+void TcpServer::handlePeer(Tokenizer& args, int connId){
+    // "PEER;node;2" is a CONNECT from another server
+    Session *session = m_sessions.find(connId);
+    if (session == nullptr || !session->name.empty() || session->peer) {
+        std::cout << "Error: PEER must be the first command of a connection.\n";
         return;
     }
+    session->peer = true;
+    ++m_peerCount;
+    handleConnect(args, connId);
+}
 
-    std::getline(stream, data);
+void TcpServer::handleDisconnect(int connId){
+    if(Session *session = m_sessions.find(connId)){
+        // Only a lost connection keeps its QoS 1 state
+        forgetQosConnection(*session, connId);
+        session->qos.reset();
+        session->connection->close();
+    }
+}
+
+void TcpServer::handlePublish(Tokenizer& args, int connId){
+    std::string_view topic = args.next(Constants::delimiter[0]);
+    std::string_view data = args.rest();
     
     if (topic.empty() || data.empty()) {
         std::cout << "Error: Invalid format PUBLISH received.\n";
+    } else if (!TopicTrie::isValidTopic(topic)) {
+        std::cout << "Error: Wildcards are not allowed in a PUBLISH topic.\n";
     } else {
-        std::vector<int> topicSubscribers;
-        for(auto it : m_clientTopics){
-            if(std::find(it.second.begin(), it.second.end(), topic) != it.second.end()){
-                topicSubscribers.push_back(it.first);
-            }
-        }
-        for(auto it : topicSubscribers){
-            std::string sendData(topic + Constants::delimiter + data);
-            m_clientConnections[it]->send(sendData.c_str(), sendData.size());
-        }
+        publish(topic, data, connId);
     }
 }
-void TcpServer::handleSubscribe(std::istringstream& stream, int connId){
-    std::string topic;
-    stream >> topic;
+
+void TcpServer::handleSubscribe(Tokenizer& args, int connId){
+    std::string_view topic = args.nextWord();
     if (topic.empty()) {
         std::cout << "Error: Invalid format SUBSCRIBE received.\n";
     } else {
-        m_clientTopics[connId].push_back(topic);
+        subscribe(topic, connId);
     }
 }
-void TcpServer::handleUnsubscribe(std::istringstream& stream, int connId){
-    std::string topic;
-    stream >> topic;
+
+void TcpServer::handleUnsubscribe(Tokenizer& args, int connId){
+    std::string_view topic = args.nextWord();
     if (topic.empty()) {
         std::cout << "Error: Invalid format UNSUBSCRIBE received.\n";
     } else {
-        auto &vecRef = m_clientTopics[connId];
-        auto it = std::find(vecRef.begin(), vecRef.end(), topic);
-        if(it != vecRef.end()){
-            vecRef.erase(it);
-        }       
+        unsubscribe(topic, connId);
     }
 }
 
+void TcpServer::handleStats(int connId){
+    Session *session = m_sessions.find(connId);
+    if (session == nullptr) {
+        return;
+    }
+    std::string summary = Metrics::formatSummary(collectMetrics());
+    auto &connection = session->connection;
+    if (session->qos) {
+        // A Message frame like any delivery, so QoS 1 numbering counts it as well. It is kept
+        // even in a full window or past max_waiting_deliveries, and QoS 1 connections are never
+        // congested, so it is sent after the deliveries queued before it.
+        auto frame = Protocol::encode(Protocol::Opcode::Message, "STATS", summary);
+        QosSession &qos = *session->qos;
+        if (qos.waiting.empty()) {
+            qos.deliveries.forcePush(frame);
+            connection->send(frame);
+        } else {
+            qos.waiting.push_back(frame);
+        }
+    } else if (connection->protocol() == Protocol::Version::Binary) {
+        connection->sendControl(Protocol::encode(Protocol::Opcode::Message, "STATS", summary));
+    } else {
+        summary.insert(0, "STATS" + Constants::delimiter);
+        connection->sendControl(summary.data(), summary.size());
+    }
+}
 
-void TcpServer::onRead(int connId, std::string data) {
-    handleCommand(data, connId);
+void TcpServer::handlePing(int connId){
+    Session *session = m_sessions.find(connId);
+    if (session != nullptr) {
+        session->connection->sendControl(Protocol::encodeHeartbeat(Protocol::Opcode::Pong, session->connection->protocol()));
+    }
+}
+
+void TcpServer::handleBinaryFrame(std::string_view data, int connId){
+    Protocol::Frame frame;
+    if (!Protocol::decode(data, frame)) {
+        std::cout << "Error: Invalid binary frame received.\n";
+        return;
+    }
+    if (frame.opcode == Protocol::Opcode::Disconnect) {
+        handleDisconnect(connId);
+        return;
+    }
+    if (frame.opcode == Protocol::Opcode::Stats) {
+        handleStats(connId);
+        return;
+    }
+    if (frame.opcode == Protocol::Opcode::Ping) {
+        handlePing(connId);
+        return;
+    }
+    if (frame.opcode == Protocol::Opcode::Pong) {
+        return;
+    }
+    Session *session = m_sessions.find(connId);
+    if (frame.opcode == Protocol::Opcode::Ack) {
+        if (session == nullptr || !session->qos) {
+            std::cout << "Error: Ack received from a client without QoS 1.\n";
+        } else if (!session->qos->deliveries.acknowledge(frame.sequence)) {
+            std::cout << "Error: Ack of message " << frame.sequence << " that was not sent received.\n";
+        } else {
+            sendWaiting(*session);
+        }
+        return;
+    }
+    if (session != nullptr && session->qos &&
+        (frame.opcode == Protocol::Opcode::Publish || frame.opcode == Protocol::Opcode::PublishById ||
+         frame.opcode == Protocol::Opcode::PublishBatch)) {
+        // Counted even if the publish turns out invalid, the client numbers every one it sent
+        ++session->qos->published;
+    }
+    if (frame.opcode == Protocol::Opcode::PublishBatch) {
+        publishBatch(frame.payload, connId);
+        return;
+    }
+    if (frame.opcode == Protocol::Opcode::PublishById) {
+        // Ids are reused once released, so only those the client holds are accepted
+        if (session == nullptr || frame.topicId >= session->registeredTopics.size() ||
+            !session->registeredTopics[frame.topicId]) {
+            std::cout << "Error: Unknown topic id " << frame.topicId << " received.\n";
+        } else {
+            publish(frame.topicId, frame.payload, connId);
+        }
+        return;
+    }
+    if (frame.opcode == Protocol::Opcode::Register) {
+        registerTopic(frame.topic, connId);
+        return;
+    }
+    // Topics are shared with text clients, so they follow the text rules
+    if (frame.topic.empty() || frame.topic.find_first_of("; \t\r\n") != std::string_view::npos) {
+        std::cout << "Error: Invalid topic in binary frame received.\n";
+        return;
+    }
+    switch (frame.opcode) {
+        case Protocol::Opcode::Publish:
+            if (!TopicTrie::isValidTopic(frame.topic)) {
+                std::cout << "Error: Wildcards are not allowed in a PUBLISH topic.\n";
+            } else {
+                publish(frame.topic, frame.payload, connId);
+            }
+            break;
+        case Protocol::Opcode::Subscribe: subscribe(frame.topic, connId); break;
+        case Protocol::Opcode::Unsubscribe: unsubscribe(frame.topic, connId); break;
+        default: std::cout << "Error: Unexpected binary frame received.\n"; break;
+    }
+}
+
+void TcpServer::registerTopic(std::string_view topic, int connId){
+    Session *session = m_sessions.find(connId);
+    if(session == nullptr){
+        return;
+    }
+    // Answered either way, the client waits for the reply of every topic it registers
+    if(topic.empty() || topic.find_first_of("; \t\r\n") != std::string_view::npos ||
+       !TopicTrie::isValidTopic(topic)){
+        std::cout << "Error: Invalid REGISTER topic received.\n";
+        session->connection->sendControl(Protocol::encode(Protocol::Opcode::Registered, topic, {},
+                                                          Protocol::rejected_topic_id));
+        return;
+    }
+    TopicId topicId = m_subscriptions.find(topic);
+    auto &registered = session->registeredTopics;
+    if(topicId != SubscriptionIndex::invalid_topic && topicId < registered.size() && registered[topicId]){
+        session->connection->sendControl(Protocol::encode(Protocol::Opcode::Registered, topic, {}, topicId));
+        return;
+    }
+    bool registeredByOthers = topicId < m_topicRegistrations.size() && m_topicRegistrations[topicId] != 0;
+    if(session->registeredTopicCount >= max_registered_topics_per_session ||
+       (!registeredByOthers && m_registeredTopicCount >= max_registered_topics)){
+        std::cout << "Error: Client(id=" << connId << ") cannot register more topics.\n";
+        session->connection->sendControl(Protocol::encode(Protocol::Opcode::Registered, topic, {},
+                                                          Protocol::rejected_topic_id));
+        return;
+    }
+    topicId = m_subscriptions.intern(topic);
+    if(registered.size() <= topicId){
+        registered.resize(topicId + 1);
+    }
+    registered[topicId] = true;
+    ++session->registeredTopicCount;
+    if(m_topicRegistrations.size() <= topicId){
+        m_topicRegistrations.resize(topicId + 1);
+    }
+    if(m_topicRegistrations[topicId]++ == 0){
+        ++m_registeredTopicCount;
+    }
+    session->connection->sendControl(Protocol::encode(Protocol::Opcode::Registered, topic, {}, topicId));
+}
+
+void TcpServer::releaseRegisteredTopics(Session& session){
+    auto &registered = session.registeredTopics;
+    for(TopicId topicId = 0; topicId < registered.size() && session.registeredTopicCount != 0; ++topicId){
+        if(!registered[topicId]){
+            continue;
+        }
+        --session.registeredTopicCount;
+        if(--m_topicRegistrations[topicId] != 0){
+            continue;
+        }
+        --m_registeredTopicCount;
+        // Kept while it has subscribers or counters, those would be reported under the topic reusing it
+        m_subscriptions.release(topicId);
+    }
+    registered.clear();
+}
+
+void TcpServer::publish(std::string_view topic, std::string_view data, int connId){
+    // Published topics are not interned, subscribers by wildcard are matched by the string
+    publish(m_subscriptions.find(topic), topic, data, connId);
+}
+
+void TcpServer::publish(TopicId topicId, std::string_view data, int connId){
+    publish(topicId, m_subscriptions.topicName(topicId), data, connId);
+}
+
+void TcpServer::publish(TopicId topicId, std::string_view topic, std::string_view data, int connId){
+    (void)connId;
+    auto &metrics = topicMetrics(topicId);
+    metrics.published.add();
+    metrics.publishedBytes.add(data.size());
+    const auto &subscribers = matchSubscribers(topicId, topic);
+    if(m_publishRouter == nullptr && m_peerCount == 0 && subscribers.empty()){
+        return;
+    }
+    // Encoded at most once per protocol, every subscriber queue references the same buffer
+    PublishFrames frames(topic, data);
+    frames.setTimestamp(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+    deliver(topicId, frames, subscribers);
+    if(m_peerCount != 0){
+        deliver(topicId, frames, m_peerSubscriptions.match(topic));
+    }
+    if(m_publishRouter){
+        m_publishRouter->onPublish(topic, frames.text());
+    }
+}
+
+void TcpServer::publishBatch(std::string_view entries, int connId){
+    (void)connId;
+    auto timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    std::string_view topic;
+    std::string_view data;
+    while(Protocol::nextBatchEntry(entries, topic, data)){
+        if(topic.empty() || topic.find_first_of("; \t\r\n") != std::string_view::npos ||
+           !TopicTrie::isValidTopic(topic)){
+            std::cout << "Error: Invalid topic in PUBLISH_BATCH received.\n";
+            continue;
+        }
+        TopicId topicId = m_subscriptions.find(topic);
+        auto &metrics = topicMetrics(topicId);
+        metrics.published.add();
+        metrics.publishedBytes.add(data.size());
+        PublishFrames frames(topic, data);
+        frames.setTimestamp(timestamp);
+        queueDeliveries(topicId, frames, matchSubscribers(topicId, topic));
+        if(m_peerCount != 0){
+            queueDeliveries(topicId, frames, m_peerSubscriptions.match(topic));
+        }
+        if(m_publishRouter){
+            m_publishRouter->onPublish(topic, frames.text());
+        }
+    }
+    flushBatch();
+}
+
+void TcpServer::queueDeliveries(TopicId topicId, PublishFrames& frames, const std::vector<int>& subscribers){
+    for(int subscriber : subscribers){
+        Session *session = m_sessions.find(subscriber);
+        if(session == nullptr){
+            continue;
+        }
+        const SharedBufferPtr *frame = deliveryFrame(*session, topicId, frames);
+        if(frame == nullptr){
+            topicMetrics(topicId).dropped.add();
+            continue;
+        }
+        QosAdmission admission = session->qos ? admitQos(*session, *frame) : QosAdmission::Send;
+        if(admission != QosAdmission::Send){
+            auto &metrics = topicMetrics(topicId);
+            admission == QosAdmission::Wait ? metrics.delivered.add() : metrics.dropped.add();
+            continue;
+        }
+        if(session->pendingFrames.empty()){
+            m_batchSubscribers.push_back(subscriber);
+        }
+        // The topic is the conflation key, flushBatch() credits the topic's metrics with it
+        session->pendingFrames.push_back({*frame, topicId});
+    }
+}
+
+void TcpServer::flushBatch(){
+    for(int subscriber : m_batchSubscribers){
+        Session *session = m_sessions.find(subscriber);
+        if(session == nullptr){
+            continue;
+        }
+        auto &pending = session->pendingFrames;
+        session->connection->send(pending.data(), pending.size());
+        for(auto &frame : pending){
+            auto &metrics = topicMetrics(frame.conflationKey);
+            frame.sent ? metrics.delivered.add() : metrics.dropped.add();
+        }
+        pending.clear();
+    }
+    m_batchSubscribers.clear();
+}
+
+const SharedBufferPtr* TcpServer::deliveryFrame(const Session& session, TopicId topicId, PublishFrames& frames){
+    if(session.connection->protocol() == Protocol::Version::Binary){
+        const auto &registered = session.registeredTopics;
+        if(topicId < registered.size() && registered[topicId]){
+            return &frames.binaryById(topicId);
+        }
+        return &frames.binary();
+    }
+    return frames.isTextSafe() ? &frames.text() : nullptr;
+}
+
+bool TcpServer::sendDelivery(Session& session, const SharedBufferPtr& frame, std::uint32_t conflationKey){
+    if(!session.qos){
+        return session.connection->send(frame, conflationKey);
+    }
+    QosAdmission admission = admitQos(session, frame);
+    if(admission == QosAdmission::Send){
+        // Sent again on the next connection if this one is closing
+        session.connection->send(frame, conflationKey);
+    }
+    return admission != QosAdmission::Refuse;
+}
+
+TcpServer::QosAdmission TcpServer::admitQos(Session& session, const SharedBufferPtr& frame){
+    QosSession &qos = *session.qos;
+    if(qos.waiting.empty() && qos.deliveries.push(frame)){
+        return QosAdmission::Send;
+    }
+    // Once full the connection is closing, later deliveries are lost like those of any
+    // lost connection
+    if(qos.waiting.size() >= max_waiting_deliveries){
+        return QosAdmission::Refuse;
+    }
+    qos.waiting.push_back(frame);
+    if(qos.waiting.size() == max_waiting_deliveries){
+        std::cout << "Client " << session.name << " is " << max_waiting_deliveries
+                  << " messages behind its QoS 1 window, disconnecting it" << std::endl;
+        m_slowConsumerDisconnects.add();
+        // Posted, the caller may be iterating the subscribers that onClose changes
+        boost::asio::post(m_ioContext, [connection = session.connection]() { connection->close(); });
+    }
+    return QosAdmission::Wait;
+}
+
+void TcpServer::sendWaiting(Session& session){
+    QosSession &qos = *session.qos;
+    std::vector<TcpConnection::OutboundFrame> frames;
+    while(!qos.waiting.empty() && qos.deliveries.push(qos.waiting.front())){
+        frames.push_back({qos.waiting.front()});
+        qos.waiting.pop_front();
+    }
+    if(!frames.empty()){
+        session.connection->send(frames.data(), frames.size());
+    }
+}
+
+void TcpServer::deliver(PublishFrames& frames){
+    deliver(m_subscriptions.find(frames.topic()), frames);
+}
+
+void TcpServer::deliver(TopicId topicId, PublishFrames& frames){
+    deliver(topicId, frames, matchSubscribers(topicId, frames.topic()));
+}
+
+const std::vector<int>& TcpServer::matchSubscribers(TopicId topicId, std::string_view topic){
+    if(topicId == SubscriptionIndex::invalid_topic){
+        return m_subscriptions.match(topic);
+    }
+    return m_subscriptions.match(topicId);
+}
+
+void TcpServer::deliver(TopicId topicId, PublishFrames& frames, const std::vector<int>& subscribers){
+    std::uint64_t delivered = 0;
+    std::uint64_t dropped = 0;
+    for(int subscriber : subscribers){
+        Session *session = m_sessions.find(subscriber);
+        if(session == nullptr){
+            continue;
+        }
+        const SharedBufferPtr *frame = deliveryFrame(*session, topicId, frames);
+        if(frame == nullptr){
+            // A text subscriber cannot receive the payload, it is lost for it like a dropped one
+            ++dropped;
+            continue;
+        }
+        sendDelivery(*session, *frame, topicId) ? ++delivered : ++dropped;
+    }
+    auto &metrics = topicMetrics(topicId);
+    metrics.delivered.add(delivered);
+    metrics.dropped.add(dropped);
+}
+
+TopicMetrics& TcpServer::topicMetrics(TopicId topicId){
+    if(topicId == SubscriptionIndex::invalid_topic){
+        return m_otherTopicMetrics;
+    }
+    if(topicId >= m_topicMetricSlots.size()){
+        m_topicMetricSlots.resize(topicId + 1, no_metric_slot);
+    }
+    auto &slot = m_topicMetricSlots[topicId];
+    if(slot == no_metric_slot){
+        if(m_topicMetrics.size() >= max_topic_metrics){
+            return m_otherTopicMetrics;
+        }
+        slot = static_cast<std::uint32_t>(m_topicMetrics.size());
+        m_topicMetrics.emplace_back();
+        // Counters are kept for good, so the id must not be reused by another topic
+        m_subscriptions.hold(topicId);
+    }
+    return m_topicMetrics[slot];
+}
+
+MetricsSnapshot TcpServer::collectMetrics(){
+    MetricsSnapshot snapshot;
+    snapshot.connections.reserve(m_sessions.size());
+    m_sessions.forEach([&snapshot](int connId, const Session& session) {
+        const auto &metrics = session.connection->metrics();
+        snapshot.connections.push_back({connId, session.name, metrics.messagesIn.value(),
+                                        metrics.bytesIn.value(), metrics.messagesOut.value(),
+                                        metrics.bytesOut.value(), metrics.dropped.value(),
+                                        session.connection->queuedBytes()});
+    });
+    std::sort(snapshot.connections.begin(), snapshot.connections.end(),
+              [](const auto &a, const auto &b) { return a.id < b.id; });
+    std::uint64_t otherSubscribers = 0;
+    for(TopicId topicId = 0; topicId < m_subscriptions.topicIdCount(); ++topicId){
+        std::uint64_t subscribers = m_subscriptions.subscribers(topicId).size();
+        bool counted = topicId < m_topicMetricSlots.size() && m_topicMetricSlots[topicId] != no_metric_slot;
+        if(!counted && subscribers == 0){
+            continue;
+        }
+        // A subscribed filter gets its counters now, so its subscribers are reported with it
+        const auto &metrics = topicMetrics(topicId);
+        if(&metrics == &m_otherTopicMetrics){
+            otherSubscribers += subscribers;
+            continue;
+        }
+        if(subscribers == 0 && metrics.published.value() == 0 && metrics.delivered.value() == 0){
+            continue;
+        }
+        snapshot.topics.push_back({m_subscriptions.topicName(topicId), subscribers, metrics.published.value(),
+                                   metrics.publishedBytes.value(), metrics.delivered.value(),
+                                   metrics.dropped.value()});
+    }
+    const auto &other = m_otherTopicMetrics;
+    if(otherSubscribers != 0 || other.published.value() != 0 || other.delivered.value() != 0){
+        snapshot.topics.push_back({Metrics::other_topics, otherSubscribers, other.published.value(),
+                                   other.publishedBytes.value(), other.delivered.value(), other.dropped.value()});
+    }
+    snapshot.writeLatency->merge(m_writeLatency);
+    snapshot.slowConsumerDisconnects = m_slowConsumerDisconnects.value();
+    snapshot.rejectedConnections = m_rejectedConnections.value();
+    snapshot.timedOutConnections = m_timedOutConnections.value();
+    snapshot.discardedQosSessions = m_discardedQosSessions.value();
+    return snapshot;
+}
+
+void TcpServer::subscribe(std::string_view topic, int connId){
+    if(!TopicTrie::isValidFilter(topic)){
+        std::cout << "Error: Invalid topic filter " << topic << " received.\n";
+        return;
+    }
+    const Session *session = m_sessions.find(connId);
+    if(session != nullptr && session->peer){
+        m_peerSubscriptions.subscribe(connId, topic);
+        return;
+    }
+    // Interest is forwarded per filter, routers match publishes against it the same way
+    if(m_subscriptions.subscribe(connId, topic) && m_router &&
+       m_subscriptions.subscribers(topic).size() == 1){
+        m_router->onTopicInterest(topic, true);
+    }
+}
+
+void TcpServer::unsubscribe(std::string_view topic, int connId){
+    const Session *session = m_sessions.find(connId);
+    if(session != nullptr && session->peer){
+        m_peerSubscriptions.unsubscribe(connId, topic);
+        return;
+    }
+    if(m_subscriptions.unsubscribe(connId, topic) && m_router &&
+       m_subscriptions.subscribers(topic).empty()){
+        m_router->onTopicInterest(topic, false);
+    }
+}
+
+void TcpServer::onRead(int connId, std::string_view data) {
+    Session *session = m_sessions.find(connId);
+    if (session != nullptr) {
+        // Ticks instead of clock reads, the timeouts only need their resolution
+        Protocol::Version version = session->connection->protocol();
+        session->lastReceived = m_timers.now();
+        if (!Protocol::isHeartbeat(data, version, Protocol::Opcode::Ping) &&
+            !Protocol::isHeartbeat(data, version, Protocol::Opcode::Pong)) {
+            session->lastActive = session->lastReceived;
+        }
+    }
+    if (session != nullptr && session->connection->protocol() == Protocol::Version::Binary) {
+        handleBinaryFrame(data, connId);
+    } else {
+        handleCommand(data, connId);
+    }
 }
 
 void TcpServer::onClose(int connId){
-    if(m_clientNames.find(connId) != m_clientNames.end()){
-        std::cout << "Connection closed to client(id="<<connId<<") " << m_clientNames[connId] << std::endl;
-        m_clientTopics.erase(connId);
-        m_clientNames.erase(connId);
-        m_clientConnections.erase(connId);
+    Session *session = m_sessions.find(connId);
+    if(session == nullptr){
+        return;
+    }
+    m_timers.cancel(session->timer);
+    forgetQosConnection(*session, connId);
+    if(session->qos){
+        retainQos(*session);
     }
+    if(session->peer){
+        std::cout << "Connection closed to peer(id="<<connId<<") " << session->name << std::endl;
+        m_peerSubscriptions.removeClient(connId);
+        releaseRegisteredTopics(*session);
+        --m_peerCount;
+        m_sessions.erase(connId);
+        return;
+    }
+    if(!session->name.empty()){
+        std::cout << "Connection closed to client(id="<<connId<<") " << session->name << std::endl;
+        --m_clientCount;
+    }
+    for(const auto &topic : m_subscriptions.removeClient(connId)){
+        if(m_router){
+            m_router->onTopicInterest(topic, false);
+        }
+    }
+    // After its subscriptions are gone, so the ids of topics only it used are released
+    releaseRegisteredTopics(*session);
+    m_sessions.erase(connId);
 }
 
 void TcpServer::onStart(int connId){
     std::cout << "New client(id="<<connId<<") connected" << std::endl;
 }
 
+void TcpServer::onReadComplete(int connId){
+    Session *session = m_sessions.find(connId);
+    if(session == nullptr || !session->qos){
+        return;
+    }
+    QosSession &qos = *session->qos;
+    std::uint64_t unacknowledged = qos.published - qos.publishedAcknowledged;
+    if(unacknowledged >= AckWindow::ack_threshold){
+        sendAck(*session);
+    }else if(unacknowledged != 0 && !qos.ackPending){
+        qos.ackPending = true;
+        m_pendingAcks.push_back(connId);
+        if(m_pendingAcks.size() == 1){
+            m_ackTimer.expires_after(AckWindow::ack_delay);
+            m_ackTimer.async_wait([this](const boost::system::error_code& error) {
+                if(!error){
+                    flushAcks();
+                }
+            });
+        }
+    }
+}
+
+void TcpServer::sendAck(Session& session){
+    QosSession &qos = *session.qos;
+    qos.publishedAcknowledged = qos.published;
+    session.connection->sendControl(Protocol::encodeAck(qos.published));
+}
+
+void TcpServer::flushAcks(){
+    for(int connId : m_pendingAcks){
+        // Sessions closed meanwhile are gone, their state is reset when it is resumed
+        Session *session = m_sessions.find(connId);
+        if(session == nullptr || !session->qos || !session->qos->ackPending){
+            continue;
+        }
+        session->qos->ackPending = false;
+        if(session->qos->published != session->qos->publishedAcknowledged){
+            sendAck(*session);
+        }
+    }
+    m_pendingAcks.clear();
+}
+
+void TcpServer::onBackpressure(int connId, bool congested){
+    // The connection's slow consumer policy bounds its queue, so a client that stops
+    // reading cannot stall the server or grow its memory without bound
+    if(congested){
+        Session *session = m_sessions.find(connId);
+        SlowConsumerPolicy policy = session ? session->connection->slowConsumerPolicy() : m_slowConsumerPolicy;
+        if(policy == SlowConsumerPolicy::Disconnect){
+            m_slowConsumerDisconnects.add();
+        }
+        std::cout << "Client(id="<<connId<<") is not keeping up (" << slowConsumerPolicyName(policy) << ")" << std::endl;
+    } else {
+        std::cout << "Client(id="<<connId<<") caught up" << std::endl;
+    }
+}
+
 void signal_handler(int s){
     (void)s;
     std::cout << std::endl << "Caught SIGINT signal" << std::endl;
@@ -170,8 +1163,61 @@ void signal_handler(int s){
 }
 
 int main(int argc, char* argv[]){
-    if(argc != 2){
-        std::cout << "Program only takes one input: <server_port>" << std::endl;
+    int threads = 1;
+    int adminPort = 0;
+    std::optional<SlowConsumerPolicy> policy = SlowConsumerPolicy::DropNewest;
+    ConnectionLimits limits;
+    ConnectionTimeouts timeouts;
+    std::string localPath;
+    std::string nodeName;
+    std::vector<tcp::endpoint> peers;
+    bool validPeers = true;
+    bool validAdminPort = true;
+    bool validArgs = argc >= 2 && argc % 2 == 0;
+    for(int i = 2; validArgs && i + 1 < argc; i += 2){
+        if(strcmp(argv[i], "--threads") == 0){
+            threads = atoi(argv[i + 1]);
+        } else if(strcmp(argv[i], "--admin-port") == 0){
+            adminPort = atoi(argv[i + 1]);
+            // 0 is how no admin endpoint is stored, so it cannot be asked for
+            validAdminPort = adminPort > 0 && adminPort <= 65535;
+        } else if(strcmp(argv[i], "--slow-consumer") == 0){
+            policy = parseSlowConsumerPolicy(argv[i + 1]);
+        } else if(strcmp(argv[i], "--max-connections") == 0){
+            limits.maxConnections = strtoull(argv[i + 1], nullptr, 10);
+        } else if(strcmp(argv[i], "--backlog") == 0){
+            limits.backlog = atoi(argv[i + 1]);
+        } else if(strcmp(argv[i], "--accept-batch") == 0){
+            limits.acceptBatch = strtoull(argv[i + 1], nullptr, 10);
+        } else if(strcmp(argv[i], "--heartbeat") == 0){
+            timeouts.heartbeatInterval = std::chrono::seconds(atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "--read-timeout") == 0){
+            timeouts.readTimeout = std::chrono::seconds(atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "--idle-timeout") == 0){
+            timeouts.idleTimeout = std::chrono::seconds(atoi(argv[i + 1]));
+        } else if(strcmp(argv[i], "--uds") == 0){
+            localPath = argv[i + 1];
+        } else if(strcmp(argv[i], "--node") == 0){
+            nodeName = argv[i + 1];
+        } else if(strcmp(argv[i], "--peer") == 0){
+            // <address>:<port>
+            std::string_view peer = argv[i + 1];
+            size_t colon = peer.rfind(':');
+            boost::system::error_code error;
+            auto address = boost::asio::ip::make_address(std::string(peer.substr(0, colon)), error);
+            int peerPort = colon == std::string_view::npos ? 0 : atoi(argv[i + 1] + colon + 1);
+            validPeers = validPeers && !error && peerPort > 0 && peerPort <= 65535;
+            peers.emplace_back(address, static_cast<unsigned short>(peerPort));
+        } else {
+            validArgs = false;
+        }
+    }
+    if(!validArgs){
+        std::cout << "Usage: tcp_server <server_port> [--threads <count>] [--admin-port <port>]"
+                     " [--slow-consumer drop-newest|disconnect|drop-oldest|conflate]"
+                     " [--max-connections <count>] [--backlog <count>] [--accept-batch <count>] [--uds <path>]"
+                     " [--heartbeat <seconds>] [--read-timeout <seconds>] [--idle-timeout <seconds>]"
+                     " [--node <name> --peer <address>:<port> ...]" << std::endl;
         return -1;
     }
 
@@ -184,11 +1230,101 @@ int main(int argc, char* argv[]){
     sigaction(SIGINT, &sigIntHandler, NULL);
 
     int x = atoi(argv[1]);
+    if(threads < 1 || threads > static_cast<int>(ShardGroup::max_shards)){
+        std::cout << "Thread count must be between 1 and " << ShardGroup::max_shards << std::endl;
+        return -1;
+    }
+    if(!validAdminPort){
+        std::cout << "Admin port must be between 1 and 65535" << std::endl;
+        return -1;
+    }
+    if(!policy){
+        std::cout << "Slow consumer policy must be drop-newest, disconnect, drop-oldest or conflate" << std::endl;
+        return -1;
+    }
+    if(limits.backlog < 1 || limits.acceptBatch < 1){
+        std::cout << "Backlog and accept batch must be at least 1" << std::endl;
+        return -1;
+    }
+    if(timeouts.heartbeatInterval.count() < 0 || timeouts.readTimeout.count() < 0 || timeouts.idleTimeout.count() < 0){
+        std::cout << "Heartbeat interval and timeouts must be at least 0 (off)" << std::endl;
+        return -1;
+    }
+    if(!validPeers || (!peers.empty() && (nodeName.empty() || threads > 1))){
+        std::cout << "Peers must be given as <address>:<port>, need --node and cannot be combined with --threads" << std::endl;
+        return -1;
+    }
+    // The socket path is only known to be usable once it is bound
+    auto listenLocal = [&localPath](auto& server) {
+        if(localPath.empty()){
+            return true;
+        }
+        try{
+            server.listenLocal(localPath);
+        } catch(const boost::system::system_error& e){
+            std::cout << "Cannot listen on " << localPath << ": " << e.what() << std::endl;
+            return false;
+        }
+        return true;
+    };
+    std::cout << "Descriptor limit " << raiseDescriptorLimit() << std::endl;
+    if(threads > 1){
+        std::cout << "Starting " << threads << " shards" << std::endl;
+        ShardGroup shards{x, static_cast<size_t>(threads)};
+        shards.setSlowConsumerPolicy(*policy);
+        shards.setConnectionLimits(limits);
+        shards.setTimeouts(timeouts);
+        if(!listenLocal(shards)){
+            return -1;
+        }
+        shards.start();
+        // The admin endpoint waits for the shards, so it gets a thread of its own
+        boost::asio::io_context adminContext;
+        std::unique_ptr<AdminEndpoint> admin;
+        std::thread adminThread;
+        if(adminPort != 0){
+            admin = std::make_unique<AdminEndpoint>(adminPort, adminContext, [&shards]() {
+                return Metrics::formatPrometheus(shards.collectMetrics());
+            });
+            admin->start();
+            adminThread = std::thread{[&adminContext]() { adminContext.run(); }};
+        }
+        shards.wait();
+        adminContext.stop();
+        if(adminThread.joinable()){
+            adminThread.join();
+        }
+        return 0;
+    }
+
     boost::asio::io_context context;
 
     TcpServer server{x, context};
+    server.setSlowConsumerPolicy(*policy);
+    server.setConnectionLimits(limits);
+    server.setTimeouts(timeouts);
+    if(!listenLocal(server)){
+        return -1;
+    }
     server.start();
+    std::unique_ptr<Federation> federation;
+    if(!peers.empty()){
+        federation = std::make_unique<Federation>(server, context, nodeName);
+        for(const auto &peer : peers){
+            federation->addPeer(peer);
+        }
+        federation->start();
+    }
+    std::unique_ptr<AdminEndpoint> admin;
+    if(adminPort != 0){
+        admin = std::make_unique<AdminEndpoint>(adminPort, context, [&server]() {
+            std::vector<MetricsSnapshot> snapshots;
+            snapshots.push_back(server.collectMetrics());
+            return Metrics::formatPrometheus(snapshots);
+        });
+        admin->start();
+    }
     context.run();
 
     return 0;
-}
\ No newline at end of file
+}
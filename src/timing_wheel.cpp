@@ -0,0 +1,131 @@
+#include "timing_wheel.hpp"
+#include <algorithm>
+
+namespace {
+    constexpr std::uint64_t slot_mask = TimingWheel::slot_count - 1;
+}
+
+TimingWheel::TimingWheel() :
+    m_free(invalid_timer),
+    m_now(0),
+    m_size(0) {
+    m_slots.fill(invalid_timer);
+}
+
+std::uint64_t TimingWheel::now() const{
+    return m_now;
+}
+
+size_t TimingWheel::size() const{
+    return m_size;
+}
+
+TimingWheel::TimerId TimingWheel::schedule(std::uint64_t deadline, std::uint32_t key){
+    TimerId id = m_free;
+    if(id != invalid_timer){
+        m_free = m_timers[id].next;
+    } else {
+        id = static_cast<TimerId>(m_timers.size());
+        m_timers.emplace_back();
+    }
+    Timer &timer = m_timers[id];
+    // The slot of the current tick is already being expired or done
+    timer.deadline = std::max(deadline, m_now + 1);
+    timer.key = key;
+    ++m_size;
+    place(id);
+    return id;
+}
+
+void TimingWheel::cancel(TimerId id){
+    if(id >= m_timers.size() || m_timers[id].slot == no_slot){
+        return;
+    }
+    unlink(id);
+    release(id);
+}
+
+void TimingWheel::advance(std::uint64_t tick, const std::function<void(std::uint32_t)>& onExpire){
+    while(m_now < tick){
+        if(m_size == 0){
+            m_now = tick;
+            break;
+        }
+        ++m_now;
+        // Every 256 ticks the next slot of level 1 comes into reach, and so on up the levels
+        for(unsigned level = level_count - 1; level > 0; --level){
+            if((m_now & ((std::uint64_t{1} << (slot_bits * level)) - 1)) == 0){
+                cascade(level);
+            }
+        }
+        // One timer at a time, onExpire may cancel the next one of the slot
+        std::uint32_t slot = static_cast<std::uint32_t>(m_now & slot_mask);
+        while(m_slots[slot] != invalid_timer){
+            TimerId id = m_slots[slot];
+            std::uint32_t key = m_timers[id].key;
+            unlink(id);
+            release(id);
+            onExpire(key);
+        }
+    }
+}
+
+void TimingWheel::place(TimerId id){
+    std::uint64_t deadline = m_timers[id].deadline;
+    // Lowest level whose slot range holds the deadline, which is the first level above
+    // which the deadline and now agree
+    for(unsigned level = 0; level < level_count; ++level){
+        unsigned shift = slot_bits * (level + 1);
+        if((deadline >> shift) == (m_now >> shift)){
+            auto index = static_cast<std::uint32_t>((deadline >> (slot_bits * level)) & slot_mask);
+            return link(id, level * slot_count + index);
+        }
+    }
+    // Further out than the wheel reaches. Parked in the top level slot visited last, which
+    // places it again once it is in reach.
+    unsigned top = level_count - 1;
+    auto index = static_cast<std::uint32_t>(((m_now >> (slot_bits * top)) - 1) & slot_mask);
+    link(id, top * slot_count + index);
+}
+
+void TimingWheel::link(TimerId id, std::uint32_t slot){
+    Timer &timer = m_timers[id];
+    timer.slot = slot;
+    timer.previous = invalid_timer;
+    timer.next = m_slots[slot];
+    if(timer.next != invalid_timer){
+        m_timers[timer.next].previous = id;
+    }
+    m_slots[slot] = id;
+}
+
+void TimingWheel::unlink(TimerId id){
+    Timer &timer = m_timers[id];
+    if(timer.previous != invalid_timer){
+        m_timers[timer.previous].next = timer.next;
+    } else {
+        m_slots[timer.slot] = timer.next;
+    }
+    if(timer.next != invalid_timer){
+        m_timers[timer.next].previous = timer.previous;
+    }
+}
+
+void TimingWheel::release(TimerId id){
+    Timer &timer = m_timers[id];
+    timer.slot = no_slot;
+    timer.next = m_free;
+    m_free = id;
+    --m_size;
+}
+
+void TimingWheel::cascade(unsigned level){
+    std::uint32_t slot = level * slot_count + static_cast<std::uint32_t>((m_now >> (slot_bits * level)) & slot_mask);
+    TimerId id = m_slots[slot];
+    m_slots[slot] = invalid_timer;
+    while(id != invalid_timer){
+        TimerId next = m_timers[id].next;
+        place(id);
+        id = next;
+    }
+}
@@ -0,0 +1,149 @@
+#include "topic_trie.hpp"
+#include <algorithm>
+
+namespace {
+    // Splits off the first level of a topic, rest is left empty after the last level
+    std::string_view nextLevel(std::string_view& rest, bool& atEnd){
+        size_t end = rest.find(TopicTrie::level_separator);
+        std::string_view level = rest.substr(0, end);
+        if(end == std::string_view::npos){
+            rest = {};
+            atEnd = true;
+        }else{
+            rest.remove_prefix(end + 1);
+        }
+        return level;
+    }
+
+    void eraseId(std::vector<TopicId>& ids, TopicId id){
+        auto it = std::find(ids.begin(), ids.end(), id);
+        if(it != ids.end()){
+            *it = ids.back();
+            ids.pop_back();
+        }
+    }
+}
+
+bool TopicTrie::isWildcard(std::string_view filter){
+    return filter.find_first_of("+#") != std::string_view::npos;
+}
+
+bool TopicTrie::isValidFilter(std::string_view filter){
+    if(filter.empty()){
+        return false;
+    }
+    bool atEnd = false;
+    while(!atEnd){
+        std::string_view level = nextLevel(filter, atEnd);
+        if(level.size() > 1 && isWildcard(level)){
+            return false;
+        }
+        if(level.size() == 1 && level.front() == multi_level_wildcard && !atEnd){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool TopicTrie::isValidTopic(std::string_view topic){
+    return !topic.empty() && !isWildcard(topic);
+}
+
+void TopicTrie::insert(std::string_view filter, TopicId filterId){
+    Node *node = &m_root;
+    bool atEnd = false;
+    while(!atEnd){
+        std::string_view level = nextLevel(filter, atEnd);
+        if(level.size() == 1 && level.front() == multi_level_wildcard){
+            node->multiLevelFilters.push_back(filterId);
+            return;
+        }
+        std::unique_ptr<Node> *child = nullptr;
+        if(level.size() == 1 && level.front() == single_level_wildcard){
+            child = &node->singleLevel;
+        }else{
+            auto it = node->children.find(level);
+            if(it == node->children.end()){
+                it = node->children.emplace(std::string(level), nullptr).first;
+            }
+            child = &it->second;
+        }
+        if(!*child){
+            *child = std::make_unique<Node>();
+        }
+        node = child->get();
+    }
+    node->filters.push_back(filterId);
+}
+
+void TopicTrie::erase(std::string_view filter, TopicId filterId){
+    erase(m_root, filter, filterId);
+}
+
+// Returns true if node became empty so the parent can prune it
+bool TopicTrie::erase(Node& node, std::string_view filter, TopicId filterId){
+    bool atEnd = false;
+    std::string_view level = nextLevel(filter, atEnd);
+    if(level.size() == 1 && level.front() == multi_level_wildcard){
+        eraseId(node.multiLevelFilters, filterId);
+        return node.empty();
+    }
+    std::unique_ptr<Node> *child = nullptr;
+    auto it = node.children.end();
+    if(level.size() == 1 && level.front() == single_level_wildcard){
+        child = &node.singleLevel;
+    }else{
+        it = node.children.find(level);
+        if(it == node.children.end()){
+            return node.empty();
+        }
+        child = &it->second;
+    }
+    if(!*child){
+        return node.empty();
+    }
+    bool childEmpty = false;
+    if(atEnd){
+        eraseId((*child)->filters, filterId);
+        childEmpty = (*child)->empty();
+    }else{
+        childEmpty = erase(**child, filter, filterId);
+    }
+    if(childEmpty){
+        if(it != node.children.end()){
+            node.children.erase(it);
+        }else{
+            child->reset();
+        }
+    }
+    return node.empty();
+}
+
+void TopicTrie::match(std::string_view topic, std::vector<TopicId>& filterIds) const{
+    match(m_root, topic, false, filterIds);
+}
+
+void TopicTrie::match(const Node& node, std::string_view rest, bool atEnd, std::vector<TopicId>& filterIds){
+    // '#' also matches the parent level itself, so it applies before checking for the end
+    filterIds.insert(filterIds.end(), node.multiLevelFilters.begin(), node.multiLevelFilters.end());
+    if(atEnd){
+        filterIds.insert(filterIds.end(), node.filters.begin(), node.filters.end());
+        return;
+    }
+    std::string_view level = nextLevel(rest, atEnd);
+    auto it = node.children.find(level);
+    if(it != node.children.end()){
+        match(*it->second, rest, atEnd, filterIds);
+    }
+    if(node.singleLevel){
+        match(*node.singleLevel, rest, atEnd, filterIds);
+    }
+}
+
+bool TopicTrie::empty() const{
+    return m_root.empty();
+}
+
+bool TopicTrie::Node::empty() const{
+    return children.empty() && !singleLevel && filters.empty() && multiLevelFilters.empty();
+}
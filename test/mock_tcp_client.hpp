@@ -8,5 +8,5 @@ public:
 
     // A mock class is needed only for onRead because it doesn't return a value 
     // but we still want to check if the correct message was received
-    MOCK_METHOD(void, onRead, (int connId, std::string payload), (override));
+    MOCK_METHOD(void, onRead, (int connId, std::string_view payload), (override));
 };
\ No newline at end of file
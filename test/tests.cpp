@@ -1,10 +1,91 @@
 #include <gtest/gtest.h>
 #include "tcp_server.hpp"
+#include "shard_group.hpp"
 #include "mock_tcp_client.hpp"
+#include "frame_scanner.hpp"
+#include "topic_trie.hpp"
+#include "latency_histogram.hpp"
+#include "admin_endpoint.hpp"
+#include "async_client.hpp"
+#include "slot_table.hpp"
+#include "timing_wheel.hpp"
+#include "ack_window.hpp"
+#include "federation.hpp"
 #include <bits/this_thread_sleep.h>
+#include <algorithm>
+#include <fstream>
+#include <future>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using ::testing::StrictMock;
 
+namespace {
+    // Counts heap allocations of the whole process, for the allocation test below
+    std::atomic<std::uint64_t> allocations{0};
+    constexpr int max_clients = 32;
+
+    // Discards what is written to std::cout until the end of the scope, also when a failed
+    // ASSERT returns early. The buffer keeps no state, so the server threads may write to it
+    // at the same time. Swapping it is not synchronized: declare the capture before the
+    // ContextThreads, so it is installed before they start and restored after they joined.
+    // out() writes to the original std::cout.
+    class CoutCapture {
+        public:
+            CoutCapture() : m_sink(), m_previous(std::cout.rdbuf(&m_sink)), m_out(m_previous) {}
+            ~CoutCapture() { std::cout.rdbuf(m_previous); }
+
+            std::ostream& out() { return m_out; }
+
+        private:
+            class Sink : public std::streambuf {
+                protected:
+                    int_type overflow(int_type c) override { return traits_type::not_eof(c); }
+                    std::streamsize xsputn(const char*, std::streamsize count) override { return count; }
+            };
+
+            Sink m_sink;
+            std::streambuf *m_previous;
+            std::ostream m_out;
+    };
+
+    // Runs an io_context on a thread of its own, stopped and joined at the end of the scope,
+    // also when a failed ASSERT returns early
+    class ContextThread {
+        public:
+            explicit ContextThread(boost::asio::io_context& context) :
+                m_context(context),
+                m_thread([&context]() { context.run(); }) {}
+            ~ContextThread() {
+                m_context.stop();
+                m_thread.join();
+            }
+
+        private:
+            boost::asio::io_context& m_context;
+            std::thread m_thread;
+    };
+}
+
+void* operator new(size_t size){
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void *memory = std::malloc(size == 0 ? 1 : size)){
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept{
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept{
+    std::free(memory);
+}
+
 TEST(TcpServerClientTest, BasicConnection) {
     boost::asio::io_context io_context;
     TcpServer server(12345, io_context);
@@ -184,11 +265,11 @@ TEST(TcpServerClientTest, MaxNoOfClients) {
     std::thread thread{[&io_context]() { io_context.run(); }};
     std::vector<std::unique_ptr<StrictMock<MockTcpClient>>> clients;
     
-    for (int i = 0; i < Constants::max_clients; ++i) {
+    for (int i = 0; i < max_clients; ++i) {
         clients.push_back(std::make_unique<StrictMock<MockTcpClient>>(io_context));
     }
 
-    for (int i = 0; i < Constants::max_clients; ++i) {
+    for (int i = 0; i < max_clients; ++i) {
         std::string command = "CONNECT 12345 client" + std::to_string(i + 1);
         clients[i]->handleCommand(command);
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
@@ -197,13 +278,13 @@ TEST(TcpServerClientTest, MaxNoOfClients) {
         ASSERT_EQ(server.getClientName(i), "client" + std::to_string(i + 1));
     }
 
-    for (int i = 0; i < Constants::max_clients; ++i) {
+    for (int i = 0; i < max_clients; ++i) {
         std::string command = "SUBSCRIBE test";
         clients[i]->handleCommand(command);
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
     }
     
-    for (int i = 0; i < Constants::max_clients; ++i) {
+    for (int i = 0; i < max_clients; ++i) {
         EXPECT_CALL(*clients[i], onRead(0, "test;test")).Times(1);
     }
 
@@ -213,12 +294,12 @@ TEST(TcpServerClientTest, MaxNoOfClients) {
 
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
-    for (int i = 0; i < Constants::max_clients; ++i) {
+    for (int i = 0; i < max_clients; ++i) {
         std::string command = "DISCONNECT";
         clients[i]->handleCommand(command);
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
         ASSERT_FALSE(clients[i]->isConnected());
-        ASSERT_EQ(server.getClientCount(), Constants::max_clients - 1 - i);
+        ASSERT_EQ(server.getClientCount(), max_clients - 1 - i);
         ASSERT_EQ(server.getClientName(i), "");
     }
 
@@ -226,6 +307,1981 @@ TEST(TcpServerClientTest, MaxNoOfClients) {
     thread.join();
 }
 
+TEST(SubscriptionIndexTest, SubscribeUnsubscribeRemoveClient) {
+    SubscriptionIndex index;
+    ASSERT_TRUE(index.subscribe(0, "test"));
+    ASSERT_FALSE(index.subscribe(0, "test"));
+    ASSERT_TRUE(index.subscribe(1, "test"));
+    ASSERT_TRUE(index.subscribe(1, "test1"));
+    ASSERT_EQ(index.subscribers("test"), (std::vector<int>{0, 1}));
+    ASSERT_EQ(index.clientTopics(1), (std::vector<std::string>{"test", "test1"}));
+
+    ASSERT_TRUE(index.unsubscribe(0, "test"));
+    ASSERT_FALSE(index.unsubscribe(0, "test"));
+    ASSERT_EQ(index.subscribers("test"), (std::vector<int>{1}));
+
+    index.removeClient(1);
+    ASSERT_TRUE(index.subscribers("test").empty());
+    ASSERT_TRUE(index.subscribers("test1").empty());
+    ASSERT_TRUE(index.subscribers("unknown").empty());
+    ASSERT_TRUE(index.clientTopics(1).empty());
+}
+
+TEST(SubscriptionIndexTest, ChurnReleasesTopicIds) {
+    SubscriptionIndex index;
+    ASSERT_TRUE(index.subscribe(0, "kept"));
+    size_t topics = index.topicCount();
+    for (int i = 0; i < 1000; ++i) {
+        std::string topic = "churn/" + std::to_string(i);
+        ASSERT_TRUE(index.subscribe(1, topic));
+        ASSERT_TRUE(index.subscribe(2, i % 2 ? topic : "md/#"));
+        ASSERT_TRUE(index.unsubscribe(1, topic));
+        index.removeClient(2);
+    }
+    ASSERT_EQ(index.topicCount(), topics);
+    ASSERT_LE(index.topicIdCount(), topics + 2);
+
+    // A held id outlives its subscribers, it is given up with the last hold
+    TopicId topicId = index.intern("held");
+    ASSERT_TRUE(index.subscribe(1, "held"));
+    ASSERT_TRUE(index.unsubscribe(1, "held"));
+    ASSERT_EQ(index.find("held"), topicId);
+    ASSERT_TRUE(index.subscribe(1, "held"));
+    ASSERT_FALSE(index.release(topicId));
+    ASSERT_EQ(index.removeClient(1), (std::vector<std::string>{"held"}));
+    ASSERT_EQ(index.find("held"), SubscriptionIndex::invalid_topic);
+    ASSERT_EQ(index.topicCount(), topics);
+}
+
+TEST(TopicTrieTest, WildcardMatching) {
+    ASSERT_TRUE(TopicTrie::isValidFilter("md/eq/+/trades"));
+    ASSERT_TRUE(TopicTrie::isValidFilter("md/#"));
+    ASSERT_TRUE(TopicTrie::isValidFilter("#"));
+    ASSERT_FALSE(TopicTrie::isValidFilter("md/#/trades"));
+    ASSERT_FALSE(TopicTrie::isValidFilter("md/eq+"));
+    ASSERT_FALSE(TopicTrie::isValidFilter(""));
+    ASSERT_FALSE(TopicTrie::isValidTopic("md/+"));
+
+    TopicTrie trie;
+    trie.insert("md/eq/+/trades", 0);
+    trie.insert("md/#", 1);
+    trie.insert("+/eq/AAPL/+", 2);
+    trie.insert("#", 3);
+    auto match = [&trie](std::string_view topic) {
+        std::vector<TopicId> filters;
+        trie.match(topic, filters);
+        std::sort(filters.begin(), filters.end());
+        return filters;
+    };
+    ASSERT_EQ(match("md/eq/AAPL/trades"), (std::vector<TopicId>{0, 1, 2, 3}));
+    ASSERT_EQ(match("md/eq/AAPL/quotes"), (std::vector<TopicId>{1, 2, 3}));
+    ASSERT_EQ(match("md"), (std::vector<TopicId>{1, 3}));
+    ASSERT_EQ(match("md/eq/AAPL"), (std::vector<TopicId>{1, 3}));
+    ASSERT_EQ(match("news"), (std::vector<TopicId>{3}));
+
+    trie.erase("#", 3);
+    trie.erase("md/#", 1);
+    ASSERT_EQ(match("md/eq/AAPL/trades"), (std::vector<TopicId>{0, 2}));
+    trie.erase("md/eq/+/trades", 0);
+    trie.erase("+/eq/AAPL/+", 2);
+    ASSERT_TRUE(trie.empty());
+}
+
+TEST(SubscriptionIndexTest, WildcardMatchCachedAndInvalidated) {
+    SubscriptionIndex index;
+    ASSERT_TRUE(index.subscribe(0, "md/eq/AAPL/trades"));
+    ASSERT_EQ(index.match("md/eq/AAPL/trades"), (std::vector<int>{0}));
+
+    ASSERT_TRUE(index.subscribe(1, "md/eq/+/trades"));
+    ASSERT_TRUE(index.subscribe(0, "md/#"));
+    // Client 0 matches twice but is delivered to once
+    ASSERT_EQ(index.match("md/eq/AAPL/trades"), (std::vector<int>{0, 1}));
+    ASSERT_EQ(index.match("md/eq/MSFT/trades"), (std::vector<int>{0, 1}));
+    ASSERT_EQ(index.match("md/fx"), (std::vector<int>{0}));
+
+    // Exact and wildcard changes both invalidate the cached lists
+    ASSERT_TRUE(index.subscribe(2, "md/fx"));
+    ASSERT_EQ(index.match("md/fx"), (std::vector<int>{0, 2}));
+    ASSERT_TRUE(index.unsubscribe(0, "md/#"));
+    ASSERT_EQ(index.match("md/fx"), (std::vector<int>{2}));
+    ASSERT_EQ(index.match("md/eq/MSFT/trades"), (std::vector<int>{1}));
+
+    ASSERT_EQ(index.removeClient(1).size(), 1u);
+    ASSERT_TRUE(index.match("md/eq/MSFT/trades").empty());
+    ASSERT_EQ(index.match("md/eq/AAPL/trades"), (std::vector<int>{0}));
+
+    // Published topics are not interned, even those a wildcard matches, and their cached
+    // lists are invalidated like the others
+    ASSERT_TRUE(index.subscribe(3, "md/fx/#"));
+    size_t topics = index.topicCount();
+    ASSERT_TRUE(index.match("md/eq/IBM/quotes").empty());
+    ASSERT_EQ(index.match("md/fx/EURUSD"), (std::vector<int>{3}));
+    ASSERT_TRUE(index.subscribe(4, "md/+/EURUSD"));
+    ASSERT_EQ(index.match("md/fx/EURUSD"), (std::vector<int>{3, 4}));
+    for (size_t i = 0; i < SubscriptionIndex::max_resolved_topics + 1; ++i) {
+        ASSERT_EQ(index.match("md/fx/" + std::to_string(i)), (std::vector<int>{3}));
+    }
+    ASSERT_EQ(index.find("md/fx/EURUSD"), SubscriptionIndex::invalid_topic);
+    ASSERT_EQ(index.topicCount(), topics + 1);
+}
+
+TEST(SlotTableTest, GenerationalHandles) {
+    SlotTable<std::string> table;
+    // First use of every slot has generation 0, the handle is the slot index
+    ASSERT_EQ(table.insert("a"), 0);
+    ASSERT_EQ(table.insert("b"), 1);
+    ASSERT_TRUE(table.erase(0));
+    ASSERT_FALSE(table.erase(0));
+    ASSERT_EQ(table.find(0), nullptr);
+
+    // The freed slot is reused under a new generation, the stale handle stays invalid
+    int reused = table.insert("c");
+    ASSERT_NE(reused, 0);
+    ASSERT_EQ(reused & (SlotTable<std::string>::max_slots - 1), 0);
+    ASSERT_EQ(table.find(0), nullptr);
+    ASSERT_EQ(*table.find(reused), "c");
+    ASSERT_EQ(*table.find(1), "b");
+    ASSERT_EQ(table.find(2), nullptr);
+    ASSERT_EQ(table.find(-1), nullptr);
+    ASSERT_EQ(table.size(), 2u);
+
+    std::vector<std::string> values;
+    table.forEach([&values](int, const std::string& value) { values.push_back(value); });
+    ASSERT_EQ(values, (std::vector<std::string>{"c", "b"}));
+}
+
+TEST(TimingWheelTest, ExpiryOrderCascadeAndCancel) {
+    TimingWheel wheel;
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> expired;
+    std::function<void(std::uint32_t)> record = [&](std::uint32_t key) {
+        expired.emplace_back(wheel.now(), key);
+        // Rescheduling from the callback, a deadline that passed expires on the next tick
+        if (key == 0) {
+            wheel.schedule(0, 5);
+        }
+    };
+    // One timer on each level
+    const std::uint64_t deadlines[] = {3, 300, 70000, 20000000};
+    for (std::uint32_t key = 0; key < 4; ++key) {
+        wheel.schedule(deadlines[key], key);
+    }
+    wheel.schedule(1, 6);
+    TimingWheel::TimerId cancelled = wheel.schedule(2, 7);
+    TimingWheel::TimerId late = wheel.schedule(70000, 8);
+    wheel.cancel(cancelled);
+    wheel.cancel(late);
+    ASSERT_EQ(wheel.size(), 5u);
+
+    wheel.advance(4, record);
+    ASSERT_EQ(expired, (std::vector<std::pair<std::uint64_t, std::uint32_t>>{{1, 6}, {3, 0}, {4, 5}}));
+    wheel.advance(69999, record);
+    ASSERT_EQ(expired.size(), 4u);
+    ASSERT_EQ(expired.back(), std::make_pair(std::uint64_t{300}, 1u));
+    // Cascaded down twice before expiring on its tick
+    wheel.advance(70000, record);
+    ASSERT_EQ(expired.back(), std::make_pair(std::uint64_t{70000}, 2u));
+    wheel.advance(30000000, record);
+    ASSERT_EQ(expired.back(), std::make_pair(std::uint64_t{20000000}, 3u));
+    ASSERT_EQ(wheel.size(), 0u);
+    ASSERT_EQ(wheel.now(), 30000000u);
+}
+
+TEST(AckWindowTest, CumulativeAcknowledgeAndResume) {
+    AckWindow window(4);
+    std::vector<SharedBufferPtr> frames;
+    for (int i = 0; i < 5; ++i) {
+        frames.push_back(Protocol::encode(Protocol::Opcode::Message, "test", std::to_string(i)));
+    }
+    for (int i = 0; i < 4; ++i) {
+        ASSERT_TRUE(window.push(frames[i]));
+    }
+    ASSERT_TRUE(window.full());
+    ASSERT_FALSE(window.push(frames[4]));
+
+    // One Ack releases every frame up to its sequence, never more than was sent
+    ASSERT_FALSE(window.acknowledge(5));
+    ASSERT_TRUE(window.acknowledge(2));
+    ASSERT_TRUE(window.acknowledge(1));
+    ASSERT_EQ(window.acknowledged(), 2u);
+    ASSERT_EQ(window.frames().front(), frames[2]);
+    ASSERT_TRUE(window.push(frames[4]));
+
+    // The receiver got sequence 3 before the connection was lost, 4 and 5 are sent again
+    window.resume(3);
+    ASSERT_EQ(window.size(), 2u);
+    ASSERT_EQ(window.frames().front(), frames[3]);
+    ASSERT_EQ(window.acknowledged(), 3u);
+    // A receiver that starts over takes the numbering with it
+    window.resume(0);
+    ASSERT_EQ(window.size(), 2u);
+    ASSERT_TRUE(window.acknowledge(2));
+    ASSERT_EQ(window.size(), 0u);
+}
+
+TEST(SharedBufferTest, EncodeOnceShareReferences) {
+    auto message = SharedBuffer::create(10);
+    message->append("test");
+    message->append(';');
+    message->append("data");
+    message->append('\n');
+    SharedBufferPtr first{message};
+    SharedBufferPtr second{first};
+    ASSERT_EQ(first->data(), second->data());
+    ASSERT_EQ(std::string_view(second->data(), second->size()), "test;data\n");
+    ASSERT_EQ(second->capacity(), 10u);
+}
+
+#if defined(TCP_SERVER_COROUTINES)
+TEST(CoroutineTest, ResumedByCompletionsAndDestroyedWithItsOperation) {
+    auto state = std::make_shared<std::vector<std::string>>();
+    std::weak_ptr<std::vector<std::string>> alive = state;
+    {
+        boost::asio::io_context io_context;
+        boost::asio::steady_timer timer(io_context, std::chrono::milliseconds(1));
+        boost::asio::steady_timer never(io_context, boost::asio::steady_timer::time_point::max());
+        auto waiter = [](boost::asio::steady_timer& timer, boost::asio::steady_timer& never,
+                         std::shared_ptr<std::vector<std::string>> state) -> Coroutine {
+            auto [error] = co_await timer.async_wait(use_coroutine);
+            state->push_back(error ? error.message() : "expired");
+            co_await never.async_wait(use_coroutine);
+            state->push_back("never");
+        };
+        waiter(timer, never, std::move(state));
+        io_context.run_for(std::chrono::milliseconds(50));
+        ASSERT_EQ(alive.lock()->size(), 1u);
+        ASSERT_EQ(alive.lock()->front(), "expired");
+    }
+    // The second wait never completed, the coroutine and its parameters went with the io_context
+    ASSERT_TRUE(alive.expired());
+}
+#endif
+
+TEST(CommandParserTest, LookupAndTokenize) {
+    static_assert(lookupCommand("PUBLISH") == CommandType::Publish);
+    ASSERT_EQ(lookupCommand("CONNECT"), CommandType::Connect);
+    ASSERT_EQ(lookupCommand("DISCONNECT"), CommandType::Disconnect);
+    ASSERT_EQ(lookupCommand("SUBSCRIBE"), CommandType::Subscribe);
+    ASSERT_EQ(lookupCommand("UNSUBSCRIBE"), CommandType::Unsubscribe);
+    ASSERT_EQ(lookupCommand("STATS"), CommandType::Stats);
+    ASSERT_EQ(lookupCommand("PEER"), CommandType::Peer);
+    ASSERT_EQ(lookupCommand("PING"), CommandType::Ping);
+    ASSERT_EQ(lookupCommand("PONG"), CommandType::Pong);
+    ASSERT_EQ(lookupCommand("P"), CommandType::Unknown);
+    ASSERT_EQ(lookupCommand("PUBLISHX"), CommandType::Unknown);
+    ASSERT_EQ(lookupCommand("publish"), CommandType::Unknown);
+    ASSERT_EQ(lookupCommand(""), CommandType::Unknown);
+
+    Tokenizer wire("PUBLISH;topic;data;with;delimiters");
+    ASSERT_EQ(wire.next(';'), "PUBLISH");
+    ASSERT_EQ(wire.next(';'), "topic");
+    ASSERT_EQ(wire.rest(), "data;with;delimiters");
+
+    Tokenizer cli("  PUBLISH   topic  two words");
+    ASSERT_EQ(cli.nextWord(), "PUBLISH");
+    ASSERT_EQ(cli.nextWord(), "topic");
+    ASSERT_EQ(cli.rest(), " two words");
+    ASSERT_EQ(cli.nextWord(), "two");
+    ASSERT_EQ(cli.nextWord(), "words");
+    ASSERT_TRUE(cli.empty());
+    ASSERT_EQ(cli.nextWord(), "");
+}
+
+TEST(ProtocolTest, EncodeDecodeRoundTrip) {
+    const std::string payload("binary;payload\n\0with nul", 25);
+    auto frame = Protocol::encode(Protocol::Opcode::Publish, "test", payload);
+    ASSERT_EQ(frame->size(), Protocol::frameSize(Protocol::Opcode::Publish, "test", payload));
+    ASSERT_EQ(frame->size(), frame->capacity());
+    ASSERT_EQ(Protocol::readLength(frame->data()), frame->size() - Protocol::length_size);
+
+    Protocol::Frame decoded;
+    ASSERT_TRUE(Protocol::decode(std::string_view(frame->data() + Protocol::length_size,
+                                                  frame->size() - Protocol::length_size), decoded));
+    ASSERT_EQ(decoded.opcode, Protocol::Opcode::Publish);
+    ASSERT_EQ(decoded.topic, "test");
+    ASSERT_EQ(decoded.payload, payload);
+
+    // Truncated frames and unknown opcodes are rejected
+    ASSERT_FALSE(Protocol::decode(std::string_view(frame->data() + Protocol::length_size,
+                                                   frame->size() - Protocol::length_size - 1), decoded));
+    ASSERT_FALSE(Protocol::decode(std::string_view("\x7f", 1), decoded));
+
+    ASSERT_EQ(Protocol::varintSize(127), 1u);
+    ASSERT_EQ(Protocol::varintSize(128), 2u);
+    auto large = Protocol::encode(Protocol::Opcode::Subscribe, std::string(300, 't'));
+    ASSERT_EQ(large->size(), Protocol::header_size + 2 + 300);
+
+    // Frames by topic id carry a varint id instead of the topic
+    auto byId = Protocol::encode(Protocol::Opcode::MessageById, {}, "value", 300);
+    ASSERT_EQ(byId->size(), Protocol::header_size + 2 + 1 + 5);
+    ASSERT_TRUE(Protocol::decode(std::string_view(byId->data() + Protocol::length_size,
+                                                  byId->size() - Protocol::length_size), decoded));
+    ASSERT_EQ(decoded.opcode, Protocol::Opcode::MessageById);
+    ASSERT_EQ(decoded.topicId, 300u);
+    ASSERT_EQ(decoded.payload, "value");
+    auto registered = Protocol::encode(Protocol::Opcode::Registered, "md/eq/trades", {}, 7);
+    ASSERT_TRUE(Protocol::decode(std::string_view(registered->data() + Protocol::length_size,
+                                                  registered->size() - Protocol::length_size), decoded));
+    ASSERT_EQ(decoded.topicId, 7u);
+    ASSERT_EQ(decoded.topic, "md/eq/trades");
+
+    // A batch is one payload of (topic, payload) entries, every entry is checked
+    std::string entries;
+    Protocol::appendBatchEntry(entries, "a", payload);
+    Protocol::appendBatchEntry(entries, "b", "2");
+    ASSERT_EQ(entries.size(), Protocol::batchEntrySize("a", payload) + Protocol::batchEntrySize("b", "2"));
+    auto batch = Protocol::encode(Protocol::Opcode::PublishBatch, {}, entries);
+    ASSERT_TRUE(Protocol::decode(std::string_view(batch->data() + Protocol::length_size,
+                                                  batch->size() - Protocol::length_size), decoded));
+    std::string_view rest = decoded.payload;
+    std::string_view topic;
+    std::string_view value;
+    ASSERT_TRUE(Protocol::nextBatchEntry(rest, topic, value));
+    ASSERT_EQ(topic, "a");
+    ASSERT_EQ(value, payload);
+    ASSERT_TRUE(Protocol::nextBatchEntry(rest, topic, value));
+    ASSERT_EQ(topic, "b");
+    ASSERT_EQ(value, "2");
+    ASSERT_FALSE(Protocol::nextBatchEntry(rest, topic, value));
+    auto truncated = Protocol::encode(Protocol::Opcode::PublishBatch, {}, entries.substr(0, entries.size() - 1));
+    ASSERT_FALSE(Protocol::decode(std::string_view(truncated->data() + Protocol::length_size,
+                                                   truncated->size() - Protocol::length_size), decoded));
+
+    // Heartbeats are the bare opcode, or the command as a text line
+    auto ping = Protocol::encodeHeartbeat(Protocol::Opcode::Ping, Protocol::Version::Binary);
+    ASSERT_EQ(ping->size(), Protocol::header_size);
+    std::string_view pingFrame(ping->data() + Protocol::length_size, ping->size() - Protocol::length_size);
+    ASSERT_TRUE(Protocol::decode(pingFrame, decoded));
+    ASSERT_EQ(decoded.opcode, Protocol::Opcode::Ping);
+    ASSERT_TRUE(Protocol::isHeartbeat(pingFrame, Protocol::Version::Binary, Protocol::Opcode::Ping));
+    ASSERT_FALSE(Protocol::isHeartbeat(pingFrame, Protocol::Version::Binary, Protocol::Opcode::Pong));
+    auto pong = Protocol::encodeHeartbeat(Protocol::Opcode::Pong, Protocol::Version::Text);
+    ASSERT_EQ(std::string_view(pong->data(), pong->size()), "PONG\n");
+    ASSERT_TRUE(Protocol::isHeartbeat("PONG", Protocol::Version::Text, Protocol::Opcode::Pong));
+
+    // Acks carry a varint sequence
+    auto ack = Protocol::encodeAck(300);
+    ASSERT_EQ(ack->size(), Protocol::header_size + 2);
+    ASSERT_TRUE(Protocol::decode(std::string_view(ack->data() + Protocol::length_size,
+                                                  ack->size() - Protocol::length_size), decoded));
+    ASSERT_EQ(decoded.opcode, Protocol::Opcode::Ack);
+    ASSERT_EQ(decoded.sequence, 300u);
+}
+
+TEST(TcpServerClientTest, BinaryAndTextClientsOnSamePort) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+
+    StrictMock<MockTcpClient> binaryClient(io_context);
+    StrictMock<MockTcpClient> textClient(io_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    std::string command = "CONNECT 12345 client1 v2";
+    binaryClient.handleCommand(command);
+    command = "CONNECT 12345 client2";
+    textClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 2);
+    ASSERT_EQ(server.getClientName(0), "client1");
+
+    command = "SUBSCRIBE test";
+    binaryClient.handleCommand(command);
+    textClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientTopics(0), (std::vector<std::string>{"test"}));
+
+    EXPECT_CALL(binaryClient, onRead(0, "test;from binary")).Times(1);
+    EXPECT_CALL(textClient, onRead(0, "test;from binary")).Times(1);
+    command = "PUBLISH test from binary";
+    binaryClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    EXPECT_CALL(binaryClient, onRead(0, "test;from text")).Times(1);
+    EXPECT_CALL(textClient, onRead(0, "test;from text")).Times(1);
+    command = "PUBLISH test from text";
+    textClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    command = "DISCONNECT";
+    binaryClient.handleCommand(command);
+    textClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(binaryClient.isConnected());
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, BinaryPayloadsSkipTextSubscribers) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    tcp::socket binary(client_context);
+    tcp::socket text(client_context);
+    binary.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    text.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+
+    // CONNECT and the pipelined binary SUBSCRIBE arrive in one write
+    auto subscribe = Protocol::encode(Protocol::Opcode::Subscribe, "test");
+    std::string handshake = "CONNECT;binary;2\n" + std::string(subscribe->data(), subscribe->size());
+    boost::asio::write(binary, boost::asio::buffer(handshake));
+    boost::asio::write(text, boost::asio::buffer(std::string("CONNECT;text\nSUBSCRIBE;test\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientTopics(0), (std::vector<std::string>{"test"}));
+
+    const std::string payload("a;b\nc", 5);
+    auto publish = Protocol::encode(Protocol::Opcode::Publish, "test", payload);
+    auto safePublish = Protocol::encode(Protocol::Opcode::Publish, "test", "safe");
+    boost::asio::write(binary, std::vector<boost::asio::const_buffer>{
+        boost::asio::buffer(publish->data(), publish->size()),
+        boost::asio::buffer(safePublish->data(), safePublish->size())});
+
+    auto expected = Protocol::encode(Protocol::Opcode::Message, "test", payload);
+    auto expectedSafe = Protocol::encode(Protocol::Opcode::Message, "test", "safe");
+    std::string binaryExpected = std::string(Protocol::connack) + "\n" +
+                                 std::string(expected->data(), expected->size()) +
+                                 std::string(expectedSafe->data(), expectedSafe->size());
+    std::string received(binaryExpected.size(), '\0');
+    boost::asio::read(binary, boost::asio::buffer(received));
+    ASSERT_EQ(received, binaryExpected);
+
+    // The text subscriber only gets the message it can frame
+    received.assign(std::string("test;safe\n").size(), '\0');
+    boost::asio::read(text, boost::asio::buffer(received));
+    ASSERT_EQ(received, "test;safe\n");
+    // and the other one is counted as dropped for it
+    std::promise<MetricsSnapshot> snapshot;
+    boost::asio::post(io_context, [&]() { snapshot.set_value(server.collectMetrics()); });
+    auto topics = snapshot.get_future().get().topics;
+    ASSERT_EQ(topics.size(), 1u);
+    ASSERT_EQ(topics[0].delivered, 3u);
+    ASSERT_EQ(topics[0].dropped, 1u);
+
+    binary.close();
+    text.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(FrameScannerTest, MatchesScalarScan) {
+    // Cover every delimiter position around the 16 and 32 byte vector widths
+    for (size_t size = 0; size < 100; ++size) {
+        for (size_t position = 0; position <= size; ++position) {
+            std::string buffer(size, 'x');
+            if (position < size) {
+                buffer[position] = '\n';
+            }
+            const char *begin = buffer.data();
+            const char *end = begin + buffer.size();
+            ASSERT_EQ(findDelimiter(begin, end, '\n'), findDelimiterScalar(begin, end, '\n'));
+            ASSERT_EQ(findDelimiter(begin, end, '\n') - begin, static_cast<long>(position));
+        }
+    }
+}
+
+TEST(LatencyHistogramTest, PercentilesWithinPrecision) {
+    // Bucket boundaries are contiguous and every value lands in a bucket that covers it
+    for (std::uint64_t value : {0ull, 1ull, 255ull, 256ull, 257ull, 1000ull, 123456789ull, ~0ull}) {
+        size_t index = LatencyHistogram::bucketIndex(value);
+        ASSERT_LT(index, LatencyHistogram::bucket_count);
+        ASSERT_GE(LatencyHistogram::bucketValue(index), value);
+        if (index > 0) {
+            ASSERT_LT(LatencyHistogram::bucketValue(index - 1), value);
+        }
+    }
+
+    LatencyHistogram histogram;
+    for (std::uint64_t value = 1; value <= 100000; ++value) {
+        histogram.record(value * 1000);
+    }
+    ASSERT_EQ(histogram.count(), 100000u);
+    ASSERT_EQ(histogram.max(), 100000000u);
+    ASSERT_NEAR(histogram.percentile(50), 50000000.0, 50000000.0 / 100);
+    ASSERT_NEAR(histogram.percentile(99), 99000000.0, 99000000.0 / 100);
+    ASSERT_NEAR(histogram.percentile(99.9), 99900000.0, 99900000.0 / 100);
+    ASSERT_EQ(histogram.percentile(100), histogram.max());
+
+    LatencyHistogram other;
+    other.record(200000000);
+    histogram.merge(other);
+    ASSERT_EQ(histogram.count(), 100001u);
+    ASSERT_EQ(histogram.max(), 200000000u);
+}
+
+TEST(TcpServerClientTest, PipelinedAndSplitFrames) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    tcp::socket socket(client_context);
+    socket.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+
+    // Several frames coalesced into one write, the last one split across two writes
+    boost::asio::write(socket, boost::asio::buffer(std::string("CONNECT;client1\nSUBSCRIBE;test\nSUBSCRIBE;te")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    boost::asio::write(socket, boost::asio::buffer(std::string("st1\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientName(0), "client1");
+    ASSERT_EQ(server.getClientTopics(0), (std::vector<std::string>{"test", "test1"}));
+
+    boost::asio::write(socket, boost::asio::buffer(std::string("PUBLISH;test;a\nPUBLISH;test1;b\n")));
+    std::string received;
+    while (received.size() < std::string("test;a\ntest1;b\n").size()) {
+        char data[64];
+        received.append(data, socket.read_some(boost::asio::buffer(data)));
+    }
+    ASSERT_EQ(received, "test;a\ntest1;b\n");
+
+    // Frames longer than a read are reassembled up to max_text_frame_length
+    std::string payload(Constants::max_text_frame_length - std::string("PUBLISH;test;").size(), 'x');
+    boost::asio::write(socket, boost::asio::buffer("PUBLISH;test;" + payload + "\n"));
+    std::string expected = "test;" + payload + "\n";
+    received.resize(expected.size());
+    boost::asio::read(socket, boost::asio::buffer(received));
+    ASSERT_EQ(received, expected);
+
+    // A connection sending more without a delimiter is closed
+    boost::system::error_code error;
+    boost::asio::write(socket, boost::asio::buffer(std::string(Constants::max_text_frame_length + 1, 'x')), error);
+    char data[64];
+    while (!error) {
+        socket.read_some(boost::asio::buffer(data), error);
+    }
+    ASSERT_TRUE(error == boost::asio::error::eof || error == boost::asio::error::connection_reset) << error.message();
+    socket.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, SlowConsumerDoesNotStallOthers) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.setWriteWaterMarks(64 * 1024, 256 * 1024);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    auto connect = [&client_context](const std::string& name) {
+        auto socket = std::make_unique<tcp::socket>(client_context);
+        socket->connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+        std::string subscribe = "CONNECT;" + name + "\nSUBSCRIBE;test\n";
+        boost::asio::write(*socket, boost::asio::buffer(subscribe));
+        return socket;
+    };
+    // The slow subscriber never reads, so its kernel buffers and outbound queue fill up
+    auto slow = connect("slow");
+    auto healthy = connect("healthy");
+    auto publisher = connect("publisher");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const int messages = 20000;
+    const std::string frame = "PUBLISH;test;" + std::string(900, 'x') + "\n";
+    auto received = std::async(std::launch::async, [&healthy, &frame]() {
+        size_t bytes = 0;
+        char data[64 * 1024];
+        boost::system::error_code error;
+        while (bytes < messages * (frame.size() - 8) && !error) {
+            bytes += healthy->read_some(boost::asio::buffer(data), error);
+        }
+        return bytes;
+    });
+    for (int i = 0; i < messages; ++i) {
+        boost::asio::write(*publisher, boost::asio::buffer(frame));
+    }
+    ASSERT_EQ(received.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    ASSERT_EQ(received.get(), messages * (frame.size() - 8));
+
+    slow->close();
+    healthy->close();
+    publisher->close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, SlowConsumerPolicies) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.setWriteWaterMarks(4 * 1024, 16 * 1024);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    auto connect = [&client_context](const std::string& name, const std::string& policy) {
+        auto socket = std::make_unique<tcp::socket>(client_context);
+        socket->open(tcp::v4());
+        socket->set_option(boost::asio::socket_base::receive_buffer_size(4096));
+        socket->connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+        std::string subscribe = "CONNECT;" + name + ";1;" + policy + "\nSUBSCRIBE;a\nSUBSCRIBE;b\n";
+        boost::asio::write(*socket, boost::asio::buffer(subscribe));
+        return socket;
+    };
+    // None of the subscribers reads while the publishes arrive
+    auto disconnect = connect("disconnect", "disconnect");
+    auto dropOldest = connect("dropOldest", "drop-oldest");
+    auto conflate = connect("conflate", "conflate");
+    auto publisher = connect("publisher", "drop-newest");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const int messages = 40000;
+    for (int i = 0; i < messages; ++i) {
+        std::string frame = std::string("PUBLISH;") + (i % 2 ? "b;" : "a;") + std::to_string(i) + ";" +
+                            std::string(500, 'x') + "\n";
+        boost::asio::write(*publisher, boost::asio::buffer(frame));
+    }
+
+    // Reads until the last publish of both topics arrived, every topic in publish order
+    auto readAll = [messages](tcp::socket& socket) {
+        std::map<std::string, int> last{{"a", -1}, {"b", -1}};
+        int frames = 0;
+        std::string buffer;
+        char data[64 * 1024];
+        boost::system::error_code error;
+        while ((last["a"] != messages - 2 || last["b"] != messages - 1) && !error) {
+            buffer.append(data, socket.read_some(boost::asio::buffer(data), error));
+            size_t end;
+            while ((end = buffer.find('\n')) != std::string::npos) {
+                Tokenizer fields(std::string_view(buffer).substr(0, end));
+                std::string topic(fields.next(';'));
+                int sequence = std::stoi(std::string(fields.next(';')));
+                EXPECT_GT(sequence, last[topic]);
+                last[topic] = sequence;
+                ++frames;
+                buffer.erase(0, end + 1);
+            }
+        }
+        return frames;
+    };
+    auto conflated = std::async(std::launch::async, readAll, std::ref(*conflate));
+    auto droppedOldest = std::async(std::launch::async, readAll, std::ref(*dropOldest));
+    ASSERT_EQ(conflated.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    ASSERT_EQ(droppedOldest.wait_for(std::chrono::seconds(10)), std::future_status::ready);
+    // Both get the newest messages, the older ones were replaced or evicted
+    ASSERT_LT(conflated.get(), messages);
+    ASSERT_LT(droppedOldest.get(), messages);
+
+    // The disconnect subscriber was closed once its queue reached the high water mark
+    ASSERT_EQ(server.getClientCount(), 3);
+    char data[64 * 1024];
+    boost::system::error_code error;
+    while (!error) {
+        disconnect->read_some(boost::asio::buffer(data), error);
+    }
+    ASSERT_EQ(error, boost::asio::error::eof);
+
+    dropOldest->close();
+    conflate->close();
+    publisher->close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(ShardGroupTest, PublishReachesSubscribersOnAllShards) {
+    ShardGroup shards(12345, 4);
+    shards.start();
+
+    // SO_REUSEPORT spreads the connections over the shards, so most subscribers
+    // end up on a different shard than the publisher
+    boost::asio::io_context client_context;
+    std::vector<std::unique_ptr<tcp::socket>> subscribers;
+    for (int i = 0; i < 16; ++i) {
+        subscribers.push_back(std::make_unique<tcp::socket>(client_context));
+        subscribers.back()->connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+        std::string subscribe = "CONNECT;client" + std::to_string(i) + "\nSUBSCRIBE;test\n";
+        boost::asio::write(*subscribers.back(), boost::asio::buffer(subscribe));
+    }
+    tcp::socket publisher(client_context);
+    publisher.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    boost::asio::write(publisher, boost::asio::buffer(std::string("CONNECT;publisher\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(shards.getClientCount(), 17);
+
+    boost::asio::write(publisher, boost::asio::buffer(std::string("PUBLISH;test;a\nPUBLISH;other;b\nPUBLISH;test;c\n")));
+    for (auto &subscriber : subscribers) {
+        std::string received;
+        while (received.size() < std::string("test;a\ntest;c\n").size()) {
+            char data[64];
+            received.append(data, subscriber->read_some(boost::asio::buffer(data)));
+        }
+        ASSERT_EQ(received, "test;a\ntest;c\n");
+    }
+
+    for (auto &subscriber : subscribers) {
+        subscriber->close();
+    }
+    publisher.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(shards.getClientCount(), 0);
+
+    // A stopped shard no longer runs handlers, the count must not wait for one
+    shards.stop();
+    shards.wait();
+    ASSERT_EQ(shards.getClientCount(), 0);
+}
+
+TEST(TcpServerClientTest, WildcardSubscriptions) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    tcp::socket subscriber(client_context);
+    subscriber.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    boost::asio::write(subscriber, boost::asio::buffer(std::string(
+        "CONNECT;client1\nSUBSCRIBE;md/eq/+/trades\nSUBSCRIBE;md/fx/#\nSUBSCRIBE;md/#/bad\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientTopics(0), (std::vector<std::string>{"md/eq/+/trades", "md/fx/#"}));
+
+    tcp::socket publisher(client_context);
+    publisher.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    boost::asio::write(publisher, boost::asio::buffer(std::string(
+        "CONNECT;client2\nPUBLISH;md/eq/AAPL/quotes;a\nPUBLISH;md/+/AAPL/trades;b\n"
+        "PUBLISH;md/eq/AAPL/trades;c\nPUBLISH;md/fx;d\nPUBLISH;md/fx/EURUSD;e\n")));
+    std::string expected = "md/eq/AAPL/trades;c\nmd/fx;d\nmd/fx/EURUSD;e\n";
+    std::string received;
+    while (received.size() < expected.size()) {
+        char data[64];
+        received.append(data, subscriber.read_some(boost::asio::buffer(data)));
+    }
+    ASSERT_EQ(received, expected);
+
+    subscriber.close();
+    publisher.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, PublishBatchFanOut) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    tcp::socket binary(client_context);
+    tcp::socket text(client_context);
+    binary.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    text.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    auto subscribe = Protocol::encode(Protocol::Opcode::Subscribe, "md/#");
+    boost::asio::write(binary, boost::asio::buffer("CONNECT;binary;2\n" + std::string(subscribe->data(), subscribe->size())));
+    boost::asio::write(text, boost::asio::buffer(std::string("CONNECT;text\nSUBSCRIBE;md/fx/+\n")));
+    std::string received(Protocol::connack.size() + 1, '\0');
+    boost::asio::read(binary, boost::asio::buffer(received));
+
+    // Invalid entries are skipped, the rest is delivered in batch order
+    std::string entries;
+    Protocol::appendBatchEntry(entries, "md/eq/AAPL", "a");
+    Protocol::appendBatchEntry(entries, "md/+/AAPL", "skipped");
+    Protocol::appendBatchEntry(entries, "md/fx/EURUSD", "b");
+    Protocol::appendBatchEntry(entries, "md/fx/EURUSD", "c\n");
+    Protocol::appendBatchEntry(entries, "md/eq/MSFT", "d");
+    auto batch = Protocol::encode(Protocol::Opcode::PublishBatch, {}, entries);
+    tcp::socket publisher(client_context);
+    publisher.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    boost::asio::write(publisher, boost::asio::buffer("CONNECT;publisher;2\n" + std::string(batch->data(), batch->size())));
+
+    std::string expected;
+    for (auto [topic, payload] : {std::pair{"md/eq/AAPL", "a"}, {"md/fx/EURUSD", "b"}, {"md/fx/EURUSD", "c\n"},
+                                  {"md/eq/MSFT", "d"}}) {
+        auto message = Protocol::encode(Protocol::Opcode::Message, topic, payload);
+        expected.append(message->data(), message->size());
+    }
+    received.assign(expected.size(), '\0');
+    boost::asio::read(binary, boost::asio::buffer(received));
+    ASSERT_EQ(received, expected);
+    // The text subscriber only gets the message it can frame
+    received.assign(std::string("md/fx/EURUSD;b\n").size(), '\0');
+    boost::asio::read(text, boost::asio::buffer(received));
+    ASSERT_EQ(received, "md/fx/EURUSD;b\n");
+
+    // TcpClient batches by size and sends a partial batch after the delay
+    StrictMock<MockTcpClient> binaryClient(io_context);
+    StrictMock<MockTcpClient> textClient(io_context);
+    binaryClient.setBatching(64, std::chrono::seconds(10));
+    textClient.setBatching(1024, std::chrono::milliseconds(20));
+    std::string command = "CONNECT 12345 client1 v2";
+    binaryClient.handleCommand(command);
+    command = "CONNECT 12345 client2";
+    textClient.handleCommand(command);
+    for (int i = 0; i < 4; ++i) {
+        command = "PUBLISH md/fx/GBPUSD binary" + std::to_string(i);
+        binaryClient.handleCommand(command);
+    }
+    command = "PUBLISH md/fx/USDJPY text";
+    textClient.handleCommand(command);
+    expected = "md/fx/GBPUSD;binary0\nmd/fx/GBPUSD;binary1\nmd/fx/GBPUSD;binary2\nmd/fx/GBPUSD;binary3\n"
+               "md/fx/USDJPY;text\n";
+    received.clear();
+    while (received.size() < expected.size()) {
+        char data[128];
+        received.append(data, text.read_some(boost::asio::buffer(data)));
+    }
+    ASSERT_EQ(received, expected);
+
+    binaryClient.handleCommand("DISCONNECT");
+    textClient.handleCommand("DISCONNECT");
+    binary.close();
+    text.close();
+    publisher.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, UnixDomainSocketClients) {
+    const std::string path = "/tmp/tcp_server_client_test.sock";
+    boost::asio::io_context io_context;
+    auto server = std::make_unique<TcpServer>(12345, io_context);
+    server->listenLocal(path);
+    server->start();
+
+    StrictMock<MockTcpClient> localClient(io_context);
+    StrictMock<MockTcpClient> tcpClient(io_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    // TCP and local clients share the sessions and the subscriptions
+    std::string command = "CONNECT " + path + " client1 v2";
+    localClient.handleCommand(command);
+    command = "CONNECT 12345 client2";
+    tcpClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_TRUE(localClient.isConnected());
+    ASSERT_EQ(server->getClientCount(), 2);
+
+    command = "SUBSCRIBE test";
+    localClient.handleCommand(command);
+    tcpClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    EXPECT_CALL(localClient, onRead(0, "test;from tcp")).Times(1);
+    EXPECT_CALL(tcpClient, onRead(0, "test;from tcp")).Times(1);
+    command = "PUBLISH test from tcp";
+    tcpClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    EXPECT_CALL(localClient, onRead(0, "test;from uds")).Times(1);
+    EXPECT_CALL(tcpClient, onRead(0, "test;from uds")).Times(1);
+    command = "PUBLISH test from uds";
+    localClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    command = "DISCONNECT";
+    localClient.handleCommand(command);
+    tcpClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(localClient.isConnected());
+    ASSERT_EQ(server->getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+    // The socket file goes away with the server
+    ASSERT_EQ(::access(path.c_str(), F_OK), 0);
+    server.reset();
+    ASSERT_NE(::access(path.c_str(), F_OK), 0);
+
+    // Only a socket file is replaced, anything else at the path is kept and refused
+    std::ofstream(path) << "not a socket";
+    server = std::make_unique<TcpServer>(12345, io_context);
+    ASSERT_THROW(server->listenLocal(path), boost::system::system_error);
+    ASSERT_EQ(::access(path.c_str(), F_OK), 0);
+    ::unlink(path.c_str());
+}
+
+TEST(ShmRingTest, WrapAroundFullAndClose) {
+    auto consumer = ShmRing::create(64);
+    ASSERT_NE(consumer, nullptr);
+    // The memory is sealed, the consumer cannot shrink it under the producer's mapping
+    ASSERT_NE(::ftruncate(consumer->descriptor(), 0), 0);
+    auto producer = ShmRing::attach(::dup(consumer->descriptor()));
+    ASSERT_NE(producer, nullptr);
+
+    // Memory whose size is not sealed is refused
+    int fd = ::memfd_create("tcp-client-test", MFD_CLOEXEC);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(::ftruncate(fd, 4096), 0);
+    ASSERT_EQ(ShmRing::attach(fd), nullptr);
+
+    std::vector<std::string> frames;
+    auto onFrame = [&frames](std::string_view frame) { frames.emplace_back(frame); };
+    auto frame = Protocol::encode(Protocol::Opcode::Message, "t", "0123456789");
+    ASSERT_TRUE(producer->write(frame->data(), frame->size()));
+    ASSERT_TRUE(producer->write(frame->data(), frame->size()));
+    ASSERT_TRUE(producer->write(frame->data(), frame->size()));
+    // Full, the ring is left as it was
+    ASSERT_FALSE(producer->write(frame->data(), frame->size()));
+    ASSERT_TRUE(consumer->wait(std::chrono::milliseconds(0)));
+    ASSERT_EQ(consumer->read(onFrame), 3u);
+    ASSERT_EQ(consumer->read(onFrame), 0u);
+
+    // These skip the end of the ring instead of wrapping around it
+    for (int i = 0; i < 10; ++i) {
+        auto message = Protocol::encode(Protocol::Opcode::Message, "t", std::to_string(i) + "abcdefghijklmnopqrstuvwxyz");
+        ASSERT_TRUE(producer->write(message->data(), message->size()));
+        ASSERT_EQ(consumer->read(onFrame), 1u);
+        Protocol::Frame decoded;
+        ASSERT_TRUE(Protocol::decode(frames.back(), decoded));
+        ASSERT_EQ(decoded.payload, std::to_string(i) + "abcdefghijklmnopqrstuvwxyz");
+    }
+    ASSERT_FALSE(producer->write(frame->data(), 65));
+
+    // A sleeping consumer is woken by notify() and by close()
+    auto waiter = std::async(std::launch::async, [&consumer]() { return consumer->wait(std::chrono::seconds(5)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    ASSERT_TRUE(producer->write(frame->data(), frame->size()));
+    producer->notify();
+    ASSERT_TRUE(waiter.get());
+    ASSERT_EQ(consumer->read(onFrame), 1u);
+    waiter = std::async(std::launch::async, [&consumer]() { return consumer->wait(std::chrono::seconds(5)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    producer->close();
+    ASSERT_FALSE(waiter.get());
+    ASSERT_TRUE(consumer->isClosed());
+}
+
+TEST(ShmRingTest, CapacityChangedByConsumer) {
+    auto consumer = ShmRing::create(64);
+    ASSERT_NE(consumer, nullptr);
+    // The consumer's own view of the header, the capacity follows the magic
+    size_t mappedSize = 0;
+    {
+        struct stat status;
+        ASSERT_EQ(::fstat(consumer->descriptor(), &status), 0);
+        mappedSize = static_cast<size_t>(status.st_size);
+    }
+    void *memory = ::mmap(nullptr, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, consumer->descriptor(), 0);
+    ASSERT_NE(memory, MAP_FAILED);
+    auto capacity = reinterpret_cast<std::atomic<std::uint32_t>*>(static_cast<char*>(memory) + sizeof(std::uint32_t));
+
+    // Flipped while the producers attach, each one either refuses the ring or keeps the checked capacity
+    std::atomic<bool> stop{false};
+    std::thread flipper{[&stop, capacity]() {
+        while (!stop.load(std::memory_order_relaxed)) {
+            capacity->store(1u << 30, std::memory_order_relaxed);
+            capacity->store(64, std::memory_order_relaxed);
+        }
+    }};
+    std::string payload(40, 'x');
+    auto frame = Protocol::encode(Protocol::Opcode::Message, "t", payload);
+    for (int i = 0; i < 1000; ++i) {
+        auto producer = ShmRing::attach(::dup(consumer->descriptor()));
+        if (producer == nullptr) {
+            continue;
+        }
+        ASSERT_EQ(producer->capacity(), 64u);
+        ASSERT_FALSE(producer->write(std::string(65, 'x').data(), 65));
+    }
+    stop = true;
+    flipper.join();
+
+    // Changed after the attach, the producer still writes within its 64 bytes
+    auto producer = ShmRing::attach(::dup(consumer->descriptor()));
+    ASSERT_NE(producer, nullptr);
+    capacity->store(1u << 30);
+    std::vector<std::string> frames;
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(producer->write(frame->data(), frame->size()));
+        ASSERT_FALSE(producer->write(frame->data(), frame->size()));
+        ASSERT_EQ(consumer->read([&frames](std::string_view data) { frames.emplace_back(data); }), 1u);
+    }
+    ASSERT_EQ(frames.size(), 10u);
+    ::munmap(memory, mappedSize);
+}
+
+TEST(TcpServerClientTest, SharedMemoryDelivery) {
+    const std::string path = "/tmp/tcp_server_client_test.sock";
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.listenLocal(path);
+    server.start();
+
+    StrictMock<MockTcpClient> ringClient(io_context);
+    StrictMock<MockTcpClient> socketClient(io_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    // The ring's memory is passed over the Unix domain socket, a TCP client gets the socket
+    std::string command = "CONNECT " + path + " client1 v2 shm";
+    ringClient.handleCommand(command);
+    command = "CONNECT 12345 client2 v2 shm";
+    socketClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_TRUE(ringClient.isConnected());
+    ASSERT_EQ(server.getClientCount(), 2);
+    // One ring, mapped by the client and by the server
+    std::ifstream maps("/proc/self/maps");
+    std::string mapping;
+    int ringMappings = 0;
+    while (std::getline(maps, mapping)) {
+        ringMappings += mapping.find("/memfd:tcp-client-ring") != std::string::npos;
+    }
+    ASSERT_EQ(ringMappings, 2);
+
+    command = "SUBSCRIBE test";
+    ringClient.handleCommand(command);
+    socketClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // Both get the same messages, the first one out of the ring
+    for (int i = 0; i < 100; ++i) {
+        EXPECT_CALL(ringClient, onRead(0, "test;" + std::to_string(i))).Times(1);
+        EXPECT_CALL(socketClient, onRead(0, "test;" + std::to_string(i))).Times(1);
+    }
+    for (int i = 0; i < 100; ++i) {
+        command = "PUBLISH test " + std::to_string(i);
+        (i % 2 ? ringClient : socketClient).handleCommand(command);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    // Ring writes count as sent messages like socket writes
+    std::promise<MetricsSnapshot> snapshot;
+    boost::asio::post(io_context, [&]() { snapshot.set_value(server.collectMetrics()); });
+    auto connections = snapshot.get_future().get().connections;
+    ASSERT_EQ(connections.size(), 2u);
+    ASSERT_EQ(connections[0].messagesOut, connections[1].messagesOut);
+
+    command = "DISCONNECT";
+    ringClient.handleCommand(command);
+    socketClient.handleCommand(command);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(ringClient.isConnected());
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, StatsCommandAndAdminEndpoint) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    AdminEndpoint admin(12346, io_context, [&server]() {
+        std::vector<MetricsSnapshot> snapshots;
+        snapshots.push_back(server.collectMetrics());
+        return Metrics::formatPrometheus(snapshots);
+    });
+    admin.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    tcp::socket socket(client_context);
+    socket.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    boost::asio::write(socket, boost::asio::buffer(std::string(
+        "CONNECT;client1\nSUBSCRIBE;test\nPUBLISH;test;abc\nPUBLISH;other;abcd\nSTATS\n")));
+    // The STATS reply is a control frame and may overtake the queued delivery
+    boost::asio::streambuf buffer;
+    std::istream lines(&buffer);
+    std::string stats;
+    bool delivered = false;
+    while (!delivered || stats.empty()) {
+        boost::asio::read_until(socket, buffer, '\n');
+        std::string line;
+        std::getline(lines, line);
+        if (line == "test;abc") {
+            delivered = true;
+        } else {
+            stats = line;
+        }
+    }
+    ASSERT_EQ(stats.rfind("STATS;connections=1;topics=2;published=2;delivered=1;dropped=0;", 0), 0u) << stats;
+
+    tcp::socket http(client_context);
+    http.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12346});
+    boost::asio::write(http, boost::asio::buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+    std::string response;
+    boost::system::error_code error;
+    char data[4096];
+    while (!error) {
+        response.append(data, http.read_some(boost::asio::buffer(data), error));
+    }
+    ASSERT_EQ(response.rfind("HTTP/1.0 200 OK\r\n", 0), 0u);
+    ASSERT_NE(response.find("tcp_server_connections{shard=\"0\"} 1\n"), std::string::npos);
+    ASSERT_NE(response.find("tcp_server_topic_published_total{shard=\"0\",topic=\"test\"} 1\n"), std::string::npos);
+    ASSERT_NE(response.find("tcp_server_topic_published_bytes_total{shard=\"0\",topic=\"#other\"} 4\n"), std::string::npos);
+    ASSERT_NE(response.find("tcp_server_connection_messages_in_total{shard=\"0\",conn=\"0\",name=\"client1\"} 5\n"), std::string::npos);
+    ASSERT_NE(response.find("tcp_server_publish_write_latency_seconds_count{shard=\"0\"} 1\n"), std::string::npos);
+
+    // Published topics without an id, even those a wildcard matches, and the topics beyond
+    // the cap share one label set
+    std::string publishes = "SUBSCRIBE;unique/#\n";
+    for (size_t i = 0; i < TcpServer::max_topic_metrics; ++i) {
+        publishes += "PUBLISH;unique/" + std::to_string(i) + ";x\n";
+        publishes += "SUBSCRIBE;capped/" + std::to_string(i) + "\nPUBLISH;capped/" + std::to_string(i) + ";x\n";
+    }
+    boost::asio::write(socket, boost::asio::buffer(publishes + "STATS\n"));
+    boost::asio::read_until(socket, buffer, "STATS;");
+    http = tcp::socket(client_context);
+    http.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12346});
+    boost::asio::write(http, boost::asio::buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+    response.clear();
+    error = {};
+    while (!error) {
+        response.append(data, http.read_some(boost::asio::buffer(data), error));
+    }
+    // test and capped/0 to capped/1022 have counters of their own, the filter unique/# gets
+    // its counters once it is reported and none are left by then
+    std::string other = std::to_string(1 + TcpServer::max_topic_metrics + 1);
+    ASSERT_NE(response.find("tcp_server_topic_published_total{shard=\"0\",topic=\"#other\"} " + other + "\n"), std::string::npos);
+    ASSERT_EQ(response.find("topic=\"unique/"), std::string::npos);
+    ASSERT_NE(response.find("topic=\"capped/1022\""), std::string::npos);
+    ASSERT_EQ(response.find("topic=\"capped/1023\""), std::string::npos);
+
+    socket.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(AsyncClientTest, PipelinedPublishesAndHandlers) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    boost::asio::io_context client_context;
+    auto work = boost::asio::make_work_guard(client_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    std::thread client_thread{[&client_context]() { client_context.run(); }};
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345};
+
+    std::atomic<int> received{0};
+    std::string last;
+    AsyncClient subscriber(client_context);
+    subscriber.setMessageHandler([&](std::string_view topic, std::string_view payload) {
+        if (topic == "test") {
+            last = payload;
+            ++received;
+        }
+    });
+    subscriber.connect(endpoint, "subscriber", Protocol::Version::Text).get();
+    subscriber.subscribe("test").get();
+
+    AsyncClient publisher(client_context);
+    publisher.connect(endpoint, "publisher").get();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 2);
+
+    // Nothing waits between publishes, they are queued and written in batches
+    constexpr int count = 10000;
+    for (int i = 0; i < count; ++i) {
+        ASSERT_TRUE(publisher.publish("test", "message" + std::to_string(i)));
+    }
+    std::promise<boost::system::error_code> written;
+    publisher.asyncPublish("test", "last", [&written](const boost::system::error_code& error) {
+        written.set_value(error);
+    });
+    ASSERT_FALSE(written.get_future().get());
+    for (int i = 0; i < 100 && received < count + 1; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    ASSERT_EQ(received, count + 1);
+    ASSERT_EQ(last, "last");
+
+    // The handler runs on the io_context thread and may publish, it is not called by the
+    // publish() that congested the queue
+    std::atomic<bool> congested{false};
+    std::thread::id handlerThread;
+    publisher.setBackpressureHandler([&](bool isCongested) {
+        handlerThread = std::this_thread::get_id();
+        publisher.publish("other", "from the handler");
+        congested = congested || isCongested;
+    });
+    std::string large(64 * 1024, 'x');
+    for (int i = 0; i < 1000 && publisher.publish("other", large); ++i) {
+    }
+    for (int i = 0; i < 100 && !congested; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_TRUE(congested);
+    ASSERT_EQ(handlerThread, client_thread.get_id());
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    publisher.disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_FALSE(publisher.isConnected());
+    ASSERT_THROW(publisher.asyncPublish("test", "closed").get(), boost::system::system_error);
+    ASSERT_EQ(server.getClientCount(), 1);
+
+    subscriber.disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    work.reset();
+    client_context.stop();
+    client_thread.join();
+    io_context.stop();
+    thread.join();
+}
+
+TEST(AsyncClientTest, HeartbeatsKeepConnectionAndWriteCounts) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    ConnectionTimeouts timeouts;
+    timeouts.heartbeatInterval = std::chrono::milliseconds(100);
+    timeouts.readTimeout = std::chrono::milliseconds(300);
+    server.setTimeouts(timeouts);
+    server.start();
+    boost::asio::io_context client_context;
+    auto work = boost::asio::make_work_guard(client_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    std::thread client_thread{[&client_context]() { client_context.run(); }};
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345};
+
+    std::atomic<int> received{0};
+    AsyncClient subscriber(client_context);
+    subscriber.setMessageHandler([&received](std::string_view topic, std::string_view payload) {
+        (void)topic;
+        (void)payload;
+        ++received;
+    });
+    subscriber.connect(endpoint, "subscriber").get();
+    subscriber.subscribe("test").get();
+    AsyncClient publisher(client_context);
+    publisher.connect(endpoint, "publisher", Protocol::Version::Text).get();
+
+    // Both answer the server's PINGs, which keeps them connected past the read timeout
+    std::this_thread::sleep_for(std::chrono::milliseconds(700));
+    ASSERT_TRUE(subscriber.isConnected());
+    ASSERT_TRUE(publisher.isConnected());
+    ASSERT_EQ(server.getClientCount(), 2);
+
+    // The PONGs are control frames, they do not complete the handlers of publishes. Each
+    // handler runs once its publish is written, so the last one sees all of them delivered.
+    constexpr int count = 1000;
+    std::vector<std::future<void>> written;
+    for (int i = 0; i < count; ++i) {
+        written.push_back(publisher.asyncPublish("test", "message" + std::to_string(i)));
+    }
+    for (auto &future : written) {
+        ASSERT_EQ(future.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+        future.get();
+    }
+    for (int i = 0; i < 100 && received < count; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_EQ(received, count);
+
+    publisher.disconnect();
+    subscriber.disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    work.reset();
+    client_context.stop();
+    client_thread.join();
+    io_context.stop();
+    thread.join();
+}
+
+TEST(AsyncClientTest, RegisteredTopicIds) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    boost::asio::io_context client_context;
+    auto work = boost::asio::make_work_guard(client_context);
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    std::thread client_thread{[&client_context]() { client_context.run(); }};
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345};
+
+    // Binary subscriber that registered the topic, read frame by frame to see the opcodes
+    tcp::socket raw(client_context);
+    raw.connect(endpoint);
+    auto subscribe = Protocol::encode(Protocol::Opcode::Subscribe, "md/eq/trades");
+    auto registerFrame = Protocol::encode(Protocol::Opcode::Register, "md/eq/trades");
+    boost::asio::write(raw, boost::asio::buffer(std::string("CONNECT;raw;2\n")));
+    boost::asio::write(raw, std::vector<boost::asio::const_buffer>{
+        boost::asio::buffer(registerFrame->data(), registerFrame->size()),
+        boost::asio::buffer(subscribe->data(), subscribe->size())});
+    boost::asio::streambuf rawBuffer;
+    boost::asio::read_until(raw, rawBuffer, '\n');
+    rawBuffer.consume(Protocol::connack.size() + 1);
+    auto readFrame = [&raw, &rawBuffer](Protocol::Frame& frame, std::string& storage) {
+        while (rawBuffer.size() < Protocol::length_size) {
+            boost::asio::read(raw, rawBuffer, boost::asio::transfer_at_least(1));
+        }
+        size_t length = Protocol::readLength(static_cast<const char*>(rawBuffer.data().data()));
+        if (rawBuffer.size() < Protocol::length_size + length) {
+            boost::asio::read(raw, rawBuffer, boost::asio::transfer_exactly(Protocol::length_size + length - rawBuffer.size()));
+        }
+        storage.assign(static_cast<const char*>(rawBuffer.data().data()) + Protocol::length_size, length);
+        rawBuffer.consume(Protocol::length_size + length);
+        return Protocol::decode(storage, frame);
+    };
+    Protocol::Frame frame;
+    std::string storage;
+    ASSERT_TRUE(readFrame(frame, storage));
+    ASSERT_EQ(frame.opcode, Protocol::Opcode::Registered);
+    ASSERT_EQ(frame.topic, "md/eq/trades");
+    std::uint32_t topicId = frame.topicId;
+
+    // A topic that cannot be registered is answered as well
+    auto rejected = Protocol::encode(Protocol::Opcode::Register, "md/+/trades");
+    boost::asio::write(raw, boost::asio::buffer(rejected->data(), rejected->size()));
+    ASSERT_TRUE(readFrame(frame, storage));
+    ASSERT_EQ(frame.opcode, Protocol::Opcode::Registered);
+    ASSERT_EQ(frame.topic, "md/+/trades");
+    ASSERT_EQ(frame.topicId, Protocol::rejected_topic_id);
+
+    // A binary subscriber that did not register still gets the topic string
+    std::promise<std::string> plainReceived;
+    bool plainDone = false;
+    AsyncClient plain(client_context);
+    plain.setMessageHandler([&plainReceived, &plainDone](std::string_view topic, std::string_view payload) {
+        if (!std::exchange(plainDone, true)) {
+            plainReceived.set_value(std::string(topic) + ";" + std::string(payload));
+        }
+    });
+    plain.connect(endpoint, "plain").get();
+    plain.subscribe("md/eq/trades").get();
+
+    AsyncClient publisher(client_context);
+    publisher.connect(endpoint, "publisher").get();
+    ASSERT_EQ(publisher.registerTopic("md/eq/trades").get(), topicId);
+    ASSERT_THROW(publisher.registerTopic("md/eq/+").get(), boost::system::system_error);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    publisher.asyncPublish(topicId, "100@1.5").get();
+
+    ASSERT_TRUE(readFrame(frame, storage));
+    ASSERT_EQ(frame.opcode, Protocol::Opcode::MessageById);
+    ASSERT_EQ(frame.topicId, topicId);
+    ASSERT_EQ(frame.payload, "100@1.5");
+    auto plainFuture = plainReceived.get_future();
+    ASSERT_EQ(plainFuture.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(plainFuture.get(), "md/eq/trades;100@1.5");
+
+    // The client library resolves ids of delivered messages back to the topic
+    std::promise<std::string> registeredReceived;
+    AsyncClient registeredClient(client_context);
+    registeredClient.setMessageHandler([&registeredReceived](std::string_view topic, std::string_view payload) {
+        registeredReceived.set_value(std::string(topic) + ";" + std::string(payload));
+    });
+    registeredClient.connect(endpoint, "registered").get();
+    registeredClient.subscribe("md/eq/trades").get();
+    ASSERT_EQ(registeredClient.registerTopic("md/eq/trades").get(), topicId);
+    publisher.asyncPublish(topicId, "200@1.6").get();
+    auto registeredFuture = registeredReceived.get_future();
+    ASSERT_EQ(registeredFuture.wait_for(std::chrono::seconds(5)), std::future_status::ready);
+    ASSERT_EQ(registeredFuture.get(), "md/eq/trades;200@1.6");
+
+    // Registrations are capped per client, and the ids only a closed client used are reused
+    AsyncClient many(client_context);
+    many.connect(endpoint, "many").get();
+    std::vector<std::future<std::uint32_t>> registrations;
+    for (size_t i = 0; i < TcpServer::max_registered_topics_per_session; ++i) {
+        registrations.push_back(many.registerTopic("many/" + std::to_string(i)));
+    }
+    std::vector<std::uint32_t> manyIds;
+    for (auto &registration : registrations) {
+        manyIds.push_back(registration.get());
+    }
+    ASSERT_THROW(many.registerTopic("many/extra").get(), boost::system::system_error);
+    ASSERT_EQ(many.registerTopic("many/0").get(), manyIds.front());
+    many.disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::uint32_t reused = registeredClient.registerTopic("reused").get();
+    ASSERT_NE(std::find(manyIds.begin(), manyIds.end(), reused), manyIds.end());
+    ASSERT_EQ(registeredClient.registerTopic("md/eq/trades").get(), topicId);
+
+    raw.close();
+    plain.disconnect();
+    publisher.disconnect();
+    registeredClient.disconnect();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    work.reset();
+    client_context.stop();
+    client_thread.join();
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, NoAllocationsPerMessage) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+
+    boost::asio::io_context client_context;
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345};
+    tcp::socket subscriber(client_context);
+    subscriber.connect(endpoint);
+    boost::asio::write(subscriber, boost::asio::buffer(std::string("CONNECT;subscriber\nSUBSCRIBE;test\n")));
+    tcp::socket publisher(client_context);
+    publisher.connect(endpoint);
+    boost::asio::write(publisher, boost::asio::buffer(std::string("CONNECT;publisher\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    const std::string frame = "PUBLISH;test;" + std::string(100, 'x') + "\n";
+    const size_t delivered = frame.size() - 8;
+    std::vector<char> batch;
+    for (int i = 0; i < 100; ++i) {
+        batch.insert(batch.end(), frame.begin(), frame.end());
+    }
+    std::vector<char> received(100 * delivered);
+    auto exchange = [&](int batches) {
+        auto reader = std::async(std::launch::async, [&]() {
+            for (int i = 0; i < batches; ++i) {
+                boost::asio::read(subscriber, boost::asio::buffer(received));
+            }
+        });
+        for (int i = 0; i < batches; ++i) {
+            boost::asio::write(publisher, boost::asio::buffer(batch));
+        }
+        reader.get();
+    };
+    // Warm up the pools and the buffers that grow to their steady state size
+    exchange(100);
+    std::uint64_t before = allocations.load();
+    exchange(100);
+    // 10000 messages received, queued, written and read. Only the test's reader thread allocates.
+    ASSERT_LT(allocations.load() - before, 10u);
+
+    subscriber.close();
+    publisher.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, AdmissionControlAndDescriptorExhaustion) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    ConnectionLimits limits;
+    limits.maxConnections = 2;
+    server.setConnectionLimits(limits);
+    server.start();
+    AdminEndpoint admin(12346, io_context, []() { return std::string("up\n"); });
+    admin.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    auto metrics = [&io_context, &server]() {
+        std::promise<MetricsSnapshot> snapshot;
+        boost::asio::post(io_context, [&]() { snapshot.set_value(server.collectMetrics()); });
+        return snapshot.get_future().get();
+    };
+
+    boost::asio::io_context client_context;
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345};
+    std::vector<std::unique_ptr<tcp::socket>> clients;
+    for (int i = 0; i < 3; ++i) {
+        clients.push_back(std::make_unique<tcp::socket>(client_context));
+        clients.back()->connect(endpoint);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // The third connection was reset right after it was accepted
+    char data[16];
+    boost::system::error_code error;
+    clients[2]->read_some(boost::asio::buffer(data), error);
+    ASSERT_EQ(error, boost::asio::error::connection_reset);
+    ASSERT_EQ(metrics().connections.size(), 2u);
+    ASSERT_EQ(metrics().rejectedConnections, 1u);
+    clients.clear();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // Out of descriptors: the server can accept one more connection, the others are accepted
+    // with its spare descriptor and rejected instead of stopping the accept loop
+    limits.maxConnections = 0;
+    server.setConnectionLimits(limits);
+    for (int i = 0; i < 4; ++i) {
+        clients.push_back(std::make_unique<tcp::socket>(client_context));
+        clients.back()->open(tcp::v4());
+    }
+    int lowestFree = ::open("/dev/null", O_RDONLY);
+    ::close(lowestFree);
+    struct rlimit original;
+    getrlimit(RLIMIT_NOFILE, &original);
+    struct rlimit lowered = original;
+    lowered.rlim_cur = lowestFree + 1;
+    setrlimit(RLIMIT_NOFILE, &lowered);
+    for (auto &client : clients) {
+        client->connect(endpoint);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    setrlimit(RLIMIT_NOFILE, &original);
+    ASSERT_EQ(metrics().connections.size(), 1u);
+    ASSERT_EQ(metrics().rejectedConnections, 4u);
+
+    // Accepting goes on once descriptors are available again
+    tcp::socket late(client_context);
+    late.connect(endpoint);
+    boost::asio::write(late, boost::asio::buffer(std::string("CONNECT;late\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 1);
+    ASSERT_EQ(metrics().connections.size(), 2u);
+
+    // The admin endpoint retries its accept until descriptors are available again
+    tcp::socket operatorClient(client_context);
+    operatorClient.open(tcp::v4());
+    lowestFree = ::open("/dev/null", O_RDONLY);
+    ::close(lowestFree);
+    lowered.rlim_cur = lowestFree;
+    setrlimit(RLIMIT_NOFILE, &lowered);
+    operatorClient.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12346});
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    setrlimit(RLIMIT_NOFILE, &original);
+    boost::asio::write(operatorClient, boost::asio::buffer(std::string("GET /metrics HTTP/1.0\r\n\r\n")));
+    std::string response;
+    error = {};
+    while (!error) {
+        response.append(data, operatorClient.read_some(boost::asio::buffer(data), error));
+    }
+    ASSERT_EQ(response.rfind("HTTP/1.0 200 OK\r\n", 0), 0u);
+
+    late.close();
+    clients.clear();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, HeartbeatsAndTimeouts) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    ConnectionTimeouts timeouts;
+    timeouts.heartbeatInterval = std::chrono::milliseconds(100);
+    timeouts.readTimeout = std::chrono::milliseconds(300);
+    timeouts.idleTimeout = std::chrono::milliseconds(1000);
+    server.setTimeouts(timeouts);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    auto metrics = [&io_context, &server]() {
+        std::promise<MetricsSnapshot> snapshot;
+        boost::asio::post(io_context, [&]() { snapshot.set_value(server.collectMetrics()); });
+        return snapshot.get_future().get();
+    };
+
+    // Never answers the PINGs and is reaped by the read timeout
+    boost::asio::io_context client_context;
+    tcp::socket silent(client_context);
+    silent.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+    boost::asio::write(silent, boost::asio::buffer(std::string("CONNECT;silent\nSUBSCRIBE;silent\n")));
+    // Answers them, PINGs never reach onRead
+    StrictMock<MockTcpClient> client(io_context);
+    std::string command = "CONNECT 12345 client";
+    client.handleCommand(command);
+    command = "SUBSCRIBE test";
+    client.handleCommand(command);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(700));
+    ASSERT_EQ(server.getClientCount(), 1);
+    ASSERT_TRUE(client.isConnected());
+    auto snapshot = metrics();
+    ASSERT_EQ(snapshot.timedOutConnections, 1u);
+    // The reaped session's subscription went with it
+    for (const auto &topic : snapshot.topics) {
+        ASSERT_EQ(topic.subscribers, topic.name == "test" ? 1u : 0u);
+    }
+    std::string received;
+    char data[64];
+    boost::system::error_code error;
+    while (!error) {
+        size_t size = silent.read_some(boost::asio::buffer(data), error);
+        received.append(data, size);
+    }
+    ASSERT_EQ(received.substr(0, 5), "PING\n");
+
+    // Heartbeats alone do not keep a connection open past the idle timeout
+    std::this_thread::sleep_for(std::chrono::milliseconds(700));
+    ASSERT_FALSE(client.isConnected());
+    ASSERT_EQ(server.getClientCount(), 0);
+    ASSERT_EQ(metrics().timedOutConnections, 2u);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, AtLeastOnceDelivery) {
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    std::thread thread{[&io_context]() { io_context.run(); }};
+    auto bytes = [](const SharedBufferPtr& frame) { return std::string(frame->data(), frame->size()); };
+    auto message = [&bytes](const std::string& payload) {
+        return bytes(Protocol::encode(Protocol::Opcode::Message, "qos", payload));
+    };
+    boost::asio::io_context client_context;
+    auto connect = [&client_context](tcp::socket& socket, const std::string& frames) {
+        socket.connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345});
+        boost::asio::write(socket, boost::asio::buffer(frames));
+    };
+    auto read = [](tcp::socket& socket, size_t size) {
+        std::string received(size, '\0');
+        boost::asio::read(socket, boost::asio::buffer(received));
+        return received;
+    };
+    std::string subscribe = bytes(Protocol::encode(Protocol::Opcode::Subscribe, "qos"));
+
+    tcp::socket subscriber(client_context);
+    connect(subscriber, "CONNECT;sub;2;;;1;0\n" + subscribe);
+    ASSERT_EQ(read(subscriber, 16), "CONNACK;2;qos;0\n");
+    // The publishes of a read are acknowledged together, after AckWindow::ack_delay
+    tcp::socket publisher(client_context);
+    std::string publishes;
+    for (int i = 0; i < 3; ++i) {
+        publishes += bytes(Protocol::encode(Protocol::Opcode::Publish, "qos", "m" + std::to_string(i)));
+    }
+    connect(publisher, "CONNECT;pub;2;;;1;0\n" + publishes);
+    ASSERT_EQ(read(publisher, 16), "CONNACK;2;qos;0\n");
+    ASSERT_EQ(read(publisher, Protocol::encodeAck(3)->size()), bytes(Protocol::encodeAck(3)));
+    std::string expected = message("m0") + message("m1") + message("m2");
+    ASSERT_EQ(read(subscriber, expected.size()), expected);
+
+    // Both connections are lost, the subscriber only acknowledged m0
+    boost::asio::write(subscriber, boost::asio::buffer(bytes(Protocol::encodeAck(1))));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    subscriber.close();
+    publisher.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    // It had received m1 as well, so only m2 is sent again. Subscriptions are not kept.
+    tcp::socket resumed(client_context);
+    connect(resumed, "CONNECT;sub;2;;;1;2\n" + subscribe);
+    expected = "CONNACK;2;qos;0\n" + message("m2");
+    ASSERT_EQ(read(resumed, expected.size()), expected);
+    tcp::socket republisher(client_context);
+    connect(republisher, "CONNECT;pub;2;;;1;0\n");
+    ASSERT_EQ(read(republisher, 16), "CONNACK;2;qos;3\n");
+
+    // TcpClient holds its publishes back until the CONNACK told where to resume
+    StrictMock<MockTcpClient> client(io_context);
+    std::string command = "CONNECT 12345 client v2 qos1";
+    client.handleCommand(command);
+    command = "PUBLISH qos m3";
+    client.handleCommand(command);
+    ASSERT_EQ(read(resumed, message("m3").size()), message("m3"));
+
+    // A clean DISCONNECT discards the state, m3 is not acknowledged and not sent again
+    boost::asio::write(resumed, boost::asio::buffer(bytes(Protocol::encode(Protocol::Opcode::Disconnect))));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    tcp::socket fresh(client_context);
+    connect(fresh, "CONNECT;sub;2;;;1;0\n" + subscribe);
+    ASSERT_EQ(read(fresh, 16), "CONNACK;2;qos;0\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    command = "PUBLISH qos m4";
+    client.handleCommand(command);
+    ASSERT_EQ(read(fresh, message("m4").size()), message("m4"));
+
+    client.handleCommand("DISCONNECT");
+    fresh.close();
+    republisher.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    // STATS is answered even when the window is full, after the messages sent before it.
+    // Without QoS 1 it is a control frame, so the flooder's reply shows its publishes are done.
+    auto isStats = [&read](tcp::socket& socket) {
+        std::string frame = read(socket, Protocol::length_size);
+        frame = read(socket, Protocol::readLength(frame.data()));
+        Protocol::Frame decoded;
+        return Protocol::decode(frame, decoded) && decoded.topic == "STATS";
+    };
+    std::string stats = bytes(Protocol::encode(Protocol::Opcode::Stats));
+    tcp::socket full(client_context);
+    connect(full, "CONNECT;full;2;;;1;0\n" + subscribe);
+    ASSERT_EQ(read(full, 16), "CONNACK;2;qos;0\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    std::string burst;
+    expected.clear();
+    for (size_t i = 0; i < AckWindow::default_capacity + 1; ++i) {
+        burst += bytes(Protocol::encode(Protocol::Opcode::Publish, "qos", "x"));
+        if (i < AckWindow::default_capacity) {
+            expected += message("x");
+        }
+    }
+    tcp::socket flooder(client_context);
+    connect(flooder, "CONNECT;flooder;2\n" + burst + stats);
+    ASSERT_EQ(read(flooder, Protocol::connack.size() + 1), std::string(Protocol::connack) + "\n");
+    ASSERT_TRUE(isStats(flooder));
+    boost::asio::write(full, boost::asio::buffer(stats));
+    ASSERT_EQ(read(full, expected.size()), expected);
+    // The message past the window waits for an Ack, the reply comes after it
+    boost::asio::write(full, boost::asio::buffer(bytes(Protocol::encodeAck(AckWindow::default_capacity))));
+    ASSERT_EQ(read(full, message("x").size()), message("x"));
+    ASSERT_TRUE(isStats(full));
+    flooder.close();
+    full.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // A subscriber max_waiting_deliveries behind its window is disconnected and keeps them
+    const size_t window = AckWindow::default_capacity;
+    std::string received = std::to_string(window + 2);
+    tcp::socket behind(client_context);
+    connect(behind, "CONNECT;full;2;;;1;" + received + "\n" + subscribe);
+    ASSERT_EQ(read(behind, 16), "CONNACK;2;qos;0\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    burst.clear();
+    for (size_t i = 0; i < window + TcpServer::max_waiting_deliveries; ++i) {
+        burst += bytes(Protocol::encode(Protocol::Opcode::Publish, "qos", "y"));
+    }
+    flooder = tcp::socket(client_context);
+    connect(flooder, "CONNECT;flooder;2\n" + burst + stats);
+    ASSERT_EQ(read(flooder, Protocol::connack.size() + 1), std::string(Protocol::connack) + "\n");
+    ASSERT_TRUE(isStats(flooder));
+    boost::system::error_code error;
+    std::string data(64 * 1024, '\0');
+    while (!error) {
+        behind.read_some(boost::asio::buffer(data), error);
+    }
+    ASSERT_EQ(error, boost::asio::error::eof);
+    expected.clear();
+    for (size_t i = 0; i < window; ++i) {
+        expected += message("y");
+    }
+    behind = tcp::socket(client_context);
+    connect(behind, "CONNECT;full;2;;;1;" + received + "\n");
+    ASSERT_EQ(read(behind, 16 + expected.size()), "CONNACK;2;qos;0\n" + expected);
+    boost::asio::write(behind, boost::asio::buffer(bytes(Protocol::encodeAck(2 * window + 2))));
+    ASSERT_EQ(read(behind, expected.size()), expected);
+    flooder.close();
+    behind.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    // Once max_retained_sessions states are kept the least recently lost ones make room.
+    // sub, pub and full were lost before oldest.
+    tcp::socket oldest(client_context);
+    connect(oldest, "CONNECT;oldest;2;;;1;0\n" + bytes(Protocol::encode(Protocol::Opcode::Publish, "qos", "m5")));
+    ASSERT_EQ(read(oldest, 16), "CONNACK;2;qos;0\n");
+    ASSERT_EQ(read(oldest, Protocol::encodeAck(1)->size()), bytes(Protocol::encodeAck(1)));
+    oldest.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (size_t i = 0; i < TcpServer::max_retained_sessions; ++i) {
+        bool last = i + 1 == TcpServer::max_retained_sessions;
+        std::string publish = last ? bytes(Protocol::encode(Protocol::Opcode::Publish, "qos", "m6")) : "";
+        tcp::socket lost(client_context);
+        connect(lost, "CONNECT;lost" + std::to_string(i) + ";2;;;1;0\n" + publish);
+        ASSERT_EQ(read(lost, 16), "CONNACK;2;qos;0\n");
+        if (last) {
+            ASSERT_EQ(read(lost, Protocol::encodeAck(1)->size()), bytes(Protocol::encodeAck(1)));
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    std::promise<MetricsSnapshot> snapshot;
+    boost::asio::post(io_context, [&]() { snapshot.set_value(server.collectMetrics()); });
+    ASSERT_EQ(snapshot.get_future().get().discardedQosSessions, 4u);
+    tcp::socket newest(client_context);
+    connect(newest, "CONNECT;lost" + std::to_string(TcpServer::max_retained_sessions - 1) + ";2;;;1;0\n");
+    ASSERT_EQ(read(newest, 16), "CONNACK;2;qos;1\n");
+    oldest = tcp::socket(client_context);
+    connect(oldest, "CONNECT;oldest;2;;;1;0\n");
+    ASSERT_EQ(read(oldest, 16), "CONNACK;2;qos;0\n");
+    newest.close();
+    oldest.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(server.getClientCount(), 0);
+
+    io_context.stop();
+    thread.join();
+}
+
+TEST(TcpServerClientTest, ConnectStormOfIdleConnections) {
+    const size_t connections = 2000;
+    // Both ends of every connection are in this process, the soft limit is raised like
+    // tcp_server's main does and left raised
+    struct rlimit limit;
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &limit), 0);
+    const rlim_t needed = 2 * connections + 64;
+    if (limit.rlim_cur < needed) {
+        limit.rlim_cur = std::min(limit.rlim_max, needed);
+        if (limit.rlim_cur < needed || setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            GTEST_SKIP() << "Needs " << needed << " descriptors, the hard limit is " << limit.rlim_max;
+        }
+    }
+    auto residentBytes = []() {
+        std::ifstream statm("/proc/self/statm");
+        size_t pages = 0;
+        size_t resident = 0;
+        statm >> pages >> resident;
+        return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    };
+
+    CoutCapture serverLog;
+    boost::asio::io_context io_context;
+    TcpServer server(12345, io_context);
+    server.start();
+    ContextThread thread(io_context);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    size_t baseline = residentBytes();
+
+    // All connections are opened at once and send CONNECT, then stay idle
+    boost::asio::io_context client_context;
+    tcp::endpoint endpoint{boost::asio::ip::address::from_string("127.0.0.1"), 12345};
+    const std::string command = "CONNECT;idle\n";
+    std::vector<tcp::socket> clients;
+    clients.reserve(connections);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < connections; ++i) {
+        tcp::socket &client = clients.emplace_back(client_context);
+        client.async_connect(endpoint, [&client, &command](const boost::system::error_code &error) {
+            ASSERT_FALSE(error);
+            boost::asio::async_write(client, boost::asio::buffer(command),
+                                     [](const boost::system::error_code &error, size_t) { ASSERT_FALSE(error); });
+        });
+    }
+    client_context.run();
+    while (static_cast<size_t>(server.getClientCount()) < connections &&
+           std::chrono::steady_clock::now() - start < std::chrono::seconds(10)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    auto storm = std::chrono::steady_clock::now() - start;
+    size_t resident = residentBytes();
+
+    ASSERT_EQ(static_cast<size_t>(server.getClientCount()), connections);
+    ASSERT_LT(storm, std::chrono::seconds(5));
+    // Both ends of every connection live in this process, the server's share is documented
+    // as about 2 KiB per idle connection in the README
+    ASSERT_LT((resident - baseline) / connections, 8u * 1024);
+    serverLog.out() << connections << " connections in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(storm).count() << " ms, "
+              << (resident - baseline) / connections << " B resident per connection (both ends)" << std::endl;
+
+    clients.clear();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    ASSERT_EQ(server.getClientCount(), 0);
+}
+
+TEST(FederationTest, ThreeNodeMesh) {
+    // Three nodes on loopback, each with its own io_context and thread, peered in a full mesh
+    const int ports[] = {12350, 12351, 12352};
+    CoutCapture serverLog;
+    std::deque<boost::asio::io_context> contexts(3);
+    std::deque<TcpServer> servers;
+    std::deque<Federation> federations;
+    // Destroyed first, the federations may only go once their io_context stopped
+    std::deque<ContextThread> threads;
+    for (int node = 0; node < 3; ++node) {
+        servers.emplace_back(ports[node], contexts[node]);
+        servers.back().start();
+        federations.emplace_back(servers.back(), contexts[node], "node" + std::to_string(node));
+        for (int peer = 0; peer < 3; ++peer) {
+            if (peer != node) {
+                federations.back().addPeer({boost::asio::ip::address::from_string("127.0.0.1"),
+                                            static_cast<unsigned short>(ports[peer])});
+            }
+        }
+    }
+    for (int node = 0; node < 3; ++node) {
+        federations[node].start();
+        threads.emplace_back(contexts[node]);
+    }
+    auto connectedPeers = [&federations]() {
+        size_t connected = 0;
+        for (const auto &federation : federations) {
+            connected += federation.connectedPeers();
+        }
+        return connected;
+    };
+    for (int i = 0; i < 1000 && connectedPeers() < 6; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    ASSERT_EQ(connectedPeers(), 6u);
+
+    boost::asio::io_context client_context;
+    auto connect = [&client_context, &ports](int node, const std::string& commands) {
+        auto socket = std::make_unique<tcp::socket>(client_context);
+        socket->connect(tcp::endpoint{boost::asio::ip::address::from_string("127.0.0.1"),
+                                      static_cast<unsigned short>(ports[node])});
+        socket->set_option(tcp::no_delay(true));
+        boost::asio::write(*socket, boost::asio::buffer(commands));
+        return socket;
+    };
+    // Reads text frames until count arrived or the timeout passed
+    auto readFrames = [](tcp::socket& socket, size_t count,
+                         std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+        std::vector<std::string> frames;
+        std::string buffer;
+        char data[64 * 1024];
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        socket.non_blocking(true);
+        while (frames.size() < count && std::chrono::steady_clock::now() < deadline) {
+            boost::system::error_code error;
+            size_t bytes = socket.read_some(boost::asio::buffer(data), error);
+            if (error == boost::asio::error::would_block) {
+                std::this_thread::yield();
+                continue;
+            }
+            buffer.append(data, bytes);
+            size_t end;
+            while ((end = buffer.find('\n')) != std::string::npos) {
+                frames.push_back(buffer.substr(0, end));
+                buffer.erase(0, end + 1);
+            }
+        }
+        return frames;
+    };
+    auto local = connect(0, "CONNECT;local\nSUBSCRIBE;fed/#\n");
+    auto exact = connect(1, "CONNECT;exact\nSUBSCRIBE;fed/a\n");
+    auto wildcard = connect(2, "CONNECT;wildcard\nSUBSCRIBE;fed/#\n");
+    auto publisher = connect(0, "CONNECT;publisher\n");
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+    // Nobody subscribed to other/x, so only fed/a is forwarded and every subscriber gets it once
+    const size_t messages = 1000;
+    std::string batch;
+    for (size_t i = 0; i < messages; ++i) {
+        batch += "PUBLISH;fed/a;" + std::to_string(i) + "\nPUBLISH;other/x;" + std::to_string(i) + "\n";
+    }
+    boost::asio::write(*publisher, boost::asio::buffer(batch));
+    for (auto *subscriber : {local.get(), exact.get(), wildcard.get()}) {
+        auto frames = readFrames(*subscriber, messages);
+        ASSERT_EQ(frames.size(), messages);
+        for (size_t i = 0; i < messages; ++i) {
+            ASSERT_EQ(frames[i], "fed/a;" + std::to_string(i));
+        }
+    }
+    for (auto *subscriber : {local.get(), exact.get(), wildcard.get()}) {
+        ASSERT_TRUE(readFrames(*subscriber, 1, std::chrono::milliseconds(100)).empty());
+    }
+    std::uint64_t forwarded = federations[1].receivedMessages() + federations[2].receivedMessages();
+    ASSERT_EQ(forwarded, 2 * messages);
+    ASSERT_EQ(federations[0].receivedMessages(), 0u);
+    // Flooding would send both topics to both peers
+    std::uint64_t flooded = 2 * 2 * messages;
+
+    // Cross node latency, one publish in flight at a time
+    LatencyHistogram latency;
+    for (int i = 0; i < 200; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        boost::asio::write(*publisher, boost::asio::buffer(std::string("PUBLISH;fed/b;x\n")));
+        ASSERT_EQ(readFrames(*wildcard, 1).size(), 1u);
+        latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count());
+        ASSERT_EQ(readFrames(*local, 1).size(), 1u);
+    }
+
+    // Withdrawn interest stops the forwarding to that node
+    boost::asio::write(*wildcard, boost::asio::buffer(std::string("UNSUBSCRIBE;fed/#\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    std::uint64_t before = federations[2].receivedMessages();
+    boost::asio::write(*publisher, boost::asio::buffer(std::string("PUBLISH;fed/a;late\n")));
+    ASSERT_EQ(readFrames(*exact, 1), std::vector<std::string>{"fed/a;late"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    ASSERT_EQ(federations[2].receivedMessages(), before);
+
+    serverLog.out() << "forwarded " << forwarded << " of " << flooded << " messages a flood would send, cross node latency p50 "
+              << latency.percentile(50) / 1000 << " us, p99 " << latency.percentile(99) / 1000 << " us" << std::endl;
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();